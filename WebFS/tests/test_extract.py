@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""PUT /api/extract regression tests.
+
+Run against a host build of the server:
+    cc -O2 -pthread -o webfs webfs.c && python3 tests/test_extract.py ./webfs
+Each case starts the binary on a free port with a scratch root, sends a hand-built
+archive and checks what landed on disk.
+"""
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import unittest
+import urllib.request
+
+BINARY = os.path.abspath(sys.argv.pop(1) if len(sys.argv) > 1 else "webfs")
+
+
+def header(name, size, typeflag=b"0", mode=0o644):
+    h = bytearray(512)
+    h[0:len(name)] = name
+    h[100:108] = b"%07o\0" % mode
+    h[108:116] = b"0000000\0"
+    h[116:124] = b"0000000\0"
+    h[124:136] = b"%011o\0" % size
+    h[136:148] = b"%011o\0" % int(time.time())
+    h[148:156] = b" " * 8
+    h[156:157] = typeflag
+    h[257:263] = b"ustar\0"
+    h[263:265] = b"00"
+    h[148:156] = b"%06o\0 " % sum(h)
+    return bytes(h)
+
+
+def member(name, data, typeflag=b"0"):
+    return header(name, len(data), typeflag) + data + b"\0" * (-len(data) % 512)
+
+
+def pax(records):
+    body = b""
+    for key, value in records:
+        rec = b" %s=%s\n" % (key, value)
+        n = len(rec) + 1
+        while len(str(n).encode()) + len(rec) != n:
+            n += 1
+        body += str(n).encode() + rec
+    return member(b"PaxHeader", body, b"x")
+
+
+def archive(*members):
+    return b"".join(members) + b"\0" * 1024
+
+
+class ExtractTest(unittest.TestCase):
+    def setUp(self):
+        self.root = tempfile.mkdtemp()
+        with socket.socket() as s:
+            s.bind(("127.0.0.1", 0))
+            self.port = s.getsockname()[1]
+        self.server = subprocess.Popen([BINARY, "-p", str(self.port), "-r", self.root],
+                                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        for _ in range(100):
+            try:
+                socket.create_connection(("127.0.0.1", self.port), 0.1).close()
+                break
+            except OSError:
+                time.sleep(0.05)
+
+    def tearDown(self):
+        self.server.kill()
+        self.server.wait()
+        shutil.rmtree(self.root)
+
+    def extract(self, body, path="/x"):
+        req = urllib.request.Request("http://127.0.0.1:%d/api/extract?path=%s" % (self.port, path),
+                                     data=body, method="PUT")
+        with urllib.request.urlopen(req) as r:
+            return r.read()
+
+    def read(self, rel):
+        with open(os.path.join(self.root, rel), "rb") as f:
+            return f.read()
+
+    def test_pax_size_then_long_name(self):
+        # The pax size belongs to the header right after it; the 'L' record must not
+        # take it, nor may it leak to the member after the long name.
+        long_name = b"d/" + b"n" * 150
+        data = b"long-name member"
+        self.extract(archive(pax([(b"size", b"999")]),
+                             member(b"././@LongLink", long_name + b"\0", b"L"),
+                             member(b"placeholder", data),
+                             member(b"after", b"next")))
+        self.assertEqual(self.read("x/" + long_name.decode()), data)
+        self.assertEqual(self.read("x/after"), b"next")
+
+    def test_deep_path(self):
+        # Directories are opened one component at a time; a path deeper than the
+        # limit is skipped rather than taking the server down.
+        deep = b"a/" * 2000 + b"f"
+        report = self.extract(archive(pax([(b"path", deep)]), member(b"placeholder", b"too deep"),
+                                      pax([(b"path", b"b/" * 100 + b"f")]), member(b"placeholder", b"ok"),
+                                      member(b"after", b"next")))
+        self.assertIn(b'"skipped":1', report)
+        self.assertEqual(self.read("x/" + "b/" * 100 + "f"), b"ok")
+        self.assertEqual(self.read("x/after"), b"next")
+        self.assertFalse(os.path.exists(os.path.join(self.root, "x/a")))
+
+    def test_malformed_pax(self):
+        # A record whose length ends before its key must not be read past; the entry
+        # it describes is reported as an error and the archive carries on.
+        bad = member(b"PaxHeader", b"1 path=" + b"z" * 40 + b"\n", b"x")
+        report = self.extract(archive(bad, member(b"victim", b"data"), member(b"after", b"next")))
+        self.assertIn(b'"errors":1', report)
+        self.assertFalse(os.path.exists(os.path.join(self.root, "x/victim")))
+        self.assertEqual(self.read("x/after"), b"next")
+
+    def test_pax_size_applies_to_next_member(self):
+        data = b"sized by pax"
+        body = bytearray(header(b"f", 0)) + data + b"\0" * (-len(data) % 512)
+        self.extract(archive(pax([(b"size", str(len(data)).encode())]), bytes(body),
+                             member(b"g", b"plain")))
+        self.assertEqual(self.read("x/f"), data)
+        self.assertEqual(self.read("x/g"), b"plain")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -8,6 +8,7 @@
  *
  * Build:
  *   clang -O2 -Wall -pthread -o webfs webfs.c
+ *   (add -DWEBFS_HAVE_ZLIB -lz to accept .tar.gz bodies on /api/extract)
  *
  * Run:
  *   sudo webfs -p 8000 -r /
@@ -18,6 +19,8 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE         /* fallocate, sync_file_range on Linux */
+#define _DARWIN_C_SOURCE    /* F_PREALLOCATE on iOS */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +31,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -37,9 +41,31 @@
 #include <time.h>
 #include <stdint.h>
 #include <limits.h>
+#include <regex.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#if defined(__APPLE__)
+#include <sys/clonefile.h>
+#include <sys/attr.h>       /* getattrlistbulk */
+#include <sys/vnode.h>      /* VREG, VDIR, VLNK */
+#include <copyfile.h>
+#include <sys/event.h>      /* kqueue directory watches for /api/events */
+#endif
+#if defined(__linux__)
+#include <linux/fs.h>       /* FICLONE */
+#include <sys/syscall.h>    /* SYS_getdents64 */
+#include <sys/inotify.h>
+#endif
+#if defined(WEBFS_HAVE_ZLIB)
+#include <zlib.h>           /* gzip-compressed archives for /api/extract */
+#endif
 
 #define BACKLOG 10
 #define BUFSIZE 8192
+#define UPLOAD_CHUNK (1024 * 1024)          /* per-buffer size of the upload pipeline */
+#define WRITEBACK_WINDOW (8 * 1024 * 1024)  /* sync_file_range granularity */
 
 static int g_port = 8080;
 static char g_root[PATH_MAX] = "/";
@@ -117,13 +143,21 @@ static void join_path(char *out, size_t outsz, const char *root, const char *req
     }
 }
 
+#define TEMP_TAG ".webfs-"     /* temp files beside a target: ".NAME.webfs-XXXXXX" */
+
+/* Whether name is one of the temp files uploads are written to before the rename */
+static int is_temp_name(const char *name) {
+    size_t n = strlen(name), t = strlen(TEMP_TAG);
+    return name[0] == '.' && n >= t + 6 && memcmp(name + n - 6 - t, TEMP_TAG, t) == 0;
+}
+
 /* Simple base64 decode for Basic Auth */
 static int b64val(char c) {
     if (c >= 'A' && c <= 'Z') return c - 'A';
     if (c >= 'a' && c <= 'z') return c - 'a' + 26;
     if (c >= '0' && c <= '9') return c - '0' + 52;
-    if (c == '+') return 62;
-    if (c == '/') return 63;
+    if (c == '+' || c == '-') return 62;     /* standard and URL-safe alphabets */
+    if (c == '/' || c == '_') return 63;
     return -1;
 }
 static int b64dec_simple(const char *in, char *out, int outlen) {
@@ -154,6 +188,14 @@ static ssize_t send_all(int fd, const void *buf, size_t sz) {
     return (ssize_t)sent;
 }
 
+/* 1 once the client has closed its end: nothing more is wanted from a long response.
+ * Only meaningful after the request body has been read. */
+static int peer_gone(int fd) {
+    char c;
+    ssize_t r = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
 /* Send HTTP headers */
 static void send_headers(int fd, int code, const char *status, const char *ctype, size_t content_len, const char *extra) {
     char hdr[1024];
@@ -173,6 +215,327 @@ static void send_headers(int fd, int code, const char *status, const char *ctype
     send_all(fd, "\r\n", 2);
 }
 
+/* Send HTTP headers for a response whose length is not known up front */
+static void send_headers_chunked(int fd, int code, const char *status, const char *ctype, const char *extra) {
+    char hdr[1024];
+    int n = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Server: WebFS/0.1\r\n"
+                     "Connection: close\r\n"
+                     "Transfer-Encoding: chunked\r\n",
+                     code, status);
+    send_all(fd, hdr, n);
+    if (ctype) {
+        char t[128];
+        int m = snprintf(t, sizeof(t), "Content-Type: %s\r\n", ctype);
+        send_all(fd, t, m);
+    }
+    if (extra) send_all(fd, extra, strlen(extra));
+    send_all(fd, "\r\n", 2);
+}
+
+/* Send one chunk of a chunked body (n must be > 0) */
+static ssize_t send_chunk(int fd, const void *buf, size_t n) {
+    char sz[24];
+    int m = snprintf(sz, sizeof(sz), "%zx\r\n", n);
+    if (send_all(fd, sz, m) <= 0) return -1;
+    if (send_all(fd, buf, n) <= 0) return -1;
+    return send_all(fd, "\r\n", 2);
+}
+
+/* ---------- JSON encoding ----------
+ * Strings are scanned for bytes that need attention (quote, backslash, controls, and
+ * anything non-ASCII, which must be checked as UTF-8) 16 at a time with SSE2/NEON;
+ * clean runs are handed on in one piece. Invalid UTF-8 becomes U+FFFD so a listing
+ * of arbitrary filenames is always valid JSON. Integers are formatted by hand. */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+typedef void (*json_put_fn)(void *ctx, const char *s, size_t n);
+
+/* Length of the prefix of s[0..n) that can be copied verbatim */
+static size_t json_clean_prefix(const unsigned char *s, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'), space = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        /* signed compare: bytes >= 0x80 are negative, so one test finds controls and non-ASCII */
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+                                 _mm_cmplt_epi8(v, space));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t quote = vdupq_n_u8('"'), bslash = vdupq_n_u8('\\'), space = vdupq_n_u8(0x20), high = vdupq_n_u8(0x80);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(s + i);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)),
+                                vorrq_u8(vcltq_u8(v, space), vcgeq_u8(v, high)));
+        if (vmaxvq_u8(m)) break;    /* the scalar loop below pins down the byte */
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80) return i;
+    }
+    return n;
+}
+
+/* Length of the well-formed UTF-8 sequence at s (no overlongs, surrogates or values
+ * past U+10FFFF), or 0 */
+static size_t utf8_seq_len(const unsigned char *s, size_t n) {
+    unsigned char c = s[0];
+    if (c < 0xC2 || c > 0xF4) return 0;
+    size_t len = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+    if (n < len) return 0;
+    unsigned char lo = 0x80, hi = 0xBF;     /* allowed range of the second byte */
+    if (c == 0xE0) lo = 0xA0;
+    else if (c == 0xED) hi = 0x9F;
+    else if (c == 0xF0) lo = 0x90;
+    else if (c == 0xF4) hi = 0x8F;
+    if (s[1] < lo || s[1] > hi) return 0;
+    for (size_t k = 2; k < len; k++) if ((s[k] & 0xC0) != 0x80) return 0;
+    return len;
+}
+
+/* Emit s[0..n) escaped for use inside a JSON string (no surrounding quotes) */
+static void json_escape(const char *str, size_t n, json_put_fn put, void *ctx) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)str;
+    size_t i = 0, run = 0;
+    while (i < n) {
+        i += json_clean_prefix(s + i, n - i);
+        if (i >= n) break;
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+            size_t l = utf8_seq_len(s + i, n - i);
+            if (l) { i += l; continue; }    /* valid: stays part of the clean run */
+        }
+        if (i > run) put(ctx, str + run, i - run);
+        char esc[6] = { '\\', 0 };
+        size_t elen = 2;
+        switch (c) {
+        case '"': esc[1] = '"'; break;
+        case '\\': esc[1] = '\\'; break;
+        case '\b': esc[1] = 'b'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        default:
+            if (c >= 0x80) { put(ctx, "\\ufffd", 6); elen = 0; break; }
+            esc[1] = 'u'; esc[2] = '0'; esc[3] = '0'; esc[4] = hex[c >> 4]; esc[5] = hex[c & 15];
+            elen = 6;
+        }
+        if (elen) put(ctx, esc, elen);
+        i++;
+        run = i;
+    }
+    if (n > run) put(ctx, str + run, n - run);
+}
+
+/* Decimal text of v in out (at least 21 bytes); returns the length */
+static size_t fmt_int(char *out, long long v) {
+    static const char digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    while (u >= 100) {
+        unsigned d = (unsigned)(u % 100);
+        u /= 100;
+        *--p = digits[2 * d + 1];
+        *--p = digits[2 * d];
+    }
+    if (u >= 10) { *--p = digits[2 * u + 1]; *--p = digits[2 * u]; }
+    else *--p = (char)('0' + u);
+    if (v < 0) *--p = '-';
+    size_t len = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(out, p, len);
+    return len;
+}
+
+/* Growable output buffer for responses whose size is not known in advance */
+struct strbuf {
+    char *p;
+    size_t len, cap;
+    int oom;
+};
+
+static void sb_append(struct strbuf *sb, const char *s, size_t n) {
+    if (sb->oom) return;
+    if (sb->len + n + 1 > sb->cap) {
+        size_t cap = sb->cap ? sb->cap : 1024;
+        while (sb->len + n + 1 > cap) cap *= 2;
+        char *np = realloc(sb->p, cap);
+        if (!np) { sb->oom = 1; return; }
+        sb->p = np; sb->cap = cap;
+    }
+    memcpy(sb->p + sb->len, s, n);
+    sb->len += n;
+    sb->p[sb->len] = '\0';
+}
+
+static void sb_printf(struct strbuf *sb, const char *fmt, ...) {
+    char tmp[512];
+    va_list ap; va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(tmp)) { sb_append(sb, tmp, n); return; }
+    char *big = malloc(n + 1);
+    if (!big) { sb->oom = 1; return; }
+    va_start(ap, fmt);
+    vsnprintf(big, n + 1, fmt, ap);
+    va_end(ap);
+    sb_append(sb, big, n);
+    free(big);
+}
+
+/* Buffered response body writer. In chunked mode each flush becomes one HTTP chunk,
+ * so a response of any size goes out in bounded memory as it is produced. With fd -1
+ * nothing is sent and the output only collects in tee. */
+#define OSTREAM_BUF (16 * 1024)
+
+struct ostream {
+    int fd;
+    int chunked;
+    int failed;             /* peer went away; further output is dropped */
+    struct strbuf *tee;     /* optional copy of everything sent (for caching) */
+    size_t tee_max;         /* past this the copy is abandoned (tee->oom) */
+    size_t len;
+    char buf[OSTREAM_BUF];
+};
+
+static void os_init(struct ostream *os, int fd, int chunked) {
+    os->fd = fd; os->chunked = chunked; os->failed = 0; os->len = 0;
+    os->tee = NULL; os->tee_max = 0;
+}
+
+static void os_tee(struct ostream *os, const char *data, size_t n) {
+    if (!os->tee || os->tee->oom) return;
+    if (os->tee->len + n > os->tee_max) { os->tee->oom = 1; return; }
+    sb_append(os->tee, data, n);
+}
+
+static void os_flush(struct ostream *os) {
+    if (os->len && !os->failed) {
+        os_tee(os, os->buf, os->len);
+        if (os->fd >= 0) {
+            ssize_t r = os->chunked ? send_chunk(os->fd, os->buf, os->len) : send_all(os->fd, os->buf, os->len);
+            if (r <= 0) os->failed = 1;
+        }
+    }
+    os->len = 0;
+}
+
+static void os_write(struct ostream *os, const char *data, size_t n) {
+    if (os->len + n > sizeof(os->buf)) {
+        os_flush(os);
+        if (n > sizeof(os->buf)) {
+            if (!os->failed) os_tee(os, data, n);
+            if (!os->failed && os->fd >= 0 && (os->chunked ? send_chunk(os->fd, data, n) : send_all(os->fd, data, n)) <= 0) os->failed = 1;
+            return;
+        }
+    }
+    memcpy(os->buf + os->len, data, n);
+    os->len += n;
+}
+
+static void os_put(void *ctx, const char *s, size_t n) {
+    os_write(ctx, s, n);
+}
+
+/* Write s escaped, without quotes, so a JSON string can be assembled from parts */
+static void os_json_raw(struct ostream *os, const char *s) {
+    json_escape(s, strlen(s), os_put, os);
+}
+
+/* Write s as a quoted JSON string */
+static void os_json_str(struct ostream *os, const char *s) {
+    os_write(os, "\"", 1);
+    json_escape(s, strlen(s), os_put, os);
+    os_write(os, "\"", 1);
+}
+
+static void os_int(struct ostream *os, long long v) {
+    char num[24];
+    os_write(os, num, fmt_int(num, v));
+}
+
+/* CBOR (RFC 8949) items: a head byte carrying the major type plus a 0/1/2/4/8-byte
+ * argument, so small integers and lengths cost a single byte */
+#define CBOR_UINT 0
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_NULL 0xf6
+#define CBOR_INDEF_ARRAY 0x9f
+#define CBOR_INDEF_MAP 0xbf
+#define CBOR_BREAK 0xff
+
+static void cbor_head(struct ostream *os, int major, unsigned long long v) {
+    unsigned char h[9];
+    size_t n;
+    if (v < 24) { h[0] = (unsigned char)(major << 5 | v); n = 1; }
+    else if (v <= 0xff) { h[0] = (unsigned char)(major << 5 | 24); h[1] = (unsigned char)v; n = 2; }
+    else if (v <= 0xffff) { h[0] = (unsigned char)(major << 5 | 25); h[1] = (unsigned char)(v >> 8); h[2] = (unsigned char)v; n = 3; }
+    else if (v <= 0xffffffffULL) {
+        h[0] = (unsigned char)(major << 5 | 26);
+        for (int i = 0; i < 4; i++) h[1 + i] = (unsigned char)(v >> (24 - 8 * i));
+        n = 5;
+    } else {
+        h[0] = (unsigned char)(major << 5 | 27);
+        for (int i = 0; i < 8; i++) h[1 + i] = (unsigned char)(v >> (56 - 8 * i));
+        n = 9;
+    }
+    os_write(os, (const char *)h, n);
+}
+
+static void cbor_byte(struct ostream *os, unsigned char b) {
+    os_write(os, (const char *)&b, 1);
+}
+
+/* A text string, or a byte string when s is not valid UTF-8 (CBOR text must be), so
+ * odd filenames survive byte for byte */
+static void cbor_str(struct ostream *os, const char *s) {
+    size_t n = strlen(s), i = 0;
+    const unsigned char *u = (const unsigned char *)s;
+    while (i < n) {
+        if (u[i] < 0x80) { i++; continue; }
+        size_t l = utf8_seq_len(u + i, n - i);
+        if (!l) break;
+        i += l;
+    }
+    cbor_head(os, i == n ? CBOR_TEXT : CBOR_BYTES, n);
+    os_write(os, s, n);
+}
+
+/* Flush and terminate the body */
+static void os_end(struct ostream *os) {
+    os_flush(os);
+    if (os->chunked && !os->failed && send_all(os->fd, "0\r\n\r\n", 5) <= 0) os->failed = 1;
+}
+
+static void sb_put(void *ctx, const char *s, size_t n) {
+    sb_append(ctx, s, n);
+}
+
+/* Append s as a quoted JSON string */
+static void sb_json_str(struct strbuf *sb, const char *s) {
+    sb_append(sb, "\"", 1);
+    json_escape(s, strlen(s), sb_put, sb);
+    sb_append(sb, "\"", 1);
+}
+
 /* Custom strcasestr implementation */
 static char* my_strcasestr(const char* haystack, const char* needle) {
     if (!haystack || !needle) return NULL;
@@ -194,6 +557,643 @@ static char* my_strcasestr(const char* haystack, const char* needle) {
     return NULL;
 }
 
+/* ---------- Checksums ----------
+ * CRC32C and SHA-256 computed incrementally while data streams through, so transfers
+ * can be verified without a second pass; MD5 and XXH3 as well for /api/hash. Hardware
+ * paths: SSE4.2 CRC32 / SHA-NI picked at runtime on x86, ARMv8 CRC32 / SHA2 instructions
+ * when the compiler targets them, SSE2 / NEON for XXH3. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86_ACCEL 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC32C 1
+#endif
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#include <arm_neon.h>
+#define HAVE_ARM_SHA2 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define DIGEST_SHA256 0x1
+#define DIGEST_CRC32C 0x2
+#define DIGEST_MD5    0x4
+#define DIGEST_XXH3   0x8
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t n) {
+    while (n && ((uintptr_t)p & 7)) { crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8); n--; }
+    while (n >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4); memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo); hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8; n -= 8;
+    }
+    while (n--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(HAVE_X86_ACCEL)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_x86(uint32_t crc, const uint8_t *p, size_t n) {
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    while (n >= 8) { uint64_t v; memcpy(&v, p, 8); c = _mm_crc32_u64(c, v); p += 8; n -= 8; }
+    crc = (uint32_t)c;
+#endif
+    while (n--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+#if defined(HAVE_ARM_CRC32C)
+static uint32_t crc32c_arm(uint32_t crc, const uint8_t *p, size_t n) {
+    while (n >= 8) { uint64_t v; memcpy(&v, p, 8); crc = __crc32cd(crc, v); p += 8; n -= 8; }
+    while (n--) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t) = crc32c_sw;
+
+/* crc is the running value: start from 0, feed chunks, use the final result as-is */
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t n) {
+    return ~crc32c_impl(~crc, data, n);
+}
+
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+    size_t n;
+};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_sw(uint32_t h[8], const uint8_t *p, size_t nblocks) {
+    while (nblocks--) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+        p += 64;
+    }
+}
+
+#if defined(HAVE_X86_ACCEL)
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_x86(uint32_t h[8], const uint8_t *p, size_t nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xB1);  /* CDAB */
+    __m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1B);  /* EFGH */
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);                                      /* ABEF */
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);                                            /* CDGH */
+    while (nblocks--) {
+        __m128i save0 = st0, save1 = st1, msg[4];
+        for (int i = 0; i < 4; i++)
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
+        for (int i = 0; i < 16; i++) {
+            __m128i wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&SHA256_K[4 * i]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, wk);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(wk, 0x0E));
+            if (i < 12) {
+                __m128i t = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+                msg[i & 3] = _mm_sha256msg2_epu32(t, msg[(i + 3) & 3]);
+            }
+        }
+        st0 = _mm_add_epi32(st0, save0);
+        st1 = _mm_add_epi32(st1, save1);
+        p += 64;
+    }
+    tmp = _mm_shuffle_epi32(st0, 0x1B);                  /* FEBA */
+    st1 = _mm_shuffle_epi32(st1, 0xB1);                  /* DCHG */
+    _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, st1, 0xF0));  /* DCBA */
+    _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(st1, tmp, 8));     /* HGFE */
+}
+#endif
+
+#if defined(HAVE_ARM_SHA2)
+static void sha256_blocks_arm(uint32_t h[8], const uint8_t *p, size_t nblocks) {
+    uint32x4_t st0 = vld1q_u32(&h[0]), st1 = vld1q_u32(&h[4]);
+    while (nblocks--) {
+        uint32x4_t save0 = st0, save1 = st1, msg[4];
+        for (int i = 0; i < 4; i++)
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * i)));
+        for (int i = 0; i < 16; i++) {
+            uint32x4_t wk = vaddq_u32(msg[i & 3], vld1q_u32(&SHA256_K[4 * i]));
+            uint32x4_t abcd = st0;
+            st0 = vsha256hq_u32(st0, st1, wk);
+            st1 = vsha256h2q_u32(st1, abcd, wk);
+            if (i < 12)
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+                                             msg[(i + 2) & 3], msg[(i + 3) & 3]);
+        }
+        st0 = vaddq_u32(st0, save0);
+        st1 = vaddq_u32(st1, save1);
+        p += 64;
+    }
+    vst1q_u32(&h[0], st0);
+    vst1q_u32(&h[4], st1);
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t[8], const uint8_t *, size_t) = sha256_blocks_sw;
+
+static void sha256_init(struct sha256_ctx *c) {
+    static const uint32_t iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(c->h, iv, sizeof(iv));
+    c->len = 0; c->n = 0;
+}
+
+static void sha256_update(struct sha256_ctx *c, const void *data, size_t len) {
+    const uint8_t *p = data;
+    c->len += len;
+    if (c->n) {
+        size_t take = 64 - c->n < len ? 64 - c->n : len;
+        memcpy(c->buf + c->n, p, take);
+        c->n += take; p += take; len -= take;
+        if (c->n < 64) return;
+        sha256_blocks(c->h, c->buf, 1);
+        c->n = 0;
+    }
+    if (len >= 64) { sha256_blocks(c->h, p, len / 64); p += len & ~(size_t)63; len &= 63; }
+    memcpy(c->buf, p, len);
+    c->n = len;
+}
+
+static void sha256_final(struct sha256_ctx *c, uint8_t out[32]) {
+    uint64_t bits = c->len * 8;
+    c->buf[c->n++] = 0x80;
+    if (c->n > 56) { memset(c->buf + c->n, 0, 64 - c->n); sha256_blocks(c->h, c->buf, 1); c->n = 0; }
+    memset(c->buf + c->n, 0, 56 - c->n);
+    for (int i = 0; i < 8; i++) c->buf[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_blocks(c->h, c->buf, 1);
+    for (int i = 0; i < 8; i++) {
+        out[4*i] = c->h[i] >> 24; out[4*i+1] = c->h[i] >> 16; out[4*i+2] = c->h[i] >> 8; out[4*i+3] = c->h[i];
+    }
+}
+
+struct md5_ctx {
+    uint32_t h[4];
+    uint64_t len;
+    uint8_t buf[64];
+    size_t n;
+};
+
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* MD5 has no hardware path; it is here for checking against published checksums */
+static void md5_blocks(uint32_t h[4], const uint8_t *p, size_t nblocks) {
+    static const uint8_t R[64] = { 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+                                   5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+                                   4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+                                   6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21 };
+    while (nblocks--) {
+        uint32_t m[16];
+        for (int i = 0; i < 16; i++)
+            m[i] = (uint32_t)p[4*i] | (uint32_t)p[4*i+1] << 8 | (uint32_t)p[4*i+2] << 16 | (uint32_t)p[4*i+3] << 24;
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f;
+            int g;
+            if (i < 16) { f = (b & c) | (~b & d); g = i; }
+            else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+            else if (i < 48) { f = b ^ c ^ d; g = (3 * i + 5) & 15; }
+            else { f = c ^ (b | ~d); g = (7 * i) & 15; }
+            uint32_t t = d;
+            d = c;
+            c = b;
+            f += a + MD5_K[i] + m[g];
+            b += ROL32(f, R[i]);
+            a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        p += 64;
+    }
+}
+
+static void md5_init(struct md5_ctx *c) {
+    c->h[0] = 0x67452301; c->h[1] = 0xefcdab89; c->h[2] = 0x98badcfe; c->h[3] = 0x10325476;
+    c->len = 0; c->n = 0;
+}
+
+static void md5_update(struct md5_ctx *c, const void *data, size_t len) {
+    const uint8_t *p = data;
+    c->len += len;
+    if (c->n) {
+        size_t take = 64 - c->n < len ? 64 - c->n : len;
+        memcpy(c->buf + c->n, p, take);
+        c->n += take; p += take; len -= take;
+        if (c->n < 64) return;
+        md5_blocks(c->h, c->buf, 1);
+        c->n = 0;
+    }
+    if (len >= 64) { md5_blocks(c->h, p, len / 64); p += len & ~(size_t)63; len &= 63; }
+    memcpy(c->buf, p, len);
+    c->n = len;
+}
+
+static void md5_final(struct md5_ctx *c, uint8_t out[16]) {
+    uint64_t bits = c->len * 8;
+    c->buf[c->n++] = 0x80;
+    if (c->n > 56) { memset(c->buf + c->n, 0, 64 - c->n); md5_blocks(c->h, c->buf, 1); c->n = 0; }
+    memset(c->buf + c->n, 0, 56 - c->n);
+    for (int i = 0; i < 8; i++) c->buf[56 + i] = (uint8_t)(bits >> (8 * i));
+    md5_blocks(c->h, c->buf, 1);
+    for (int i = 0; i < 4; i++) {
+        out[4*i] = c->h[i]; out[4*i+1] = c->h[i] >> 8; out[4*i+2] = c->h[i] >> 16; out[4*i+3] = c->h[i] >> 24;
+    }
+}
+
+/* XXH3 (64-bit, seed 0, default secret), streaming. A 64-byte stripe is folded into
+ * eight accumulators only once a later byte shows it is not the input's last 64, which
+ * the one-shot definition treats apart; the last stripe taken in is kept for that. The
+ * first 240 bytes are kept too, as short inputs have their own formulas. Stripe loop
+ * in SSE2 on x86-64 and NEON on arm64, both part of the base instruction set. */
+
+#define XXH_P32_1 0x9E3779B1U
+#define XXH_P32_2 0x85EBCA77U
+#define XXH_P32_3 0xC2B2AE3DU
+#define XXH_P64_1 0x9E3779B185EBCA87ULL
+#define XXH_P64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P64_3 0x165667B19E3779F9ULL
+#define XXH_P64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_P64_5 0x27D4EB2F165667C5ULL
+
+static const uint8_t XXH3_SECRET[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+struct xxh3_ctx {
+    uint64_t acc[8];
+    uint64_t len;
+    int stripes;                /* taken into the current 16-stripe block */
+    size_t n;                   /* pending in buf, at most 64 */
+    uint8_t buf[64];
+    uint8_t last[64];           /* the last stripe taken in */
+    uint8_t head[240];
+};
+
+static uint32_t xxh_r32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh_r64(const uint8_t *p) {
+    return (uint64_t)xxh_r32(p) | (uint64_t)xxh_r32(p + 4) << 32;
+}
+
+static uint64_t xxh_fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 m = (unsigned __int128)a * b;
+    return (uint64_t)m ^ (uint64_t)(m >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF), hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32), hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t hi = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    return ((cross << 32) | (lo_lo & 0xFFFFFFFF)) ^ hi;
+#endif
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= XXH_P64_2;
+    h ^= h >> 29;
+    h *= XXH_P64_3;
+    return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_mix16(const uint8_t *p, const uint8_t *s) {
+    return xxh_fold64(xxh_r64(p) ^ xxh_r64(s), xxh_r64(p + 8) ^ xxh_r64(s + 8));
+}
+
+/* The whole of an input of at most 240 bytes */
+static uint64_t xxh3_short(const uint8_t *p, size_t len) {
+    const uint8_t *s = XXH3_SECRET;
+    if (len == 0) return xxh64_avalanche(xxh_r64(s + 56) ^ xxh_r64(s + 64));
+    if (len <= 3) {
+        uint32_t c = (uint32_t)p[0] << 16 | (uint32_t)p[len >> 1] << 24 | p[len - 1] | (uint32_t)len << 8;
+        return xxh64_avalanche((uint64_t)c ^ (uint64_t)(xxh_r32(s) ^ xxh_r32(s + 4)));
+    }
+    if (len <= 8) {
+        uint64_t v = ((uint64_t)xxh_r32(p) << 32 | xxh_r32(p + len - 4)) ^ (xxh_r64(s + 8) ^ xxh_r64(s + 16));
+        v ^= ((v << 49) | (v >> 15)) ^ ((v << 24) | (v >> 40));
+        v *= 0x9FB21C651E98DF25ULL;
+        v ^= (v >> 35) + len;
+        v *= 0x9FB21C651E98DF25ULL;
+        return v ^ (v >> 28);
+    }
+    if (len <= 16) {
+        uint64_t lo = xxh_r64(p) ^ (xxh_r64(s + 24) ^ xxh_r64(s + 32));
+        uint64_t hi = xxh_r64(p + len - 8) ^ (xxh_r64(s + 40) ^ xxh_r64(s + 48));
+        uint64_t acc = len + __builtin_bswap64(lo) + hi + xxh_fold64(lo, hi);
+        return xxh3_avalanche(acc);
+    }
+    uint64_t acc = len * XXH_P64_1;
+    if (len <= 128) {
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) { acc += xxh3_mix16(p + 48, s + 96); acc += xxh3_mix16(p + len - 64, s + 112); }
+                acc += xxh3_mix16(p + 32, s + 64); acc += xxh3_mix16(p + len - 48, s + 80);
+            }
+            acc += xxh3_mix16(p + 16, s + 32); acc += xxh3_mix16(p + len - 32, s + 48);
+        }
+        acc += xxh3_mix16(p, s); acc += xxh3_mix16(p + len - 16, s + 16);
+        return xxh3_avalanche(acc);
+    }
+    for (int i = 0; i < 8; i++) acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+    acc = xxh3_avalanche(acc);
+    for (size_t i = 8; i < len / 16; i++) acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+    acc += xxh3_mix16(p + len - 16, s + 119);
+    return xxh3_avalanche(acc);
+}
+
+static void xxh3_stripe(uint64_t acc[8], const uint8_t *p, const uint8_t *s) {
+#if defined(__x86_64__)
+    __m128i *a = (__m128i *)acc;
+    for (int i = 0; i < 4; i++) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(s + 16 * i)));
+        __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i sum = _mm_add_epi64(_mm_loadu_si128(a + i), _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128(a + i, _mm_add_epi64(prod, sum));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (int i = 0; i < 4; i++) {
+        uint64x2_t d = vreinterpretq_u64_u8(vld1q_u8(p + 16 * i));
+        uint64x2_t dk = veorq_u64(d, vreinterpretq_u64_u8(vld1q_u8(s + 16 * i)));
+        uint64x2_t sum = vaddq_u64(vld1q_u64(acc + 2 * i), vextq_u64(d, d, 1));
+        vst1q_u64(acc + 2 * i, vmlal_u32(sum, vmovn_u64(dk), vshrn_n_u64(dk, 32)));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        uint64_t d = xxh_r64(p + 8 * i), dk = d ^ xxh_r64(s + 8 * i);
+        acc[i ^ 1] += d;
+        acc[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
+    }
+#endif
+}
+
+static void xxh3_scramble(uint64_t acc[8], const uint8_t *s) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= xxh_r64(s + 8 * i);
+        acc[i] = a * XXH_P32_1;
+    }
+}
+
+static void xxh3_init(struct xxh3_ctx *c) {
+    static const uint64_t iv[8] = { XXH_P32_3, XXH_P64_1, XXH_P64_2, XXH_P64_3, XXH_P64_4, XXH_P32_2, XXH_P64_5, XXH_P32_1 };
+    memcpy(c->acc, iv, sizeof(iv));
+    c->len = 0;
+    c->stripes = 0;
+    c->n = 0;
+}
+
+static void xxh3_take(struct xxh3_ctx *c, const uint8_t *p) {
+    xxh3_stripe(c->acc, p, XXH3_SECRET + 8 * c->stripes);
+    if (++c->stripes == 16) {
+        xxh3_scramble(c->acc, XXH3_SECRET + 192 - 64);
+        c->stripes = 0;
+    }
+}
+
+static void xxh3_update(struct xxh3_ctx *c, const void *data, size_t len) {
+    const uint8_t *p = data, *taken = NULL;
+    if (c->len < sizeof(c->head)) memcpy(c->head + c->len, p, len < sizeof(c->head) - c->len ? len : sizeof(c->head) - c->len);
+    c->len += len;
+    if (c->n + len <= 64) {
+        memcpy(c->buf + c->n, p, len);
+        c->n += len;
+        return;
+    }
+    if (c->n) {     /* more follows, so the pending stripe can go in */
+        size_t fill = 64 - c->n;
+        memcpy(c->buf + c->n, p, fill);
+        p += fill;
+        len -= fill;
+        xxh3_take(c, c->buf);
+        taken = c->buf;
+    }
+    for (; len > 64; p += 64, len -= 64) {
+        xxh3_take(c, p);
+        taken = p;
+    }
+    if (taken) memcpy(c->last, taken, 64);
+    memcpy(c->buf, p, len);
+    c->n = len;
+}
+
+static uint64_t xxh3_final(const struct xxh3_ctx *c) {
+    if (c->len <= 240) return xxh3_short(c->head, (size_t)c->len);
+    uint64_t acc[8];
+    uint8_t tail[64];
+    memcpy(acc, c->acc, sizeof(acc));
+    memcpy(tail, c->last + c->n, 64 - c->n);
+    memcpy(tail + 64 - c->n, c->buf, c->n);
+    xxh3_stripe(acc, tail, XXH3_SECRET + 192 - 64 - 7);
+    uint64_t h = c->len * XXH_P64_1;
+    for (int i = 0; i < 4; i++) h += xxh_fold64(acc[2 * i] ^ xxh_r64(XXH3_SECRET + 11 + 16 * i), acc[2 * i + 1] ^ xxh_r64(XXH3_SECRET + 11 + 16 * i + 8));
+    return xxh3_avalanche(h);
+}
+
+/* Pick the fastest implementations for this CPU; call once before serving */
+static void checksum_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78 & (0u - (c & 1)));
+        crc32c_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            crc32c_table[t][i] = (crc32c_table[t-1][i] >> 8) ^ crc32c_table[0][crc32c_table[t-1][i] & 0xff];
+#if defined(HAVE_X86_ACCEL)
+    unsigned a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        if (c & bit_SSE4_2) crc32c_impl = crc32c_x86;
+        int sse41 = (c & bit_SSE4_1) && (c & bit_SSSE3);
+        if (sse41 && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29)))
+            sha256_blocks = sha256_blocks_x86;
+    }
+#endif
+#if defined(HAVE_ARM_CRC32C)
+    crc32c_impl = crc32c_arm;
+#endif
+#if defined(HAVE_ARM_SHA2)
+    sha256_blocks = sha256_blocks_arm;
+#endif
+}
+
+/* Running digests for one transfer (any combination of DIGEST_* algorithms) */
+struct digest_ctx {
+    int algs;
+    struct sha256_ctx sha;
+    struct md5_ctx md5c;
+    struct xxh3_ctx xxh;
+    uint32_t crc;
+    uint8_t sha256[32];     /* raw results, valid after digest_finish (or digest_final) */
+    uint8_t md5[16];
+    uint64_t xxh3;
+};
+
+static void digest_init(struct digest_ctx *dc, int algs) {
+    dc->algs = algs;
+    dc->crc = 0;
+    if (algs & DIGEST_SHA256) sha256_init(&dc->sha);
+    if (algs & DIGEST_MD5) md5_init(&dc->md5c);
+    if (algs & DIGEST_XXH3) xxh3_init(&dc->xxh);
+}
+
+static void digest_update(struct digest_ctx *dc, const void *data, size_t len) {
+    if (dc->algs & DIGEST_SHA256) sha256_update(&dc->sha, data, len);
+    if (dc->algs & DIGEST_CRC32C) dc->crc = crc32c_update(dc->crc, data, len);
+    if (dc->algs & DIGEST_MD5) md5_update(&dc->md5c, data, len);
+    if (dc->algs & DIGEST_XXH3) xxh3_update(&dc->xxh, data, len);
+}
+
+/* Finish the digests into the raw fields */
+static void digest_finish(struct digest_ctx *dc) {
+    if (dc->algs & DIGEST_SHA256) sha256_final(&dc->sha, dc->sha256);
+    if (dc->algs & DIGEST_MD5) md5_final(&dc->md5c, dc->md5);
+    if (dc->algs & DIGEST_XXH3) dc->xxh3 = xxh3_final(&dc->xxh);
+}
+
+/* Standard base64 (with padding), as used by HTTP structured-field byte sequences */
+static size_t b64enc(const uint8_t *in, size_t n, char *out) {
+    static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16 | (i + 1 < n ? (uint32_t)in[i+1] << 8 : 0) | (i + 2 < n ? in[i+2] : 0);
+        out[o++] = tbl[(v >> 18) & 63];
+        out[o++] = tbl[(v >> 12) & 63];
+        out[o++] = i + 1 < n ? tbl[(v >> 6) & 63] : '=';
+        out[o++] = i + 2 < n ? tbl[v & 63] : '=';
+    }
+    out[o] = '\0';
+    return o;
+}
+
+/* Finish the digests and format them as an RFC 9530 dictionary: sha-256=:...:, crc32c=:...: */
+static void digest_final(struct digest_ctx *dc, char *out, size_t outsz) {
+    size_t pos = 0;
+    out[0] = '\0';
+    digest_finish(dc);
+    if (dc->algs & DIGEST_SHA256) {
+        char b64[48];
+        b64enc(dc->sha256, sizeof(dc->sha256), b64);
+        pos += snprintf(out + pos, outsz - pos, "sha-256=:%s:", b64);
+    }
+    if ((dc->algs & DIGEST_CRC32C) && pos < outsz) {
+        uint8_t be[4] = { dc->crc >> 24, dc->crc >> 16, dc->crc >> 8, dc->crc };
+        char b64[12];
+        b64enc(be, sizeof(be), b64);
+        snprintf(out + pos, outsz - pos, "%scrc32c=:%s:", pos ? ", " : "", b64);
+    }
+}
+
+/* Algorithms named in a Repr-Digest / Want-Repr-Digest style dictionary.
+ * Preference weights of 0 ("sha-256=0") mean "not wanted". */
+static int digest_algs_from_header(const char *v) {
+    int algs = 0;
+    if (!v) return 0;
+    const char *end = strstr(v, "\r\n");
+    size_t len = end ? (size_t)(end - v) : strlen(v);
+    const char *p = v;
+    while (p < v + len) {
+        while (p < v + len && (*p == ' ' || *p == ',')) p++;
+        int alg = 0;
+        if (strncasecmp(p, "sha-256", 7) == 0) alg = DIGEST_SHA256;
+        else if (strncasecmp(p, "crc32c", 6) == 0) alg = DIGEST_CRC32C;
+        const char *eq = memchr(p, '=', v + len - p);
+        const char *comma = memchr(p, ',', v + len - p);
+        if (!comma) comma = v + len;
+        if (alg && !(eq && eq < comma && eq[1] == '0')) algs |= alg;
+        p = comma;
+    }
+    return algs;
+}
+
+/* 1 when every algorithm the client supplied a value for in `expected` agrees with `ours`
+ * (both RFC 9530 dictionaries); 0 on the first mismatch */
+static int digest_matches(const char *expected, const char *ours) {
+    static const char *names[] = { "sha-256=:", "crc32c=:" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const char *e = my_strcasestr(expected, names[i]);
+        const char *o = my_strcasestr(ours, names[i]);
+        if (!e || !o) continue;
+        e += strlen(names[i]); o += strlen(names[i]);
+        size_t el = strcspn(e, ":\r\n"), ol = strcspn(o, ":");
+        if (el != ol || memcmp(e, o, el) != 0) return 0;
+    }
+    return 1;
+}
+
 /* ---------- Embedded UI (Advanced white interface) ---------- */
 
 static const char *INDEX_HTML =
@@ -549,6 +1549,10 @@ static const char *INDEX_HTML =
 "      gap: 15px;\n"
 "    }\n"
 "\n"
+"    .stat-card.clickable {\n"
+"      cursor: pointer;\n"
+"    }\n"
+"\n"
 "    .stat-icon {\n"
 "      width: 50px;\n"
 "      height: 50px;\n"
@@ -838,13 +1842,13 @@ static const char *INDEX_HTML =
 "              <p>Files</p>\n"
 "            </div>\n"
 "          </div>\n"
-"          <div class=\"stat-card\">\n"
+"          <div class=\"stat-card clickable\" id=\"totalSizeCard\" title=\"Click to include subfolders\">\n"
 "            <div class=\"stat-icon warning\">\n"
 "              <span class=\"nav-icon\">💾</span>\n"
 "            </div>\n"
 "            <div class=\"stat-info\">\n"
 "              <h3 id=\"totalSize\">0 B</h3>\n"
-"              <p>Total Size</p>\n"
+"              <p id=\"totalSizeLabel\">Total Size</p>\n"
 "            </div>\n"
 "          </div>\n"
 "          <div class=\"stat-card\">\n"
@@ -863,7 +1867,7 @@ static const char *INDEX_HTML =
 "          <div class=\"toolbar-left\">\n"
 "            <div class=\"search-box\">\n"
 "              <span class=\"search-icon\">🔍</span>\n"
-"              <input type=\"text\" id=\"searchInput\" placeholder=\"Search files and folders...\">\n"
+"              <input type=\"text\" id=\"searchInput\" placeholder=\"Filter, or Enter to search subfolders...\">\n"
 "            </div>\n"
 "          </div>\n"
 "          <div class=\"toolbar-right\">\n"
@@ -1001,10 +2005,76 @@ static const char *INDEX_HTML =
 "    </div>\n"
 "  </div>\n"
 "\n"
+"  <script type=\"javascript/worker\" id=\"hashWorkerSrc\">\n"
+"    // SHA-256 over a File/Blob in slices; crypto.subtle is unavailable on plain-HTTP origins\n"
+"    const K = new Uint32Array([\n"
+"      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,\n"
+"      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,\n"
+"      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,\n"
+"      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,\n"
+"      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,\n"
+"      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,\n"
+"      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,\n"
+"      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2]);\n"
+"    const W = new Uint32Array(64);\n"
+"    function blocks(H, b, off, end) {\n"
+"      for (; off + 64 <= end; off += 64) {\n"
+"        for (let i = 0; i < 16; i++) {\n"
+"          const j = off + 4 * i;\n"
+"          W[i] = (b[j] << 24) | (b[j + 1] << 16) | (b[j + 2] << 8) | b[j + 3];\n"
+"        }\n"
+"        for (let i = 16; i < 64; i++) {\n"
+"          const x = W[i - 15], y = W[i - 2];\n"
+"          const s0 = ((x >>> 7) | (x << 25)) ^ ((x >>> 18) | (x << 14)) ^ (x >>> 3);\n"
+"          const s1 = ((y >>> 17) | (y << 15)) ^ ((y >>> 19) | (y << 13)) ^ (y >>> 10);\n"
+"          W[i] = (W[i - 16] + s0 + W[i - 7] + s1) | 0;\n"
+"        }\n"
+"        let a = H[0], c1 = H[1], c2 = H[2], d = H[3], e = H[4], f = H[5], g = H[6], h = H[7];\n"
+"        for (let i = 0; i < 64; i++) {\n"
+"          const S1 = ((e >>> 6) | (e << 26)) ^ ((e >>> 11) | (e << 21)) ^ ((e >>> 25) | (e << 7));\n"
+"          const t1 = (h + S1 + ((e & f) ^ (~e & g)) + K[i] + W[i]) | 0;\n"
+"          const S0 = ((a >>> 2) | (a << 30)) ^ ((a >>> 13) | (a << 19)) ^ ((a >>> 22) | (a << 10));\n"
+"          const t2 = (S0 + ((a & c1) ^ (a & c2) ^ (c1 & c2))) | 0;\n"
+"          h = g; g = f; f = e; e = (d + t1) | 0; d = c2; c2 = c1; c1 = a; a = (t1 + t2) | 0;\n"
+"        }\n"
+"        H[0] += a; H[1] += c1; H[2] += c2; H[3] += d; H[4] += e; H[5] += f; H[6] += g; H[7] += h;\n"
+"      }\n"
+"      return off;\n"
+"    }\n"
+"    async function sha256File(file) {\n"
+"      const H = new Uint32Array([0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19]);\n"
+"      const SLICE = 4 << 20;\n"
+"      let carry = new Uint8Array(0);\n"
+"      for (let pos = 0; pos < file.size; pos += SLICE) {\n"
+"        const chunk = new Uint8Array(await file.slice(pos, pos + SLICE).arrayBuffer());\n"
+"        const b = new Uint8Array(carry.length + chunk.length);\n"
+"        b.set(carry); b.set(chunk, carry.length);\n"
+"        carry = b.slice(blocks(H, b, 0, b.length));\n"
+"      }\n"
+"      const len = file.size, tail = new Uint8Array(Math.ceil((carry.length + 9) / 64) * 64);\n"
+"      tail.set(carry); tail[carry.length] = 0x80;\n"
+"      const dv = new DataView(tail.buffer);\n"
+"      dv.setUint32(tail.length - 8, Math.floor(len / 0x20000000));\n"
+"      dv.setUint32(tail.length - 4, (len % 0x20000000) * 8);\n"
+"      blocks(H, tail, 0, tail.length);\n"
+"      let hex = '';\n"
+"      for (const v of H) hex += v.toString(16).padStart(8, '0');\n"
+"      return hex;\n"
+"    }\n"
+"    onmessage = async (e) => {\n"
+"      try { postMessage({ id: e.data.id, sha256: await sha256File(e.data.file) }); }\n"
+"      catch (err) { postMessage({ id: e.data.id, sha256: null }); }\n"
+"    };\n"
+"  </script>\n"
 "  <script>\n"
 "    // State management\n"
 "    let currentPath = '/';\n"
 "    let currentEntries = [];\n"
+"    const PAGE_SIZE = 500;\n"
+"    let listCursor = null;     // cursor for the next page of currentPath, null once complete\n"
+"    let listTotals = null;     // {total, dirs, files, bytes} reported by the server\n"
+"    let listLoading = false;\n"
+"    let pageObserver = null;\n"
 "    let itemToRename = null;\n"
 "    let itemToView = null;\n"
 "\n"
@@ -1077,25 +2147,259 @@ static const char *INDEX_HTML =
 "      return null;\n"
 "    }\n"
 "\n"
-"    async function listDirectory(path) {\n"
-"      const data = await apiCall(`/api/list?path=${encodeURIComponent(path)}`);\n"
-"      if (data) {\n"
-"        currentEntries = data;\n"
-"        updateFileListing();\n"
-"        updateStats();\n"
-"        updateBreadcrumb(path);\n"
-"        currentPath = path;\n"
+"    // Listings travel as columnar CBOR (RFC 8949) when the server offers it\n"
+"    const CBOR_BREAK = Symbol('break');\n"
+"    const utf8Decoder = new TextDecoder();\n"
+"\n"
+"    function cborDecode(buffer) {\n"
+"      const bytes = new Uint8Array(buffer);\n"
+"      const view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);\n"
+"      let pos = 0;\n"
+"      function arg(info) {\n"
+"        if (info < 24) return info;\n"
+"        if (info === 24) return bytes[pos++];\n"
+"        if (info === 25) { pos += 2; return view.getUint16(pos - 2); }\n"
+"        if (info === 26) { pos += 4; return view.getUint32(pos - 4); }\n"
+"        if (info === 27) { pos += 8; return view.getUint32(pos - 8) * 4294967296 + view.getUint32(pos - 4); }\n"
+"        if (info === 31) return -1;\n"
+"        throw new Error('Malformed CBOR');\n"
 "      }\n"
-"    }\n"
-"\n"
-"    async function createDirectory(path) {\n"
-"      const result = await apiCall(`/api/mkdir?path=${encodeURIComponent(path)}`, { method: 'POST' });\n"
-"      if (result !== null) {\n"
-"        await listDirectory(currentPath);\n"
-"        showStatus('Folder created successfully');\n"
-"        return true;\n"
+"      function item() {\n"
+"        const head = bytes[pos++], major = head >> 5, info = head & 31;\n"
+"        if (major === 7) {\n"
+"          if (info === 20) return false;\n"
+"          if (info === 21) return true;\n"
+"          if (info === 22 || info === 23) return null;\n"
+"          if (info === 26) { pos += 4; return view.getFloat32(pos - 4); }\n"
+"          if (info === 27) { pos += 8; return view.getFloat64(pos - 8); }\n"
+"          if (info === 31) return CBOR_BREAK;\n"
+"          throw new Error('Unsupported CBOR value');\n"
+"        }\n"
+"        const n = arg(info);\n"
+"        switch (major) {\n"
+"          case 0: return n;\n"
+"          case 1: return -1 - n;\n"
+"          case 2:\n"
+"          case 3: {\n"
+"            if (n < 0) throw new Error('Unsupported CBOR string');\n"
+"            // Short ASCII names are the common case and cheaper to build directly\n"
+"            if (n <= 64) {\n"
+"              let s = '', i = pos;\n"
+"              for (; i < pos + n && bytes[i] < 0x80; i++) s += String.fromCharCode(bytes[i]);\n"
+"              if (i === pos + n) { pos = i; return s; }\n"
+"            }\n"
+"            pos += n;\n"
+"            return utf8Decoder.decode(bytes.subarray(pos - n, pos));\n"
+"          }\n"
+"          case 4: {\n"
+"            const arr = [];\n"
+"            if (n < 0) for (let v = item(); v !== CBOR_BREAK; v = item()) arr.push(v);\n"
+"            else for (let i = 0; i < n; i++) arr.push(item());\n"
+"            return arr;\n"
+"          }\n"
+"          case 5: {\n"
+"            const obj = {};\n"
+"            if (n < 0) for (let k = item(); k !== CBOR_BREAK; k = item()) obj[k] = item();\n"
+"            else for (let i = 0; i < n; i++) { const k = item(); obj[k] = item(); }\n"
+"            return obj;\n"
+"          }\n"
+"          default: return item();  // tag: the tagged value itself\n"
+"        }\n"
 "      }\n"
-"      return false;\n"
+"      return item();\n"
+"    }\n"
+"\n"
+"    // Turn the column blocks back into the entry objects the JSON listing has\n"
+"    function listingFromCbor(doc) {\n"
+"      const types = ['file', 'dir', 'link'];\n"
+"      const base = doc.path === '/' ? '' : doc.path;\n"
+"      const entries = [];\n"
+"      for (const block of doc.blocks) {\n"
+"        const names = block[0];\n"
+"        for (let i = 0; i < names.length; i++) {\n"
+"          const entry = { name: names[i], path: `${base}/${names[i]}` };\n"
+"          for (let c = 1; c < doc.fields.length; c++) {\n"
+"            const value = block[c][i];\n"
+"            if (value !== null) entry[doc.fields[c]] = value;\n"
+"          }\n"
+"          if (entry.type !== undefined) entry.type = types[entry.type];\n"
+"          if (entry.mode !== undefined) entry.mode = '0' + entry.mode.toString(8).padStart(3, '0');\n"
+"          entries.push(entry);\n"
+"        }\n"
+"      }\n"
+"      return { entries, total: doc.total, dirs: doc.dirs, files: doc.files, bytes: doc.bytes, next: doc.next ?? null };\n"
+"    }\n"
+"\n"
+"    async function fetchListing(url) {\n"
+"      try {\n"
+"        const response = await fetch(url, { headers: { 'Accept': 'application/cbor, application/json' } });\n"
+"        if (!response.ok) return null;\n"
+"        if ((response.headers.get('Content-Type') || '').startsWith('application/cbor')) {\n"
+"          return listingFromCbor(cborDecode(await response.arrayBuffer()));\n"
+"        }\n"
+"        return await response.json();\n"
+"      } catch (error) {\n"
+"        return null;\n"
+"      }\n"
+"    }\n"
+"\n"
+"    // Listings come sorted from the server a page at a time; further pages load on scroll\n"
+"    function listPageUrl(path, cursor) {\n"
+"      let url = `/api/list?path=${encodeURIComponent(path)}&sort=name&limit=${PAGE_SIZE}&fields=type,size,mtime,mode,target,du`;\n"
+"      if (cursor) url += `&cursor=${encodeURIComponent(cursor)}`;\n"
+"      return url;\n"
+"    }\n"
+"\n"
+"    async function listDirectory(path) {\n"
+"      if (searchAbort) searchAbort.abort();\n"
+"      const data = await fetchListing(listPageUrl(path, null));\n"
+"      if (data) {\n"
+"        currentPath = path;\n"
+"        currentEntries = data.entries;\n"
+"        listCursor = data.next;\n"
+"        listTotals = data;\n"
+"        updateFileListing();\n"
+"        updateStats();\n"
+"        updateBreadcrumb(path);\n"
+"        watchDirectory(path);\n"
+"      }\n"
+"    }\n"
+"\n"
+"    // Live updates for the folder on screen: the server pushes each change with the entry\n"
+"    // as a listing shows it, and the row is patched in place\n"
+"    let events = null;\n"
+"\n"
+"    function watchDirectory(path) {\n"
+"      if (events && events.path === path) return;\n"
+"      if (events) events.close();\n"
+"      events = null;\n"
+"      if (!window.EventSource) return;\n"
+"      const es = events = new EventSource(`/api/events?path=${encodeURIComponent(path)}&fields=type,size,mtime,mode,target,du`);\n"
+"      es.path = path;\n"
+"      let connected = false;\n"
+"      es.addEventListener('ready', () => {\n"
+"        if (connected) listDirectory(path);     // reconnected: changes may have been missed\n"
+"        connected = true;\n"
+"      });\n"
+"      es.addEventListener('reset', () => listDirectory(path));\n"
+"      es.addEventListener('gone', () => {\n"
+"        es.close();\n"
+"        if (events === es) events = null;\n"
+"        showStatus('This folder was removed');\n"
+"      });\n"
+"      for (const kind of ['create', 'modify', 'delete']) {\n"
+"        es.addEventListener(kind, e => {\n"
+"          if (events === es && path === currentPath) patchEntry(kind, JSON.parse(e.data));\n"
+"        });\n"
+"      }\n"
+"    }\n"
+"\n"
+"    function countEntry(entry, sign) {\n"
+"      if (!listTotals) return;\n"
+"      if (entry.type === 'dir') {\n"
+"        listTotals.dirs += sign;\n"
+"      } else {\n"
+"        listTotals.files += sign;\n"
+"        listTotals.bytes += sign * (entry.size || 0);\n"
+"      }\n"
+"    }\n"
+"\n"
+"    function patchEntry(kind, entry) {\n"
+"      // leave search results and filtered views alone\n"
+"      if (searchAbort || document.getElementById('searchInput').value) return;\n"
+"      const fileRows = document.getElementById('fileRows');\n"
+"      const rowOf = name => fileRows.querySelector(`.file-row[data-name=\"${CSS.escape(name)}\"]`);\n"
+"      const i = currentEntries.findIndex(e => e.name === entry.name);\n"
+"      if (i >= 0) {\n"
+"        countEntry(currentEntries[i], -1);\n"
+"        currentEntries.splice(i, 1);\n"
+"        const old = rowOf(entry.name);\n"
+"        if (old) old.remove();\n"
+"      }\n"
+"      if (kind !== 'delete') {\n"
+"        countEntry(entry, 1);\n"
+"        // the server's order: directories first, then by name\n"
+"        const isDir = entry.type === 'dir';\n"
+"        const at = currentEntries.findIndex(e => (e.type === 'dir') !== isDir ? isDir : entry.name < e.name);\n"
+"        // past the last loaded row while pages remain: a later page brings it\n"
+"        if (at >= 0 || !listCursor) {\n"
+"          const row = createFileRow(entry);\n"
+"          setupEventListeners(row);\n"
+"          fileRows.insertBefore(row, at >= 0 ? rowOf(currentEntries[at].name) : document.getElementById('pageSentinel'));\n"
+"          currentEntries.splice(at >= 0 ? at : currentEntries.length, 0, entry);\n"
+"        }\n"
+"      }\n"
+"      updateStats();\n"
+"    }\n"
+"\n"
+"    // Enter searches the whole subtree on the server; matches stream in as they are found,\n"
+"    // labelled with their path below the current folder\n"
+"    let searchAbort = null;\n"
+"\n"
+"    async function searchTree(term) {\n"
+"      if (searchAbort) searchAbort.abort();\n"
+"      const ctl = searchAbort = new AbortController();\n"
+"      const kind = /[*?[]/.test(term) ? 'glob' : 'q';\n"
+"      const url = `/api/search?path=${encodeURIComponent(currentPath)}&${kind}=${encodeURIComponent(term)}&fields=type,size,mtime`;\n"
+"      const prefix = currentPath === '/' ? 1 : currentPath.length + 1;\n"
+"      document.getElementById('fileRows').innerHTML = '';\n"
+"      try {\n"
+"        const res = await fetch(url, { signal: ctl.signal });\n"
+"        if (!res.ok) {\n"
+"          showStatus('Search failed: ' + await res.text());\n"
+"          return;\n"
+"        }\n"
+"        const reader = res.body.getReader();\n"
+"        const decoder = new TextDecoder();\n"
+"        let buf = '';\n"
+"        for (;;) {\n"
+"          const { done, value } = await reader.read();\n"
+"          if (done) break;\n"
+"          buf += decoder.decode(value, { stream: true });\n"
+"          const lines = buf.split('\\n');\n"
+"          buf = lines.pop();\n"
+"          const found = [];\n"
+"          for (const line of lines) {\n"
+"            if (!line) continue;\n"
+"            const item = JSON.parse(line);\n"
+"            if (item.done) {\n"
+"              const where = item.index ? 'from the index' : `in ${item.scanned} names`;\n"
+"              showStatus(`${item.entries}${item.truncated ? '+' : ''} found ${where}`);\n"
+"            } else if (item.name !== undefined) {\n"
+"              item.label = item.path.slice(prefix);\n"
+"              found.push(item);\n"
+"            }\n"
+"          }\n"
+"          if (found.length) appendFileRows(found);\n"
+"        }\n"
+"      } catch (e) {\n"
+"        if (e.name !== 'AbortError') showStatus('Search failed: ' + e.message);\n"
+"      } finally {\n"
+"        if (searchAbort === ctl) searchAbort = null;\n"
+"      }\n"
+"    }\n"
+"\n"
+"    async function loadNextPage() {\n"
+"      if (!listCursor || listLoading) return;\n"
+"      const path = currentPath, cursor = listCursor;\n"
+"      listLoading = true;\n"
+"      const data = await fetchListing(listPageUrl(path, cursor));\n"
+"      listLoading = false;\n"
+"      if (!data || path !== currentPath || cursor !== listCursor) return;\n"
+"      currentEntries = currentEntries.concat(data.entries);\n"
+"      listCursor = data.next;\n"
+"      appendFileRows(data.entries);\n"
+"      observePageEnd();\n"
+"    }\n"
+"\n"
+"    async function createDirectory(path) {\n"
+"      const result = await apiCall(`/api/mkdir?path=${encodeURIComponent(path)}`, { method: 'POST' });\n"
+"      if (result !== null) {\n"
+"        await listDirectory(currentPath);\n"
+"        showStatus('Folder created successfully');\n"
+"        return true;\n"
+"      }\n"
+"      return false;\n"
 "    }\n"
 "\n"
 "    async function deleteItem(path) {\n"
@@ -1110,10 +2414,54 @@ static const char *INDEX_HTML =
 "      return false;\n"
 "    }\n"
 "\n"
+"    // Content hashing runs in a worker so large files don't block the page\n"
+"    const DEDUP_MIN_SIZE = 256 * 1024;\n"
+"    let hashWorker = null;\n"
+"    let hashSeq = 0;\n"
+"    const hashWaiters = new Map();\n"
+"\n"
+"    function hashFile(file) {\n"
+"      return new Promise(resolve => {\n"
+"        try {\n"
+"          if (!hashWorker) {\n"
+"            const src = document.getElementById('hashWorkerSrc').textContent;\n"
+"            hashWorker = new Worker(URL.createObjectURL(new Blob([src], { type: 'text/javascript' })));\n"
+"            hashWorker.onmessage = (e) => {\n"
+"              const done = hashWaiters.get(e.data.id);\n"
+"              hashWaiters.delete(e.data.id);\n"
+"              if (done) done(e.data.sha256);\n"
+"            };\n"
+"          }\n"
+"          const id = ++hashSeq;\n"
+"          hashWaiters.set(id, resolve);\n"
+"          hashWorker.postMessage({ id, file });\n"
+"        } catch (error) {\n"
+"          resolve(null);\n"
+"        }\n"
+"      });\n"
+"    }\n"
+"\n"
+"    function hexToBase64(hex) {\n"
+"      let bin = '';\n"
+"      for (let i = 0; i < hex.length; i += 2) bin += String.fromCharCode(parseInt(hex.substr(i, 2), 16));\n"
+"      return btoa(bin);\n"
+"    }\n"
+"\n"
 "    async function uploadFile(file, destination) {\n"
 "      try {\n"
+"        const headers = {};\n"
+"        // Ask the server first whether it already holds these bytes\n"
+"        if (file.size >= DEDUP_MIN_SIZE) {\n"
+"          const sha = await hashFile(file);\n"
+"          if (sha) {\n"
+"            const pre = await fetch(`/api/dedup?path=${encodeURIComponent(destination)}&size=${file.size}&sha256=${sha}`, { method: 'POST' });\n"
+"            if (pre.status === 201) return true;\n"
+"            headers['Repr-Digest'] = `sha-256=:${hexToBase64(sha)}:`;\n"
+"          }\n"
+"        }\n"
 "        const response = await fetch(`/api/upload?path=${encodeURIComponent(destination)}`, {\n"
 "          method: 'PUT',\n"
+"          headers,\n"
 "          body: file\n"
 "        });\n"
 "        return response.ok;\n"
@@ -1122,6 +2470,71 @@ static const char *INDEX_HTML =
 "      }\n"
 "    }\n"
 "\n"
+"    // Many small files go up as one streamed tar instead of one PUT each\n"
+"    const BULK_MIN_FILES = 8;\n"
+"    const textEncoder = new TextEncoder();\n"
+"\n"
+"    function tarHeader(name, size, mtime, type) {\n"
+"      const h = new Uint8Array(512);\n"
+"      const put = (off, len, str) => h.set(textEncoder.encode(str).subarray(0, len), off);\n"
+"      const oct = (off, len, n) => put(off, len, n.toString(8).padStart(len - 1, '0'));\n"
+"      put(0, 100, name);\n"
+"      oct(100, 8, 0o644);\n"
+"      oct(108, 8, 0);\n"
+"      oct(116, 8, 0);\n"
+"      oct(124, 12, size);\n"
+"      oct(136, 12, Math.floor(mtime / 1000));\n"
+"      h.fill(32, 148, 156);\n"
+"      put(156, 1, type);\n"
+"      put(257, 8, 'ustar\\u000000');\n"
+"      let sum = 0;\n"
+"      for (const b of h) sum += b;\n"
+"      put(148, 8, sum.toString(8).padStart(6, '0') + '\\u0000 ');\n"
+"      return h;\n"
+"    }\n"
+"\n"
+"    function paxRecord(key, value) {\n"
+"      const body = ` ${key}=${value}\\n`;\n"
+"      let len = textEncoder.encode(body).length;\n"
+"      len += String(len).length;\n"
+"      if (String(len).length !== String(len - String(len).length).length) len++;\n"
+"      return `${len}${body}`;\n"
+"    }\n"
+"\n"
+"    function tarPad(size) {\n"
+"      return new Uint8Array((512 - size % 512) % 512);\n"
+"    }\n"
+"\n"
+"    // Blob parts reference the File objects, so nothing is read into memory here\n"
+"    function buildTar(files) {\n"
+"      const parts = [];\n"
+"      for (const file of files) {\n"
+"        const name = file.webkitRelativePath || file.name;\n"
+"        const long = textEncoder.encode(name).length > 100 || file.size > 0o77777777777;\n"
+"        if (long) {\n"
+"          const pax = textEncoder.encode(paxRecord('path', name) + paxRecord('size', file.size));\n"
+"          parts.push(tarHeader('PaxHeader', pax.length, Date.now(), 'x'), pax, tarPad(pax.length));\n"
+"        }\n"
+"        parts.push(tarHeader(long ? 'long-name' : name, long ? 0 : file.size, file.lastModified, '0'));\n"
+"        parts.push(file, tarPad(file.size));\n"
+"      }\n"
+"      parts.push(new Uint8Array(1024));\n"
+"      return new Blob(parts);\n"
+"    }\n"
+"\n"
+"    async function uploadBulk(files, directory) {\n"
+"      try {\n"
+"        const response = await fetch(`/api/extract?path=${encodeURIComponent(directory)}`, {\n"
+"          method: 'PUT',\n"
+"          headers: { 'Content-Type': 'application/x-tar' },\n"
+"          body: buildTar(files)\n"
+"        });\n"
+"        return await response.json();\n"
+"      } catch (error) {\n"
+"        return null;\n"
+"      }\n"
+"    }\n"
+"\n"
 "    async function createFile(path, content = '') {\n"
 "      try {\n"
 "        const response = await fetch(`/api/upload?path=${encodeURIComponent(path)}`, {\n"
@@ -1175,73 +2588,127 @@ static const char *INDEX_HTML =
 "          <div class=\"file-type\">Parent Directory</div>\n"
 "          <div class=\"file-actions\"></div>\n"
 "        `;\n"
+"        setupEventListeners(row);\n"
 "        fileRows.appendChild(row);\n"
 "      }\n"
 "\n"
-"      // Sort entries: directories first, then files\n"
-"      const sortedEntries = [...currentEntries].sort((a, b) => {\n"
-"        if (a.type === b.type) {\n"
-"          return a.name.localeCompare(b.name);\n"
-"        }\n"
-"        return a.type === 'dir' ? -1 : 1;\n"
-"      });\n"
+"      // Entries arrive sorted (directories first) from the server\n"
+"      appendFileRows(currentEntries);\n"
+"      observePageEnd();\n"
+"    }\n"
 "\n"
-"      // Add file entries\n"
-"      sortedEntries.forEach(entry => {\n"
-"        const row = document.createElement('div');\n"
-"        row.className = 'file-row';\n"
-"        \n"
-"        const icon = getFileIcon(entry.type, entry.name);\n"
-"        const typeName = getFileType(entry.name, entry.type);\n"
-"        const size = entry.type === 'dir' ? '-' : formatBytes(entry.size || 0);\n"
-"        \n"
-"        let nameContent;\n"
-"        if (entry.type === 'dir') {\n"
-"          nameContent = `<a href=\"#\" data-path=\"${entry.path}\">${entry.name}</a>`;\n"
-"        } else {\n"
-"          nameContent = `<a href=\"#\" class=\"view-file\" data-path=\"${entry.path}\">${entry.name}</a>`;\n"
-"        }\n"
-"        \n"
-"        row.innerHTML = `\n"
-"          <div class=\"file-name\">\n"
-"            <div class=\"file-icon\">${icon}</div>\n"
-"            ${nameContent}\n"
-"          </div>\n"
-"          <div class=\"file-size\">${size}</div>\n"
-"          <div class=\"file-type\">${typeName}</div>\n"
-"          <div class=\"file-actions\">\n"
-"            <button class=\"action-btn download-btn\" title=\"Download\" ${entry.type === 'dir' ? 'disabled' : ''} data-path=\"${entry.path}\">\n"
-"              <span class=\"nav-icon\">⬇️</span>\n"
-"            </button>\n"
-"            <button class=\"action-btn rename-btn\" title=\"Rename\" data-path=\"${entry.path}\" data-name=\"${entry.name}\">\n"
-"              <span class=\"nav-icon\">✏️</span>\n"
-"            </button>\n"
-"            <button class=\"action-btn delete-btn\" title=\"Delete\" data-path=\"${entry.path}\">\n"
-"              <span class=\"nav-icon\">🗑️</span>\n"
-"            </button>\n"
-"          </div>\n"
-"        `;\n"
-"        \n"
-"        fileRows.appendChild(row);\n"
+"    // Tooltip text from the optional listing fields\n"
+"    function entryDetails(entry) {\n"
+"      const parts = [];\n"
+"      if (entry.mtime !== undefined) parts.push(`Modified: ${new Date(entry.mtime * 1000).toLocaleString()}`);\n"
+"      if (entry.mode !== undefined) parts.push(`Permissions: ${entry.mode}`);\n"
+"      if (entry.target !== undefined) parts.push(`Link to: ${entry.target}`);\n"
+"      return parts.join('\\n').replace(/\"/g, '&quot;');\n"
+"    }\n"
+"\n"
+"    function createFileRow(entry) {\n"
+"      const row = document.createElement('div');\n"
+"      row.className = 'file-row';\n"
+"      row.dataset.name = entry.name;\n"
+"      \n"
+"      const icon = getFileIcon(entry.type, entry.name);\n"
+"      const typeName = entry.target !== undefined ? 'Link' : getFileType(entry.name, entry.type);\n"
+"      const size = entry.type === 'dir' ? (entry.du === undefined ? '-' : formatBytes(entry.du))\n"
+"        : entry.size === undefined ? '-' : formatBytes(entry.size);\n"
+"      const details = entryDetails(entry);\n"
+"      \n"
+"      let nameContent;\n"
+"      if (entry.type === 'dir') {\n"
+"        nameContent = `<a href=\"#\" data-path=\"${entry.path}\" title=\"${details}\">${entry.label || entry.name}</a>`;\n"
+"      } else {\n"
+"        nameContent = `<a href=\"#\" class=\"view-file\" data-path=\"${entry.path}\" title=\"${details}\">${entry.label || entry.name}</a>`;\n"
+"      }\n"
+"      \n"
+"      row.innerHTML = `\n"
+"        <div class=\"file-name\">\n"
+"          <div class=\"file-icon\">${icon}</div>\n"
+"          ${nameContent}\n"
+"        </div>\n"
+"        <div class=\"file-size\">${size}</div>\n"
+"        <div class=\"file-type\">${typeName}</div>\n"
+"        <div class=\"file-actions\">\n"
+"          <button class=\"action-btn download-btn\" title=\"Download\" ${entry.type === 'dir' ? 'disabled' : ''} data-path=\"${entry.path}\">\n"
+"            <span class=\"nav-icon\">⬇️</span>\n"
+"          </button>\n"
+"          <button class=\"action-btn rename-btn\" title=\"Rename\" data-path=\"${entry.path}\" data-name=\"${entry.name}\">\n"
+"            <span class=\"nav-icon\">✏️</span>\n"
+"          </button>\n"
+"          <button class=\"action-btn delete-btn\" title=\"Delete\" data-path=\"${entry.path}\">\n"
+"            <span class=\"nav-icon\">🗑️</span>\n"
+"          </button>\n"
+"        </div>\n"
+"      `;\n"
+"      return row;\n"
+"    }\n"
+"\n"
+"    // Append rows and bind listeners on the new rows only\n"
+"    function appendFileRows(entries) {\n"
+"      const fileRows = document.getElementById('fileRows');\n"
+"      const frag = document.createDocumentFragment();\n"
+"      entries.forEach(entry => {\n"
+"        const row = createFileRow(entry);\n"
+"        setupEventListeners(row);\n"
+"        frag.appendChild(row);\n"
 "      });\n"
+"      const sentinel = document.getElementById('pageSentinel');\n"
+"      fileRows.insertBefore(frag, sentinel);\n"
+"    }\n"
 "\n"
-"      // Add event listeners\n"
-"      setupEventListeners();\n"
+"    function observePageEnd() {\n"
+"      const old = document.getElementById('pageSentinel');\n"
+"      if (old) old.remove();\n"
+"      if (!listCursor) return;\n"
+"      if (!pageObserver) {\n"
+"        pageObserver = new IntersectionObserver(items => {\n"
+"          if (items.some(i => i.isIntersecting)) loadNextPage();\n"
+"        }, { rootMargin: '400px' });\n"
+"      }\n"
+"      const sentinel = document.createElement('div');\n"
+"      sentinel.id = 'pageSentinel';\n"
+"      document.getElementById('fileRows').appendChild(sentinel);\n"
+"      pageObserver.observe(sentinel);\n"
 "    }\n"
 "\n"
 "    function updateStats() {\n"
-"      const folders = currentEntries.filter(e => e.type === 'dir').length;\n"
-"      const files = currentEntries.filter(e => e.type !== 'dir').length;\n"
-"      const totalSize = currentEntries\n"
-"        .filter(e => e.type !== 'dir')\n"
-"        .reduce((sum, e) => sum + (e.size || 0), 0);\n"
+"      const folders = listTotals ? listTotals.dirs : 0;\n"
+"      const files = listTotals ? listTotals.files : 0;\n"
+"      const totalSize = listTotals ? listTotals.bytes : 0;\n"
 "\n"
 "      document.getElementById('folderCount').textContent = folders;\n"
 "      document.getElementById('fileCount').textContent = files;\n"
 "      document.getElementById('totalSize').textContent = formatBytes(totalSize);\n"
+"      document.getElementById('totalSizeLabel').textContent = 'Total Size';\n"
 "      document.getElementById('itemsCount').textContent = folders + files;\n"
 "    }\n"
 "\n"
+"    // Recursive size of the current folder, on request: walking a big tree is not free.\n"
+"    // Subfolder sizes come back too, and later listings carry them while they are valid.\n"
+"    async function computeUsage() {\n"
+"      const path = currentPath;\n"
+"      const label = document.getElementById('totalSizeLabel');\n"
+"      label.textContent = 'Calculating…';\n"
+"      try {\n"
+"        const response = await fetch(`/api/du?path=${encodeURIComponent(path)}`);\n"
+"        if (!response.ok) throw new Error(response.statusText);\n"
+"        const usage = await response.json();\n"
+"        if (path !== currentPath) return;\n"
+"        const sizes = new Map(usage.children.map(child => [child.name, child.bytes]));\n"
+"        for (const entry of currentEntries) {\n"
+"          if (entry.type === 'dir' && sizes.has(entry.name)) entry.du = sizes.get(entry.name);\n"
+"        }\n"
+"        updateFileListing();\n"
+"        document.getElementById('totalSize').textContent = formatBytes(usage.bytes);\n"
+"        label.textContent = 'Total Size (with subfolders)';\n"
+"      } catch (error) {\n"
+"        if (path === currentPath) label.textContent = 'Total Size';\n"
+"      }\n"
+"    }\n"
+"\n"
 "    function updateBreadcrumb(path) {\n"
 "      const breadcrumb = document.getElementById('breadcrumb');\n"
 "      const parts = path.split('/').filter(p => p);\n"
@@ -1255,12 +2722,13 @@ static const char *INDEX_HTML =
 "      });\n"
 "      \n"
 "      breadcrumb.innerHTML = breadcrumbHTML;\n"
+"      setupEventListeners(breadcrumb);\n"
 "    }\n"
 "\n"
 "    // Event handlers\n"
-"    function setupEventListeners() {\n"
+"    function setupEventListeners(root = document) {\n"
 "      // Directory navigation\n"
-"      document.querySelectorAll('a[data-path]').forEach(link => {\n"
+"      root.querySelectorAll('a[data-path]').forEach(link => {\n"
 "        link.addEventListener('click', (e) => {\n"
 "          e.preventDefault();\n"
 "          const path = link.getAttribute('data-path');\n"
@@ -1269,7 +2737,7 @@ static const char *INDEX_HTML =
 "      });\n"
 "\n"
 "      // File actions\n"
-"      document.querySelectorAll('.download-btn').forEach(btn => {\n"
+"      root.querySelectorAll('.download-btn').forEach(btn => {\n"
 "        btn.addEventListener('click', (e) => {\n"
 "          e.stopPropagation();\n"
 "          const path = btn.getAttribute('data-path');\n"
@@ -1279,7 +2747,7 @@ static const char *INDEX_HTML =
 "        });\n"
 "      });\n"
 "\n"
-"      document.querySelectorAll('.rename-btn').forEach(btn => {\n"
+"      root.querySelectorAll('.rename-btn').forEach(btn => {\n"
 "        btn.addEventListener('click', (e) => {\n"
 "          e.stopPropagation();\n"
 "          const path = btn.getAttribute('data-path');\n"
@@ -1288,7 +2756,7 @@ static const char *INDEX_HTML =
 "        });\n"
 "      });\n"
 "\n"
-"      document.querySelectorAll('.delete-btn').forEach(btn => {\n"
+"      root.querySelectorAll('.delete-btn').forEach(btn => {\n"
 "        btn.addEventListener('click', (e) => {\n"
 "          e.stopPropagation();\n"
 "          const path = btn.getAttribute('data-path');\n"
@@ -1297,7 +2765,7 @@ static const char *INDEX_HTML =
 "      });\n"
 "\n"
 "      // File viewing\n"
-"      document.querySelectorAll('.view-file').forEach(link => {\n"
+"      root.querySelectorAll('.view-file').forEach(link => {\n"
 "        link.addEventListener('click', (e) => {\n"
 "          e.preventDefault();\n"
 "          const path = link.getAttribute('data-path');\n"
@@ -1306,6 +2774,7 @@ static const char *INDEX_HTML =
 "      });\n"
 "\n"
 "      // Sidebar navigation\n"
+"      if (root !== document) return;\n"
 "      document.querySelectorAll('.nav-item[data-path]').forEach(item => {\n"
 "        item.addEventListener('click', () => {\n"
 "          const path = item.getAttribute('data-path');\n"
@@ -1411,7 +2880,21 @@ static const char *INDEX_HTML =
 "        \n"
 "        let uploadSuccess = true;\n"
 "        \n"
-"        for (const file of files) {\n"
+"        if (files.length >= BULK_MIN_FILES) {\n"
+"          const progressItem = document.createElement('div');\n"
+"          progressItem.className = 'upload-item';\n"
+"          progressItem.innerHTML = `<div><strong>${files.length} files</strong></div><div>Uploading...</div>`;\n"
+"          progressContainer.appendChild(progressItem);\n"
+"          const result = await uploadBulk(files, currentPath);\n"
+"          const failed = result ? result.entries.filter(e => e.status === 'error' || e.status === 'skipped') : [];\n"
+"          uploadSuccess = !!result && result.complete && failed.length === 0;\n"
+"          progressItem.innerHTML = uploadSuccess\n"
+"            ? `<div><strong>${files.length} files</strong></div><div style=\"color: green;\">✓ Uploaded successfully</div>`\n"
+"            : `<div><strong>${files.length} files</strong></div><div>Upload failed${failed.length ? ': ' + failed.map(e => e.path).join(', ') : ''}</div>`;\n"
+"        }\n"
+"        \n"
+"        for (const file of (files.length >= BULK_MIN_FILES ? [] : files)) {\n"
+
 "          const progressItem = document.createElement('div');\n"
 "          progressItem.className = 'upload-item';\n"
 "          progressItem.innerHTML = `\n"
@@ -1514,9 +2997,12 @@ static const char *INDEX_HTML =
 "        }\n"
 "      });\n"
 "\n"
+"      document.getElementById('totalSizeCard').addEventListener('click', computeUsage);\n"
+"\n"
 "      // Search functionality\n"
 "      document.getElementById('searchInput').addEventListener('input', (e) => {\n"
 "        const searchTerm = e.target.value.toLowerCase();\n"
+"        if (searchAbort) searchAbort.abort();\n"
 "        \n"
 "        if (searchTerm === '') {\n"
 "          updateFileListing();\n"
@@ -1527,50 +3013,16 @@ static const char *INDEX_HTML =
 "          entry.name.toLowerCase().includes(searchTerm)\n"
 "        );\n"
 "        \n"
-"        const fileRows = document.getElementById('fileRows');\n"
-"        fileRows.innerHTML = '';\n"
-"\n"
-"        filteredEntries.forEach(entry => {\n"
-"          const row = document.createElement('div');\n"
-"          row.className = 'file-row';\n"
-"          \n"
-"          const icon = getFileIcon(entry.type, entry.name);\n"
-"          const typeName = getFileType(entry.name, entry.type);\n"
-"          const size = entry.type === 'dir' ? '-' : formatBytes(entry.size || 0);\n"
-"          \n"
-"          let nameContent;\n"
-"          if (entry.type === 'dir') {\n"
-"            nameContent = `<a href=\"#\" data-path=\"${entry.path}\">${entry.name}</a>`;\n"
-"          } else {\n"
-"            nameContent = `<a href=\"#\" class=\"view-file\" data-path=\"${entry.path}\">${entry.name}</a>`;\n"
-"          }\n"
-"          \n"
-"          row.innerHTML = `\n"
-"            <div class=\"file-name\">\n"
-"              <div class=\"file-icon\">${icon}</div>\n"
-"              ${nameContent}\n"
-"            </div>\n"
-"            <div class=\"file-size\">${size}</div>\n"
-"            <div class=\"file-type\">${typeName}</div>\n"
-"            <div class=\"file-actions\">\n"
-"              <button class=\"action-btn download-btn\" title=\"Download\" ${entry.type === 'dir' ? 'disabled' : ''} data-path=\"${entry.path}\">\n"
-"                <span class=\"nav-icon\">⬇️</span>\n"
-"              </button>\n"
-"              <button class=\"action-btn rename-btn\" title=\"Rename\" data-path=\"${entry.path}\" data-name=\"${entry.name}\">\n"
-"                <span class=\"nav-icon\">✏️</span>\n"
-"              </button>\n"
-"              <button class=\"action-btn delete-btn\" title=\"Delete\" data-path=\"${entry.path}\">\n"
-"                <span class=\"nav-icon\">🗑️</span>\n"
-"              </button>\n"
-"            </div>\n"
-"          `;\n"
-"          \n"
-"          fileRows.appendChild(row);\n"
-"        });\n"
-"\n"
-"        setupEventListeners();\n"
+"        document.getElementById('fileRows').innerHTML = '';\n"
+"        appendFileRows(filteredEntries);\n"
+"      });\n"
+"      document.getElementById('searchInput').addEventListener('keydown', (e) => {\n"
+"        if (e.key === 'Enter' && e.target.value !== '') searchTree(e.target.value);\n"
 "      });\n"
 "\n"
+"      // Sidebar and static links; listing rows bind their own as they are added\n"
+"      setupEventListeners();\n"
+"\n"
 "      // Load initial directory\n"
 "      listDirectory('/');\n"
 "    }\n"
@@ -1583,19 +3035,54 @@ static const char *INDEX_HTML =
 
 /* ---------- HTTP request parsing helpers ---------- */
 
+/* header_get: find header name and return pointer to its value (within headers) */
+static char *header_get(const char *headers, const char *name) {
+    if (!headers || !name) return NULL;
+    size_t nlen = strlen(name);
+    for (char *p = my_strcasestr(headers, name); p; p = my_strcasestr(p + 1, name)) {
+        /* only a whole header name at the start of a line counts */
+        if (p != headers && p[-1] != '\n') continue;
+        char *v = p + nlen;
+        while (*v == ' ' || *v == '\t') v++;
+        if (*v != ':') continue;
+        v++;
+        while (*v && isspace((unsigned char)*v)) v++;
+        return v;
+    }
+    return NULL;
+}
+
+/* header_copy: copy a header value (up to end of line) into out; returns 1 if present */
+static int header_copy(const char *headers, const char *name, char *out, size_t outsz) {
+    const char *v = header_get(headers, name);
+    if (!v) return 0;
+    size_t n = strcspn(v, "\r\n");
+    if (n >= outsz) n = outsz - 1;
+    memcpy(out, v, n);
+    out[n] = '\0';
+    return 1;
+}
+
 struct http_req {
     char method[16];
     char uri[PATH_MAX];
     char proto[16];
     char headers[BUFSIZE];
-    char *body;
+    int conn;
+    char *body;             /* body bytes that arrived together with the headers */
     size_t body_len;
+    long long content_len;  /* -1 when the client sent no Content-Length */
+    long long body_read;    /* body bytes consumed so far */
+    int expect_continue;    /* client sent "Expect: 100-continue" and waits for our go-ahead */
 };
 
-/* parse incoming request buffer (single-chunk parse, simple) */
+/* parse incoming request buffer (request line + headers; the body is left on the socket) */
 static int parse_request(int conn, struct http_req *req, char *buf, ssize_t rlen) {
     if (rlen <= 0) return -1;
     buf[rlen] = '\0';
+    req->conn = conn;
+    req->body = NULL; req->body_len = 0;
+    req->content_len = -1; req->body_read = 0;
     char *line_end = strstr(buf, "\r\n");
     if (!line_end) return -1;
     *line_end = '\0';
@@ -1604,7 +3091,6 @@ static int parse_request(int conn, struct http_req *req, char *buf, ssize_t rlen
     char *hdrend = strstr(p, "\r\n\r\n");
     if (!hdrend) {
         req->headers[0] = '\0';
-        req->body = NULL; req->body_len = 0;
         return 0;
     }
     size_t hdrlen = hdrend - p;
@@ -1612,52 +3098,186 @@ static int parse_request(int conn, struct http_req *req, char *buf, ssize_t rlen
     memcpy(req->headers, p, hdrlen);
     req->headers[hdrlen] = '\0';
 
-    req->body = NULL; req->body_len = 0;
     char *cl = my_strcasestr(req->headers, "Content-Length:");
     if (cl) {
         char *num = cl + strlen("Content-Length:");
         while (*num && isspace((unsigned char)*num)) num++;
-        int content_len = atoi(num);
+        long long content_len = strtoll(num, NULL, 10);
+        if (content_len < 0) return -1;
+        req->content_len = content_len;
         char *bodystart = hdrend + 4;
         ssize_t have = rlen - (bodystart - buf);
-        if (content_len > 0) {
-            req->body = malloc(content_len + 1);
-            if (!req->body) return -1;
-            if (have > 0) {
-                size_t tocopy = (have < content_len) ? have : content_len;
-                memcpy(req->body, bodystart, tocopy);
-                size_t got = tocopy;
-                while ((int)got < content_len) {
-                    ssize_t nr = recv(conn, req->body + got, content_len - got, 0);
-                    if (nr <= 0) break;
-                    got += nr;
-                }
-                req->body_len = (size_t)content_len < got ? content_len : got;
-            } else {
-                size_t got = 0;
-                while ((int)got < content_len) {
-                    ssize_t nr = recv(conn, req->body + got, content_len - got, 0);
-                    if (nr <= 0) break;
-                    got += nr;
-                }
-                req->body_len = got;
-            }
-            req->body[req->body_len] = '\0';
+        if (have > 0) {
+            req->body = bodystart;
+            req->body_len = (have < content_len) ? (size_t)have : (size_t)content_len;
         }
     }
+    char *expect = header_get(req->headers, "Expect");
+    req->expect_continue = expect && strncasecmp(expect, "100-continue", 12) == 0;
     return 0;
 }
 
-/* header_get: find header name and return pointer to its value (within headers) */
-static char *header_get(const char *headers, const char *name) {
-    if (!headers || !name) return NULL;
-    char *p = my_strcasestr(headers, name);
-    if (!p) return NULL;
-    char *colon = strchr(p, ':');
-    if (!colon) return NULL;
-    char *v = colon + 1;
-    while (*v && isspace((unsigned char)*v)) v++;
-    return v;
+/* Read up to n body bytes: first whatever arrived with the headers, then from the socket.
+ * Returns 0 once Content-Length bytes have been consumed, -1 on a connection error. */
+static ssize_t req_read(struct http_req *req, char *dst, size_t n) {
+    long long left = req->content_len - req->body_read;
+    if (left <= 0) return 0;
+    /* the first read is the handler's commitment to the body: only now invite the client to send it */
+    if (req->expect_continue) {
+        req->expect_continue = 0;
+        if (send_all(req->conn, "HTTP/1.1 100 Continue\r\n\r\n", 25) <= 0) return -1;
+    }
+    if ((long long)n > left) n = (size_t)left;
+    size_t prefix = req->body_len > (size_t)req->body_read ? req->body_len - (size_t)req->body_read : 0;
+    if (prefix > 0) {
+        if (n > prefix) n = prefix;
+        memcpy(dst, req->body + req->body_read, n);
+        req->body_read += n;
+        return (ssize_t)n;
+    }
+    ssize_t nr;
+    do { nr = recv(req->conn, dst, n, 0); } while (nr < 0 && errno == EINTR);
+    if (nr <= 0) return -1;
+    req->body_read += nr;
+    return nr;
+}
+
+/* Fill dst completely unless the body ends first; returns bytes read or -1 */
+static ssize_t req_read_full(struct http_req *req, char *dst, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = req_read(req, dst + got, n - got);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return (ssize_t)got;
+}
+
+/* ---------- Body pipeline ----------
+ * Receives the request body into two alternating buffers: while the connection thread
+ * waits on the network for the next chunk, a writer thread hands the previous one to
+ * the sink, so disk and network time overlap instead of adding up. */
+
+typedef int (*body_sink_fn)(void *ctx, const char *data, size_t len);
+
+struct body_pipe {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    char *buf[2];
+    size_t len[2];
+    int full[2];
+    int eof;        /* receiver has queued its last buffer */
+    int failed;     /* sink returned an error; stop receiving */
+    body_sink_fn sink;
+    void *ctx;
+};
+
+static void *body_pipe_writer(void *arg) {
+    struct body_pipe *bp = arg;
+    int idx = 0;
+    pthread_mutex_lock(&bp->mu);
+    for (;;) {
+        while (!bp->full[idx] && !bp->eof) pthread_cond_wait(&bp->cv, &bp->mu);
+        if (!bp->full[idx]) break;
+        pthread_mutex_unlock(&bp->mu);
+        int rc = bp->failed ? -1 : bp->sink(bp->ctx, bp->buf[idx], bp->len[idx]);
+        pthread_mutex_lock(&bp->mu);
+        if (rc != 0) bp->failed = 1;
+        bp->full[idx] = 0;
+        pthread_cond_broadcast(&bp->cv);
+        idx ^= 1;
+    }
+    pthread_mutex_unlock(&bp->mu);
+    return NULL;
+}
+
+#define PIPE_OK 0
+#define PIPE_SHORT -1   /* client sent less than Content-Length */
+#define PIPE_SINK -2    /* sink reported an error */
+#define PIPE_NOMEM -3
+
+/* Stream the whole request body through sink. Bodies that fit in one chunk skip the thread. */
+static int pipe_body(struct http_req *req, body_sink_fn sink, void *ctx) {
+    long long total = req->content_len > 0 ? req->content_len : 0;
+    if (total <= UPLOAD_CHUNK) {
+        char *one = malloc(total ? (size_t)total : 1);
+        if (!one) return PIPE_NOMEM;
+        ssize_t n = req_read_full(req, one, (size_t)total);
+        int rc = n != (ssize_t)total ? PIPE_SHORT : (n > 0 && sink(ctx, one, (size_t)n) != 0) ? PIPE_SINK : PIPE_OK;
+        free(one);
+        return rc;
+    }
+    struct body_pipe bp;
+    memset(&bp, 0, sizeof(bp));
+    bp.sink = sink; bp.ctx = ctx;
+    bp.buf[0] = malloc(UPLOAD_CHUNK);
+    bp.buf[1] = malloc(UPLOAD_CHUNK);
+    if (!bp.buf[0] || !bp.buf[1]) { free(bp.buf[0]); free(bp.buf[1]); return PIPE_NOMEM; }
+    pthread_mutex_init(&bp.mu, NULL);
+    pthread_cond_init(&bp.cv, NULL);
+    pthread_t th;
+    if (pthread_create(&th, NULL, body_pipe_writer, &bp) != 0) {
+        free(bp.buf[0]); free(bp.buf[1]);
+        pthread_mutex_destroy(&bp.mu); pthread_cond_destroy(&bp.cv);
+        return PIPE_NOMEM;
+    }
+    int rc = PIPE_OK, idx = 0;
+    for (;;) {
+        pthread_mutex_lock(&bp.mu);
+        while (bp.full[idx] && !bp.failed) pthread_cond_wait(&bp.cv, &bp.mu);
+        int failed = bp.failed;
+        pthread_mutex_unlock(&bp.mu);
+        if (failed) { rc = PIPE_SINK; break; }
+        ssize_t n = req_read_full(req, bp.buf[idx], UPLOAD_CHUNK);
+        if (n < 0 || (n < UPLOAD_CHUNK && req->body_read < req->content_len)) { rc = PIPE_SHORT; break; }
+        if (n == 0) break;
+        pthread_mutex_lock(&bp.mu);
+        bp.len[idx] = (size_t)n;
+        bp.full[idx] = 1;
+        pthread_cond_broadcast(&bp.cv);
+        pthread_mutex_unlock(&bp.mu);
+        idx ^= 1;
+        if (req->body_read >= req->content_len) break;
+    }
+    pthread_mutex_lock(&bp.mu);
+    bp.eof = 1;
+    pthread_cond_broadcast(&bp.cv);
+    pthread_mutex_unlock(&bp.mu);
+    pthread_join(th, NULL);
+    if (rc == PIPE_OK && bp.failed) rc = PIPE_SINK;
+    free(bp.buf[0]); free(bp.buf[1]);
+    pthread_mutex_destroy(&bp.mu);
+    pthread_cond_destroy(&bp.cv);
+    return rc;
+}
+
+/* query_param_nth: copy the URL-decoded value of the nth (from 0) occurrence of name
+ * from the query string of uri; 1 if there is one */
+static int query_param_nth(const char *uri, const char *name, int nth, char *out, size_t outsz) {
+    const char *q = strchr(uri, '?');
+    size_t nlen = strlen(name);
+    while (q) {
+        q++;
+        if (strncmp(q, name, nlen) == 0 && q[nlen] == '=' && nth-- == 0) {
+            const char *v = q + nlen + 1;
+            size_t n = strcspn(v, "&");
+            char raw[PATH_MAX];
+            if (n >= sizeof(raw)) n = sizeof(raw) - 1;
+            memcpy(raw, v, n);
+            raw[n] = '\0';
+            char dec[PATH_MAX];
+            url_decode(dec, raw);
+            snprintf(out, outsz, "%s", dec);
+            return 1;
+        }
+        q = strchr(q, '&');
+    }
+    return 0;
+}
+
+static int query_param(const char *uri, const char *name, char *out, size_t outsz) {
+    return query_param_nth(uri, name, 0, out, outsz);
 }
 
 /* Check Basic Authorization header value */
@@ -1684,139 +3304,7381 @@ static int check_basic_auth_header(const char *value) {
     return 0;
 }
 
-/* ---------- API handlers ---------- */
+/* ---------- Content index ----------
+ * SHA-256 -> file, filled in as a side effect of transfers that hash their data anyway.
+ * Entries remember the file's identity (dev, ino, size, mtime) and are dropped as soon
+ * as the file no longer matches, so a hit is always safe to link or copy from. */
 
-/* /api/list?path=... -> JSON array */
-static void api_list(int conn, const char *reqpath) {
-    char fs[PATH_MAX];
-    join_path(fs, sizeof(fs), g_root, reqpath);
-    DIR *d = opendir(fs);
-    if (!d) {
-        const char *empty = "[]";
-        send_headers(conn, 200, "OK", "application/json; charset=utf-8", strlen(empty), NULL);
-        send_all(conn, empty, strlen(empty));
-        return;
-    }
-    struct dirent *e;
-    char out[BUFSIZE];
-    size_t pos = 0;
-    pos += snprintf(out + pos, sizeof(out) - pos, "[");
-    int first = 1;
-    while ((e = readdir(d)) != NULL) {
-        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
-        char childfs[PATH_MAX];
-        snprintf(childfs, sizeof(childfs), "%s/%s", fs, e->d_name);
-        struct stat st;
-        if (stat(childfs, &st) != 0) continue;
-        const char *type = S_ISDIR(st.st_mode) ? "dir" : "file";
-        long long size = S_ISDIR(st.st_mode) ? 0 : (long long)st.st_size;
-        /* sanitize name */
-        char jsafe[PATH_MAX]; size_t j = 0;
-        for (size_t k = 0; k < strlen(e->d_name) && j + 1 < sizeof(jsafe); ++k) {
-            char c = e->d_name[k];
-            if (c == '"' || c == '\\') { jsafe[j++] = '\\'; jsafe[j++] = c; }
-            else jsafe[j++] = c;
-        }
-        jsafe[j] = '\0';
-        char clientpath[PATH_MAX];
-        if (strcmp(reqpath, "/") == 0) snprintf(clientpath, sizeof(clientpath), "/%s", e->d_name);
-        else snprintf(clientpath, sizeof(clientpath), "%s/%s", reqpath, e->d_name);
-        if (!first) pos += snprintf(out + pos, sizeof(out) - pos, ",");
-        pos += snprintf(out + pos, sizeof(out) - pos,
-                        "{\"name\":\"%s\",\"path\":\"%s\",\"type\":\"%s\",\"size\":%lld}",
-                        jsafe, clientpath, type, size);
-        first = 0;
-        if (pos > sizeof(out) - 512) break;
-    }
-    closedir(d);
-    pos += snprintf(out + pos, sizeof(out) - pos, "]");
-    send_headers(conn, 200, "OK", "application/json; charset=utf-8", pos, NULL);
-    send_all(conn, out, pos);
+#define CINDEX_MAX 16384
+#define CINDEX_BUCKETS 4096
+
+struct cindex_entry {
+    uint8_t sha256[32];
+    char *path;
+    long long size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int next;               /* bucket chain, -1 terminated */
+};
+
+static struct cindex_entry g_cindex[CINDEX_MAX];
+static int g_cindex_bucket[CINDEX_BUCKETS];
+static int g_cindex_next = 0;   /* ring position: once full, the oldest entry is reused */
+static pthread_mutex_t g_cindex_mu = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__APPLE__)
+#define ST_MTIM(st) ((st)->st_mtimespec)
+#define ST_CTIM(st) ((st)->st_ctimespec)
+#else
+#define ST_MTIM(st) ((st)->st_mtim)
+#define ST_CTIM(st) ((st)->st_ctim)
+#endif
+
+static unsigned cindex_bucket(const uint8_t sha[32]) {
+    return ((unsigned)sha[0] << 8 | sha[1]) % CINDEX_BUCKETS;
 }
 
-/* /api/download?path=... */
-static void api_download(int conn, const char *reqpath) {
-    char fs[PATH_MAX];
-    join_path(fs, sizeof(fs), g_root, reqpath);
-    struct stat st;
-    if (stat(fs, &st) != 0 || S_ISDIR(st.st_mode)) {
-        const char *nf = "Not found";
-        send_headers(conn, 404, "Not Found", "text/plain; charset=utf-8", strlen(nf), NULL);
-        send_all(conn, nf, strlen(nf));
-        return;
-    }
-    int fd = open(fs, O_RDONLY);
-    if (fd < 0) {
-        const char *err = "Error";
-        send_headers(conn, 500, "Error", "text/plain; charset=utf-8", strlen(err), NULL);
-        send_all(conn, err, strlen(err));
-        return;
-    }
-    off_t fsz = st.st_size;
-    const char *ctype = "application/octet-stream";
-    const char *ext = strrchr(fs, '.');
-    if (ext) {
-        if (!strcasecmp(ext, ".html") || !strcasecmp(ext, ".htm")) ctype = "text/html";
-        else if (!strcasecmp(ext, ".txt")) ctype = "text/plain";
-        else if (!strcasecmp(ext, ".json")) ctype = "application/json";
-        else if (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg")) ctype = "image/jpeg";
-        else if (!strcasecmp(ext, ".png")) ctype = "image/png";
+/* unlink slot i from its bucket chain (caller holds the lock) */
+static void cindex_unlink(int i) {
+    int *pp = &g_cindex_bucket[cindex_bucket(g_cindex[i].sha256)];
+    while (*pp != -1 && *pp != i) pp = &g_cindex[*pp].next;
+    if (*pp == i) *pp = g_cindex[i].next;
+    free(g_cindex[i].path);
+    g_cindex[i].path = NULL;
+}
+
+static void cindex_init(void) {
+    for (int i = 0; i < CINDEX_BUCKETS; i++) g_cindex_bucket[i] = -1;
+}
+
+static void cindex_add(const uint8_t sha[32], const char *path, const struct stat *st) {
+    if (!S_ISREG(st->st_mode) || st->st_size == 0) return;
+    pthread_mutex_lock(&g_cindex_mu);
+    unsigned b = cindex_bucket(sha);
+    for (int i = g_cindex_bucket[b]; i != -1; i = g_cindex[i].next) {
+        if (memcmp(g_cindex[i].sha256, sha, 32) == 0 && strcmp(g_cindex[i].path, path) == 0) {
+            cindex_unlink(i);   /* refresh the stale identity below */
+            break;
+        }
     }
-    send_headers(conn, 200, "OK", ctype, (size_t)fsz, NULL);
-    char buf[BUFSIZE];
-    ssize_t n;
-    while ((n = read(fd, buf, sizeof(buf))) > 0) {
-        if (send_all(conn, buf, n) <= 0) break;
+    int slot = g_cindex_next;
+    g_cindex_next = (g_cindex_next + 1) % CINDEX_MAX;
+    if (g_cindex[slot].path) cindex_unlink(slot);
+    struct cindex_entry *e = &g_cindex[slot];
+    memcpy(e->sha256, sha, 32);
+    e->path = strdup(path);
+    e->size = (long long)st->st_size;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = ST_MTIM(st);
+    e->next = g_cindex_bucket[b];
+    g_cindex_bucket[b] = slot;
+    if (!e->path) { g_cindex_bucket[b] = e->next; }
+    pthread_mutex_unlock(&g_cindex_mu);
+}
+
+/* Find a file that still holds exactly this content; copies its path into out */
+static int cindex_lookup(const uint8_t sha[32], long long size, char *out, size_t outsz) {
+    int found = 0;
+    pthread_mutex_lock(&g_cindex_mu);
+    int i = g_cindex_bucket[cindex_bucket(sha)];
+    while (i != -1 && !found) {
+        struct cindex_entry *e = &g_cindex[i];
+        int next = e->next;
+        if (e->size == size && memcmp(e->sha256, sha, 32) == 0) {
+            struct stat st;
+            if (stat(e->path, &st) == 0 && S_ISREG(st.st_mode) && st.st_dev == e->dev && st.st_ino == e->ino &&
+                st.st_size == size && ST_MTIM(&st).tv_sec == e->mtime.tv_sec && ST_MTIM(&st).tv_nsec == e->mtime.tv_nsec) {
+                snprintf(out, outsz, "%s", e->path);
+                found = 1;
+            } else {
+                cindex_unlink(i);
+            }
+        }
+        i = next;
     }
-    close(fd);
+    pthread_mutex_unlock(&g_cindex_mu);
+    return found;
 }
 
-/* PUT /api/upload?path=... -> req->body */
-static void api_upload(int conn, const char *reqpath, struct http_req *req) {
-    if (!req || req->body_len == 0) {
-        const char *nb = "No body";
+/* ---------- Name matching ----------
+ * Search patterns are compiled once per request, then run against every name in a
+ * subtree (or, for /api/grep, every file's contents) by several walker threads at once
+ * (a compiled matcher is read-only).
+ *   substring  case-insensitive unless asked otherwise. Candidate positions are found
+ *              16 at a time by comparing the needle's first and last bytes (SSE2/NEON)
+ *              and then checked in full.
+ *   glob       * ? [set] [!set] and \ escapes, compiled to a bit-parallel automaton with
+ *              one bit per pattern position (up to GLOB_MAX): linear, no backtracking.
+ *   regex      POSIX extended; compiled patterns are shared through a small cache. */
+
+#define MATCH_SUBSTR 1
+#define MATCH_GLOB 2
+#define MATCH_REGEX 3
+#define GLOB_MAX 64
+#define RX_CACHE 16
+#define SUBSTR_NONE ((size_t)-1)
+
+struct rx_entry {
+    char *pattern;
+    int icase;
+    int refs;                   /* the cache's own reference included */
+    unsigned long used;         /* LRU stamp */
+    regex_t re;
+};
+
+struct name_matcher {
+    int kind;
+    int icase;
+    unsigned char needle[NAME_MAX + 1];     /* substring, lower-cased when icase */
+    size_t nlen;
+    uint64_t mask[256];         /* glob: positions each byte can fill */
+    uint64_t loop;              /* glob: positions followed by a star, which absorb any byte */
+    int lead;                   /* glob: pattern starts with a star */
+    int npos;
+    struct rx_entry *rx;
+};
+
+static struct rx_entry *g_rx[RX_CACHE];
+static unsigned long g_rx_clock;
+static pthread_mutex_t g_rx_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char ascii_lower(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? (unsigned char)(c + 32) : c;
+}
+
+static void rx_release(struct rx_entry *e) {
+    if (--e->refs) return;
+    regfree(&e->re);
+    free(e->pattern);
+    free(e);
+}
+
+/* A compiled regex for pattern, shared with other requests; NULL with err filled */
+static struct rx_entry *rx_get(const char *pattern, int icase, char *err, size_t errsz) {
+    pthread_mutex_lock(&g_rx_mu);
+    for (int i = 0; i < RX_CACHE; i++) {
+        struct rx_entry *e = g_rx[i];
+        if (e && e->icase == icase && strcmp(e->pattern, pattern) == 0) {
+            e->refs++;
+            e->used = ++g_rx_clock;
+            pthread_mutex_unlock(&g_rx_mu);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&g_rx_mu);
+    struct rx_entry *e = calloc(1, sizeof(*e));
+    if (!e || !(e->pattern = strdup(pattern))) {
+        free(e);
+        snprintf(err, errsz, "Out of memory");
+        return NULL;
+    }
+    int rc = regcomp(&e->re, pattern, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0));
+    if (rc != 0) {
+        regerror(rc, &e->re, err, errsz);
+        free(e->pattern);
+        free(e);
+        return NULL;
+    }
+    e->icase = icase;
+    e->refs = 2;
+    pthread_mutex_lock(&g_rx_mu);
+    int slot = 0;
+    for (int i = 0; i < RX_CACHE; i++) {
+        if (!g_rx[i]) { slot = i; break; }
+        if (g_rx[i]->used < g_rx[slot]->used) slot = i;
+    }
+    if (g_rx[slot]) rx_release(g_rx[slot]);
+    g_rx[slot] = e;
+    e->used = ++g_rx_clock;
+    pthread_mutex_unlock(&g_rx_mu);
+    return e;
+}
+
+static int glob_compile(struct name_matcher *m, const unsigned char *p) {
+    while (*p) {
+        if (*p == '*') {
+            if (m->npos == 0) m->lead = 1;
+            else m->loop |= 1ULL << (m->npos - 1);
+            p++;
+            continue;
+        }
+        if (m->npos == GLOB_MAX) return -1;
+        unsigned char set[256] = { 0 };
+        if (*p == '?') {
+            memset(set, 1, sizeof(set));
+            p++;
+        } else if (*p == '[' && strchr((const char *)p + 2, ']')) {
+            const unsigned char *q = p + 1;
+            int neg = *q == '!' || *q == '^';
+            if (neg) q++;
+            do {    /* a ']' right after the bracket is a member */
+                unsigned lo = *q == '\\' && q[1] ? *++q : *q, hi = lo;
+                q++;
+                if (*q == '-' && q[1] && q[1] != ']') {
+                    q++;
+                    hi = *q == '\\' && q[1] ? *++q : *q;
+                    q++;
+                }
+                for (unsigned c = lo; c <= hi; c++) set[c] = 1;
+            } while (*q && *q != ']');
+            if (!*q) return -1;
+            p = q + 1;
+            if (m->icase)
+                for (int c = 'a'; c <= 'z'; c++) set[c] = set[c - 32] = set[c] | set[c - 32];
+            if (neg) for (int c = 0; c < 256; c++) set[c] = !set[c];
+        } else {
+            unsigned char c = *p == '\\' && p[1] ? *++p : *p;
+            p++;
+            set[c] = 1;
+            if (m->icase && ascii_lower(c) != c) set[ascii_lower(c)] = 1;
+            if (m->icase && c >= 'a' && c <= 'z') set[c - 32] = 1;
+        }
+        for (int c = 0; c < 256; c++) if (set[c]) m->mask[c] |= 1ULL << m->npos;
+        m->npos++;
+    }
+    return 0;
+}
+
+/* 0, or -1 with err filled (bad or too long a pattern) */
+static int matcher_init(struct name_matcher *m, int kind, const char *pattern, int icase, char *err, size_t errsz) {
+    memset(m, 0, sizeof(*m));
+    m->kind = kind;
+    m->icase = icase;
+    if (kind == MATCH_SUBSTR) {
+        m->nlen = strlen(pattern);
+        if (m->nlen > NAME_MAX) { snprintf(err, errsz, "Pattern too long"); return -1; }
+        for (size_t i = 0; i < m->nlen; i++)
+            m->needle[i] = icase ? ascii_lower((unsigned char)pattern[i]) : (unsigned char)pattern[i];
+        return 0;
+    }
+    if (kind == MATCH_GLOB) {
+        if (glob_compile(m, (const unsigned char *)pattern) == 0) return 0;
+        snprintf(err, errsz, "Glob too long or unterminated [ (at most %d positions)", GLOB_MAX);
+        return -1;
+    }
+    m->rx = rx_get(pattern, icase, err, errsz);
+    return m->rx ? 0 : -1;
+}
+
+static void matcher_free(struct name_matcher *m) {
+    if (!m->rx) return;
+    pthread_mutex_lock(&g_rx_mu);
+    rx_release(m->rx);
+    pthread_mutex_unlock(&g_rx_mu);
+    m->rx = NULL;
+}
+
+static int needle_at(const struct name_matcher *m, const unsigned char *s) {
+    if (!m->icase) return memcmp(s, m->needle, m->nlen) == 0;
+    for (size_t i = 0; i < m->nlen; i++) if (ascii_lower(s[i]) != m->needle[i]) return 0;
+    return 1;
+}
+
+/* Offset of the first occurrence of the needle in s[0..n), or SUBSTR_NONE */
+static size_t substr_find(const struct name_matcher *m, const unsigned char *s, size_t n) {
+    size_t k = m->nlen;
+    if (k == 0) return 0;
+    if (k > n) return SUBSTR_NONE;
+    size_t i = 0, last = n - k;     /* candidate starts are 0..last */
+    /* with icase, bytes are compared with 0x20 set: a superset of the case-folded
+     * matches (some punctuation pairs up too), which needle_at then settles */
+    unsigned char f = m->needle[0], l = m->needle[k - 1], fold = m->icase ? 0x20 : 0;
+#if defined(__SSE2__)
+    const __m128i vf = _mm_set1_epi8((char)(f | fold)), vl = _mm_set1_epi8((char)(l | fold));
+    const __m128i vfold = _mm_set1_epi8((char)fold);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i)), vfold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i + k - 1)), vfold);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, vf), _mm_cmpeq_epi8(b, vl)));
+        for (; mask; mask &= mask - 1)
+            if (needle_at(m, s + i + __builtin_ctz(mask))) return i + __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t vf = vdupq_n_u8(f | fold), vl = vdupq_n_u8(l | fold), vfold = vdupq_n_u8(fold);
+    for (; i + 16 <= last + 1; i += 16) {
+        uint8x16_t a = vorrq_u8(vld1q_u8(s + i), vfold), b = vorrq_u8(vld1q_u8(s + i + k - 1), vfold);
+        if (!vmaxvq_u8(vandq_u8(vceqq_u8(a, vf), vceqq_u8(b, vl)))) continue;
+        for (size_t j = i; j < i + 16; j++) if (needle_at(m, s + j)) return j;
+    }
+#endif
+    for (; i <= last; i++)
+        if (((s[i] | fold) == (f | fold)) && needle_at(m, s + i)) return i;
+    return SUBSTR_NONE;
+}
+
+static int glob_match(const struct name_matcher *m, const unsigned char *s) {
+    if (m->npos == 0) return m->lead || !*s;
+    uint64_t d = 0, start = 1, accept = 1ULL << (m->npos - 1);
+    for (; *s; s++) {
+        d = (((d << 1) | start) & m->mask[*s]) | (d & m->loop);
+        if (!m->lead) start = 0;
+        if (!d && !start) return 0;
+    }
+    return (d & accept) != 0;
+}
+
+static int name_match(const struct name_matcher *m, const char *name) {
+    switch (m->kind) {
+    case MATCH_SUBSTR: return substr_find(m, (const unsigned char *)name, strlen(name)) != SUBSTR_NONE;
+    case MATCH_GLOB: return glob_match(m, (const unsigned char *)name);
+    default: return regexec(&m->rx->re, name, 0, NULL, 0) == 0;
+    }
+}
+
+/* ---------- Directory reading ----------
+ * Entries come straight from the kernel in large batches: getdents64 on Linux,
+ * getattrlistbulk on iOS (which also returns file sizes, saving a stat per file),
+ * plain readdir elsewhere. Callers stat relative to it->fd with fstatat, so no
+ * absolute path is ever re-walked from the root. */
+
+#define DIRBUF_SIZE (64 * 1024)
+
+/* Per-entry metadata a listing can ask for (fields=); name and path are always sent */
+#define LF_TYPE   0x001
+#define LF_SIZE   0x002
+#define LF_MTIME  0x004
+#define LF_MODE   0x008
+#define LF_UID    0x010
+#define LF_GID    0x020
+#define LF_NLINK  0x040
+#define LF_TARGET 0x080
+#define LF_INO    0x100
+#define LF_ALLOC  0x200     /* bytes allocated on disk */
+#define LF_DU     0x400     /* directories: recursive size, when /api/du has it cached */
+#define LF_STAT   (LF_SIZE | LF_MTIME | LF_MODE | LF_UID | LF_GID | LF_NLINK | LF_ALLOC)   /* need a stat unless bulk-read */
+
+struct dir_entry {
+    const char *name;
+    int type;               /* DT_* or DT_UNKNOWN */
+    unsigned long long ino;
+    int have_size;          /* size already known from the bulk call */
+    long long size;
+    int have;               /* LF_* bits below that the bulk call filled in */
+    long long mtime_ns;
+    unsigned mode;          /* permission bits */
+    unsigned uid, gid, nlink;
+};
+
+struct dir_iter {
+    int fd;
+#if defined(__linux__)
+    char *buf;
+    long pos, len;
+#elif defined(__APPLE__)
+    char *buf;
+    char *pos;
+    int left;               /* records remaining in buf */
+    struct attrlist al;
+#else
+    DIR *d;
+#endif
+};
+
+#if defined(__linux__)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+/* want: LF_* bits the caller will need; on iOS they are added to the bulk request so
+ * most entries need no stat at all */
+static int dir_iter_open(struct dir_iter *it, const char *path, int want) {
+    memset(it, 0, sizeof(*it));
+    it->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (it->fd < 0) return -1;
+#if defined(__linux__) || defined(__APPLE__)
+    it->buf = malloc(DIRBUF_SIZE);
+    if (!it->buf) { close(it->fd); return -1; }
+#endif
+#if defined(__APPLE__)
+    it->al.bitmapcount = ATTR_BIT_MAP_COUNT;
+    it->al.commonattr = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | ATTR_CMN_OBJTYPE | ATTR_CMN_FILEID;
+    it->al.fileattr = ATTR_FILE_DATALENGTH;
+    if (want & LF_MTIME) it->al.commonattr |= ATTR_CMN_MODTIME;
+    if (want & LF_UID) it->al.commonattr |= ATTR_CMN_OWNERID;
+    if (want & LF_GID) it->al.commonattr |= ATTR_CMN_GRPID;
+    if (want & LF_MODE) it->al.commonattr |= ATTR_CMN_ACCESSMASK;
+    if (want & LF_NLINK) { it->al.dirattr |= ATTR_DIR_LINKCOUNT; it->al.fileattr |= ATTR_FILE_LINKCOUNT; }
+#else
+    (void)want;
+#endif
+#if !defined(__linux__) && !defined(__APPLE__)
+    it->d = fdopendir(it->fd);
+    if (!it->d) { close(it->fd); return -1; }
+#endif
+    return 0;
+}
+
+/* 1 with *e filled (e->name valid until the next call), 0 at the end, -1 on error.
+ * "." and ".." are skipped. */
+static int dir_iter_next(struct dir_iter *it, struct dir_entry *e) {
+    for (;;) {
+        memset(e, 0, sizeof(*e));
+#if defined(__linux__)
+        if (it->pos >= it->len) {
+            it->len = syscall(SYS_getdents64, it->fd, it->buf, DIRBUF_SIZE);
+            it->pos = 0;
+            if (it->len <= 0) return it->len == 0 ? 0 : -1;
+        }
+        struct linux_dirent64 *de = (struct linux_dirent64 *)(it->buf + it->pos);
+        it->pos += de->d_reclen;
+        e->name = de->d_name;
+        e->type = de->d_type;
+        e->ino = de->d_ino;
+#elif defined(__APPLE__)
+        if (it->left <= 0) {
+            it->left = getattrlistbulk(it->fd, &it->al, it->buf, DIRBUF_SIZE, 0);
+            it->pos = it->buf;
+            if (it->left <= 0) return it->left == 0 ? 0 : -1;
+        }
+        char *rec = it->pos, *p = rec;
+        uint32_t reclen;
+        memcpy(&reclen, p, 4); p += 4;
+        attribute_set_t ret;
+        memcpy(&ret, p, sizeof(ret)); p += sizeof(ret);
+        it->pos += reclen;
+        it->left--;
+        if (ret.commonattr & ATTR_CMN_NAME) {
+            attrreference_t ref;
+            memcpy(&ref, p, sizeof(ref));
+            e->name = p + ref.attr_dataoffset;
+            p += sizeof(ref);
+        }
+        if (ret.commonattr & ATTR_CMN_OBJTYPE) {
+            fsobj_type_t t;
+            memcpy(&t, p, sizeof(t)); p += sizeof(t);
+            e->type = t == VDIR ? DT_DIR : t == VREG ? DT_REG : t == VLNK ? DT_LNK : DT_UNKNOWN;
+        }
+        /* attributes follow in bit order: MODTIME, OWNERID, GRPID, ACCESSMASK, FILEID */
+        if (ret.commonattr & ATTR_CMN_MODTIME) {
+            struct timespec ts;
+            memcpy(&ts, p, sizeof(ts)); p += sizeof(ts);
+            e->mtime_ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            e->have |= LF_MTIME;
+        }
+        if (ret.commonattr & ATTR_CMN_OWNERID) {
+            uid_t u;
+            memcpy(&u, p, sizeof(u)); p += sizeof(u);
+            e->uid = u;
+            e->have |= LF_UID;
+        }
+        if (ret.commonattr & ATTR_CMN_GRPID) {
+            gid_t g;
+            memcpy(&g, p, sizeof(g)); p += sizeof(g);
+            e->gid = g;
+            e->have |= LF_GID;
+        }
+        if (ret.commonattr & ATTR_CMN_ACCESSMASK) {
+            uint32_t m;
+            memcpy(&m, p, sizeof(m)); p += sizeof(m);
+            e->mode = m & 07777;
+            e->have |= LF_MODE;
+        }
+        if (ret.commonattr & ATTR_CMN_FILEID) {
+            uint64_t ino;
+            memcpy(&ino, p, sizeof(ino)); p += sizeof(ino);
+            e->ino = ino;
+        }
+        if (ret.dirattr & ATTR_DIR_LINKCOUNT) {
+            uint32_t n;
+            memcpy(&n, p, sizeof(n)); p += sizeof(n);
+            e->nlink = n;
+            e->have |= LF_NLINK;
+        }
+        if (ret.fileattr & ATTR_FILE_LINKCOUNT) {
+            uint32_t n;
+            memcpy(&n, p, sizeof(n)); p += sizeof(n);
+            e->nlink = n;
+            e->have |= LF_NLINK;
+        }
+        if (ret.fileattr & ATTR_FILE_DATALENGTH) {
+            off_t sz;
+            memcpy(&sz, p, sizeof(sz)); p += sizeof(sz);
+            e->size = (long long)sz;
+            e->have_size = 1;
+        }
+        if (!e->name) continue;
+#else
+        struct dirent *de = readdir(it->d);
+        if (!de) return 0;
+        e->name = de->d_name;
+        e->type = de->d_type;
+        e->ino = de->d_ino;
+#endif
+        if (e->name[0] == '.' && (e->name[1] == '\0' || (e->name[1] == '.' && e->name[2] == '\0'))) continue;
+        return 1;
+    }
+}
+
+static void dir_iter_close(struct dir_iter *it) {
+#if defined(__linux__) || defined(__APPLE__)
+    free(it->buf);
+    close(it->fd);
+#else
+    closedir(it->d);
+#endif
+}
+
+/* ---------- I/O worker pool ----------
+ * A small shared set of threads for metadata calls that block on the filesystem.
+ * On local flash an fstatat takes a microsecond or two and is best done inline; on
+ * network or FUSE mounts it can take milliseconds, and then many calls in flight
+ * hide the latency. Callers ask iopool_width() how wide to go: it follows an EWMA of
+ * the observed per-call latency, so the same code stays sequential where that is
+ * fastest and fans out where the filesystem is slow. Jobs may themselves submit and
+ * wait (a walk helper lists directories too), so a waiter never counts on a free
+ * worker: it runs a share of the work itself and takes back, with iopool_cancel(),
+ * whatever no worker has started. Only started jobs are waited for, and those do not
+ * wait on anything queued behind them. */
+
+#define IOPOOL_THREADS 16
+#define IOPOOL_NS_PER_WORKER 20000  /* one more worker per 20 us of per-call latency */
+
+struct io_job {
+    void (*fn)(void *arg);
+    void *arg;
+    struct io_job *next;
+};
+
+static struct io_job *g_iopool_head, *g_iopool_tail;
+static pthread_mutex_t g_iopool_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_iopool_cv = PTHREAD_COND_INITIALIZER;
+static pthread_once_t g_iopool_once = PTHREAD_ONCE_INIT;
+static double g_io_ewma_ns = 0;       /* per-call latency; 0 until measured */
+
+static void *iopool_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&g_iopool_mu);
+        while (!g_iopool_head) pthread_cond_wait(&g_iopool_cv, &g_iopool_mu);
+        struct io_job *j = g_iopool_head;
+        g_iopool_head = j->next;
+        if (!g_iopool_head) g_iopool_tail = NULL;
+        pthread_mutex_unlock(&g_iopool_mu);
+        j->fn(j->arg);
+    }
+    return NULL;
+}
+
+static void iopool_start(void) {
+    for (int i = 0; i < IOPOOL_THREADS; i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, iopool_worker, NULL) == 0) pthread_detach(th);
+    }
+}
+
+/* Queue j (owned by the caller, which must keep it alive until it has run) */
+static void iopool_submit(struct io_job *j) {
+    pthread_once(&g_iopool_once, iopool_start);
+    j->next = NULL;
+    pthread_mutex_lock(&g_iopool_mu);
+    if (g_iopool_tail) g_iopool_tail->next = j; else g_iopool_head = j;
+    g_iopool_tail = j;
+    pthread_cond_signal(&g_iopool_cv);
+    pthread_mutex_unlock(&g_iopool_mu);
+}
+
+/* Take j back off the queue: 1 if no worker had started it, 0 if one has */
+static int iopool_cancel(struct io_job *j) {
+    int found = 0;
+    pthread_mutex_lock(&g_iopool_mu);
+    for (struct io_job **pp = &g_iopool_head, *prev = NULL; *pp; prev = *pp, pp = &(*pp)->next) {
+        if (*pp != j) continue;
+        *pp = j->next;
+        if (g_iopool_tail == j) g_iopool_tail = prev;
+        found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&g_iopool_mu);
+    return found;
+}
+
+static long long mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Fold in a sample of `calls` calls that took `ns` in total */
+static void iopool_observe(long long ns, int calls) {
+    if (calls <= 0) return;
+    double per = (double)ns / calls;
+    pthread_mutex_lock(&g_iopool_mu);
+    g_io_ewma_ns = g_io_ewma_ns == 0 ? per : g_io_ewma_ns + (per - g_io_ewma_ns) / 8;
+    pthread_mutex_unlock(&g_iopool_mu);
+}
+
+/* How many threads (caller included) are worth using for n independent calls */
+static int iopool_width(int n) {
+    pthread_mutex_lock(&g_iopool_mu);
+    double lat = g_io_ewma_ns;
+    pthread_mutex_unlock(&g_iopool_mu);
+    int w = (int)(lat / IOPOOL_NS_PER_WORKER) + 1;
+    if (w > IOPOOL_THREADS + 1) w = IOPOOL_THREADS + 1;
+    if (w > n / 8) w = n / 8;           /* at least 8 calls per thread */
+    return w < 1 ? 1 : w;
+}
+
+static int g_ncpu = 1;
+static pthread_once_t g_ncpu_once = PTHREAD_ONCE_INIT;
+
+static void ncpu_probe(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    g_ncpu = n < 1 ? 1 : n > IOPOOL_THREADS + 1 ? IOPOOL_THREADS + 1 : (int)n;
+}
+
+/* Threads (caller included) worth using for work bound by the CPU rather than the disk */
+static int iopool_cpus(void) {
+    pthread_once(&g_ncpu_once, ncpu_probe);
+    return g_ncpu;
+}
+
+/* Completion counter for a batch of jobs */
+struct io_wait {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int pending;
+};
+
+static void io_wait_init(struct io_wait *w, int pending) {
+    pthread_mutex_init(&w->mu, NULL);
+    pthread_cond_init(&w->cv, NULL);
+    w->pending = pending;
+}
+
+static void io_wait_done(struct io_wait *w) {
+    pthread_mutex_lock(&w->mu);
+    if (--w->pending == 0) pthread_cond_broadcast(&w->cv);
+    pthread_mutex_unlock(&w->mu);
+}
+
+static void io_wait_all(struct io_wait *w) {
+    pthread_mutex_lock(&w->mu);
+    while (w->pending > 0) pthread_cond_wait(&w->cv, &w->mu);
+    pthread_mutex_unlock(&w->mu);
+    pthread_mutex_destroy(&w->mu);
+    pthread_cond_destroy(&w->cv);
+}
+
+/* ---------- Listing cache ----------
+ * Encoded /api/list responses, keyed by directory + client path + listing options and
+ * kept in LRU order under a byte cap. A hit is revalidated with one stat of the
+ * directory (identity, mtime and ctime must be unchanged), our own mutating handlers
+ * drop affected entries at once, and a TTL bounds staleness the directory timestamps
+ * cannot show, such as a file resized in place. */
+
+#define LCACHE_MAX_BYTES (32 * 1024 * 1024)
+#define LCACHE_ENTRY_MAX (LCACHE_MAX_BYTES / 8)
+#define LCACHE_TTL 30
+#define LCACHE_BUCKETS 1024
+
+struct lcache_entry {
+    struct lcache_entry *prev, *next;   /* LRU list, most recent first */
+    struct lcache_entry *hnext;
+    unsigned hash;
+    int refs;                           /* senders still using body */
+    int linked;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime, ctime;
+    time_t built;
+    size_t dirlen;                      /* key starts with the directory's fs path */
+    size_t len;
+    char *body;
+    char key[];
+};
+
+static struct lcache_entry *g_lcache_bucket[LCACHE_BUCKETS];
+static struct lcache_entry *g_lcache_head, *g_lcache_tail;
+static size_t g_lcache_bytes;
+static unsigned long g_lcache_gen;      /* bumped by every invalidation */
+static unsigned long long g_lcache_hits, g_lcache_misses, g_lcache_stale, g_lcache_inval, g_lcache_evict;
+static int g_lcache_entries;
+static pthread_mutex_t g_lcache_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned lcache_hash(const char *key) {
+    unsigned h = 2166136261u;
+    for (; *key; key++) h = (h ^ (unsigned char)*key) * 16777619u;
+    return h;
+}
+
+static size_t lcache_cost(const struct lcache_entry *e) {
+    return sizeof(*e) + strlen(e->key) + 1 + e->len;
+}
+
+/* Detach e from the table and LRU list (caller holds the lock); freed once unused */
+static void lcache_unlink(struct lcache_entry *e) {
+    struct lcache_entry **pp = &g_lcache_bucket[e->hash % LCACHE_BUCKETS];
+    while (*pp && *pp != e) pp = &(*pp)->hnext;
+    if (*pp) *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next; else g_lcache_head = e->next;
+    if (e->next) e->next->prev = e->prev; else g_lcache_tail = e->prev;
+    g_lcache_bytes -= lcache_cost(e);
+    g_lcache_entries--;
+    e->linked = 0;
+    if (e->refs == 0) { free(e->body); free(e); }
+}
+
+static void lcache_release(struct lcache_entry *e) {
+    pthread_mutex_lock(&g_lcache_mu);
+    if (--e->refs == 0 && !e->linked) { free(e->body); free(e); }
+    pthread_mutex_unlock(&g_lcache_mu);
+}
+
+static int lcache_same_dir(const struct lcache_entry *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+           e->mtime.tv_sec == ST_MTIM(st).tv_sec && e->mtime.tv_nsec == ST_MTIM(st).tv_nsec &&
+           e->ctime.tv_sec == ST_CTIM(st).tv_sec && e->ctime.tv_nsec == ST_CTIM(st).tv_nsec;
+}
+
+/* Send the cached response for key if it is still valid for the directory st; 1 if sent */
+static int lcache_serve(int conn, const char *key, const struct stat *st, const char *ctype, const char *extra) {
+    unsigned h = lcache_hash(key);
+    pthread_mutex_lock(&g_lcache_mu);
+    struct lcache_entry *e = g_lcache_bucket[h % LCACHE_BUCKETS];
+    while (e && (e->hash != h || strcmp(e->key, key) != 0)) e = e->hnext;
+    if (e && (!lcache_same_dir(e, st) || time(NULL) - e->built >= LCACHE_TTL)) {
+        lcache_unlink(e);
+        g_lcache_stale++;
+        e = NULL;
+    }
+    if (!e) {
+        g_lcache_misses++;
+        pthread_mutex_unlock(&g_lcache_mu);
+        return 0;
+    }
+    g_lcache_hits++;
+    e->refs++;
+    if (e != g_lcache_head) {   /* move to front */
+        e->prev->next = e->next;
+        if (e->next) e->next->prev = e->prev; else g_lcache_tail = e->prev;
+        e->prev = NULL; e->next = g_lcache_head;
+        g_lcache_head->prev = e; g_lcache_head = e;
+    }
+    pthread_mutex_unlock(&g_lcache_mu);
+    send_headers(conn, 200, "OK", ctype, e->len, extra);
+    send_all(conn, e->body, e->len);
+    lcache_release(e);
+    return 1;
+}
+
+static unsigned long lcache_generation(void) {
+    pthread_mutex_lock(&g_lcache_mu);
+    unsigned long g = g_lcache_gen;
+    pthread_mutex_unlock(&g_lcache_mu);
+    return g;
+}
+
+/* Insert a freshly produced response (takes ownership of body->p). It is dropped when
+ * anything was invalidated since gen, when the directory changed while it was being
+ * listed (before vs. a new stat of dirfs), or when the directory changed so recently
+ * that a further change in the same timestamp tick would go unnoticed. */
+static void lcache_store(const char *key, size_t dirlen, const char *dirfs, const struct stat *before,
+                         unsigned long gen, struct strbuf *body) {
+    struct stat after;
+    time_t now = time(NULL);
+    size_t klen = strlen(key);
+    struct lcache_entry *e = NULL;
+    if (body->oom || body->len > LCACHE_ENTRY_MAX || stat(dirfs, &after) != 0 || !S_ISDIR(after.st_mode) ||
+        after.st_ino != before->st_ino || after.st_dev != before->st_dev ||
+        ST_MTIM(&after).tv_sec != ST_MTIM(before).tv_sec || ST_MTIM(&after).tv_nsec != ST_MTIM(before).tv_nsec ||
+        ST_CTIM(&after).tv_sec != ST_CTIM(before).tv_sec || ST_CTIM(&after).tv_nsec != ST_CTIM(before).tv_nsec ||
+        now - ST_MTIM(&after).tv_sec < 2 || now - ST_CTIM(&after).tv_sec < 2 ||
+        !(e = malloc(sizeof(*e) + klen + 1))) {
+        free(body->p);
+        body->p = NULL;
+        return;
+    }
+    memcpy(e->key, key, klen + 1);
+    e->hash = lcache_hash(key);
+    e->refs = 0;
+    e->linked = 1;
+    e->dev = after.st_dev;
+    e->ino = after.st_ino;
+    e->mtime = ST_MTIM(&after);
+    e->ctime = ST_CTIM(&after);
+    e->built = now;
+    e->dirlen = dirlen;
+    e->len = body->len;
+    e->body = body->p;
+    body->p = NULL;
+
+    pthread_mutex_lock(&g_lcache_mu);
+    if (gen != g_lcache_gen) {
+        pthread_mutex_unlock(&g_lcache_mu);
+        free(e->body); free(e);
+        return;
+    }
+    struct lcache_entry *old = g_lcache_bucket[e->hash % LCACHE_BUCKETS];
+    while (old && (old->hash != e->hash || strcmp(old->key, key) != 0)) old = old->hnext;
+    if (old) lcache_unlink(old);
+    size_t bucket = e->hash % LCACHE_BUCKETS;
+    e->hnext = g_lcache_bucket[bucket];
+    g_lcache_bucket[bucket] = e;
+    e->prev = NULL; e->next = g_lcache_head;
+    if (g_lcache_head) g_lcache_head->prev = e; else g_lcache_tail = e;
+    g_lcache_head = e;
+    g_lcache_bytes += lcache_cost(e);
+    g_lcache_entries++;
+    while (g_lcache_bytes > LCACHE_MAX_BYTES && g_lcache_tail != e) {
+        lcache_unlink(g_lcache_tail);
+        g_lcache_evict++;
+    }
+    pthread_mutex_unlock(&g_lcache_mu);
+}
+
+/* Drop cached listings of directory dirfs, and with subtree of everything below it */
+static void lcache_invalidate(const char *dirfs, int subtree) {
+    size_t n = strlen(dirfs);
+    while (n > 1 && dirfs[n - 1] == '/') n--;
+    pthread_mutex_lock(&g_lcache_mu);
+    g_lcache_gen++;
+    for (struct lcache_entry *e = g_lcache_head, *next; e; e = next) {
+        next = e->next;
+        if (strncmp(e->key, dirfs, n) != 0) continue;
+        if (e->dirlen == n || (subtree && e->dirlen > n && (e->key[n] == '/' || n == 1))) {
+            lcache_unlink(e);
+            g_lcache_inval++;
+        }
+    }
+    pthread_mutex_unlock(&g_lcache_mu);
+}
+
+/* Something at fs was created, replaced or removed: its parent's listing and, if it
+ * is (or was) a directory, every listing inside it are out of date */
+static void lcache_touch(const char *fs) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", fs);
+    size_t n = strlen(parent);
+    while (n > 1 && parent[n - 1] == '/') parent[--n] = '\0';
+    char *slash = strrchr(parent, '/');
+    if (slash == parent) parent[1] = '\0';
+    else if (slash) *slash = '\0';
+    lcache_invalidate(parent, 0);
+    lcache_invalidate(fs, 1);
+}
+
+/* Listing cache section of /api/metrics */
+static void lcache_metrics(struct strbuf *sb) {
+    pthread_mutex_lock(&g_lcache_mu);
+    unsigned long long lookups = g_lcache_hits + g_lcache_misses;
+    sb_printf(sb, "\"listcache\":{\"entries\":%d,\"bytes\":%zu,\"cap\":%d,\"hits\":%llu,\"misses\":%llu,"
+                  "\"stale\":%llu,\"invalidations\":%llu,\"evictions\":%llu,\"hit_ratio\":%.4f}",
+              g_lcache_entries, g_lcache_bytes, LCACHE_MAX_BYTES, g_lcache_hits, g_lcache_misses,
+              g_lcache_stale, g_lcache_inval, g_lcache_evict, lookups ? (double)g_lcache_hits / lookups : 0.0);
+    pthread_mutex_unlock(&g_lcache_mu);
+}
+
+/* ---------- Subtree size cache ----------
+ * Recursive totals from /api/du, one per directory. An entry is trusted while the
+ * directory's own (dev, ino, mtime, ctime) is unchanged, for DU_TTL seconds, and until
+ * a change made through this server anywhere below it (du_touch). Changes made by
+ * other programs deep inside a subtree do not touch its top directory, so those show
+ * up after the TTL. Each entry also keeps the hard-linked files (nlink > 1) it counted,
+ * so a walk that reuses it can still count every (dev, ino) once overall. */
+
+#define DU_CACHE_MAX 65536      /* directories */
+#define DU_TTL 300
+#define DU_LINKS_MAX 64         /* subtrees with more distinct hard links are not cached */
+#define DU_BUCKETS 4096
+
+struct du_total {
+    long long bytes;            /* apparent size of everything but directories */
+    long long alloc;            /* allocated on disk, directories included */
+    long long files;            /* non-directories */
+    long long dirs;             /* directories, the top one included */
+};
+
+struct du_link {
+    dev_t dev;
+    ino_t ino;
+    long long bytes, alloc;
+    int counted;                /* walks: counted under this subtree, not elsewhere first */
+};
+
+struct du_entry {
+    struct du_entry *prev, *next;       /* LRU list, most recent first */
+    struct du_entry *hnext;
+    unsigned hash;
+    dev_t dev;
+    ino_t ino;
+    long long mtime_ns, ctime_ns;
+    time_t built;
+    struct du_total t;
+    int nlinks;
+    struct du_link *links;
+    char path[];
+};
+
+static struct du_entry *g_du_bucket[DU_BUCKETS];
+static struct du_entry *g_du_head, *g_du_tail;
+static int g_du_entries;
+static unsigned long long g_du_hits, g_du_misses;
+static pthread_mutex_t g_du_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static struct du_entry *du_find(const char *path, unsigned h) {
+    for (struct du_entry *e = g_du_bucket[h % DU_BUCKETS]; e; e = e->hnext)
+        if (e->hash == h && strcmp(e->path, path) == 0) return e;
+    return NULL;
+}
+
+static void du_unlink(struct du_entry *e) {
+    struct du_entry **pp = &g_du_bucket[e->hash % DU_BUCKETS];
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next; else g_du_head = e->next;
+    if (e->next) e->next->prev = e->prev; else g_du_tail = e->prev;
+    g_du_entries--;
+    free(e->links);
+    free(e);
+}
+
+/* Caller holds g_du_mu */
+static int du_valid(struct du_entry *e, dev_t dev, ino_t ino, long long mtime_ns, long long ctime_ns) {
+    return e && e->dev == dev && e->ino == ino && e->mtime_ns == mtime_ns && e->ctime_ns == ctime_ns &&
+           time(NULL) - e->built < DU_TTL;
+}
+
+/* The cached total of directory path if it is still valid for this stat of it; links
+ * (room for DU_LINKS_MAX) receives its hard links */
+static int du_cache_get(const char *path, dev_t dev, ino_t ino, long long mtime_ns, long long ctime_ns,
+                        struct du_total *t, struct du_link *links, int *nlinks) {
+    pthread_mutex_lock(&g_du_mu);
+    struct du_entry *e = du_find(path, lcache_hash(path));
+    int ok = du_valid(e, dev, ino, mtime_ns, ctime_ns);
+    if (ok) {
+        *t = e->t;
+        *nlinks = e->nlinks;
+        if (e->nlinks) memcpy(links, e->links, e->nlinks * sizeof(*links));
+        g_du_hits++;
+    } else {
+        if (e) du_unlink(e);
+        g_du_misses++;
+    }
+    pthread_mutex_unlock(&g_du_mu);
+    return ok;
+}
+
+/* Recursive apparent size of directory path for a listing, -1 when not cached */
+static long long du_cache_size(const char *path, dev_t dev, ino_t ino, long long mtime_ns, long long ctime_ns) {
+    pthread_mutex_lock(&g_du_mu);
+    struct du_entry *e = du_find(path, lcache_hash(path));
+    long long size = du_valid(e, dev, ino, mtime_ns, ctime_ns) ? e->t.bytes : -1;
+    pthread_mutex_unlock(&g_du_mu);
+    return size;
+}
+
+static void du_cache_put(const char *path, dev_t dev, ino_t ino, long long mtime_ns, long long ctime_ns,
+                         const struct du_total *t, const struct du_link *links, int nlinks) {
+    /* a directory changed within the last couple of seconds may change again within
+     * its timestamp granularity without the stat showing it */
+    time_t now = time(NULL);
+    if (now - mtime_ns / 1000000000LL < 2 || now - ctime_ns / 1000000000LL < 2) return;
+    size_t pl = strlen(path);
+    struct du_entry *e = malloc(sizeof(*e) + pl + 1);
+    struct du_link *l = nlinks ? malloc(nlinks * sizeof(*l)) : NULL;
+    if (!e || (nlinks && !l)) { free(e); free(l); return; }
+    memcpy(e->path, path, pl + 1);
+    e->hash = lcache_hash(path);
+    e->dev = dev; e->ino = ino;
+    e->mtime_ns = mtime_ns; e->ctime_ns = ctime_ns;
+    e->built = now;
+    e->t = *t;
+    e->nlinks = nlinks;
+    e->links = l;
+    if (nlinks) memcpy(l, links, nlinks * sizeof(*l));
+    pthread_mutex_lock(&g_du_mu);
+    struct du_entry *old = du_find(path, e->hash);
+    if (old) du_unlink(old);
+    while (g_du_entries >= DU_CACHE_MAX && g_du_tail) du_unlink(g_du_tail);
+    e->hnext = g_du_bucket[e->hash % DU_BUCKETS];
+    g_du_bucket[e->hash % DU_BUCKETS] = e;
+    e->prev = NULL;
+    e->next = g_du_head;
+    if (g_du_head) g_du_head->prev = e; else g_du_tail = e;
+    g_du_head = e;
+    g_du_entries++;
+    pthread_mutex_unlock(&g_du_mu);
+}
+
+/* Something at fs was created, replaced or removed: every total that includes it (its
+ * ancestors') and every total below it are out of date */
+static void du_touch(const char *fs) {
+    char p[PATH_MAX];
+    snprintf(p, sizeof(p), "%s", fs);
+    size_t n = strlen(p);
+    while (n > 1 && p[n - 1] == '/') p[--n] = '\0';
+    pthread_mutex_lock(&g_du_mu);
+    for (struct du_entry *e = g_du_head, *next; e; e = next) {
+        next = e->next;
+        if (strncmp(e->path, p, n) == 0 && (e->path[n] == '\0' || e->path[n] == '/' || n == 1)) du_unlink(e);
+    }
+    for (;;) {
+        char *slash = strrchr(p, '/');
+        if (!slash) break;
+        if (slash == p) { if (!p[1]) break; p[1] = '\0'; }
+        else *slash = '\0';
+        struct du_entry *e = du_find(p, lcache_hash(p));
+        if (e) du_unlink(e);
+    }
+    pthread_mutex_unlock(&g_du_mu);
+}
+
+/* Size cache section of /api/metrics */
+static void du_metrics(struct strbuf *sb) {
+    pthread_mutex_lock(&g_du_mu);
+    sb_printf(sb, "\"ducache\":{\"entries\":%d,\"cap\":%d,\"hits\":%llu,\"misses\":%llu}",
+              g_du_entries, DU_CACHE_MAX, g_du_hits, g_du_misses);
+    pthread_mutex_unlock(&g_du_mu);
+}
+
+/* ---------- File hash cache ----------
+ * Hashes of whole files by (dev, ino), for requests that hash many files and tend to be
+ * repeated (/api/duplicates, /api/hash). An entry is trusted while the file's size,
+ * mtime and ctime are what they were when it was hashed; a file changed within the
+ * last couple of seconds is not cached, as in the size cache. An entry holds whichever
+ * hashes have been computed: the quick one over the first and last blocks (duplicates)
+ * and any of the full-file digests.
+ * With -c FILE the cache survives restarts: it is loaded at startup and, once changed,
+ * written out at most every HC_PERSIST_SEC by a background thread (a fixed-size record
+ * per entry, most recently used first, replacing the old file by rename). */
+
+#define HC_MAX 131072           /* files */
+#define HC_BUCKETS 16384
+#define HC_MAGIC "WFSHSH1"
+#define HC_VERSION 1
+#define HC_PERSIST_SEC 60
+#define HC_QUICK  0x01
+#define HC_SHA256 0x02
+#define HC_CRC32C 0x04
+#define HC_MD5    0x08
+#define HC_XXH3   0x10
+
+struct hc_id {                  /* what a cached hash is only valid for */
+    dev_t dev;
+    ino_t ino;
+    long long size, mtime_ns, ctime_ns;
+};
+
+struct hc_sums {                /* the hashes an entry can hold, one per HC_* bit */
+    uint64_t quick;
+    uint8_t sha256[32];
+    uint32_t crc32c;
+    uint8_t md5[16];
+    uint64_t xxh3;
+};
+
+struct hc_entry {
+    struct hc_entry *prev, *next;       /* LRU list, most recent first */
+    struct hc_entry *hnext;
+    struct hc_id id;
+    int have;                   /* HC_* */
+    struct hc_sums sums;
+};
+
+struct hc_header {
+    char magic[8];
+    uint32_t version, count;
+};
+
+struct hc_record {              /* on disk, in host byte order */
+    uint64_t dev, ino;
+    int64_t size, mtime_ns, ctime_ns;
+    uint32_t have, crc32c;
+    uint64_t quick, xxh3;
+    uint8_t sha256[32], md5[16];
+};
+
+static struct hc_entry *g_hc_bucket[HC_BUCKETS];
+static struct hc_entry *g_hc_head, *g_hc_tail;
+static int g_hc_entries;
+static int g_hc_dirty;          /* changed since loaded or last written */
+static unsigned long long g_hc_hits, g_hc_misses;
+static char g_hc_file[PATH_MAX];
+static pthread_mutex_t g_hc_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static void hc_id_stat(struct hc_id *id, const struct stat *st) {
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->size = (long long)st->st_size;
+    id->mtime_ns = (long long)ST_MTIM(st).tv_sec * 1000000000LL + ST_MTIM(st).tv_nsec;
+    id->ctime_ns = (long long)ST_CTIM(st).tv_sec * 1000000000LL + ST_CTIM(st).tv_nsec;
+}
+
+static int hc_id_equal(const struct hc_id *a, const struct hc_id *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime_ns == b->mtime_ns &&
+           a->ctime_ns == b->ctime_ns;
+}
+
+static unsigned hc_bucket(dev_t dev, ino_t ino) {
+    return (unsigned)((((uint64_t)ino ^ ((uint64_t)dev << 29)) * 0x9E3779B97F4A7C15ULL) >> 40) % HC_BUCKETS;
+}
+
+static struct hc_entry *hc_find(const struct hc_id *id) {
+    for (struct hc_entry *e = g_hc_bucket[hc_bucket(id->dev, id->ino)]; e; e = e->hnext)
+        if (e->id.dev == id->dev && e->id.ino == id->ino) return e;
+    return NULL;
+}
+
+static void hc_lru_remove(struct hc_entry *e) {
+    if (e->prev) e->prev->next = e->next; else g_hc_head = e->next;
+    if (e->next) e->next->prev = e->prev; else g_hc_tail = e->prev;
+}
+
+static void hc_lru_front(struct hc_entry *e) {
+    e->prev = NULL;
+    e->next = g_hc_head;
+    if (g_hc_head) g_hc_head->prev = e; else g_hc_tail = e;
+    g_hc_head = e;
+}
+
+static void hc_unlink(struct hc_entry *e) {
+    struct hc_entry **pp = &g_hc_bucket[hc_bucket(e->id.dev, e->id.ino)];
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    hc_lru_remove(e);
+    g_hc_entries--;
+    free(e);
+}
+
+/* A new entry for id, evicting the least recently used if full (caller holds the lock) */
+static struct hc_entry *hc_insert(const struct hc_id *id) {
+    if (g_hc_entries >= HC_MAX && g_hc_tail) hc_unlink(g_hc_tail);
+    struct hc_entry *e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->id = *id;
+    unsigned b = hc_bucket(id->dev, id->ino);
+    e->hnext = g_hc_bucket[b];
+    g_hc_bucket[b] = e;
+    g_hc_entries++;
+    return e;
+}
+
+/* The hashes cached for the file id describes: HC_* bits of what was filled in */
+static int hcache_get(const struct hc_id *id, struct hc_sums *out) {
+    pthread_mutex_lock(&g_hc_mu);
+    struct hc_entry *e = hc_find(id);
+    int have = 0;
+    if (e && !hc_id_equal(&e->id, id)) {
+        hc_unlink(e);
+        g_hc_dirty = 1;
+    } else if (e) {
+        have = e->have;
+        *out = e->sums;
+        hc_lru_remove(e);
+        hc_lru_front(e);
+    }
+    if (have) g_hc_hits++; else g_hc_misses++;
+    pthread_mutex_unlock(&g_hc_mu);
+    return have;
+}
+
+/* Remember the hashes in have (HC_* bits) of in for the file id describes */
+static void hcache_put(const struct hc_id *id, int have, const struct hc_sums *in) {
+    time_t now = time(NULL);
+    if (now - id->mtime_ns / 1000000000LL < 2 || now - id->ctime_ns / 1000000000LL < 2) return;
+    pthread_mutex_lock(&g_hc_mu);
+    struct hc_entry *e = hc_find(id);
+    if (e && !hc_id_equal(&e->id, id)) { hc_unlink(e); e = NULL; }
+    if (e) hc_lru_remove(e);
+    else if (!(e = hc_insert(id))) { pthread_mutex_unlock(&g_hc_mu); return; }
+    if (have & HC_QUICK) e->sums.quick = in->quick;
+    if (have & HC_SHA256) memcpy(e->sums.sha256, in->sha256, 32);
+    if (have & HC_CRC32C) e->sums.crc32c = in->crc32c;
+    if (have & HC_MD5) memcpy(e->sums.md5, in->md5, 16);
+    if (have & HC_XXH3) e->sums.xxh3 = in->xxh3;
+    e->have |= have;
+    hc_lru_front(e);
+    g_hc_dirty = 1;
+    pthread_mutex_unlock(&g_hc_mu);
+}
+
+/* Read g_hc_file into the (empty) cache, keeping its order */
+static void hcache_load(void) {
+    FILE *f = fopen(g_hc_file, "rb");
+    if (!f) return;
+    struct hc_header h;
+    struct hc_record r;
+    uint32_t n = 0;
+    if (fread(&h, sizeof(h), 1, f) == 1 && !memcmp(h.magic, HC_MAGIC, sizeof(h.magic)) && h.version == HC_VERSION) {
+        pthread_mutex_lock(&g_hc_mu);
+        while (n < h.count && n < HC_MAX && fread(&r, sizeof(r), 1, f) == 1) {
+            struct hc_id id = { (dev_t)r.dev, (ino_t)r.ino, r.size, r.mtime_ns, r.ctime_ns };
+            if (hc_find(&id)) continue;
+            struct hc_entry *e = hc_insert(&id);
+            if (!e) break;
+            e->have = (int)r.have;
+            e->sums.quick = r.quick;
+            e->sums.crc32c = r.crc32c;
+            e->sums.xxh3 = r.xxh3;
+            memcpy(e->sums.sha256, r.sha256, 32);
+            memcpy(e->sums.md5, r.md5, 16);
+            e->prev = g_hc_tail;        /* the file is most recent first */
+            e->next = NULL;
+            if (g_hc_tail) g_hc_tail->next = e; else g_hc_head = e;
+            g_hc_tail = e;
+            n++;
+        }
+        pthread_mutex_unlock(&g_hc_mu);
+        fprintf(stderr, "hash cache: %u entries loaded from %s\n", n, g_hc_file);
+    }
+    fclose(f);
+}
+
+/* Write the cache to g_hc_file if it has changed. The records are copied out under the
+ * lock and written without it. */
+static void hcache_save(void) {
+    pthread_mutex_lock(&g_hc_mu);
+    struct hc_header h;
+    memset(&h, 0, sizeof(h));
+    struct hc_record *v = g_hc_dirty ? calloc(g_hc_entries ? (size_t)g_hc_entries : 1, sizeof(*v)) : NULL;
+    if (v) {
+        memcpy(h.magic, HC_MAGIC, sizeof(h.magic));
+        h.version = HC_VERSION;
+        for (struct hc_entry *e = g_hc_head; e; e = e->next) {
+            struct hc_record *r = &v[h.count++];
+            r->dev = (uint64_t)e->id.dev;
+            r->ino = (uint64_t)e->id.ino;
+            r->size = e->id.size;
+            r->mtime_ns = e->id.mtime_ns;
+            r->ctime_ns = e->id.ctime_ns;
+            r->have = (uint32_t)e->have;
+            r->crc32c = e->sums.crc32c;
+            r->quick = e->sums.quick;
+            r->xxh3 = e->sums.xxh3;
+            memcpy(r->sha256, e->sums.sha256, 32);
+            memcpy(r->md5, e->sums.md5, 16);
+        }
+        g_hc_dirty = 0;
+    }
+    pthread_mutex_unlock(&g_hc_mu);
+    if (!v) return;
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_hc_file);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && (!h.count || fwrite(v, sizeof(*v), h.count, f) == h.count) &&
+             fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f && fclose(f) != 0) ok = 0;
+    if (ok) ok = rename(tmp, g_hc_file) == 0;
+    if (!ok) {
+        fprintf(stderr, "hash cache: cannot write %s: %s\n", g_hc_file, strerror(errno));
+        unlink(tmp);
+        pthread_mutex_lock(&g_hc_mu);
+        g_hc_dirty = 1;
+        pthread_mutex_unlock(&g_hc_mu);
+    }
+    free(v);
+}
+
+static void *hc_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep(HC_PERSIST_SEC);
+        hcache_save();
+    }
+    return NULL;
+}
+
+/* -c FILE: load the saved cache and keep saving it */
+static void hcache_start(void) {
+    hcache_load();
+    pthread_mutex_lock(&g_hc_mu);
+    g_hc_dirty = 0;
+    pthread_mutex_unlock(&g_hc_mu);
+    pthread_t th;
+    if (pthread_create(&th, NULL, hc_thread, NULL) == 0) pthread_detach(th);
+}
+
+/* Hash cache section of /api/metrics */
+static void hcache_metrics(struct strbuf *sb) {
+    pthread_mutex_lock(&g_hc_mu);
+    sb_printf(sb, "\"hashcache\":{\"entries\":%d,\"cap\":%d,\"hits\":%llu,\"misses\":%llu,\"persistent\":%s}",
+              g_hc_entries, HC_MAX, g_hc_hits, g_hc_misses, g_hc_file[0] ? "true" : "false");
+    pthread_mutex_unlock(&g_hc_mu);
+}
+
+/* ---------- Subtree hash cache ----------
+ * Merkle hashes of directories from /api/manifest, one per directory, trusted on the
+ * same terms as the size cache: while the directory's own (dev, ino, mtime, ctime) is
+ * unchanged, for MK_TTL seconds, and until a change below it is made through this
+ * server or seen by the change watcher (mk_touch). A file rewritten in place by another
+ * program deep inside the subtree shows up after the TTL, or at once with verify=1. */
+
+#define MK_CACHE_MAX 65536      /* directories */
+#define MK_TTL 300
+#define MK_BUCKETS 4096
+
+struct mk_total {
+    uint8_t sum[32];
+    long long files;            /* non-directories */
+    long long dirs;             /* directories, the top one included */
+    long long bytes;            /* size of the regular files */
+};
+
+struct mk_entry {
+    struct mk_entry *prev, *next;       /* LRU list, most recent first */
+    struct mk_entry *hnext;
+    unsigned hash;
+    dev_t dev;
+    ino_t ino;
+    long long mtime_ns, ctime_ns;
+    time_t built;
+    struct mk_total t;
+    char path[];
+};
+
+static struct mk_entry *g_mk_bucket[MK_BUCKETS];
+static struct mk_entry *g_mk_head, *g_mk_tail;
+static int g_mk_entries;
+static unsigned long long g_mk_hits, g_mk_misses;
+static pthread_mutex_t g_mk_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mk_entry *mk_find(const char *path, unsigned h) {
+    for (struct mk_entry *e = g_mk_bucket[h % MK_BUCKETS]; e; e = e->hnext)
+        if (e->hash == h && strcmp(e->path, path) == 0) return e;
+    return NULL;
+}
+
+static void mk_unlink(struct mk_entry *e) {
+    struct mk_entry **pp = &g_mk_bucket[e->hash % MK_BUCKETS];
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next; else g_mk_head = e->next;
+    if (e->next) e->next->prev = e->prev; else g_mk_tail = e->prev;
+    g_mk_entries--;
+    free(e);
+}
+
+/* The cached hash of directory path if it is still valid for st, its stat */
+static int mk_cache_get(const char *path, const struct stat *st, struct mk_total *t) {
+    long long mtime_ns = (long long)ST_MTIM(st).tv_sec * 1000000000LL + ST_MTIM(st).tv_nsec;
+    long long ctime_ns = (long long)ST_CTIM(st).tv_sec * 1000000000LL + ST_CTIM(st).tv_nsec;
+    pthread_mutex_lock(&g_mk_mu);
+    struct mk_entry *e = mk_find(path, lcache_hash(path));
+    int ok = e && e->dev == st->st_dev && e->ino == st->st_ino && e->mtime_ns == mtime_ns &&
+             e->ctime_ns == ctime_ns && time(NULL) - e->built < MK_TTL;
+    if (ok) {
+        *t = e->t;
+        g_mk_hits++;
+    } else {
+        if (e) mk_unlink(e);
+        g_mk_misses++;
+    }
+    pthread_mutex_unlock(&g_mk_mu);
+    return ok;
+}
+
+static void mk_cache_put(const char *path, dev_t dev, ino_t ino, long long mtime_ns, long long ctime_ns,
+                         const struct mk_total *t) {
+    time_t now = time(NULL);
+    if (now - mtime_ns / 1000000000LL < 2 || now - ctime_ns / 1000000000LL < 2) return;
+    size_t pl = strlen(path);
+    struct mk_entry *e = malloc(sizeof(*e) + pl + 1);
+    if (!e) return;
+    memcpy(e->path, path, pl + 1);
+    e->hash = lcache_hash(path);
+    e->dev = dev; e->ino = ino;
+    e->mtime_ns = mtime_ns; e->ctime_ns = ctime_ns;
+    e->built = now;
+    e->t = *t;
+    pthread_mutex_lock(&g_mk_mu);
+    struct mk_entry *old = mk_find(path, e->hash);
+    if (old) mk_unlink(old);
+    while (g_mk_entries >= MK_CACHE_MAX && g_mk_tail) mk_unlink(g_mk_tail);
+    e->hnext = g_mk_bucket[e->hash % MK_BUCKETS];
+    g_mk_bucket[e->hash % MK_BUCKETS] = e;
+    e->prev = NULL;
+    e->next = g_mk_head;
+    if (g_mk_head) g_mk_head->prev = e; else g_mk_tail = e;
+    g_mk_head = e;
+    g_mk_entries++;
+    pthread_mutex_unlock(&g_mk_mu);
+}
+
+/* Something at fs was created, changed or removed: the hashes of its ancestors and of
+ * everything below it are out of date. Unlike sizes, a file's hash changes with its
+ * content, so this is called for modifications too. */
+static void mk_touch(const char *fs) {
+    char p[PATH_MAX];
+    snprintf(p, sizeof(p), "%s", fs);
+    size_t n = strlen(p);
+    while (n > 1 && p[n - 1] == '/') p[--n] = '\0';
+    pthread_mutex_lock(&g_mk_mu);
+    for (struct mk_entry *e = g_mk_head, *next; e; e = next) {
+        next = e->next;
+        if (strncmp(e->path, p, n) == 0 && (e->path[n] == '\0' || e->path[n] == '/' || n == 1)) mk_unlink(e);
+    }
+    for (;;) {
+        char *slash = strrchr(p, '/');
+        if (!slash) break;
+        if (slash == p) { if (!p[1]) break; p[1] = '\0'; }
+        else *slash = '\0';
+        struct mk_entry *e = mk_find(p, lcache_hash(p));
+        if (e) mk_unlink(e);
+    }
+    pthread_mutex_unlock(&g_mk_mu);
+}
+
+/* Subtree hash cache section of /api/metrics */
+static void mk_metrics(struct strbuf *sb) {
+    pthread_mutex_lock(&g_mk_mu);
+    sb_printf(sb, "\"manifestcache\":{\"entries\":%d,\"cap\":%d,\"hits\":%llu,\"misses\":%llu}",
+              g_mk_entries, MK_CACHE_MAX, g_mk_hits, g_mk_misses);
+    pthread_mutex_unlock(&g_mk_mu);
+}
+
+/* ---------- Filename index ----------
+ * With -i FILE a background thread keeps a trigram index of every name under the root,
+ * so /api/search?q= can answer without walking. FILE is used straight from mmap, which
+ * makes the index usable the moment the server restarts:
+ *   header | entries | dirs | names (NUL-terminated) | trigrams | postings
+ * A directory's children are contiguous in entries, so it can be re-read and diffed
+ * against what was indexed. A trigram's posting list holds the ids of the entries whose
+ * lower-cased name contains it, ascending, as varint deltas. Symlinks are indexed but
+ * never followed.
+ * Changes go to an in-memory overlay on top of the mapped file: entries marked dead and
+ * entries added. A directory is re-read when WebFS changes something in it (fs_changed)
+ * or when the periodic pass finds its mtime moved. When the overlay grows large, or at
+ * most every IX_PERSIST_SEC once it has changed, it is merged into a new file that
+ * replaces the old one by rename. */
+
+#define IX_MAGIC "WFSIDX1"
+#define IX_VERSION 1
+#define IX_RESCAN_SEC 60        /* mtime pass over every directory */
+#define IX_PERSIST_SEC 600
+#define IX_OVERLAY_MIN 65536    /* overlay entries that force a merge, or a quarter of the file's */
+#define IX_DIRTY_MAX 256
+#define IX_NONE 0xffffffffu
+
+struct ix_header {
+    char magic[8];
+    uint32_t version, nents, ndirs, ntri;
+    uint64_t root_hash;         /* of the root it describes */
+    uint64_t ents_off, dirs_off, names_off, tri_off, post_off, size;
+    int64_t built;              /* unix time */
+};
+
+struct ix_ent {                 /* entry 0 is the root itself */
+    uint32_t parent, name_off;
+    uint32_t dir;               /* index into dirs, IX_NONE for anything else */
+    uint16_t name_len;
+    uint8_t isdir, pad;
+};
+
+struct ix_dirrec {
+    uint32_t ent, first, count, pad;    /* children: entries first..first+count-1 */
+    int64_t mtime_ns;
+};
+
+struct ix_tri {
+    uint32_t key, count;        /* key: three lower-cased bytes */
+    uint64_t off;               /* into postings */
+};
+
+struct ix_dir {                 /* in memory: the file's record plus children added since */
+    uint32_t ent, first, count;
+    uint32_t kids;              /* first overlay child, IX_NONE-terminated */
+    int64_t mtime_ns;
+};
+
+struct ix_ov {                  /* overlay entry; its id is nents + its position */
+    uint32_t parent, name_off, dir;
+    uint32_t next;              /* next overlay child of the same parent */
+    uint16_t name_len;
+    uint8_t isdir, dead;
+};
+
+/* One generation of the index: a mapped file and the overlay on top of it. Only the
+ * indexer thread changes it, under the write lock; a merge swaps in a whole new one. */
+struct ix_state {
+    void *map;
+    size_t map_len;
+    const struct ix_ent *ents;
+    const char *names;
+    const struct ix_tri *tri;
+    const uint8_t *post, *post_end;
+    uint32_t nents, ntri;
+    uint8_t *dead;              /* bitmap over the file's entries */
+    uint32_t ndead;
+    struct ix_dir *dirs;
+    uint32_t ndirs, dirs_cap;
+    struct ix_ov *ov;
+    uint32_t nov, ov_cap;
+    struct strbuf ov_names;
+};
+
+static char g_ix_file[PATH_MAX];
+static struct ix_state g_ix;
+static int g_ix_ready;
+static pthread_rwlock_t g_ix_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* paths fs_changed reported, for the indexer thread */
+static char *g_ix_dirty[IX_DIRTY_MAX];
+static int g_ix_ndirty, g_ix_overflow;
+static pthread_mutex_t g_ix_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_ix_cv = PTHREAD_COND_INITIALIZER;
+/* throughput, written under the write lock */
+static const char *g_ix_build_how = "none";     /* walk, file or merge */
+static long long g_ix_build_ns, g_ix_build_entries, g_ix_walk_ns, g_ix_walk_entries, g_ix_file_bytes;
+static unsigned long long g_ix_passes, g_ix_checked, g_ix_rescans, g_ix_added, g_ix_removed;
+static long long g_ix_pass_ns, g_ix_rescan_ns;
+static unsigned long long g_ix_queries;     /* these two under g_ix_mu */
+static long long g_ix_query_ns;
+
+static uint64_t ix_root_hash(void) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = g_root; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return h;
+}
+
+static const char *ix_name(const struct ix_state *s, uint32_t id) {
+    return id < s->nents ? s->names + s->ents[id].name_off : s->ov_names.p + s->ov[id - s->nents].name_off;
+}
+
+static uint32_t ix_parent(const struct ix_state *s, uint32_t id) {
+    return id < s->nents ? s->ents[id].parent : s->ov[id - s->nents].parent;
+}
+
+static uint32_t ix_dirof(const struct ix_state *s, uint32_t id) {
+    return id < s->nents ? s->ents[id].dir : s->ov[id - s->nents].dir;
+}
+
+static int ix_dead(const struct ix_state *s, uint32_t id) {
+    return id < s->nents ? (s->dead[id >> 3] >> (id & 7)) & 1 : s->ov[id - s->nents].dead;
+}
+
+/* Neither id nor any directory above it has been removed */
+static int ix_live(const struct ix_state *s, uint32_t id) {
+    for (; id != IX_NONE; id = ix_parent(s, id)) if (ix_dead(s, id)) return 0;
+    return 1;
+}
+
+/* Request path of id ("/" for the root); -1 when it does not fit */
+static int ix_path(const struct ix_state *s, uint32_t id, char *out, size_t outsz) {
+    size_t pos = outsz - 1;
+    out[pos] = '\0';
+    for (; id != 0 && id != IX_NONE; id = ix_parent(s, id)) {
+        const char *n = ix_name(s, id);
+        size_t nl = strlen(n);
+        if (nl + 1 > pos) return -1;
+        pos -= nl;
+        memcpy(out + pos, n, nl);
+        out[--pos] = '/';
+    }
+    if (pos == outsz - 1) out[--pos] = '/';
+    memmove(out, out + pos, outsz - pos);
+    return 0;
+}
+
+/* Calls fn for every live child of directory d; stops when fn returns nonzero */
+static void ix_children(const struct ix_state *s, uint32_t d, int (*fn)(void *, uint32_t), void *arg) {
+    const struct ix_dir *dr = &s->dirs[d];
+    for (uint32_t i = dr->first; i < dr->first + dr->count; i++)
+        if (!ix_dead(s, i) && fn(arg, i)) return;
+    for (uint32_t k = dr->kids; k != IX_NONE; k = s->ov[k].next)
+        if (!s->ov[k].dead && fn(arg, s->nents + k)) return;
+}
+
+struct ix_find {
+    const struct ix_state *s;
+    const char *name;
+    size_t len;
+    uint32_t id;
+};
+
+static int ix_find_cb(void *arg, uint32_t id) {
+    struct ix_find *f = arg;
+    if (strncmp(ix_name(f->s, id), f->name, f->len) || ix_name(f->s, id)[f->len]) return 0;
+    f->id = id;
+    return 1;
+}
+
+/* Entry id of the deepest indexed directory on rel; *whole says whether that is rel itself */
+static uint32_t ix_lookup(const struct ix_state *s, const char *rel, int *whole) {
+    uint32_t id = 0;
+    *whole = 0;
+    while (*rel == '/') rel++;
+    while (*rel) {
+        struct ix_find f = { s, rel, strcspn(rel, "/"), IX_NONE };
+        ix_children(s, ix_dirof(s, id), ix_find_cb, &f);
+        if (f.id == IX_NONE || ix_dirof(s, f.id) == IX_NONE) return id;
+        id = f.id;
+        rel += f.len;
+        while (*rel == '/') rel++;
+    }
+    *whole = 1;
+    return id;
+}
+
+/* The request path of an absolute path under the root, or NULL */
+static const char *ix_rel(const char *fs) {
+    size_t rl = strlen(g_root);
+    while (rl > 1 && g_root[rl - 1] == '/') rl--;
+    if (rl == 1) return fs;
+    if (strncmp(fs, g_root, rl) != 0 || (fs[rl] && fs[rl] != '/')) return NULL;
+    return fs[rl] ? fs + rl : "/";
+}
+
+static void ix_state_free(struct ix_state *s) {
+    if (s->map) munmap(s->map, s->map_len);
+    free(s->dead);
+    free(s->dirs);
+    free(s->ov);
+    free(s->ov_names.p);
+    memset(s, 0, sizeof(*s));
+}
+
+static uint32_t ix_add_dir(struct ix_state *s, uint32_t ent, int64_t mtime_ns) {
+    if (s->ndirs == s->dirs_cap) {
+        uint32_t cap = s->dirs_cap ? s->dirs_cap * 2 : 1024;
+        struct ix_dir *nd = realloc(s->dirs, cap * sizeof(*nd));
+        if (!nd) return IX_NONE;
+        s->dirs = nd;
+        s->dirs_cap = cap;
+    }
+    struct ix_dir *d = &s->dirs[s->ndirs];
+    d->ent = ent;
+    d->first = d->count = 0;
+    d->kids = IX_NONE;
+    d->mtime_ns = mtime_ns;
+    return s->ndirs++;
+}
+
+/* Add a child of directory entry parent to the overlay (write lock held); its id */
+static uint32_t ix_add(struct ix_state *s, uint32_t parent, const char *name, int isdir) {
+    if (s->nov == s->ov_cap) {
+        uint32_t cap = s->ov_cap ? s->ov_cap * 2 : 1024;
+        struct ix_ov *no = realloc(s->ov, cap * sizeof(*no));
+        if (!no) return IX_NONE;
+        s->ov = no;
+        s->ov_cap = cap;
+    }
+    size_t nl = strlen(name), off = s->ov_names.len;
+    sb_append(&s->ov_names, name, nl + 1);
+    if (s->ov_names.oom || off > UINT32_MAX) return IX_NONE;
+    uint32_t k = s->nov, id = s->nents + k;
+    struct ix_ov *o = &s->ov[k];
+    o->parent = parent;
+    o->name_off = (uint32_t)off;
+    o->name_len = (uint16_t)nl;
+    o->isdir = (uint8_t)isdir;
+    o->dead = 0;
+    o->dir = isdir ? ix_add_dir(s, id, 0) : IX_NONE;
+    if (isdir && o->dir == IX_NONE) return IX_NONE;
+    o->next = IX_NONE;
+    if (parent != IX_NONE) {
+        struct ix_dir *pd = &s->dirs[ix_dirof(s, parent)];
+        o->next = pd->kids;
+        pd->kids = k;
+    }
+    s->nov++;
+    return id;
+}
+
+static void ix_kill(struct ix_state *s, uint32_t id) {
+    if (id < s->nents) {
+        s->dead[id >> 3] |= (uint8_t)(1 << (id & 7));
+        s->ndead++;
+    } else {
+        s->ov[id - s->nents].dead = 1;
+    }
+}
+
+/* ----- Updates (indexer thread) ----- */
+
+struct ix_name_rec {
+    const char *name;
+    int isdir, keep;
+};
+
+static int ix_name_cmp(const void *a, const void *b) {
+    return strcmp(((const struct ix_name_rec *)a)->name, ((const struct ix_name_rec *)b)->name);
+}
+
+struct ix_diff {
+    const struct ix_state *s;
+    struct ix_name_rec *now;
+    size_t n;
+    uint32_t *gone;
+    size_t ngone, gone_cap;
+    int oom;
+};
+
+static int ix_diff_cb(void *arg, uint32_t id) {
+    struct ix_diff *df = arg;
+    struct ix_name_rec key = { ix_name(df->s, id), 0, 0 };
+    struct ix_name_rec *r = bsearch(&key, df->now, df->n, sizeof(*r), ix_name_cmp);
+    if (r && !r->keep && r->isdir == (ix_dirof(df->s, id) != IX_NONE)) {
+        r->keep = 1;
+        return 0;
+    }
+    if (df->ngone == df->gone_cap) {
+        size_t cap = df->gone_cap ? df->gone_cap * 2 : 64;
+        uint32_t *ng = realloc(df->gone, cap * sizeof(*ng));
+        if (!ng) { df->oom = 1; return 1; }
+        df->gone = ng;
+        df->gone_cap = cap;
+    }
+    df->gone[df->ngone++] = id;
+    return 0;
+}
+
+struct ix_todo {
+    uint32_t *d;
+    size_t n, cap;
+};
+
+static void ix_todo_push(struct ix_todo *t, uint32_t d) {
+    if (t->n == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 256;
+        uint32_t *nd = realloc(t->d, cap * sizeof(*nd));
+        if (!nd) return;
+        t->d = nd;
+        t->cap = cap;
+    }
+    t->d[t->n++] = d;
+}
+
+/* Re-read directory d of s and bring its children up to date; directories that are new
+ * to the index are pushed on todo, to be read in turn */
+static void ix_rescan(struct ix_state *s, uint32_t d, struct ix_todo *todo) {
+    char rel[PATH_MAX], fs[PATH_MAX];
+    uint32_t ent = s->dirs[d].ent;
+    if (!ix_live(s, ent) || ix_path(s, ent, rel, sizeof(rel)) != 0) return;
+    join_path(fs, sizeof(fs), g_root, rel);
+    long long t0 = mono_ns();
+    struct dir_iter it;
+    if (dir_iter_open(&it, fs, LF_TYPE) != 0) return;   /* gone: its parent's rescan drops it */
+    struct stat st;
+    int64_t mtime_ns = fstat(it.fd, &st) == 0 ? (int64_t)ST_MTIM(&st).tv_sec * 1000000000LL + ST_MTIM(&st).tv_nsec : 0;
+    struct strbuf names = {0};
+    struct ix_name_rec *now = NULL;
+    size_t n = 0, cap = 0;
+    struct dir_entry e;
+    while (dir_iter_next(&it, &e) == 1) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            struct ix_name_rec *nn = realloc(now, cap * sizeof(*nn));
+            if (!nn) break;
+            now = nn;
+        }
+        int isdir = e.type == DT_DIR;
+        if (e.type == DT_UNKNOWN && fstatat(it.fd, e.name, &st, AT_SYMLINK_NOFOLLOW) == 0) isdir = S_ISDIR(st.st_mode);
+        now[n].name = (const char *)(uintptr_t)names.len;   /* an offset until names stops moving */
+        now[n].isdir = isdir;
+        now[n].keep = 0;
+        n++;
+        sb_append(&names, e.name, strlen(e.name) + 1);
+    }
+    dir_iter_close(&it);
+    if (names.oom || (n && !now)) {
+        free(names.p);
+        free(now);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) now[i].name = names.p + (uintptr_t)now[i].name;
+    qsort(now, n, sizeof(*now), ix_name_cmp);
+    struct ix_diff df = { s, now, n, NULL, 0, 0, 0 };
+    ix_children(s, d, ix_diff_cb, &df);
+
+    if (!df.oom) {
+        unsigned long long added = 0;
+        pthread_rwlock_wrlock(&g_ix_lock);
+        for (size_t i = 0; i < df.ngone; i++) ix_kill(s, df.gone[i]);
+        for (size_t i = 0; i < n; i++) {
+            if (now[i].keep) continue;
+            uint32_t id = ix_add(s, ent, now[i].name, now[i].isdir);
+            if (id == IX_NONE) break;
+            added++;
+            if (now[i].isdir) ix_todo_push(todo, ix_dirof(s, id));
+        }
+        s->dirs[d].mtime_ns = mtime_ns;
+        g_ix_rescans++;
+        g_ix_added += added;
+        g_ix_removed += df.ngone;
+        g_ix_rescan_ns += mono_ns() - t0;
+        pthread_rwlock_unlock(&g_ix_lock);
+    }
+    free(df.gone);
+    free(names.p);
+    free(now);
+}
+
+static void ix_rescan_all(struct ix_state *s, uint32_t d) {
+    struct ix_todo todo = {0};
+    ix_todo_push(&todo, d);
+    while (todo.n) ix_rescan(s, todo.d[--todo.n], &todo);
+    free(todo.d);
+}
+
+/* The periodic pass: re-read every directory whose mtime is not what was indexed */
+static void ix_pass(struct ix_state *s) {
+    long long t0 = mono_ns();
+    unsigned long long checked = 0;
+    for (uint32_t d = 0; d < s->ndirs; d++) {   /* directories a rescan adds are checked as it goes */
+        char rel[PATH_MAX], fs[PATH_MAX];
+        struct stat st;
+        uint32_t ent = s->dirs[d].ent;
+        if (!ix_live(s, ent) || ix_path(s, ent, rel, sizeof(rel)) != 0) continue;
+        join_path(fs, sizeof(fs), g_root, rel);
+        checked++;
+        if (lstat(fs, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        if ((int64_t)ST_MTIM(&st).tv_sec * 1000000000LL + ST_MTIM(&st).tv_nsec != s->dirs[d].mtime_ns) ix_rescan_all(s, d);
+    }
+    pthread_rwlock_wrlock(&g_ix_lock);
+    g_ix_passes++;
+    g_ix_checked += checked;
+    g_ix_pass_ns = mono_ns() - t0;
+    pthread_rwlock_unlock(&g_ix_lock);
+}
+
+/* A path fs_changed reported: re-read the deepest indexed directory on it, and the
+ * parent of that directory when it is the path itself (it may have been replaced) */
+static void ix_dirty(struct ix_state *s, const char *fs) {
+    const char *rel = ix_rel(fs);
+    if (!rel) return;
+    int whole;
+    uint32_t id = ix_lookup(s, rel, &whole);
+    if (whole && id != 0) ix_rescan_all(s, ix_dirof(s, ix_parent(s, id)));
+    ix_rescan_all(s, ix_dirof(s, id));
+}
+
+/* ----- The file ----- */
+
+struct ix_build {
+    struct ix_ent *ents;
+    uint32_t nents, ents_cap;
+    struct ix_dirrec *dirs;
+    uint32_t *src;              /* per dir: the directory of the state it came from */
+    uint32_t ndirs, dirs_cap;
+    struct strbuf names;
+};
+
+static void ix_build_free(struct ix_build *b) {
+    free(b->ents);
+    free(b->dirs);
+    free(b->src);
+    free(b->names.p);
+}
+
+static int ix_build_add(struct ix_build *b, uint32_t parent, const char *name, uint32_t srcdir, int64_t mtime_ns) {
+    if (b->nents == b->ents_cap) {
+        uint32_t cap = b->ents_cap ? b->ents_cap * 2 : 4096;
+        struct ix_ent *ne = realloc(b->ents, cap * sizeof(*ne));
+        if (!ne) return -1;
+        b->ents = ne;
+        b->ents_cap = cap;
+    }
+    if (srcdir != IX_NONE && b->ndirs == b->dirs_cap) {
+        uint32_t cap = b->dirs_cap ? b->dirs_cap * 2 : 1024;
+        struct ix_dirrec *nd = realloc(b->dirs, cap * sizeof(*nd));
+        uint32_t *ns = nd ? realloc(b->src, cap * sizeof(*ns)) : NULL;
+        if (nd) b->dirs = nd;
+        if (!ns) return -1;
+        b->src = ns;
+        b->dirs_cap = cap;
+    }
+    size_t nl = strlen(name), off = b->names.len;
+    sb_append(&b->names, name, nl + 1);
+    if (b->names.oom || off > UINT32_MAX) return -1;
+    struct ix_ent *e = &b->ents[b->nents];
+    memset(e, 0, sizeof(*e));
+    e->parent = parent;
+    e->name_off = (uint32_t)off;
+    e->name_len = (uint16_t)nl;
+    e->dir = IX_NONE;
+    if (srcdir != IX_NONE) {
+        struct ix_dirrec *d = &b->dirs[b->ndirs];
+        memset(d, 0, sizeof(*d));
+        d->ent = b->nents;
+        d->mtime_ns = mtime_ns;
+        b->src[b->ndirs] = srcdir;
+        e->dir = b->ndirs++;
+        e->isdir = 1;
+    }
+    b->nents++;
+    return 0;
+}
+
+struct ix_merge_ctx {
+    const struct ix_state *s;
+    struct ix_build *b;
+    uint32_t parent;
+    int err;
+};
+
+static int ix_merge_cb(void *arg, uint32_t id) {
+    struct ix_merge_ctx *m = arg;
+    uint32_t d = ix_dirof(m->s, id);
+    if (ix_build_add(m->b, m->parent, ix_name(m->s, id), d, d != IX_NONE ? m->s->dirs[d].mtime_ns : 0) != 0) m->err = 1;
+    return m->err;
+}
+
+/* Lay out the live tree of s breadth first, each directory's children together */
+static int ix_merge(const struct ix_state *s, struct ix_build *b) {
+    memset(b, 0, sizeof(*b));
+    if (ix_build_add(b, IX_NONE, "", 0, s->dirs[0].mtime_ns) != 0) return -1;
+    for (uint32_t d = 0; d < b->ndirs; d++) {
+        struct ix_merge_ctx m = { s, b, b->dirs[d].ent, 0 };
+        b->dirs[d].first = b->nents;
+        ix_children(s, b->src[d], ix_merge_cb, &m);
+        if (m.err) return -1;
+        b->dirs[d].count = b->nents - b->dirs[d].first;
+    }
+    return 0;
+}
+
+/* Distinct lower-cased trigrams of name into t (up to NAME_MAX of them); their count */
+static int ix_trigrams(const char *name, size_t len, uint32_t *t) {
+    int n = 0;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        uint32_t k = (uint32_t)ascii_lower((unsigned char)name[i]) << 16 |
+                     (uint32_t)ascii_lower((unsigned char)name[i + 1]) << 8 | ascii_lower((unsigned char)name[i + 2]);
+        int j = 0;
+        while (j < n && t[j] != k) j++;
+        if (j == n) t[n++] = k;
+    }
+    return n;
+}
+
+/* Open-addressed trigram -> slot table used while writing */
+struct ix_tab {
+    uint32_t *key;              /* trigram + 1; 0 = empty */
+    uint32_t *val;
+    uint32_t cap, n, shift;     /* cap = 1 << (32 - shift) */
+};
+
+static uint32_t ix_tab_slot(const struct ix_tab *t, uint32_t key) {
+    uint32_t h = ((key + 1) * 2654435761u) >> t->shift;     /* top bits: every key byte counts */
+    while (t->key[h] && t->key[h] != key + 1) h = (h + 1) & (t->cap - 1);
+    return h;
+}
+
+/* The slot value for key, inserted as 0 if new; NULL when out of memory */
+static uint32_t *ix_tab_get(struct ix_tab *t, uint32_t key) {
+    uint32_t h = t->cap ? ix_tab_slot(t, key) : 0;
+    if (t->cap && t->key[h]) return &t->val[h];
+    if ((t->n + 1) * 2 > t->cap) {
+        struct ix_tab g = { NULL, NULL, t->cap ? t->cap * 2 : 65536, t->n, t->cap ? t->shift - 1 : 16 };
+        g.key = calloc(g.cap, sizeof(*g.key));
+        g.val = calloc(g.cap, sizeof(*g.val));
+        if (!g.key || !g.val) { free(g.key); free(g.val); return NULL; }
+        for (uint32_t i = 0; i < t->cap; i++) {
+            if (!t->key[i]) continue;
+            uint32_t j = ix_tab_slot(&g, t->key[i] - 1);
+            g.key[j] = t->key[i];
+            g.val[j] = t->val[i];
+        }
+        free(t->key);
+        free(t->val);
+        *t = g;
+        h = ix_tab_slot(t, key);
+    }
+    t->key[h] = key + 1;
+    t->val[h] = 0;
+    t->n++;
+    return &t->val[h];
+}
+
+static int ix_tri_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct ix_tri *)a)->key, y = ((const struct ix_tri *)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static uint8_t *ix_varint(uint8_t *p, uint32_t v) {
+    while (v >= 0x80) { *p++ = (uint8_t)(v | 0x80); v >>= 7; }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static int ix_put(FILE *f, const void *p, size_t n, uint64_t *off) {
+    static const char zero[8];
+    if (n && fwrite(p, 1, n, f) != n) return -1;
+    *off += n;
+    size_t pad = (8 - *off % 8) % 8;
+    if (pad && fwrite(zero, 1, pad, f) != pad) return -1;
+    *off += pad;
+    return 0;
+}
+
+/* Write b to path (through a temporary file and a rename) */
+static int ix_write(const struct ix_build *b, const char *path) {
+    struct ix_tab tab = {0};
+    struct ix_tri *tri = NULL;
+    uint32_t *ids = NULL, *fill = NULL;
+    uint8_t *post = NULL;
+    size_t post_len = 0, post_cap = 0;
+    uint32_t t[NAME_MAX];
+    int rc = -1;
+    FILE *f = NULL;
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    /* count each trigram's entries, then give every trigram its run of ids */
+    size_t total = 0;
+    for (uint32_t i = 1; i < b->nents; i++) {
+        int n = ix_trigrams(b->names.p + b->ents[i].name_off, b->ents[i].name_len, t);
+        for (int j = 0; j < n; j++) {
+            uint32_t *c = ix_tab_get(&tab, t[j]);
+            if (!c) goto out;
+            ++*c;
+        }
+        total += n;
+    }
+    tri = malloc((tab.n ? tab.n : 1) * sizeof(*tri));
+    ids = malloc((total ? total : 1) * sizeof(*ids));
+    fill = malloc((tab.n ? tab.n : 1) * sizeof(*fill));
+    if (!tri || !ids || !fill) goto out;
+    uint32_t ntri = 0;
+    for (uint32_t i = 0; i < tab.cap; i++)
+        if (tab.key[i]) { tri[ntri].key = tab.key[i] - 1; tri[ntri].count = tab.val[i]; ntri++; }
+    qsort(tri, ntri, sizeof(*tri), ix_tri_cmp);
+    size_t at = 0;
+    for (uint32_t i = 0; i < ntri; i++) {
+        fill[i] = (uint32_t)at;
+        at += tri[i].count;
+        *ix_tab_get(&tab, tri[i].key) = i;
+    }
+    for (uint32_t i = 1; i < b->nents; i++) {
+        int n = ix_trigrams(b->names.p + b->ents[i].name_off, b->ents[i].name_len, t);
+        for (int j = 0; j < n; j++) ids[fill[*ix_tab_get(&tab, t[j])]++] = i;
+    }
+    at = 0;
+    for (uint32_t i = 0; i < ntri; i++) {
+        if (post_len + (size_t)tri[i].count * 5 > post_cap) {
+            size_t cap = post_cap ? post_cap : 1 << 20;
+            while (post_len + (size_t)tri[i].count * 5 > cap) cap *= 2;
+            uint8_t *np = realloc(post, cap);
+            if (!np) goto out;
+            post = np;
+            post_cap = cap;
+        }
+        tri[i].off = post_len;
+        uint8_t *w = post + post_len;
+        uint32_t prev = 0;
+        for (uint32_t j = 0; j < tri[i].count; j++) {
+            w = ix_varint(w, ids[at + j] - prev);
+            prev = ids[at + j];
+        }
+        post_len = (size_t)(w - post);
+        at += tri[i].count;
+    }
+
+    struct ix_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IX_MAGIC, sizeof(h.magic));
+    h.version = IX_VERSION;
+    h.nents = b->nents;
+    h.ndirs = b->ndirs;
+    h.ntri = ntri;
+    h.root_hash = ix_root_hash();
+    h.built = (int64_t)time(NULL);
+    uint64_t off = 0;
+    h.ents_off = (sizeof(h) + 7) / 8 * 8;
+    h.dirs_off = h.ents_off + ((uint64_t)b->nents * sizeof(struct ix_ent) + 7) / 8 * 8;
+    h.names_off = h.dirs_off + ((uint64_t)b->ndirs * sizeof(struct ix_dirrec) + 7) / 8 * 8;
+    h.tri_off = h.names_off + (b->names.len + 7) / 8 * 8;
+    h.post_off = h.tri_off + (uint64_t)ntri * sizeof(struct ix_tri);
+    h.size = h.post_off + (post_len + 7) / 8 * 8;
+    if (!(f = fopen(tmp, "wb"))) goto out;
+    if (ix_put(f, &h, sizeof(h), &off) || ix_put(f, b->ents, (size_t)b->nents * sizeof(*b->ents), &off) ||
+        ix_put(f, b->dirs, (size_t)b->ndirs * sizeof(*b->dirs), &off) || ix_put(f, b->names.p, b->names.len, &off) ||
+        ix_put(f, tri, (size_t)ntri * sizeof(*tri), &off) || ix_put(f, post, post_len, &off))
+        goto out;
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) goto out;
+    if (fclose(f) != 0) { f = NULL; goto out; }
+    f = NULL;
+    rc = rename(tmp, path);
+out:
+    if (f) fclose(f);
+    if (rc != 0) unlink(tmp);
+    free(tab.key);
+    free(tab.val);
+    free(tri);
+    free(ids);
+    free(fill);
+    free(post);
+    return rc;
+}
+
+/* Map an index file into s; -1 unless it is intact and was built for this root */
+static int ix_open(const char *path, struct ix_state *s) {
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct ix_header))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    s->map = map;
+    s->map_len = (size_t)st.st_size;
+    const struct ix_header *h = map;
+    const uint8_t *base = map;
+    if (memcmp(h->magic, IX_MAGIC, sizeof(h->magic)) || h->version != IX_VERSION || h->root_hash != ix_root_hash() ||
+        h->size != s->map_len || h->nents == 0 || h->ndirs == 0 ||
+        h->ents_off < sizeof(*h) || h->ents_off % 8 || h->dirs_off % 8 || h->tri_off % 8 ||
+        h->dirs_off < h->ents_off + (uint64_t)h->nents * sizeof(struct ix_ent) ||
+        h->names_off < h->dirs_off + (uint64_t)h->ndirs * sizeof(struct ix_dirrec) ||
+        h->tri_off < h->names_off || h->post_off < h->tri_off + (uint64_t)h->ntri * sizeof(struct ix_tri) ||
+        h->size < h->post_off)
+        goto bad;
+    s->ents = (const struct ix_ent *)(base + h->ents_off);
+    s->names = (const char *)base + h->names_off;
+    s->tri = (const struct ix_tri *)(base + h->tri_off);
+    s->post = base + h->post_off;
+    s->post_end = base + h->size;
+    s->nents = h->nents;
+    s->ntri = h->ntri;
+    /* bad offsets would send queries outside the map, so check every one once */
+    uint64_t names_len = h->tri_off - h->names_off;
+    if (names_len == 0 || s->names[names_len - 1] != '\0') goto bad;
+    for (uint32_t i = 0; i < s->nents; i++) {
+        const struct ix_ent *e = &s->ents[i];
+        if ((uint64_t)e->name_off + e->name_len >= names_len || s->names[e->name_off + e->name_len] ||
+            (i ? e->parent >= i : e->parent != IX_NONE) || (e->dir != IX_NONE && e->dir >= h->ndirs))
+            goto bad;
+    }
+    for (uint32_t i = 0; i < s->ntri; i++)
+        if (s->tri[i].off > (uint64_t)(s->post_end - s->post) || (i && s->tri[i].key <= s->tri[i - 1].key)) goto bad;
+    const struct ix_dirrec *dr = (const struct ix_dirrec *)(base + h->dirs_off);
+    s->dead = calloc((s->nents + 7) / 8, 1);
+    s->dirs = malloc(h->ndirs * sizeof(*s->dirs));
+    if (!s->dead || !s->dirs) goto bad;
+    s->dirs_cap = s->ndirs = h->ndirs;
+    for (uint32_t i = 0; i < h->ndirs; i++) {
+        if (dr[i].ent >= s->nents || s->ents[dr[i].ent].dir != i ||
+            dr[i].first > s->nents || dr[i].count > s->nents - dr[i].first)
+            goto bad;
+        s->dirs[i].ent = dr[i].ent;
+        s->dirs[i].first = dr[i].first;
+        s->dirs[i].count = dr[i].count;
+        s->dirs[i].kids = IX_NONE;
+        s->dirs[i].mtime_ns = dr[i].mtime_ns;
+    }
+    if (s->ents[0].dir != 0) goto bad;
+    return 0;
+bad:
+    ix_state_free(s);
+    return -1;
+}
+
+/* Merge s into a new file and map it; the new state replaces g_ix */
+static int ix_persist(struct ix_state *s, const char *how, long long t0) {
+    struct ix_build b;
+    struct ix_state ns;
+    int rc = ix_merge(s, &b);
+    if (rc == 0) rc = ix_write(&b, g_ix_file);
+    ix_build_free(&b);
+    if (rc == 0) rc = ix_open(g_ix_file, &ns);
+    if (rc != 0) {
+        fprintf(stderr, "index: cannot write %s: %s\n", g_ix_file, strerror(errno));
+        return -1;
+    }
+    pthread_rwlock_wrlock(&g_ix_lock);
+    struct ix_state old = *s;
+    *s = ns;
+    g_ix_ready = 1;
+    g_ix_build_how = how;
+    g_ix_build_ns = mono_ns() - t0;
+    g_ix_build_entries = ns.nents;
+    g_ix_file_bytes = (long long)ns.map_len;
+    pthread_rwlock_unlock(&g_ix_lock);
+    ix_state_free(&old);
+    return 0;
+}
+
+static void *ix_thread(void *arg) {
+    (void)arg;
+    struct ix_state *s = &g_ix;
+    long long t0 = mono_ns();
+    int failed = 0;             /* the last write failed: retry only on the timer */
+    if (ix_open(g_ix_file, s) == 0) {
+        pthread_rwlock_wrlock(&g_ix_lock);
+        g_ix_ready = 1;
+        g_ix_build_how = "file";
+        g_ix_build_ns = mono_ns() - t0;
+        g_ix_build_entries = s->nents;
+        g_ix_file_bytes = (long long)s->map_len;
+        pthread_rwlock_unlock(&g_ix_lock);
+        fprintf(stderr, "index: %u entries loaded from %s\n", s->nents, g_ix_file);
+        ix_pass(s);                     /* catch up with changes made while down */
+    } else {
+        pthread_rwlock_wrlock(&g_ix_lock);
+        uint32_t root = ix_add(s, IX_NONE, "", 1);
+        pthread_rwlock_unlock(&g_ix_lock);
+        if (root == IX_NONE) return NULL;
+        ix_rescan_all(s, 0);
+        long long walked = mono_ns() - t0;
+        pthread_rwlock_wrlock(&g_ix_lock);
+        g_ix_walk_ns = walked;
+        g_ix_walk_entries = s->nov;
+        pthread_rwlock_unlock(&g_ix_lock);
+        fprintf(stderr, "index: walked %u entries in %lld ms\n", s->nov, walked / 1000000);
+        if (ix_persist(s, "walk", t0) != 0) {
+            pthread_rwlock_wrlock(&g_ix_lock);  /* serve from memory until a write succeeds */
+            g_ix_ready = 1;
+            g_ix_build_how = "walk";
+            g_ix_build_ns = walked;
+            g_ix_build_entries = s->nov;
+            pthread_rwlock_unlock(&g_ix_lock);
+            failed = 1;
+        }
+    }
+    long long last_pass = mono_ns(), last_write = last_pass;
+    for (;;) {
+        char *dirty[IX_DIRTY_MAX];
+        pthread_mutex_lock(&g_ix_mu);
+        if (!g_ix_ndirty && !g_ix_overflow) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&g_ix_cv, &g_ix_mu, &ts);
+        }
+        int n = g_ix_ndirty, overflow = g_ix_overflow;
+        memcpy(dirty, g_ix_dirty, n * sizeof(*dirty));
+        g_ix_ndirty = g_ix_overflow = 0;
+        pthread_mutex_unlock(&g_ix_mu);
+        for (int i = 0; i < n; i++) {
+            ix_dirty(s, dirty[i]);
+            free(dirty[i]);
+        }
+        long long now = mono_ns();
+        if (overflow || now - last_pass >= IX_RESCAN_SEC * 1000000000LL) {
+            ix_pass(s);
+            last_pass = mono_ns();
+        }
+        uint32_t changed = s->nov + s->ndead;
+        int big = changed >= IX_OVERLAY_MIN || changed >= s->nents / 4;
+        if (changed && ((big && !failed) || now - last_write >= IX_PERSIST_SEC * 1000000000LL)) {
+            failed = ix_persist(s, "merge", mono_ns()) != 0;
+            last_write = mono_ns();
+        }
+    }
+    return NULL;
+}
+
+static void index_start(void) {
+    pthread_t th;
+    if (pthread_create(&th, NULL, ix_thread, NULL) == 0) pthread_detach(th);
+}
+
+/* Tell the indexer something at fs was created, replaced or removed */
+static void index_touch(const char *fs) {
+    if (!g_ix_file[0]) return;
+    pthread_mutex_lock(&g_ix_mu);
+    char *p = g_ix_ndirty < IX_DIRTY_MAX ? strdup(fs) : NULL;
+    if (p) g_ix_dirty[g_ix_ndirty++] = p;
+    else g_ix_overflow = 1;     /* a full pass finds it instead */
+    pthread_cond_signal(&g_ix_cv);
+    pthread_mutex_unlock(&g_ix_mu);
+}
+
+/* ----- Queries ----- */
+
+struct ix_cursor {
+    const uint8_t *p, *end;
+    uint32_t left, cur;
+};
+
+static int ix_cursor_next(struct ix_cursor *c) {
+    if (!c->left) return 0;
+    uint32_t v = 0;
+    for (int shift = 0; c->p < c->end && shift < 35; shift += 7) {
+        uint8_t byte = *c->p++;
+        v |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            c->cur += v;
+            c->left--;
+            return 1;
+        }
+    }
+    c->left = 0;                /* truncated list */
+    return 0;
+}
+
+/* Matched by the pattern and live below scope */
+static int ix_hit(const struct ix_state *s, const struct name_matcher *m, uint32_t id, uint32_t scope) {
+    if (ix_dead(s, id) || !name_match(m, ix_name(s, id))) return 0;
+    int inside = scope == 0;
+    for (uint32_t p = ix_parent(s, id); p != IX_NONE; p = ix_parent(s, p)) {
+        if (ix_dead(s, p)) return 0;
+        if (p == scope) inside = 1;
+    }
+    return inside;
+}
+
+/* Record id if it is a hit; -1 once limit hits are in and another turns up */
+static int ix_take(const struct ix_state *s, const struct name_matcher *m, uint32_t id, uint32_t scope,
+                   long long limit, struct strbuf *out, long long *found) {
+    char path[PATH_MAX];
+    if (!ix_hit(s, m, id, scope)) return 0;
+    if (*found == limit) return -1;
+    if (ix_path(s, id, path, sizeof(path)) == 0) {
+        sb_append(out, path, strlen(path) + 1);
+        ++*found;
+    }
+    return 0;
+}
+
+/* Request paths of up to limit entries below scope whose names pass m (a substring
+ * matcher), NUL-separated in out; *found counts them, *truncated says more exist.
+ * -1 when the index is not ready or does not hold scope. */
+static int index_search(const struct name_matcher *m, const char *scope, long long limit, struct strbuf *out,
+                        long long *found, long long *candidates, int *truncated) {
+    *found = *candidates = 0;
+    *truncated = 0;
+    long long t0 = mono_ns();
+    pthread_rwlock_rdlock(&g_ix_lock);
+    const struct ix_state *s = &g_ix;
+    int whole = 0;
+    uint32_t sid = g_ix_ready ? ix_lookup(s, scope, &whole) : 0;
+    if (!whole) {
+        pthread_rwlock_unlock(&g_ix_lock);
+        return -1;
+    }
+    uint32_t keys[NAME_MAX];
+    struct ix_cursor cur[NAME_MAX];
+    int nk = m->nlen >= 3 ? ix_trigrams((const char *)m->needle, m->nlen, keys) : 0, nc = 0, lead = 0;
+    for (int i = 0; i < nk; i++) {
+        size_t lo = 0, hi = s->ntri;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (s->tri[mid].key < keys[i]) lo = mid + 1; else hi = mid;
+        }
+        if (lo == s->ntri || s->tri[lo].key != keys[i]) { nc = -1; break; }
+        cur[nc].p = s->post + s->tri[lo].off;
+        cur[nc].end = s->post_end;
+        cur[nc].left = s->tri[lo].count;
+        cur[nc].cur = 0;
+        if (cur[nc].left < cur[lead].left) lead = nc;
+        nc++;
+    }
+    if (nc > 0) {
+        /* walk the rarest trigram's list; the others only need to be skipped along */
+        while (ix_cursor_next(&cur[lead])) {
+            uint32_t id = cur[lead].cur;
+            int all = 1;
+            for (int i = 0; i < nc && all; i++) {
+                if (i == lead) continue;
+                while (cur[i].cur < id && ix_cursor_next(&cur[i])) {}
+                if (cur[i].cur < id) goto base_done;    /* a list ran out */
+                all = cur[i].cur == id;
+            }
+            if (!all) continue;
+            ++*candidates;
+            if (ix_take(s, m, id, sid, limit, out, found) < 0) goto full;
+        }
+    } else if (nc == 0) {
+        for (uint32_t id = 1; id < s->nents; id++) {
+            ++*candidates;
+            if (ix_take(s, m, id, sid, limit, out, found) < 0) goto full;
+        }
+    }
+base_done:
+    for (uint32_t k = 0; k < s->nov; k++) {
+        if (s->ov[k].parent == IX_NONE) continue;
+        ++*candidates;
+        if (ix_take(s, m, s->nents + k, sid, limit, out, found) < 0) goto full;
+    }
+    if (0) {
+full:
+        *truncated = 1;
+    }
+    pthread_rwlock_unlock(&g_ix_lock);
+    pthread_mutex_lock(&g_ix_mu);
+    g_ix_queries++;
+    g_ix_query_ns = mono_ns() - t0;
+    pthread_mutex_unlock(&g_ix_mu);
+    return 0;
+}
+
+/* Index section of /api/metrics */
+static void index_metrics(struct strbuf *sb) {
+    if (!g_ix_file[0]) {
+        sb_printf(sb, "\"index\":{\"enabled\":false}");
+        return;
+    }
+    pthread_rwlock_rdlock(&g_ix_lock);
+    sb_printf(sb, "\"index\":{\"enabled\":true,\"ready\":%s,\"entries\":%u,\"overlay\":%u,\"dead\":%u,\"dirs\":%u,\"file_bytes\":%lld,",
+              g_ix_ready ? "true" : "false", g_ix.nents, g_ix.nov, g_ix.ndead, g_ix.ndirs, g_ix_file_bytes);
+    sb_printf(sb, "\"build\":{\"how\":\"%s\",\"entries\":%lld,\"ms\":%lld,\"walk_entries\":%lld,\"walk_ms\":%lld,\"walk_per_sec\":%lld},",
+              g_ix_build_how, g_ix_build_entries, g_ix_build_ns / 1000000, g_ix_walk_entries, g_ix_walk_ns / 1000000,
+              g_ix_walk_ns ? g_ix_walk_entries * 1000000000LL / g_ix_walk_ns : 0);
+    sb_printf(sb, "\"updates\":{\"passes\":%llu,\"dirs_checked\":%llu,\"last_pass_ms\":%lld,\"rescans\":%llu,\"added\":%llu,\"removed\":%llu,\"changes_per_sec\":%lld},",
+              g_ix_passes, g_ix_checked, g_ix_pass_ns / 1000000, g_ix_rescans, g_ix_added, g_ix_removed,
+              g_ix_rescan_ns ? (long long)((g_ix_added + g_ix_removed) * 1000000000.0 / g_ix_rescan_ns) : 0);
+    pthread_rwlock_unlock(&g_ix_lock);
+    pthread_mutex_lock(&g_ix_mu);
+    sb_printf(sb, "\"queries\":%llu,\"last_query_us\":%lld}", g_ix_queries, g_ix_query_ns / 1000);
+    pthread_mutex_unlock(&g_ix_mu);
+}
+
+/* ---------- Change events ----------
+ * /api/events streams what changes inside a directory, so a view stays current when
+ * other clients or other programs on the device change things. One watcher thread
+ * serves every stream, and a directory has one watch however many streams follow it.
+ *   Linux  inotify, which names what changed.
+ *   iOS    kqueue on the directory (FSEvents is not available there). That only says the
+ *          directory changed, so the watcher keeps a snapshot of its names, sizes and
+ *          mtimes and diffs it. Files rewritten in place leave the directory alone; a
+ *          re-read every EV_POLL_SEC finds those.
+ *   other  the snapshot re-read alone.
+ * Changes the watcher sees drop cached views of them as our own handlers do, so watched
+ * directories are never served stale. Each stream coalesces pending events per name (a
+ * file created and deleted again before it was sent is never reported) and is told to
+ * relist when more than EV_PENDING_MAX names pile up. g_ev_mu is taken before the cache
+ * locks, never after.
+ * The same watches back sync tokens (/api/list?sync=1, ?since=). A token leases a watch
+ * on its directory for EV_LEASE_SEC, and while leased, every change to the directory seen
+ * by the watcher or reported by our own handlers goes into a journal shared by all
+ * directories: the last EV_JOURNAL_MAX (name, directory) records, numbered. A token is
+ * the journal position when it was issued, so the names changed since are the leased
+ * directory's records after it, if the journal still reaches back that far and the
+ * directory was watched all along. */
+
+#define EV_SUBS_MAX 64              /* open /api/events streams */
+#define EV_PENDING_MAX 256          /* names waiting per stream before it is reset */
+#define EV_COALESCE_MS 100          /* let a burst gather before sending it */
+#define EV_KEEPALIVE_SEC 15
+#define EV_POLL_SEC 5               /* snapshot re-read interval without inotify */
+#define EV_JOURNAL_MAX 16384        /* changes remembered for sync tokens */
+#define EV_LEASE_SEC 600            /* a directory stays watched this long after a token */
+#define EV_LEASES_MAX 256
+
+#define EV_CREATE 1
+#define EV_MODIFY 2
+#define EV_DELETE 3
+
+#if !defined(__linux__)
+struct ev_snap {                    /* one entry of a watched directory */
+    char *name;
+    long long size, mtime_ns;
+    int isdir;
+};
+#endif
+
+struct ev_watch {
+    struct ev_watch *next;
+    int refs;                       /* streams following it */
+    int wd;                         /* inotify watch, or the directory fd kqueue watches */
+    int dead;                       /* the directory went away; no longer shared */
+    unsigned long long id;          /* names it in the journal */
+    time_t lease;                   /* held for sync tokens until then (0 = not) */
+    unsigned long long since;       /* journal position from which it has every change */
+#if !defined(__linux__)
+    struct ev_snap *snap;           /* sorted by name */
+    size_t nsnap;
+#endif
+    char fs[];
+};
+
+struct ev_pending {
+    char *name;
+    int kind;                       /* EV_* */
+};
+
+struct ev_sub {
+    struct ev_sub *next;
+    struct ev_watch *w;
+    pthread_cond_t cv;              /* something to send */
+    struct ev_pending q[EV_PENDING_MAX];
+    int n;
+    int reset;                      /* events were dropped: the client has to relist */
+    int gone;                       /* the directory itself was deleted or moved */
+};
+
+static struct ev_watch *g_ev_watches;
+static struct ev_sub *g_ev_subs;
+static int g_ev_nsubs;
+static int g_ev_fd = -1;            /* inotify or kqueue descriptor */
+static pthread_mutex_t g_ev_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_ev_once = PTHREAD_ONCE_INIT;
+static unsigned long long g_ev_changes, g_ev_resets;
+
+struct ev_change {
+    unsigned long long seq;
+    unsigned long long watch;       /* ev_watch id */
+    char *name;
+};
+
+static struct ev_change g_ev_journal[EV_JOURNAL_MAX];   /* ring, indexed by seq */
+static unsigned long long g_ev_seq;                     /* last journaled change */
+static unsigned long long g_ev_ids;
+static unsigned g_ev_epoch;         /* tells this run's tokens from an earlier run's */
+static int g_ev_leases;
+static unsigned long long g_ev_deltas, g_ev_fallbacks;
+
+/* Record that name in leased w's directory changed (upload temp files are nobody's news) */
+static void ev_journal(struct ev_watch *w, const char *name) {
+    if (is_temp_name(name)) return;
+    struct ev_change *c = &g_ev_journal[++g_ev_seq % EV_JOURNAL_MAX];
+    free(c->name);
+    c->seq = g_ev_seq;
+    c->watch = w->id;
+    c->name = strdup(name);
+    if (!c->name) w->since = g_ev_seq;  /* lost: older tokens for w are no good now */
+}
+
+static void ev_clear(struct ev_sub *s) {
+    for (int i = 0; i < s->n; i++) free(s->q[i].name);
+    s->n = 0;
+}
+
+/* Add a change to s, merged with one already waiting for the same name */
+static void ev_queue(struct ev_sub *s, int kind, const char *name) {
+    if (s->reset) return;
+    for (int i = 0; i < s->n; i++) {
+        struct ev_pending *p = &s->q[i];
+        if (strcmp(p->name, name) != 0) continue;
+        if (p->kind == EV_CREATE && kind == EV_DELETE) {    /* came and went unseen */
+            free(p->name);
+            memmove(p, p + 1, (size_t)(s->n - i - 1) * sizeof(*p));
+            s->n--;
+            return;
+        }
+        if (p->kind == EV_DELETE && kind == EV_CREATE) p->kind = EV_MODIFY;    /* replaced */
+        else if (p->kind != EV_CREATE) p->kind = kind;
+        return;
+    }
+    char *copy = s->n < EV_PENDING_MAX ? strdup(name) : NULL;
+    if (copy) {
+        s->q[s->n].name = copy;
+        s->q[s->n].kind = kind;
+        s->n++;
+    } else {
+        ev_clear(s);
+        s->reset = 1;
+        g_ev_resets++;
+    }
+    pthread_cond_signal(&s->cv);
+}
+
+/* name in w's directory changed: tell its streams and drop cached views of it */
+static void ev_note(struct ev_watch *w, int kind, const char *name) {
+    char fs[PATH_MAX];
+    g_ev_changes++;
+    snprintf(fs, sizeof(fs), "%s/%s", strcmp(w->fs, "/") ? w->fs : "", name);
+    lcache_touch(fs);
+    du_touch(fs);
+    mk_touch(fs);
+    if (kind != EV_MODIFY) index_touch(fs);     /* same names: the index has nothing to do */
+    if (w->lease) ev_journal(w, name);
+    if (is_temp_name(name)) return;     /* an upload in progress: only its rename is news */
+    for (struct ev_sub *s = g_ev_subs; s; s = s->next)
+        if (s->w == w) ev_queue(s, kind, name);
+}
+
+static void ev_gone(struct ev_watch *w) {
+    w->dead = 1;
+    for (struct ev_sub *s = g_ev_subs; s; s = s->next)
+        if (s->w == w) { s->gone = 1; pthread_cond_signal(&s->cv); }
+}
+
+#if defined(__linux__)
+
+#define EV_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static int ev_watch_add(struct ev_watch *w) {
+    w->wd = inotify_add_watch(g_ev_fd, w->fs, EV_MASK);
+    return w->wd < 0 ? -1 : 0;
+}
+
+static void ev_watch_drop(struct ev_watch *w) {
+    if (!w->dead) inotify_rm_watch(g_ev_fd, w->wd);
+}
+
+static void *ev_thread(void *arg) {
+    (void)arg;
+    long buf[8192];                 /* aligned for struct inotify_event */
+    for (;;) {
+        ssize_t n = read(g_ev_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno != EINTR) sleep(1);
+            continue;
+        }
+        pthread_mutex_lock(&g_ev_mu);
+        for (char *p = (char *)buf; p < (char *)buf + n;) {
+            const struct inotify_event *e = (const struct inotify_event *)p;
+            p += sizeof(*e) + e->len;
+            if (e->mask & IN_Q_OVERFLOW) {
+                for (struct ev_sub *s = g_ev_subs; s; s = s->next) {
+                    ev_clear(s);
+                    s->reset = 1;
+                    pthread_cond_signal(&s->cv);
+                }
+                for (struct ev_watch *w = g_ev_watches; w; w = w->next) w->since = g_ev_seq;
+                g_ev_resets++;
+                continue;
+            }
+            struct ev_watch *w = g_ev_watches;
+            while (w && (w->dead || w->wd != e->wd)) w = w->next;
+            if (!w) continue;
+            if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) ev_gone(w);
+            else if (e->len && e->name[0])
+                ev_note(w, e->mask & (IN_CREATE | IN_MOVED_TO) ? EV_CREATE
+                         : e->mask & (IN_DELETE | IN_MOVED_FROM) ? EV_DELETE : EV_MODIFY, e->name);
+        }
+        pthread_mutex_unlock(&g_ev_mu);
+    }
+    return NULL;
+}
+
+static int ev_init(void) {
+    g_ev_fd = inotify_init1(IN_CLOEXEC);
+    return g_ev_fd < 0 ? -1 : 0;
+}
+
+#else
+
+static int ev_snap_cmp(const void *a, const void *b) {
+    return strcmp(((const struct ev_snap *)a)->name, ((const struct ev_snap *)b)->name);
+}
+
+static void ev_snap_free(struct ev_snap *snap, size_t n) {
+    for (size_t i = 0; i < n; i++) free(snap[i].name);
+    free(snap);
+}
+
+/* Read the directory fs into a snapshot sorted by name; -1 if it cannot be read */
+static int ev_snap_read(const char *fs, struct ev_snap **out, size_t *nout) {
+    struct dir_iter it;
+    struct dir_entry de;
+    struct ev_snap *snap = NULL;
+    size_t n = 0, cap = 0;
+    int r;
+    if (dir_iter_open(&it, fs, LF_MTIME | LF_SIZE) != 0) return -1;
+    while ((r = dir_iter_next(&it, &de)) > 0) {
+        struct ev_snap e = { NULL, de.size, de.mtime_ns, de.type == DT_DIR };
+        struct stat st;
+        if ((!de.have_size || !(de.have & LF_MTIME)) && fstatat(it.fd, de.name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            e.size = (long long)st.st_size;
+            e.mtime_ns = (long long)ST_MTIM(&st).tv_sec * 1000000000LL + ST_MTIM(&st).tv_nsec;
+            e.isdir = S_ISDIR(st.st_mode);
+        }
+        if (n == cap) {
+            struct ev_snap *ns = realloc(snap, (cap ? cap * 2 : 64) * sizeof(*snap));
+            if (!ns) { r = -1; break; }
+            snap = ns;
+            cap = cap ? cap * 2 : 64;
+        }
+        if (!(e.name = strdup(de.name))) { r = -1; break; }
+        snap[n++] = e;
+    }
+    dir_iter_close(&it);
+    if (r < 0) {
+        ev_snap_free(snap, n);
+        return -1;
+    }
+    qsort(snap, n, sizeof(*snap), ev_snap_cmp);
+    *out = snap;
+    *nout = n;
+    return 0;
+}
+
+/* Re-read w's directory and report how it differs from the last snapshot */
+static void ev_rescan(struct ev_watch *w) {
+    struct ev_snap *snap;
+    size_t n, i = 0, j = 0;
+    if (ev_snap_read(w->fs, &snap, &n) != 0) {
+        if (errno == ENOENT || errno == ENOTDIR) ev_gone(w);
+        return;
+    }
+    while (i < w->nsnap || j < n) {
+        int c = i == w->nsnap ? 1 : j == n ? -1 : strcmp(w->snap[i].name, snap[j].name);
+        if (c < 0) ev_note(w, EV_DELETE, w->snap[i++].name);
+        else if (c > 0) ev_note(w, EV_CREATE, snap[j++].name);
+        else {
+            if (w->snap[i].size != snap[j].size || w->snap[i].mtime_ns != snap[j].mtime_ns ||
+                w->snap[i].isdir != snap[j].isdir)
+                ev_note(w, EV_MODIFY, snap[j].name);
+            i++;
+            j++;
+        }
+    }
+    ev_snap_free(w->snap, w->nsnap);
+    w->snap = snap;
+    w->nsnap = n;
+}
+
+static int ev_watch_add(struct ev_watch *w) {
+    if (ev_snap_read(w->fs, &w->snap, &w->nsnap) != 0) return -1;
+#if defined(__APPLE__)
+    struct kevent kev;
+    w->wd = open(w->fs, O_EVTONLY | O_CLOEXEC);
+    if (w->wd >= 0) {
+        EV_SET(&kev, w->wd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE, 0, NULL);
+        if (kevent(g_ev_fd, &kev, 1, NULL, 0, NULL) == 0) return 0;
+        close(w->wd);
+    }
+    ev_snap_free(w->snap, w->nsnap);
+    w->snap = NULL;
+    w->nsnap = 0;
+    return -1;
+#else
+    static int next_wd;
+    w->wd = next_wd++;
+    return 0;
+#endif
+}
+
+static void ev_watch_drop(struct ev_watch *w) {
+#if defined(__APPLE__)
+    close(w->wd);               /* removes its kevent too */
+#endif
+    ev_snap_free(w->snap, w->nsnap);
+}
+
+static void *ev_thread(void *arg) {
+    (void)arg;
+    time_t polled = time(NULL);
+    for (;;) {
+#if defined(__APPLE__)
+        struct kevent kev[16];
+        struct timespec ts = { EV_POLL_SEC, 0 };
+        int n = kevent(g_ev_fd, NULL, 0, kev, 16, &ts);
+#else
+        sleep(EV_POLL_SEC);
+#endif
+        int poll = time(NULL) - polled >= EV_POLL_SEC;
+        if (poll) polled = time(NULL);
+        pthread_mutex_lock(&g_ev_mu);
+        for (struct ev_watch *w = g_ev_watches; w; w = w->next) {
+            int hit = poll;
+#if defined(__APPLE__)
+            for (int i = 0; i < n; i++) {
+                if ((int)kev[i].ident != w->wd) continue;
+                if (kev[i].fflags & (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE)) ev_gone(w);
+                hit = 1;
+            }
+#endif
+            if (hit && !w->dead) ev_rescan(w);
+        }
+        pthread_mutex_unlock(&g_ev_mu);
+    }
+    return NULL;
+}
+
+static int ev_init(void) {
+#if defined(__APPLE__)
+    g_ev_fd = kqueue();
+    return g_ev_fd < 0 ? -1 : 0;
+#else
+    g_ev_fd = 0;
+    return 0;
+#endif
+}
+
+#endif
+
+static void ev_start(void) {
+    pthread_t th;
+    g_ev_epoch = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+    if (ev_init() != 0) return;
+    if (pthread_create(&th, NULL, ev_thread, NULL) != 0) {
+#if defined(__linux__) || defined(__APPLE__)
+        close(g_ev_fd);
+#endif
+        g_ev_fd = -1;
+        return;
+    }
+    pthread_detach(th);
+}
+
+/* The live watch on the directory fs, set up if there is none yet (caller holds g_ev_mu
+ * and takes a reference); NULL with errno set if it cannot be watched */
+static struct ev_watch *ev_watch_get(const char *fs) {
+    struct ev_watch *w = g_ev_watches;
+    while (w && (w->dead || strcmp(w->fs, fs) != 0)) w = w->next;
+    if (w) return w;
+    if (g_ev_fd < 0) { errno = ENOSYS; return NULL; }
+    size_t n = strlen(fs);
+    if (!(w = calloc(1, sizeof(*w) + n + 1))) return NULL;
+    memcpy(w->fs, fs, n + 1);
+    if (ev_watch_add(w) != 0) {
+        int err = errno;
+        free(w);
+        errno = err;
+        return NULL;
+    }
+    /* inotify hands out one watch per inode, so another path may already have it */
+    struct ev_watch *same = g_ev_watches;
+    while (same && (same->dead || same->wd != w->wd)) same = same->next;
+    if (same) {
+        free(w);
+        return same;
+    }
+    w->id = ++g_ev_ids;
+    w->next = g_ev_watches;
+    g_ev_watches = w;
+    return w;
+}
+
+/* Drop a reference to w (caller holds g_ev_mu) */
+static void ev_watch_put(struct ev_watch *w) {
+    if (--w->refs > 0) return;
+    struct ev_watch **pw = &g_ev_watches;
+    while (*pw != w) pw = &(*pw)->next;
+    *pw = w->next;
+    ev_watch_drop(w);
+    free(w);
+}
+
+/* Follow the directory fs: NULL with errno set if it cannot be watched (EMFILE when too
+ * many streams are open) */
+static struct ev_sub *ev_subscribe(const char *fs) {
+    pthread_once(&g_ev_once, ev_start);
+    struct ev_sub *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    pthread_cond_init(&s->cv, NULL);
+    pthread_mutex_lock(&g_ev_mu);
+    struct ev_watch *w = NULL;
+    int err = g_ev_nsubs >= EV_SUBS_MAX ? EMFILE : 0;
+    if (!err && !(w = ev_watch_get(fs))) err = errno ? errno : ENOMEM;
+    if (err) {
+        pthread_mutex_unlock(&g_ev_mu);
+        pthread_cond_destroy(&s->cv);
+        free(s);
+        errno = err;
+        return NULL;
+    }
+    w->refs++;
+    s->w = w;
+    s->next = g_ev_subs;
+    g_ev_subs = s;
+    g_ev_nsubs++;
+    pthread_mutex_unlock(&g_ev_mu);
+    return s;
+}
+
+static void ev_unsubscribe(struct ev_sub *s) {
+    pthread_mutex_lock(&g_ev_mu);
+    struct ev_sub **ps = &g_ev_subs;
+    while (*ps != s) ps = &(*ps)->next;
+    *ps = s->next;
+    g_ev_nsubs--;
+    ev_watch_put(s->w);
+    ev_clear(s);
+    pthread_mutex_unlock(&g_ev_mu);
+    pthread_cond_destroy(&s->cv);
+    free(s);
+}
+
+/* Lease the watch on the directory fs for another EV_LEASE_SEC (caller holds g_ev_mu),
+ * letting lapsed leases go. NULL if it cannot be watched. */
+static struct ev_watch *ev_lease_locked(const char *fs) {
+    time_t now = time(NULL);
+    for (struct ev_watch *w = g_ev_watches, *next; w; w = next) {
+        next = w->next;
+        if (w->lease && w->lease < now && (w->dead || strcmp(w->fs, fs) != 0)) {
+            w->lease = 0;
+            g_ev_leases--;
+            ev_watch_put(w);
+        }
+    }
+    struct ev_watch *w = g_ev_watches;
+    while (w && (w->dead || strcmp(w->fs, fs) != 0)) w = w->next;
+    if (!(w && w->lease) && g_ev_leases >= EV_LEASES_MAX) return NULL;
+    if (!w && !(w = ev_watch_get(fs))) return NULL;
+    if (!w->lease) {
+        g_ev_leases++;
+        w->refs++;
+        w->since = g_ev_seq;
+    }
+    w->lease = now + EV_LEASE_SEC;
+    return w;
+}
+
+/* Start or keep journaling the directory fs and write the token for the listing about
+ * to be produced into token (at least 48 bytes); -1 if it cannot be watched */
+static int ev_lease(const char *fs, char *token, size_t n) {
+    pthread_once(&g_ev_once, ev_start);
+    pthread_mutex_lock(&g_ev_mu);
+    struct ev_watch *w = ev_lease_locked(fs);
+    if (w) snprintf(token, n, "%08x-%llu", g_ev_epoch, g_ev_seq);
+    pthread_mutex_unlock(&g_ev_mu);
+    return w ? 0 : -1;
+}
+
+/* The names changed in the directory fs since token, NUL-separated in out (possibly
+ * repeated), and the token to use next in next. -1 when the journal cannot tell: a
+ * token from another run, records dropped since, or the directory not watched all
+ * along. */
+static int ev_changes_since(const char *fs, const char *token, struct strbuf *out, char *next, size_t n) {
+    unsigned epoch;
+    unsigned long long seq;
+    char end;
+    if (sscanf(token, "%x-%llu%c", &epoch, &seq, &end) != 2) return -1;
+    pthread_once(&g_ev_once, ev_start);
+    pthread_mutex_lock(&g_ev_mu);
+    struct ev_watch *w = g_ev_watches;
+    while (w && (w->dead || !w->lease || strcmp(w->fs, fs) != 0)) w = w->next;
+    int ok = w && epoch == g_ev_epoch && seq >= w->since && seq <= g_ev_seq && g_ev_seq - seq < EV_JOURNAL_MAX;
+    if (ok) {
+        for (unsigned long long k = seq + 1; k <= g_ev_seq; k++) {
+            const struct ev_change *c = &g_ev_journal[k % EV_JOURNAL_MAX];
+            if (c->watch == w->id) sb_append(out, c->name, strlen(c->name) + 1);
+        }
+        ev_lease_locked(fs);
+        snprintf(next, n, "%08x-%llu", g_ev_epoch, g_ev_seq);
+        g_ev_deltas++;
+    } else {
+        g_ev_fallbacks++;
+    }
+    pthread_mutex_unlock(&g_ev_mu);
+    return ok && !out->oom ? 0 : -1;
+}
+
+/* Our own handlers changed fs: journal it if its directory is leased */
+static void ev_changed(const char *fs) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", fs);
+    char *slash = strrchr(dir, '/');
+    if (!slash || !slash[1]) return;
+    *slash = '\0';
+    pthread_mutex_lock(&g_ev_mu);
+    for (struct ev_watch *w = g_ev_watches; w; w = w->next)
+        if (w->lease && !w->dead && strcmp(w->fs, slash == dir ? "/" : dir) == 0) ev_journal(w, slash + 1);
+    pthread_mutex_unlock(&g_ev_mu);
+}
+
+/* Events section of /api/metrics */
+static void events_metrics(struct strbuf *sb) {
+    int watches = 0;
+    pthread_mutex_lock(&g_ev_mu);
+    for (struct ev_watch *w = g_ev_watches; w; w = w->next) watches++;
+    sb_printf(sb, "\"events\":{\"streams\":%d,\"watches\":%d,\"changes\":%llu,\"resets\":%llu,"
+              "\"leases\":%d,\"journal\":%llu,\"deltas\":%llu,\"delta_fallbacks\":%llu}",
+              g_ev_nsubs, watches, g_ev_changes, g_ev_resets, g_ev_leases, g_ev_seq, g_ev_deltas, g_ev_fallbacks);
+    pthread_mutex_unlock(&g_ev_mu);
+}
+
+/* Something at fs was created, replaced or removed: drop every cached view of it */
+static void fs_changed(const char *fs) {
+    lcache_touch(fs);
+    du_touch(fs);
+    mk_touch(fs);
+    index_touch(fs);
+    ev_changed(fs);
+}
+
+/* ---------- API handlers ---------- */
+
+#define SORT_NONE 0
+#define SORT_NAME 1
+#define SORT_SIZE 2
+#define SORT_MTIME 3
+
+/* What a listing has to produce; decides how much each entry costs */
+struct list_opts {
+    int fields;             /* LF_* to send (fields=); type and size by default */
+    int need;               /* LF_* to resolve: fields plus what sorting and totals use */
+    int cbor;               /* client accepts application/cbor: columnar blocks instead of JSON */
+    int nofollow;           /* describe symlinks themselves rather than their targets (du) */
+    const struct name_matcher *match;   /* search: entries whose names fail it are hidden */
+    int sort;               /* SORT_*; anything but SORT_NONE selects the paged response */
+    int desc;
+    long limit;             /* page size, 0 = everything */
+    int has_cursor;
+    struct list_item_key {  /* last entry of the previous page */
+        int isdir;
+        long long key;
+        char name[NAME_MAX + 1];
+    } cursor;
+};
+
+/* One listed entry as far as it has been resolved */
+struct list_item {
+    char *name;
+    int isdir;
+    int broken;             /* symlink whose target does not resolve */
+    int special;            /* neither a regular file nor a directory (with nofollow: links too) */
+    long long size;
+    long long mtime_ns;
+    unsigned mode, uid, gid, nlink;
+    unsigned long long ino;
+    char *target;           /* symlink text (malloc'd), only with LF_TARGET */
+    long long alloc;        /* the rest is only known after a stat */
+    long long ctime_ns;
+    dev_t dev;
+    long long du;           /* LF_DU: cached recursive size, -1 unknown */
+    int hide;               /* failed lo->match: resolved only far enough to be walked */
+    int dtype;              /* what the directory entry said: DT_* or DT_UNKNOWN */
+};
+
+/* Parse a fields= list; unknown names are ignored */
+static int list_fields_parse(const char *v) {
+    static const struct { const char *name; int bit; } map[] = {
+        { "type", LF_TYPE }, { "size", LF_SIZE }, { "mtime", LF_MTIME }, { "mode", LF_MODE },
+        { "uid", LF_UID }, { "gid", LF_GID }, { "nlink", LF_NLINK }, { "target", LF_TARGET }, { "ino", LF_INO },
+        { "alloc", LF_ALLOC }, { "du", LF_DU },
+    };
+    int f = 0;
+    while (*v) {
+        size_t n = strcspn(v, ",");
+        for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++)
+            if (strlen(map[i].name) == n && strncmp(map[i].name, v, n) == 0) f |= map[i].bit;
+        v += n;
+        if (*v == ',') v++;
+    }
+    return f;
+}
+
+#define LIST_BATCH 1024
+#define LIST_PROBE 16
+
+/* A run of directory entries resolved together and handed on in readdir order */
+struct list_batch {
+    int n;
+    int dirfd;
+    int nofollow;
+    const char *dirfs;                  /* the directory's path, for LF_DU lookups */
+    struct list_item item[LIST_BATCH];
+    unsigned char drop[LIST_BATCH];     /* stat failed: the entry vanished meanwhile */
+    unsigned char ops[LIST_BATCH];      /* LIST_OP_* still to do for the entry */
+    int need[LIST_BATCH];               /* indexes of entries with ops left */
+    int nneed;
+    size_t off[LIST_BATCH];             /* name offsets into names until the batch is full */
+    char *names;
+    size_t names_len, names_cap;
+};
+
+#define LIST_OP_STAT 1
+#define LIST_OP_READLINK 2
+
+/* Pick the cheapest plan for one entry and fill in what the dirent already says.
+ * Nothing but name/ino/type: the dirent alone (readdir only). Symlinks and unknown
+ * types need a stat to be typed; other entries only when the request wants stat
+ * fields the bulk read (iOS getattrlistbulk) did not supply, and directories never
+ * for size alone. Link targets cost a readlinkat, tried on links and unknown types.
+ * A cached du size is only trusted against a fresh stat of the directory. */
+static int list_plan(const struct dir_entry *e, const struct list_opts *lo, struct list_item *li) {
+    memset(li, 0, sizeof(*li));
+    li->isdir = e->type == DT_DIR;
+    li->special = e->type != DT_DIR && e->type != DT_REG && e->type != DT_UNKNOWN;
+    li->ino = e->ino;
+    li->du = -1;
+    li->dtype = e->type;
+    int ops = 0, maybe_link = e->type == DT_LNK || e->type == DT_UNKNOWN;
+    if (maybe_link) {
+        if (lo->need & (LF_TYPE | LF_STAT)) ops |= LIST_OP_STAT;   /* bulk attributes describe the link, not its target */
+    } else {
+        int have = e->have | (e->have_size || li->isdir ? LF_SIZE : 0);
+        li->size = e->have_size && !li->isdir ? e->size : 0;
+        li->mtime_ns = e->mtime_ns;
+        li->mode = e->mode; li->uid = e->uid; li->gid = e->gid; li->nlink = e->nlink;
+        if (lo->need & LF_STAT & ~have) ops |= LIST_OP_STAT;
+        if (li->isdir && (lo->need & LF_DU)) ops |= LIST_OP_STAT;
+    }
+    if ((lo->need & LF_TARGET) && maybe_link) ops |= LIST_OP_READLINK;
+    return ops;
+}
+
+static void list_item_stat(struct list_item *li, const struct stat *st) {
+    li->isdir = S_ISDIR(st->st_mode);
+    li->special = !li->isdir && !S_ISREG(st->st_mode);
+    li->size = li->isdir ? 0 : (long long)st->st_size;
+    li->mtime_ns = (long long)ST_MTIM(st).tv_sec * 1000000000LL + ST_MTIM(st).tv_nsec;
+    li->mode = st->st_mode & 07777;
+    li->uid = st->st_uid;
+    li->gid = st->st_gid;
+    li->nlink = st->st_nlink;
+    li->ino = st->st_ino;
+    li->alloc = (long long)st->st_blocks * 512;
+    li->ctime_ns = (long long)ST_CTIM(st).tv_sec * 1000000000LL + ST_CTIM(st).tv_nsec;
+    li->dev = st->st_dev;
+}
+
+/* Fill li for the entry at fs as a listing shows it (li->name is left to the caller):
+ * symlinks followed, a dangling one marked broken. -1 if there is nothing at fs. */
+static int list_item_at(struct list_item *li, const char *fs, const struct list_opts *lo) {
+    struct stat st;
+    memset(li, 0, sizeof(*li));
+    li->du = -1;
+    if (stat(fs, &st) == 0) list_item_stat(li, &st);
+    else if (lstat(fs, &st) == 0 && S_ISLNK(st.st_mode)) li->broken = 1;
+    else return -1;
+    if (lo->fields & LF_TARGET) {
+        char buf[PATH_MAX];
+        ssize_t n = readlink(fs, buf, sizeof(buf) - 1);
+        if (n >= 0) { buf[n] = '\0'; li->target = strdup(buf); }
+    }
+    if ((lo->fields & LF_DU) && li->isdir) li->du = du_cache_size(fs, li->dev, li->ino, li->mtime_ns, li->ctime_ns);
+    return 0;
+}
+
+/* Run the planned calls for need[from..to) of b, timing them for iopool_width() */
+static void list_stat_range(struct list_batch *b, int from, int to) {
+    long long t0 = mono_ns();
+    for (int k = from; k < to; k++) {
+        int i = b->need[k];
+        struct list_item *li = &b->item[i];
+        if (b->ops[i] & LIST_OP_READLINK) {
+            char buf[PATH_MAX];
+            ssize_t n = readlinkat(b->dirfd, li->name, buf, sizeof(buf) - 1);   /* EINVAL: not a link */
+            if (n >= 0) { buf[n] = '\0'; li->target = strdup(buf); }
+        }
+        if (!(b->ops[i] & LIST_OP_STAT)) continue;
+        struct stat st;
+        /* follows symlinks, so a link to a directory is listed (and browsable) as one */
+        if (fstatat(b->dirfd, li->name, &st, b->nofollow ? AT_SYMLINK_NOFOLLOW : 0) != 0) {
+            if (li->target) li->broken = 1;     /* keep dangling links when targets were asked for */
+            else b->drop[i] = 1;
+            continue;
+        }
+        list_item_stat(li, &st);
+    }
+    iopool_observe(mono_ns() - t0, to - from);
+}
+
+struct list_stat_job {
+    struct io_job job;
+    struct list_batch *b;
+    int from, to;
+    struct io_wait *wait;
+};
+
+static void list_stat_job_run(void *arg) {
+    struct list_stat_job *j = arg;
+    list_stat_range(j->b, j->from, j->to);
+    io_wait_done(j->wait);
+}
+
+/* Read up to LIST_BATCH entries and resolve them, spreading the stats over the I/O pool
+ * when the filesystem is slow enough for that to pay. Entries whose stat fails are
+ * dropped; the rest keep their readdir order. 0 once the directory is exhausted. */
+static int list_fill(struct dir_iter *it, const struct list_opts *lo, struct list_batch *b) {
+    int nread = 0;
+    struct list_opts walk = *lo;    /* for names a search hides: the type is all a walk needs */
+    walk.need &= LF_TYPE;
+    for (int i = 0; i < b->n; i++) free(b->item[i].target);
+    b->n = 0;
+    b->nneed = 0;
+    b->names_len = 0;
+    b->dirfd = it->fd;
+    b->nofollow = lo->nofollow;
+    struct dir_entry e;
+    while (b->n < LIST_BATCH && dir_iter_next(it, &e) == 1) {
+        size_t nl = strlen(e.name) + 1;
+        if (b->names_len + nl > b->names_cap) {
+            size_t cap = b->names_cap ? b->names_cap * 2 : 64 * 1024;
+            while (b->names_len + nl > cap) cap *= 2;
+            char *np = realloc(b->names, cap);
+            if (!np) break;
+            b->names = np;
+            b->names_cap = cap;
+        }
+        memcpy(b->names + b->names_len, e.name, nl);
+        int i = b->n++;
+        nread++;
+        b->off[i] = b->names_len;
+        b->names_len += nl;
+        b->drop[i] = 0;
+        int hide = lo->match && !name_match(lo->match, e.name);
+        b->ops[i] = (unsigned char)list_plan(&e, hide ? &walk : lo, &b->item[i]);
+        b->item[i].hide = hide;
+        if (b->ops[i]) b->need[b->nneed++] = i;
+    }
+    for (int i = 0; i < b->n; i++) b->item[i].name = b->names + b->off[i];
+
+    /* a few calls inline first keep the latency estimate current for this filesystem */
+    int done = b->nneed < LIST_PROBE ? b->nneed : LIST_PROBE;
+    if (done) list_stat_range(b, 0, done);
+    int left = b->nneed - done;
+    int w = iopool_width(left);
+    if (w <= 1) {
+        if (left) list_stat_range(b, done, b->nneed);
+    } else {
+        struct list_stat_job jobs[IOPOOL_THREADS];
+        struct io_wait wait;
+        io_wait_init(&wait, w - 1);
+        int per = (left + w - 1) / w;
+        for (int k = 1; k < w; k++) {
+            struct list_stat_job *j = &jobs[k - 1];
+            j->job.fn = list_stat_job_run;
+            j->job.arg = j;
+            j->b = b;
+            j->from = done + (k * per < left ? k * per : left);
+            j->to = done + ((k + 1) * per < left ? (k + 1) * per : left);
+            j->wait = &wait;
+            iopool_submit(&j->job);
+        }
+        list_stat_range(b, done, done + (per < left ? per : left));
+        for (int k = 1; k < w; k++)     /* no worker free: this thread may be one of them */
+            if (iopool_cancel(&jobs[k - 1].job)) list_stat_job_run(&jobs[k - 1]);
+        io_wait_all(&wait);
+    }
+
+    int n = 0;
+    for (int i = 0; i < b->n; i++) {
+        if (b->drop[i]) free(b->item[i].target);
+        else b->item[n++] = b->item[i];
+    }
+    b->n = n;
+    if ((lo->need & LF_DU) && b->dirfs) {
+        for (int i = 0; i < b->n; i++) {
+            struct list_item *li = &b->item[i];
+            char path[PATH_MAX];
+            if (!li->isdir || li->broken || li->hide) continue;
+            if (snprintf(path, sizeof(path), "%s/%s", strcmp(b->dirfs, "/") ? b->dirfs : "", li->name) >= (int)sizeof(path)) continue;
+            li->du = du_cache_size(path, li->dev, li->ino, li->mtime_ns, li->ctime_ns);
+        }
+    }
+    return nread > 0;
+}
+
+static void list_batch_free(struct list_batch *b) {
+    if (b) {
+        for (int i = 0; i < b->n; i++) free(b->item[i].target);
+        free(b->names);
+    }
+    free(b);
+}
+
+static void list_emit(struct ostream *os, const char *reqpath, const struct list_item *li, const struct list_opts *lo, int first) {
+    os_write(os, first ? "{\"name\":\"" : ",{\"name\":\"", first ? 9 : 10);
+    os_json_raw(os, li->name);
+    os_write(os, "\",\"path\":\"", 10);
+    if (strcmp(reqpath, "/") != 0) os_json_raw(os, reqpath);
+    os_write(os, "/", 1);
+    os_json_raw(os, li->name);
+    os_write(os, "\"", 1);
+    int f = lo->fields;
+    if (f & LF_TYPE) {
+        if (li->broken) os_write(os, ",\"type\":\"link\"", 14);
+        else if (li->isdir) os_write(os, ",\"type\":\"dir\"", 13);
+        else os_write(os, ",\"type\":\"file\"", 14);
+    }
+    if (li->broken) f &= LF_TARGET | LF_INO;    /* nothing else is known about a dangling link */
+    if (f & LF_SIZE) { os_write(os, ",\"size\":", 8); os_int(os, li->size); }
+    if (f & LF_MTIME) { os_write(os, ",\"mtime\":", 9); os_int(os, li->mtime_ns / 1000000000LL); }
+    if (f & LF_MODE) {
+        char m[8] = { '0', (char)('0' + ((li->mode >> 9) & 7)), (char)('0' + ((li->mode >> 6) & 7)),
+                      (char)('0' + ((li->mode >> 3) & 7)), (char)('0' + (li->mode & 7)) };
+        os_write(os, ",\"mode\":\"", 9);
+        os_write(os, m[1] == '0' ? m + 1 : m, m[1] == '0' ? 4 : 5);
+        os_write(os, "\"", 1);
+    }
+    if (f & LF_UID) { os_write(os, ",\"uid\":", 7); os_int(os, li->uid); }
+    if (f & LF_GID) { os_write(os, ",\"gid\":", 7); os_int(os, li->gid); }
+    if (f & LF_NLINK) { os_write(os, ",\"nlink\":", 9); os_int(os, li->nlink); }
+    if (f & LF_INO) { os_write(os, ",\"ino\":", 7); os_int(os, (long long)li->ino); }
+    if (f & LF_ALLOC) { os_write(os, ",\"alloc\":", 9); os_int(os, li->alloc); }
+    if ((f & LF_DU) && li->du >= 0) { os_write(os, ",\"du\":", 6); os_int(os, li->du); }
+    if ((f & LF_TARGET) && li->target) { os_write(os, ",\"target\":", 10); os_json_str(os, li->target); }
+    os_write(os, "}", 1);
+}
+
+static long long list_sort_key(const struct list_opts *lo, long long size, long long mtime_ns) {
+    return lo->sort == SORT_SIZE ? size : lo->sort == SORT_MTIME ? mtime_ns : 0;
+}
+
+/* Listing order: directories first, then the sort key, then name; order=desc flips the
+ * last two. The cursor is compared with the same function, which makes pages stable. */
+static int list_cmp(const struct list_opts *lo, int adir, long long akey, const char *aname,
+                    int bdir, long long bkey, const char *bname) {
+    if (adir != bdir) return adir ? -1 : 1;
+    int c = akey < bkey ? -1 : akey > bkey ? 1 : strcmp(aname, bname);
+    return lo->desc ? -c : c;
+}
+
+static int list_item_cmp(const struct list_opts *lo, const struct list_item *a, const struct list_item *b) {
+    return list_cmp(lo, a->isdir, list_sort_key(lo, a->size, a->mtime_ns), a->name,
+                    b->isdir, list_sort_key(lo, b->size, b->mtime_ns), b->name);
+}
+
+/* Max-heap on list order: the root is the entry that would be dropped first */
+static void list_heap_down(const struct list_opts *lo, struct list_item *h, size_t n, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && list_item_cmp(lo, &h[l], &h[m]) > 0) m = l;
+        if (r < n && list_item_cmp(lo, &h[r], &h[m]) > 0) m = r;
+        if (m == i) return;
+        struct list_item t = h[i]; h[i] = h[m]; h[m] = t;
+        i = m;
+    }
+}
+
+static void list_heap_up(const struct list_opts *lo, struct list_item *h, size_t i) {
+    while (i > 0) {
+        size_t p = (i - 1) / 2;
+        if (list_item_cmp(lo, &h[i], &h[p]) <= 0) return;
+        struct list_item t = h[i]; h[i] = h[p]; h[p] = t;
+        i = p;
+    }
+}
+
+/* Opaque page cursor: base64url("d|key|name") of the last entry sent */
+static void list_cursor_encode(const struct list_opts *lo, const struct list_item *li, char *out, size_t outsz) {
+    char raw[NAME_MAX + 64];
+    int n = snprintf(raw, sizeof(raw), "%d|%lld|%s", li->isdir, list_sort_key(lo, li->size, li->mtime_ns), li->name);
+    char b64[((NAME_MAX + 64) / 3 + 1) * 4 + 1];
+    size_t m = b64enc((const uint8_t *)raw, (size_t)n, b64);
+    while (m && b64[m - 1] == '=') b64[--m] = '\0';
+    for (size_t i = 0; i < m; i++) { if (b64[i] == '+') b64[i] = '-'; else if (b64[i] == '/') b64[i] = '_'; }
+    snprintf(out, outsz, "%s", b64);
+}
+
+/* -1 unless in is a cursor list_cursor_encode() could have made */
+static int list_cursor_decode(const char *in, struct list_opts *lo) {
+    char b64[((NAME_MAX + 64) / 3 + 1) * 4 + 1], raw[NAME_MAX + 64];
+    size_t n = strlen(in);
+    if (n >= sizeof(b64)) return -1;
+    for (size_t i = 0; i <= n; i++) {   /* back from base64url */
+        b64[i] = in[i] == '-' ? '+' : in[i] == '_' ? '/' : in[i];
+        if (b64[i] && b64val(b64[i]) < 0) return -1;
+    }
+    b64dec_simple(b64, raw, sizeof(raw));
+    char *p1 = strchr(raw, '|'), *p2 = p1 ? strchr(p1 + 1, '|') : NULL, *end;
+    if (p1 != raw + 1 || (raw[0] != '0' && raw[0] != '1') || !p2 || !p2[1]) return -1;
+    long long key = strtoll(p1 + 1, &end, 10);
+    if (end == p1 + 1 || end != p2) return -1;
+    lo->cursor.isdir = raw[0] == '1';
+    lo->cursor.key = key;
+    snprintf(lo->cursor.name, sizeof(lo->cursor.name), "%s", p2 + 1);
+    lo->has_cursor = 1;
+    return 0;
+}
+
+/* Columnar CBOR listing (Accept: application/cbor). One map,
+ *   {"path": parent, "fields": [column names], "blocks": [_ block, ...],
+ *    "total": n, ...page totals and "next" for sorted listings}
+ * where each block is an array of columns, one value per entry: name strings, type
+ * codes (0 file, 1 dir, 2 dangling link), unsigned numbers, target string or null.
+ * Paths are not repeated per entry and no key appears more than once. */
+static const struct { int bit; const char *name; } g_list_cols[] = {
+    { LF_TYPE, "type" }, { LF_SIZE, "size" }, { LF_MTIME, "mtime" }, { LF_MODE, "mode" }, { LF_UID, "uid" },
+    { LF_GID, "gid" }, { LF_NLINK, "nlink" }, { LF_INO, "ino" }, { LF_TARGET, "target" }, { LF_ALLOC, "alloc" },
+    { LF_DU, "du" },
+};
+#define LIST_NCOLS (sizeof(g_list_cols) / sizeof(g_list_cols[0]))
+
+static void cbor_list_open(struct ostream *os, const char *reqpath, const struct list_opts *lo) {
+    int ncols = 1;
+    for (size_t c = 0; c < LIST_NCOLS; c++) if (lo->fields & g_list_cols[c].bit) ncols++;
+    cbor_byte(os, CBOR_INDEF_MAP);
+    cbor_str(os, "path");
+    cbor_str(os, reqpath);
+    cbor_str(os, "fields");
+    cbor_head(os, CBOR_ARRAY, ncols);
+    cbor_str(os, "name");
+    for (size_t c = 0; c < LIST_NCOLS; c++) if (lo->fields & g_list_cols[c].bit) cbor_str(os, g_list_cols[c].name);
+    cbor_str(os, "blocks");
+    cbor_byte(os, CBOR_INDEF_ARRAY);
+}
+
+static void cbor_list_block(struct ostream *os, const struct list_item *items, size_t n, const struct list_opts *lo) {
+    if (!n) return;
+    int ncols = 1;
+    for (size_t c = 0; c < LIST_NCOLS; c++) if (lo->fields & g_list_cols[c].bit) ncols++;
+    cbor_head(os, CBOR_ARRAY, ncols);
+    cbor_head(os, CBOR_ARRAY, n);
+    for (size_t i = 0; i < n; i++) cbor_str(os, items[i].name);
+    for (size_t c = 0; c < LIST_NCOLS; c++) {
+        int bit = g_list_cols[c].bit;
+        if (!(lo->fields & bit)) continue;
+        cbor_head(os, CBOR_ARRAY, n);
+        for (size_t i = 0; i < n; i++) {
+            const struct list_item *li = &items[i];
+            if (bit == LF_TYPE) { cbor_head(os, CBOR_UINT, li->broken ? 2 : li->isdir); continue; }
+            if (bit == LF_TARGET) { if (li->target) cbor_str(os, li->target); else cbor_byte(os, CBOR_NULL); continue; }
+            if ((li->broken && bit != LF_INO) || (bit == LF_DU && li->du < 0)) { cbor_byte(os, CBOR_NULL); continue; }
+            unsigned long long v = bit == LF_SIZE ? (unsigned long long)li->size
+                                 : bit == LF_MTIME ? (unsigned long long)(li->mtime_ns / 1000000000LL)
+                                 : bit == LF_MODE ? li->mode : bit == LF_UID ? li->uid : bit == LF_GID ? li->gid
+                                 : bit == LF_NLINK ? li->nlink : bit == LF_ALLOC ? (unsigned long long)li->alloc
+                                 : bit == LF_DU ? (unsigned long long)li->du : li->ino;
+            cbor_head(os, CBOR_UINT, v);
+        }
+    }
+}
+
+static void cbor_kv_uint(struct ostream *os, const char *key, unsigned long long v) {
+    cbor_str(os, key);
+    cbor_head(os, CBOR_UINT, v);
+}
+
+/* Paged listing: {"total":..,"dirs":..,"files":..,"bytes":..,"entries":[..],"next":cursor|null}.
+ * One pass over the directory keeps only the best `limit` entries after the cursor in a
+ * bounded heap (partial top-K), so memory is O(limit) whatever the directory size. */
+static int list_sorted(int conn, const char *fs, const char *reqpath, const struct list_opts *lo, const char *headers,
+                       struct strbuf *tee) {
+    struct dir_iter it;
+    int opened = dir_iter_open(&it, fs, lo->need) == 0;   /* unreadable: an empty listing, not cached */
+    size_t cap = lo->limit > 0 ? (size_t)lo->limit + 1 : 256, n = 0;   /* +1 tells whether a next page exists */
+    struct list_item *h = malloc(cap * sizeof(*h));
+    long long total = 0, ndirs = 0, bytes = 0;
+    struct list_batch *b = calloc(1, sizeof(*b));
+    int oom = !b;
+    if (b) b->dirfs = fs;
+    while (opened && h && !oom && list_fill(&it, lo, b)) {
+        for (int bi = 0; bi < b->n; bi++) {
+            struct list_item li = b->item[bi];
+            total++;
+            if (li.isdir) ndirs++; else bytes += li.size;
+            if (lo->has_cursor && list_cmp(lo, li.isdir, list_sort_key(lo, li.size, li.mtime_ns), li.name,
+                                           lo->cursor.isdir, lo->cursor.key, lo->cursor.name) <= 0) continue;
+            if (lo->limit > 0 && n == cap) {
+                if (list_item_cmp(lo, &li, &h[0]) >= 0) continue;
+                free(h[0].name);
+                free(h[0].target);
+                h[0] = li;
+                h[0].name = strdup(li.name);
+                h[0].target = li.target ? strdup(li.target) : NULL;
+                list_heap_down(lo, h, n, 0);
+                continue;
+            }
+            if (n == cap) {
+                struct list_item *nh = realloc(h, cap * 2 * sizeof(*h));
+                if (!nh) { oom = 1; break; }
+                h = nh; cap *= 2;
+            }
+            h[n] = li;
+            h[n].name = strdup(li.name);
+            h[n].target = li.target ? strdup(li.target) : NULL;
+            list_heap_up(lo, h, n);
+            n++;
+        }
+    }
+    list_batch_free(b);
+    if (opened) dir_iter_close(&it);
+    if (!h) {
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return 0;
+    }
+    /* heap sort in place: ascending list order */
+    for (size_t i = n; i > 1; i--) {
+        struct list_item t = h[0]; h[0] = h[i - 1]; h[i - 1] = t;
+        list_heap_down(lo, h, i - 1, 0);
+    }
+    size_t page = (lo->limit > 0 && n > (size_t)lo->limit) ? (size_t)lo->limit : n;
+    int complete = 0;
+    char cur[(NAME_MAX + 64) / 3 * 4 + 8];
+    if (page < n) list_cursor_encode(lo, &h[page - 1], cur, sizeof(cur));
+    send_headers_chunked(conn, 200, "OK", lo->cbor ? "application/cbor" : "application/json; charset=utf-8", headers);
+    struct ostream *os = malloc(sizeof(*os));
+    if (os && lo->cbor) {
+        os_init(os, conn, 1);
+        os->tee = tee; os->tee_max = LCACHE_ENTRY_MAX;
+        cbor_list_open(os, reqpath, lo);
+        for (size_t i = 0; i < page && !os->failed; i += LIST_BATCH)
+            cbor_list_block(os, h + i, page - i < LIST_BATCH ? page - i : LIST_BATCH, lo);
+        cbor_byte(os, CBOR_BREAK);
+        cbor_kv_uint(os, "total", total);
+        cbor_kv_uint(os, "dirs", ndirs);
+        cbor_kv_uint(os, "files", total - ndirs);
+        if (lo->need & LF_SIZE) cbor_kv_uint(os, "bytes", bytes);
+        cbor_str(os, "next");
+        if (page < n) cbor_str(os, cur); else cbor_byte(os, CBOR_NULL);
+        cbor_byte(os, CBOR_BREAK);
+        os_end(os);
+        complete = opened && !os->failed;
+        free(os);
+    } else if (os) {
+        os_init(os, conn, 1);
+        os->tee = tee; os->tee_max = LCACHE_ENTRY_MAX;
+        os_write(os, "{\"total\":", 9); os_int(os, total);
+        os_write(os, ",\"dirs\":", 8); os_int(os, ndirs);
+        os_write(os, ",\"files\":", 9); os_int(os, total - ndirs);
+        if (lo->need & LF_SIZE) { os_write(os, ",\"bytes\":", 9); os_int(os, bytes); }
+        os_write(os, ",\"entries\":[", 12);
+        for (size_t i = 0; i < page && !os->failed; i++) list_emit(os, reqpath, &h[i], lo, i == 0);
+        os_write(os, "],\"next\":", 9);
+        if (page < n) os_json_str(os, cur);
+        else os_write(os, "null", 4);
+        os_write(os, "}", 1);
+        os_end(os);
+        complete = opened && !os->failed;
+        free(os);
+    } else {
+        send_all(conn, "0\r\n\r\n", 5);
+    }
+    for (size_t i = 0; i < n; i++) { free(h[i].name); free(h[i].target); }
+    free(h);
+    return complete;
+}
+
+/* Plain listing: JSON array (or CBOR blocks), streamed batch by batch (no size limit) */
+static int list_stream(int conn, const char *fs, const char *reqpath, const struct list_opts *lo, const char *headers,
+                       struct strbuf *tee) {
+    struct dir_iter it;
+    int opened = dir_iter_open(&it, fs, lo->need) == 0;   /* unreadable: an empty listing, not cached */
+    send_headers_chunked(conn, 200, "OK", lo->cbor ? "application/cbor" : "application/json; charset=utf-8", headers);
+    struct ostream *os = malloc(sizeof(*os));
+    if (!os) { if (opened) dir_iter_close(&it); send_all(conn, "0\r\n\r\n", 5); return 0; }
+    os_init(os, conn, 1);
+    os->tee = tee; os->tee_max = LCACHE_ENTRY_MAX;
+    if (lo->cbor) cbor_list_open(os, reqpath, lo);
+    else os_write(os, "[", 1);
+    struct list_batch *b = calloc(1, sizeof(*b));
+    if (b) b->dirfs = fs;
+    int first = 1;
+    long long total = 0;
+    while (opened && b && !os->failed && list_fill(&it, lo, b)) {
+        total += b->n;
+        if (lo->cbor) {
+            cbor_list_block(os, b->item, b->n, lo);
+            continue;
+        }
+        for (int i = 0; i < b->n; i++) {
+            list_emit(os, reqpath, &b->item[i], lo, first);
+            first = 0;
+        }
+    }
+    if (opened) dir_iter_close(&it);
+    if (lo->cbor) {
+        cbor_byte(os, CBOR_BREAK);
+        cbor_kv_uint(os, "total", total);
+        cbor_byte(os, CBOR_BREAK);
+    } else {
+        os_write(os, "]", 1);
+    }
+    os_end(os);
+    int complete = opened && b && !os->failed;
+    list_batch_free(b);
+    free(os);
+    return complete;
+}
+
+static int cmp_strp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* The answer to /api/list?since= when the journal has one: names is what ev_changes_since
+ * returned. Each name is looked at now, so it is "changed" (with its entry as a listing
+ * shows it) if something is there and "removed" if not. */
+static void list_delta(int conn, const char *fs, const char *reqpath, const struct list_opts *lo, const char *next,
+                       const char *headers, struct strbuf *names) {
+    size_t n = 0;
+    for (size_t at = 0; at < names->len; at += strlen(names->p + at) + 1) n++;
+    char **v = malloc((n ? n : 1) * sizeof(*v));
+    if (!v) {
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    n = 0;
+    for (size_t at = 0; at < names->len; at += strlen(names->p + at) + 1) v[n++] = names->p + at;
+    qsort(v, n, sizeof(*v), cmp_strp);
+    struct ostream os;
+    struct list_item li;
+    char path[PATH_MAX];
+    int first = 1;
+    send_headers_chunked(conn, 200, "OK", "application/json; charset=utf-8", headers);
+    os_init(&os, conn, 1);
+    os_write(&os, "{\"delta\":true,\"sync\":\"", 22);
+    os_write(&os, next, strlen(next));
+    os_write(&os, "\",\"changed\":[", 13);
+    const char *prev = NULL;
+    for (size_t i = 0; i < n; i++) {    /* what is left in v afterwards is removed */
+        if (prev && !strcmp(v[i], prev)) { v[i] = NULL; continue; }
+        prev = v[i];
+        if (snprintf(path, sizeof(path), "%s/%s", strcmp(fs, "/") ? fs : "", v[i]) >= (int)sizeof(path) ||
+            list_item_at(&li, path, lo) != 0) continue;
+        li.name = v[i];
+        list_emit(&os, reqpath, &li, lo, first);
+        first = 0;
+        free(li.target);
+        v[i] = NULL;
+    }
+    os_write(&os, "],\"removed\":[", 13);
+    first = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (!v[i]) continue;
+        if (!first) os_write(&os, ",", 1);
+        os_json_str(&os, v[i]);
+        first = 0;
+    }
+    os_write(&os, "]}", 2);
+    os_end(&os);
+    free(v);
+}
+
+/* /api/list?path=...[&fields=...][&sort=...] -> served from the listing cache when the
+ * directory is unchanged, otherwise produced and cached on the way out.
+ * With sync=1 (or since=) the response carries an X-Sync-Token header. since=TOKEN asks
+ * for what changed after the listing that token came with:
+ *   {"delta":true,"sync":TOKEN,"changed":[entries],"removed":[names]}
+ * or, when the server cannot tell (restarted, too many changes since, directory not
+ * watched), the ordinary full listing; a client tells the two apart by "delta". A name
+ * may be reported again after the change has been seen, never missed. */
+static void api_list(int conn, const char *reqpath, const struct list_opts *lo, const char *since, int sync) {
+    char fs[PATH_MAX], key[2 * PATH_MAX + NAME_MAX + 128], token[48], headers[96] = "Vary: Accept\r\n";
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    snprintf(key, sizeof(key), "%s\n%s\n%d,%d,%d,%d,%d,%ld,%d,%d,%lld,%s", fs, reqpath, lo->cbor, lo->fields, lo->need, lo->sort,
+             lo->desc, lo->limit, lo->has_cursor, lo->cursor.isdir, lo->cursor.key, lo->cursor.name);
+    struct stat dst;
+    int cacheable = stat(fs, &dst) == 0 && S_ISDIR(dst.st_mode);
+    if (cacheable && since) {
+        struct strbuf names = { 0 };
+        if (ev_changes_since(fs, since, &names, token, sizeof(token)) == 0) {
+            snprintf(headers, sizeof(headers), "X-Sync-Token: %s\r\n", token);
+            list_delta(conn, fs, reqpath, lo, token, headers, &names);
+            free(names.p);
+            return;
+        }
+        free(names.p);
+    }
+    /* the token is taken first, so changes made while listing come again in the next delta */
+    if (cacheable && (since || sync) && ev_lease(fs, token, sizeof(token)) == 0)
+        snprintf(headers, sizeof(headers), "Vary: Accept\r\nX-Sync-Token: %s\r\n", token);
+    if (cacheable && lcache_serve(conn, key, &dst, lo->cbor ? "application/cbor" : "application/json; charset=utf-8",
+                                  headers)) return;
+    unsigned long gen = lcache_generation();
+    struct strbuf tee = { 0 };
+    int complete = lo->sort != SORT_NONE ? list_sorted(conn, fs, reqpath, lo, headers, cacheable ? &tee : NULL)
+                                         : list_stream(conn, fs, reqpath, lo, headers, cacheable ? &tee : NULL);
+    if (complete && cacheable) lcache_store(key, strlen(fs), fs, &dst, gen, &tee);
+    free(tee.p);
+}
+
+/* ---------- Parallel walks ----------
+ * /api/tree and /api/du read whole subtrees. Directories wait on a stack owned by the
+ * walk; the connection thread works through it itself and pulls in pool helpers while
+ * there is a backlog and the filesystem is slow enough for more calls in flight to pay
+ * (the same latency estimate as the listing stats), so fast local disks are walked on
+ * one thread. The work unit is a whole directory (or, for grep, a whole file), so one
+ * lock per walk is enough. Walks that compute over what they read also use every CPU. */
+
+#define WALK_POLL_MS 200                    /* how often an idle walk checks the client */
+
+struct walk_crew;
+
+struct walk_helper {
+    struct io_job job;
+    struct walk_crew *crew;
+    int busy;
+};
+
+struct walk_crew {
+    pthread_mutex_t mu;         /* guards the walk's own state as well */
+    pthread_cond_t cv;          /* work queued, work finished or a helper done */
+    int queued;                 /* directories waiting */
+    int stop;                   /* finish early: client gone, limit reached or out of memory */
+    int helpers;
+    int cpu;                    /* the work is CPU-bound: spread it over the CPUs as well */
+    int conn;                   /* the client, watched for hanging up */
+    void (*help)(struct walk_crew *crew);   /* helper body: work until nothing is queued */
+    struct walk_helper helper[IOPOOL_THREADS];
+};
+
+/* Set of (dev, ino) pairs: directories already entered, hard links already counted */
+struct devino_key {
+    int used;
+    dev_t dev;
+    ino_t ino;
+};
+
+struct devino_set {
+    struct devino_key *t;
+    size_t n, cap;
+};
+
+static void crew_init(struct walk_crew *crew, int conn, void (*help)(struct walk_crew *)) {
+    memset(crew, 0, sizeof(*crew));
+    crew->conn = conn;
+    pthread_mutex_init(&crew->mu, NULL);
+    pthread_cond_init(&crew->cv, NULL);
+    crew->help = help;
+}
+
+static void crew_destroy(struct walk_crew *crew) {
+    pthread_cond_destroy(&crew->cv);
+    pthread_mutex_destroy(&crew->mu);
+}
+
+static void crew_helper_run(void *arg) {
+    struct walk_helper *h = arg;
+    struct walk_crew *crew = h->crew;
+    crew->help(crew);
+    pthread_mutex_lock(&crew->mu);
+    h->busy = 0;
+    crew->helpers--;
+    pthread_cond_broadcast(&crew->cv);
+    pthread_mutex_unlock(&crew->mu);
+}
+
+/* Put more helpers on the backlog if it pays (caller holds crew->mu) */
+static void crew_grow(struct walk_crew *crew) {
+    if (crew->stop || !crew->queued) return;
+    int want = iopool_width(8 * crew->queued) - 1;  /* a directory is worth a batch of calls */
+    if (crew->cpu) {
+        int cpus = crew->queued < iopool_cpus() ? crew->queued : iopool_cpus();
+        if (cpus - 1 > want) want = cpus - 1;
+    }
+    for (int k = 0; k < IOPOOL_THREADS && crew->helpers < want; k++) {
+        struct walk_helper *h = &crew->helper[k];
+        if (h->busy) continue;
+        h->busy = 1;
+        h->crew = crew;
+        h->job.fn = crew_helper_run;
+        h->job.arg = h;
+        crew->helpers++;
+        iopool_submit(&h->job);
+    }
+}
+
+/* Wait for the helpers (caller holds crew->mu). Helpers no worker has picked up yet are
+ * withdrawn first; crew_grow() sends them again if a backlog builds up. Wakes up now and
+ * then to stop the walk if the client has hung up. */
+static void crew_wait(struct walk_crew *crew) {
+    for (int k = 0; k < IOPOOL_THREADS; k++) {
+        struct walk_helper *h = &crew->helper[k];
+        if (h->busy && iopool_cancel(&h->job)) {
+            h->busy = 0;
+            crew->helpers--;
+        }
+    }
+    if (crew->helpers == 0) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += WALK_POLL_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    if (pthread_cond_timedwait(&crew->cv, &crew->mu, &ts) != 0 && peer_gone(crew->conn)) {
+        crew->stop = 1;
+        pthread_cond_broadcast(&crew->cv);
+    }
+}
+
+static size_t devino_slot(const struct devino_key *t, size_t cap, dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 29)) * 0x9E3779B97F4A7C15ULL;
+    size_t i = (size_t)(h >> 32) & (cap - 1);
+    while (t[i].used && (t[i].dev != dev || t[i].ino != ino)) i = (i + 1) & (cap - 1);
+    return i;
+}
+
+/* 1 if (dev, ino) is already in s, 0 after adding it, -1 out of memory */
+static int devino_add(struct devino_set *s, dev_t dev, ino_t ino) {
+    if (2 * (s->n + 1) > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        struct devino_key *t = calloc(cap, sizeof(*t));
+        if (!t) return -1;
+        for (size_t i = 0; i < s->cap; i++)
+            if (s->t[i].used) t[devino_slot(t, cap, s->t[i].dev, s->t[i].ino)] = s->t[i];
+        free(s->t);
+        s->t = t;
+        s->cap = cap;
+    }
+    size_t i = devino_slot(s->t, s->cap, dev, ino);
+    if (s->t[i].used) return 1;
+    s->t[i].used = 1;
+    s->t[i].dev = dev;
+    s->t[i].ino = ino;
+    s->n++;
+    return 0;
+}
+
+/* ---------- Content search ----------
+ * /api/grep is a tree walk that queues files next to directories. Each file is read
+ * whole into its worker's buffer and scanned for every pattern with the name matchers'
+ * substring finder. read() is used rather than mmap: a file truncated under a mapping
+ * would raise SIGBUS. Matching lines go out as NDJSON, with optional context. Files
+ * over the size cap, and files with a NUL in their first GREP_SNIFF bytes (binary),
+ * are skipped. */
+
+#define GREP_PATTERNS 8         /* q=, include= and exclude= may each be repeated */
+#define GREP_DEFAULT_MAX_SIZE (16LL * 1024 * 1024)
+#define GREP_MAX_SIZE (256LL * 1024 * 1024)
+#define GREP_CONTEXT_MAX 10
+#define GREP_SNIFF 8192
+#define GREP_TEXT_MAX 256       /* longer lines are cut to a window around the match */
+
+struct grep_opts {
+    struct name_matcher pat[GREP_PATTERNS];     /* a line matches if any of them does */
+    int npat;
+    struct name_matcher include[GREP_PATTERNS]; /* file names; none = every file */
+    struct name_matcher exclude[GREP_PATTERNS]; /* file and directory names */
+    int ninclude, nexclude;
+    long long max_size;
+    int context;                /* lines before and after each match */
+    int binary;                 /* search files that look binary too */
+};
+
+/* Whether a walk should look at the entry called name */
+static int grep_wants(const struct grep_opts *g, const char *name, int isdir) {
+    for (int i = 0; i < g->nexclude; i++) if (name_match(&g->exclude[i], name)) return 0;
+    if (isdir || !g->ninclude) return 1;
+    for (int i = 0; i < g->ninclude; i++) if (name_match(&g->include[i], name)) return 1;
+    return 0;
+}
+
+static long long count_newlines(const unsigned char *s, size_t n) {
+    long long c = 0;
+    for (const unsigned char *end = s + n; (s = memchr(s, '\n', (size_t)(end - s))) != NULL; s++) c++;
+    return c;
+}
+
+/* s[0..n) as a JSON string, without a trailing CR and cut to GREP_TEXT_MAX bytes */
+static void grep_quote(struct ostream *os, const unsigned char *s, size_t n) {
+    if (n && s[n - 1] == '\r') n--;
+    if (n > GREP_TEXT_MAX) n = GREP_TEXT_MAX;
+    os_write(os, "\"", 1);
+    json_escape((const char *)s, n, os_put, os);
+    os_write(os, "\"", 1);
+}
+
+/* One record: {"path":..,"line":N,"col":N,"text":..[,"at":N][,"before":[..],"after":[..]]}.
+ * col is the match's byte offset in the line; "at" is where text starts when the line
+ * had to be cut. */
+static void grep_emit(const struct grep_opts *g, struct ostream *os, const char *reqpath, const unsigned char *buf,
+                      size_t n, long long line, size_t ls, size_t le, size_t at) {
+    os_write(os, "{\"path\":", 8);
+    os_json_str(os, reqpath);
+    os_write(os, ",\"line\":", 8);
+    os_int(os, line);
+    os_write(os, ",\"col\":", 7);
+    os_int(os, (long long)(at - ls));
+    size_t from = 0, len = le - ls;
+    if (len && buf[le - 1] == '\r') len--;
+    if (len > GREP_TEXT_MAX) {
+        from = at - ls > GREP_TEXT_MAX / 4 ? at - ls - GREP_TEXT_MAX / 4 : 0;
+        if (from > len - GREP_TEXT_MAX) from = len - GREP_TEXT_MAX;
+    }
+    os_write(os, ",\"text\":", 8);
+    grep_quote(os, buf + ls + from, len - from);
+    if (from) {
+        os_write(os, ",\"at\":", 6);
+        os_int(os, (long long)from);
+    }
+    if (g->context) {
+        size_t start[GREP_CONTEXT_MAX], end[GREP_CONTEXT_MAX];
+        int k = 0;
+        for (size_t s = ls; k < g->context && s > 0; k++) {
+            end[k] = s - 1;
+            for (s = end[k]; s > 0 && buf[s - 1] != '\n'; s--) {}
+            start[k] = s;
+        }
+        os_write(os, ",\"before\":[", 11);
+        while (k-- > 0) {
+            grep_quote(os, buf + start[k], end[k] - start[k]);
+            if (k) os_write(os, ",", 1);
+        }
+        os_write(os, "],\"after\":[", 11);
+        size_t s = le + 1;
+        for (int i = 0; i < g->context && s < n; i++) {
+            const unsigned char *nl = memchr(buf + s, '\n', n - s);
+            size_t e = nl ? (size_t)(nl - buf) : n;
+            if (i) os_write(os, ",", 1);
+            grep_quote(os, buf + s, e - s);
+            s = e + 1;
+        }
+        os_write(os, "]", 1);
+    }
+    os_write(os, "}\n", 2);
+}
+
+/* Write a record for each line of buf[0..n) that matches, up to cap of them; the count */
+static long long grep_buffer(const struct grep_opts *g, const char *reqpath, const unsigned char *buf, size_t n,
+                             struct ostream *os, long long cap) {
+    size_t next[GREP_PATTERNS];     /* each pattern's first match at or after pos */
+    size_t pos = 0, counted = 0;
+    long long line = 1, found = 0;
+    for (int k = 0; k < g->npat; k++) next[k] = substr_find(&g->pat[k], buf, n);
+    while (found < cap) {
+        size_t at = SUBSTR_NONE;
+        for (int k = 0; k < g->npat; k++) {
+            if (next[k] != SUBSTR_NONE && next[k] < pos) {
+                size_t f = substr_find(&g->pat[k], buf + pos, n - pos);
+                next[k] = f == SUBSTR_NONE ? f : pos + f;
+            }
+            if (next[k] < at) at = next[k];
+        }
+        if (at == SUBSTR_NONE) break;
+        size_t ls = at;
+        while (ls > pos && buf[ls - 1] != '\n') ls--;
+        const unsigned char *nl = memchr(buf + at, '\n', n - at);
+        size_t le = nl ? (size_t)(nl - buf) : n;
+        line += count_newlines(buf + counted, ls - counted);
+        counted = ls;
+        grep_emit(g, os, reqpath, buf, n, line, ls, le, at);
+        found++;
+        if (!nl) break;
+        pos = le + 1;
+    }
+    return found;
+}
+
+/* ---------- File hashes ----------
+ * /api/hash: any of SHA-256, XXH3-64, CRC32C and MD5 over whole files, all of them from
+ * one read of the file. Results go into the hash cache, so asking again for an unchanged
+ * file (or for a digest already computed for it) reads nothing. */
+
+#define HASH_READ (256 * 1024)
+
+/* DIGEST_* bits from a comma-separated alg= list; -1 when a name is unknown */
+static int hash_algs_parse(const char *v) {
+    int algs = 0;
+    while (*v) {
+        size_t n = strcspn(v, ",");
+        if (n == 6 && !strncasecmp(v, "sha256", 6)) algs |= DIGEST_SHA256;
+        else if (n == 7 && !strncasecmp(v, "sha-256", 7)) algs |= DIGEST_SHA256;
+        else if (n == 4 && !strncasecmp(v, "xxh3", 4)) algs |= DIGEST_XXH3;
+        else if (n == 6 && !strncasecmp(v, "crc32c", 6)) algs |= DIGEST_CRC32C;
+        else if (n == 3 && !strncasecmp(v, "md5", 3)) algs |= DIGEST_MD5;
+        else if (n) return -1;
+        v += n + (v[n] == ',');
+    }
+    return algs;
+}
+
+/* The algs (DIGEST_*) of the regular file open as fd, st its fstat, into *out: whatever
+ * the cache holds (unless fresh) is taken from it and the rest is computed in one pass
+ * through buf (HASH_READ bytes), *read_bytes being what that took. 1 when everything
+ * came from the cache, 0 when something was computed, -1 with errno when the file
+ * cannot be read. */
+static int hash_fd(int fd, const struct stat *st, int algs, int fresh, uint8_t *buf, struct hc_sums *out,
+                   long long *read_bytes) {
+    struct hc_id id;
+    hc_id_stat(&id, st);
+    int have = fresh ? 0 : hcache_get(&id, out);
+    int need = algs;
+    if (have & HC_SHA256) need &= ~DIGEST_SHA256;
+    if (have & HC_CRC32C) need &= ~DIGEST_CRC32C;
+    if (have & HC_MD5) need &= ~DIGEST_MD5;
+    if (have & HC_XXH3) need &= ~DIGEST_XXH3;
+    *read_bytes = 0;
+    if (!need) return 1;
+    struct digest_ctx dc;
+    digest_init(&dc, need);
+    for (;;) {
+        ssize_t r = read(fd, buf, HASH_READ);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        digest_update(&dc, buf, (size_t)r);
+        *read_bytes += r;
+    }
+    digest_finish(&dc);
+    int got = 0;
+    if (need & DIGEST_SHA256) { memcpy(out->sha256, dc.sha256, 32); got |= HC_SHA256; }
+    if (need & DIGEST_CRC32C) { out->crc32c = dc.crc; got |= HC_CRC32C; }
+    if (need & DIGEST_MD5) { memcpy(out->md5, dc.md5, 16); got |= HC_MD5; }
+    if (need & DIGEST_XXH3) { out->xxh3 = dc.xxh3; got |= HC_XXH3; }
+    /* a file written to while it was read has no one hash worth keeping */
+    struct stat after;
+    struct hc_id now;
+    if (fstat(fd, &after) == 0) {
+        hc_id_stat(&now, &after);
+        if (hc_id_equal(&id, &now)) hcache_put(&id, got, out);
+    }
+    return 0;
+}
+
+static void hash_hex(struct ostream *os, const char *key, const uint8_t *p, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    char h[2 * 32];
+    for (size_t k = 0; k < n; k++) { h[2 * k] = hex[p[k] >> 4]; h[2 * k + 1] = hex[p[k] & 15]; }
+    os_write(os, ",\"", 2);
+    os_write(os, key, strlen(key));
+    os_write(os, "\":\"", 3);
+    os_write(os, h, 2 * n);
+    os_write(os, "\"", 1);
+}
+
+/* {"path":..,"size":N,"sha256":"..","xxh3":"..","crc32c":"..","md5":"..","cached":bool}
+ * with the algs asked for, digests in lowercase hex (XXH3 and CRC32C big-endian, as
+ * xxhsum and most tools print them) */
+static void hash_json(struct ostream *os, const char *reqpath, long long size, int algs,
+                      const struct hc_sums *sums, int cached) {
+    os_write(os, "{\"path\":", 8);
+    os_json_str(os, reqpath);
+    os_write(os, ",\"size\":", 8);
+    os_int(os, size);
+    if (algs & DIGEST_SHA256) hash_hex(os, "sha256", sums->sha256, 32);
+    if (algs & DIGEST_XXH3) {
+        uint8_t be[8];
+        for (int k = 0; k < 8; k++) be[k] = (uint8_t)(sums->xxh3 >> (56 - 8 * k));
+        hash_hex(os, "xxh3", be, 8);
+    }
+    if (algs & DIGEST_CRC32C) {
+        uint8_t be[4] = { sums->crc32c >> 24, sums->crc32c >> 16, sums->crc32c >> 8, sums->crc32c };
+        hash_hex(os, "crc32c", be, 4);
+    }
+    if (algs & DIGEST_MD5) hash_hex(os, "md5", sums->md5, 16);
+    os_write(os, cached ? ",\"cached\":true}\n" : ",\"cached\":false}\n", cached ? 16 : 17);
+}
+
+/* ---------- Tree walk ----------
+ * /api/tree streams a whole subtree as NDJSON: one listing entry per line, path included,
+ * so a client can build a picker or a sync plan from a single response. Each walker
+ * encodes its entries a batch at a time and queues them; only the connection thread
+ * writes to the socket. A directory is pushed only after the line naming it has been
+ * queued, so a directory's line always comes before its contents. A grep walk queues
+ * files as well and sends only their matching lines; a hash walk sends a line of
+ * digests per file. */
+
+#define TREE_MAX_ENTRIES 1000000            /* per request; limit= can only lower it */
+#define SEARCH_DEFAULT_LIMIT 1000           /* /api/search results unless limit= says otherwise */
+#define TREE_QUEUE_MAX (4 * 1024 * 1024)    /* encoded output waiting for the socket */
+
+struct tree_dir {               /* a directory waiting to be read */
+    struct tree_dir *next;
+    int depth;                  /* 1 for the requested directory */
+    int file;                   /* a file to grep or hash rather than a directory */
+    char path[];                /* request path */
+};
+
+struct tree_chunk {             /* encoded lines, sent in queue order */
+    struct tree_chunk *next;
+    char *p;
+    size_t len;
+};
+
+struct tree_walk {
+    struct walk_crew crew;      /* first: helpers get the walk from their crew */
+    const struct list_opts *lo;
+    const struct grep_opts *grep;
+    int hash;                   /* DIGEST_* for a hash walk */
+    int fresh;                  /* hash: ignore the hash cache */
+    int max_depth;              /* 0 = no limit */
+    long long limit;
+    struct tree_dir *dirs;      /* LIFO: depth first keeps the pending set small */
+    struct tree_chunk *out_head, *out_tail;
+    size_t out_bytes;
+    long long entries, dirs_read;
+    long long scanned;          /* names looked at, when searching */
+    long long files, bytes;     /* grep, hash: files searched and their size */
+    long long cached;           /* hash: files answered from the hash cache */
+    long long skipped_binary, skipped_size, unreadable;
+    int truncated;              /* stopped at the limit rather than cancelled */
+    struct ostream *conn_os;
+    struct devino_set seen;     /* directories entered */
+};
+
+/* One thread's encoder: lines go into sb through an in-memory ostream */
+struct tree_worker {
+    struct ostream os;
+    struct strbuf sb;
+    struct list_batch *b;
+    char *buf;                  /* grep: the file being searched; hash: read buffer */
+    size_t cap;
+    int writer;                 /* the connection thread: drains instead of waiting */
+};
+
+/* Send everything queued so far (connection thread only) */
+static void tree_drain(struct tree_walk *tw) {
+    pthread_mutex_lock(&tw->crew.mu);
+    struct tree_chunk *c = tw->out_head;
+    tw->out_head = tw->out_tail = NULL;
+    pthread_mutex_unlock(&tw->crew.mu);
+    size_t sent = 0;
+    while (c) {
+        struct tree_chunk *next = c->next;
+        os_write(tw->conn_os, c->p, c->len);
+        sent += c->len;
+        free(c->p);
+        free(c);
+        c = next;
+    }
+    os_flush(tw->conn_os);
+    pthread_mutex_lock(&tw->crew.mu);
+    tw->out_bytes -= sent;
+    if (tw->conn_os->failed) tw->crew.stop = 1;
+    pthread_cond_broadcast(&tw->crew.cv);
+    pthread_mutex_unlock(&tw->crew.mu);
+}
+
+/* Queue what w has encoded, then make kids (subdirectories named in it) available to
+ * walk. Helpers wait here while the socket is behind. */
+static void tree_put(struct tree_walk *tw, struct tree_worker *w, struct tree_dir *kids) {
+    os_flush(&w->os);
+    struct tree_chunk *c = w->sb.len && !w->sb.oom ? malloc(sizeof(*c)) : NULL;
+    pthread_mutex_lock(&tw->crew.mu);
+    if (w->sb.oom || (w->sb.len && !c)) tw->crew.stop = 1;
+    if (c) {
+        c->next = NULL;
+        c->p = w->sb.p;
+        c->len = w->sb.len;
+        if (tw->out_tail) tw->out_tail->next = c; else tw->out_head = c;
+        tw->out_tail = c;
+        tw->out_bytes += c->len;
+        memset(&w->sb, 0, sizeof(w->sb));
+    }
+    w->sb.len = 0;
+    w->sb.oom = 0;
+    while (kids) {
+        struct tree_dir *next = kids->next;
+        if (tw->crew.stop) { free(kids); kids = next; continue; }
+        kids->next = tw->dirs;
+        tw->dirs = kids;
+        tw->crew.queued++;
+        kids = next;
+    }
+    crew_grow(&tw->crew);
+    pthread_cond_broadcast(&tw->crew.cv);
+    if (!w->writer)
+        while (tw->out_bytes > TREE_QUEUE_MAX && !tw->crew.stop) pthread_cond_wait(&tw->crew.cv, &tw->crew.mu);
+    pthread_mutex_unlock(&tw->crew.mu);
+    if (w->writer) tree_drain(tw);
+}
+
+/* A line for a directory that is not walked: {"path":"..","error"|"skip":".."} */
+static void tree_note(struct ostream *os, const char *reqpath, const char *key, const char *msg) {
+    os_write(os, "{\"path\":", 8);
+    os_json_str(os, reqpath);
+    os_write(os, ",\"", 2);
+    os_write(os, key, strlen(key));
+    os_write(os, "\":", 2);
+    os_json_str(os, msg);
+    os_write(os, "}\n", 2);
+}
+
+/* A work item for name inside the directory at path (plen bytes, 0 for the root) */
+static struct tree_dir *tree_item(const char *path, size_t plen, const char *name, int depth, int file) {
+    size_t nl = strlen(name);
+    if (plen + 1 + nl >= PATH_MAX) return NULL;
+    struct tree_dir *k = malloc(sizeof(*k) + plen + 1 + nl + 1);
+    if (!k) return NULL;
+    memcpy(k->path, path, plen);
+    k->path[plen] = '/';
+    memcpy(k->path + plen + 1, name, nl + 1);
+    k->depth = depth;
+    k->file = file;
+    return k;
+}
+
+/* Search file d for a grep walk and queue its matching lines. Whatever is left of the
+ * limit is read before the scan and claimed after it, so concurrent files can find more
+ * than that between them; the surplus is cut off here. */
+static void grep_file(struct tree_walk *tw, const struct tree_dir *d, struct tree_worker *w) {
+    const struct grep_opts *g = tw->grep;
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, d->path);
+    pthread_mutex_lock(&tw->crew.mu);
+    long long room = tw->crew.stop ? 0 : tw->limit - tw->entries;
+    pthread_mutex_unlock(&tw->crew.mu);
+    if (room <= 0) return;
+    enum { GREP_OK, GREP_SPECIAL, GREP_BINARY, GREP_TOO_BIG, GREP_UNREADABLE } skip = GREP_OK;
+    struct stat st;
+    size_t n = 0;
+    int fd = open(fs, O_RDONLY | O_CLOEXEC | O_NONBLOCK);  /* a FIFO must not hold up the walk */
+    if (fd < 0 || fstat(fd, &st) != 0) skip = GREP_UNREADABLE;
+    else if (!S_ISREG(st.st_mode)) skip = GREP_SPECIAL;
+    else if (st.st_size > g->max_size) skip = GREP_TOO_BIG;
+    else {
+        size_t want = (size_t)st.st_size;
+        if (want > w->cap || !w->buf) {
+            size_t cap = (want | 0xFFFF) + 1;
+            char *nb = realloc(w->buf, cap);
+            if (nb) { w->buf = nb; w->cap = cap; }
+        }
+        if (want > w->cap || !w->buf) skip = GREP_UNREADABLE;
+        while (!skip && n < want) {
+            ssize_t r = read(fd, w->buf + n, want - n);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) skip = GREP_UNREADABLE;
+            if (r <= 0) break;
+            n += (size_t)r;
+        }
+        if (!skip && !g->binary && memchr(w->buf, 0, n < GREP_SNIFF ? n : GREP_SNIFF)) skip = GREP_BINARY;
+    }
+    if (fd >= 0) close(fd);
+    long long found = skip ? 0 : grep_buffer(g, d->path, (const unsigned char *)w->buf, n, &w->os, room + 1);
+    os_flush(&w->os);
+    pthread_mutex_lock(&tw->crew.mu);
+    long long allowed = tw->crew.stop ? 0 : tw->limit - tw->entries;
+    if (found > allowed && !w->sb.oom) {
+        size_t cut = 0;
+        for (long long k = 0; k < allowed; k++) cut = (size_t)((char *)memchr(w->sb.p + cut, '\n', w->sb.len - cut) - w->sb.p) + 1;
+        w->sb.len = cut;
+        if (!tw->crew.stop) tw->truncated = tw->crew.stop = 1;
+        found = allowed;
+    }
+    tw->entries += found;
+    switch (skip) {
+    case GREP_OK: tw->files++; tw->bytes += (long long)n; break;
+    case GREP_BINARY: tw->skipped_binary++; break;
+    case GREP_TOO_BIG: tw->skipped_size++; break;
+    case GREP_UNREADABLE: tw->unreadable++; break;
+    case GREP_SPECIAL: break;
+    }
+    pthread_mutex_unlock(&tw->crew.mu);
+    tree_put(tw, w, NULL);
+}
+
+/* Hash file d for a hash walk and queue its line. Files that turn out not to be regular
+ * files are left out; limit= counts the files hashed. */
+static void hash_file(struct tree_walk *tw, const struct tree_dir *d, struct tree_worker *w) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, d->path);
+    pthread_mutex_lock(&tw->crew.mu);
+    int halt = tw->crew.stop;
+    if (!halt && tw->entries >= tw->limit) tw->truncated = tw->crew.stop = halt = 1;
+    if (!halt) tw->entries++;
+    pthread_mutex_unlock(&tw->crew.mu);
+    if (halt) return;
+    if (w->cap < HASH_READ || !w->buf) {
+        char *nb = realloc(w->buf, HASH_READ);
+        if (nb) { w->buf = nb; w->cap = HASH_READ; }
+    }
+    struct stat st;
+    struct hc_sums sums;
+    long long n = 0;
+    int rc = -1, special = 0;
+    int fd = open(fs, O_RDONLY | O_CLOEXEC | O_NONBLOCK);  /* a FIFO must not hold up the walk */
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        if (!S_ISREG(st.st_mode)) special = 1;
+        else if (w->cap < HASH_READ) errno = ENOMEM;
+        else rc = hash_fd(fd, &st, tw->hash, tw->fresh, (uint8_t *)w->buf, &sums, &n);
+    }
+    if (rc < 0 && !special) tree_note(&w->os, d->path, "error", strerror(errno));
+    else if (rc >= 0) hash_json(&w->os, d->path, (long long)st.st_size, tw->hash, &sums, rc);
+    if (fd >= 0) close(fd);
+    pthread_mutex_lock(&tw->crew.mu);
+    if (special) tw->entries--;
+    else if (rc < 0) tw->unreadable++;
+    else {
+        tw->files++;
+        tw->bytes += n;
+        tw->cached += rc;
+    }
+    pthread_mutex_unlock(&tw->crew.mu);
+    tree_put(tw, w, NULL);
+}
+
+/* Symlinks are listed (as their targets, like /api/list) but never entered. The filename
+ * index does not follow them either, so a search answers the same from both, and no
+ * directory is reached by two paths with thread timing picking the one reported. */
+static int tree_is_link(int dirfd, const struct list_item *li) {
+    struct stat st;
+    if (li->dtype != DT_UNKNOWN) return li->dtype == DT_LNK;
+    return fstatat(dirfd, li->name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+}
+
+/* Read directory d and queue its entries (and its subdirectories for walking). A grep
+ * or hash walk queues the files it wants instead of sending entries. */
+static void tree_walk_dir(struct tree_walk *tw, const struct tree_dir *d, struct tree_worker *w) {
+    if (d->file) {
+        if (tw->hash) hash_file(tw, d, w);
+        else grep_file(tw, d, w);
+        return;
+    }
+    const struct list_opts *lo = tw->lo;
+    const struct grep_opts *g = tw->grep;
+    int files = g || tw->hash;  /* files are queued rather than listed */
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, d->path);
+    struct dir_iter it;
+    long long t0 = mono_ns();
+    if (dir_iter_open(&it, fs, lo->need) != 0) {
+        iopool_observe(mono_ns() - t0, 1);
+        tree_note(&w->os, d->path, "error", strerror(errno));
+        tree_put(tw, w, NULL);
+        return;
+    }
+    iopool_observe(mono_ns() - t0, 1);
+    /* links are not entered, but a bind mount or a second hard link to a directory
+     * (HFS+) would still be walked twice, or loop */
+    struct stat st;
+    int again = 0;
+    pthread_mutex_lock(&tw->crew.mu);
+    if (fstat(it.fd, &st) == 0) again = devino_add(&tw->seen, st.st_dev, st.st_ino);
+    if (again < 0) tw->crew.stop = 1;
+    if (!again) tw->dirs_read++;
+    pthread_mutex_unlock(&tw->crew.mu);
+    if (again) {
+        dir_iter_close(&it);
+        if (again > 0) tree_note(&w->os, d->path, "skip", "seen");
+        tree_put(tw, w, NULL);
+        return;
+    }
+    w->b->dirfs = fs;
+    size_t plen = strcmp(d->path, "/") == 0 ? 0 : strlen(d->path);
+    int descend = tw->max_depth == 0 || d->depth < tw->max_depth;
+    while (list_fill(&it, lo, w->b)) {
+        struct list_batch *b = w->b;
+        long long shown = 0;
+        for (int i = 0; !files && i < b->n; i++) shown += !b->item[i].hide;
+        pthread_mutex_lock(&tw->crew.mu);
+        int halt = tw->crew.stop;
+        long long left = halt ? 0 : shown;
+        if (tw->entries + left > tw->limit) { left = tw->limit - tw->entries; tw->truncated = tw->crew.stop = halt = 1; }
+        tw->entries += left;
+        tw->scanned += b->n;
+        pthread_mutex_unlock(&tw->crew.mu);
+        struct tree_dir *kids = NULL;
+        for (int i = 0; i < b->n; i++) {
+            const struct list_item *li = &b->item[i];
+            if (files) {
+                if (halt) break;
+                if (li->broken || (g ? !grep_wants(g, li->name, li->isdir) : !li->isdir && li->special)) continue;
+            } else if (!li->hide) {
+                if (!left--) break;
+                list_emit(&w->os, d->path, li, lo, 1);
+                os_write(&w->os, "\n", 1);
+            }
+            if (li->broken || (li->isdir ? !descend || tree_is_link(it.fd, li) : !files)) continue;
+            struct tree_dir *k = tree_item(d->path, plen, li->name, d->depth + 1, !li->isdir);
+            if (!k) continue;
+            k->next = kids;
+            kids = k;
+        }
+        tree_put(tw, w, kids);
+        if (halt) break;
+    }
+    w->b->dirfs = NULL;
+    dir_iter_close(&it);
+}
+
+static int tree_worker_init(struct tree_worker *w, int writer) {
+    memset(w, 0, sizeof(*w));
+    w->writer = writer;
+    os_init(&w->os, -1, 0);
+    w->os.tee = &w->sb;
+    w->os.tee_max = (size_t)-1;
+    w->b = calloc(1, sizeof(*w->b));
+    return w->b ? 0 : -1;
+}
+
+static void tree_worker_free(struct tree_worker *w) {
+    list_batch_free(w->b);
+    free(w->buf);
+    free(w->sb.p);
+}
+
+/* 1 with the next directory to read in *d, 0 when there is none (or the walk stopped) */
+static int tree_next(struct tree_walk *tw, struct tree_dir **d) {
+    pthread_mutex_lock(&tw->crew.mu);
+    *d = tw->crew.stop ? NULL : tw->dirs;
+    if (*d) { tw->dirs = (*d)->next; tw->crew.queued--; }
+    pthread_mutex_unlock(&tw->crew.mu);
+    return *d != NULL;
+}
+
+static void tree_help(struct walk_crew *crew) {
+    struct tree_walk *tw = (struct tree_walk *)crew;
+    struct tree_worker w;
+    struct tree_dir *d;
+    if (tree_worker_init(&w, 0) == 0)
+        while (tree_next(tw, &d)) { tree_walk_dir(tw, d, &w); free(d); }
+    tree_worker_free(&w);
+}
+
+/* /api/tree?path=...[&depth=N][&limit=N][&fields=...] -> NDJSON, one listing entry per
+ * line (the /api/list object, path included), in no particular order across directories
+ * except that a directory's own line comes first. Symlinks are listed but not entered.
+ * Other lines:
+ *   {"path":..,"error":".."}     a directory that could not be read
+ *   {"path":..,"skip":"seen"}    a directory already walked (reached again through a bind mount)
+ *   {"done":true,"entries":N,"dirs":N,"truncated":bool}   last line of a complete walk
+ * depth=1 lists just path, like /api/list; the default is unlimited. Stops early when
+ * the client disconnects.
+ * /api/search is the same walk with lo->match set: only matching entries are sent and
+ * limit= counts those, every directory is still descended, and the done line adds
+ * "scanned":N, the number of names tested.
+ * /api/grep is the walk with grep set: reqpath may also be a single file, the lines
+ * are grep_emit's records with limit= counting them, and the done line is
+ *   {"done":true,"matches":N,"files":N,"bytes":N,"dirs":N,"skipped_binary":N,
+ *    "skipped_size":N,"unreadable":N,"truncated":bool}
+ * /api/hash on a directory is the walk with hash set (DIGEST_*): a hash_json line per
+ * regular file, {"path":..,"error":..} for one that cannot be read, and the done line
+ *   {"done":true,"files":N,"bytes":N,"cached":N,"dirs":N,"unreadable":N,"truncated":bool}
+ * where bytes is what had to be read and cached the files that needed no reading. */
+static void api_tree(int conn, const char *reqpath, const struct list_opts *lo, const struct grep_opts *grep,
+                     int hash, int fresh, int max_depth, long long limit) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) != 0 || !(S_ISDIR(st.st_mode) || (grep && S_ISREG(st.st_mode)))) {
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    struct tree_walk *tw = calloc(1, sizeof(*tw));
+    struct ostream *os = malloc(sizeof(*os));
+    struct tree_worker *w = malloc(sizeof(*w));
+    size_t rl = strlen(reqpath);
+    struct tree_dir *root = malloc(sizeof(*root) + rl + 1);
+    if (!tw || !os || !w || !root || tree_worker_init(w, 1) != 0) {
+        if (w && w->b) tree_worker_free(w);
+        free(tw); free(os); free(w); free(root);
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    crew_init(&tw->crew, conn, tree_help);
+    tw->lo = lo;
+    tw->grep = grep;
+    tw->hash = hash;
+    tw->fresh = fresh;
+    tw->crew.cpu = grep || hash;
+    tw->max_depth = max_depth;
+    tw->limit = limit;
+    tw->conn_os = os;
+    memcpy(root->path, reqpath, rl + 1);
+    root->depth = 1;
+    root->file = !S_ISDIR(st.st_mode);
+    root->next = NULL;
+    tw->dirs = root;
+    tw->crew.queued = 1;
+
+    send_headers_chunked(conn, 200, "OK", "application/x-ndjson", NULL);
+    os_init(os, conn, 1);
+    pthread_mutex_lock(&tw->crew.mu);
+    for (;;) {
+        crew_grow(&tw->crew);
+        if (tw->out_head) {
+            pthread_mutex_unlock(&tw->crew.mu);
+            tree_drain(tw);
+            pthread_mutex_lock(&tw->crew.mu);
+            continue;
+        }
+        struct tree_dir *d = tw->crew.stop ? NULL : tw->dirs;
+        if (d) {
+            tw->dirs = d->next;
+            tw->crew.queued--;
+            pthread_mutex_unlock(&tw->crew.mu);
+            tree_walk_dir(tw, d, w);
+            free(d);
+            pthread_mutex_lock(&tw->crew.mu);
+            continue;
+        }
+        if (tw->crew.helpers == 0) break;
+        crew_wait(&tw->crew);
+    }
+    pthread_mutex_unlock(&tw->crew.mu);
+
+    while (tw->dirs) {
+        struct tree_dir *d = tw->dirs;
+        tw->dirs = d->next;
+        free(d);
+    }
+    if ((!tw->crew.stop || tw->truncated) && hash) {
+        os_write(os, "{\"done\":true,\"files\":", 21);
+        os_int(os, tw->files);
+        os_write(os, ",\"bytes\":", 9);
+        os_int(os, tw->bytes);
+        os_write(os, ",\"cached\":", 10);
+        os_int(os, tw->cached);
+        os_write(os, ",\"dirs\":", 8);
+        os_int(os, tw->dirs_read);
+        os_write(os, ",\"unreadable\":", 14);
+        os_int(os, tw->unreadable);
+        os_write(os, tw->truncated ? ",\"truncated\":true}\n" : ",\"truncated\":false}\n", tw->truncated ? 19 : 20);
+        os_end(os);
+    } else if ((!tw->crew.stop || tw->truncated) && grep) {
+        os_write(os, "{\"done\":true,\"matches\":", 23);
+        os_int(os, tw->entries);
+        os_write(os, ",\"files\":", 9);
+        os_int(os, tw->files);
+        os_write(os, ",\"bytes\":", 9);
+        os_int(os, tw->bytes);
+        os_write(os, ",\"dirs\":", 8);
+        os_int(os, tw->dirs_read);
+        os_write(os, ",\"skipped_binary\":", 18);
+        os_int(os, tw->skipped_binary);
+        os_write(os, ",\"skipped_size\":", 16);
+        os_int(os, tw->skipped_size);
+        os_write(os, ",\"unreadable\":", 14);
+        os_int(os, tw->unreadable);
+        os_write(os, tw->truncated ? ",\"truncated\":true}\n" : ",\"truncated\":false}\n", tw->truncated ? 19 : 20);
+        os_end(os);
+    } else if (!tw->crew.stop || tw->truncated) {
+        os_write(os, "{\"done\":true,\"entries\":", 23);
+        os_int(os, tw->entries);
+        os_write(os, ",\"dirs\":", 8);
+        os_int(os, tw->dirs_read);
+        if (lo->match) {
+            os_write(os, ",\"scanned\":", 11);
+            os_int(os, tw->scanned);
+        }
+        os_write(os, tw->truncated ? ",\"truncated\":true}\n" : ",\"truncated\":false}\n", tw->truncated ? 19 : 20);
+        os_end(os);
+    }
+    crew_destroy(&tw->crew);
+    tree_worker_free(w);
+    free(tw->seen.t);
+    free(tw);
+    free(w);
+    free(os);
+}
+
+/* /api/search?q= answered from the filename index: the same lines as the walk, each hit
+ * stat'ed as it is sent (hits removed since the index saw them are left out), then
+ * {"done":true,"entries":N,"candidates":N,"truncated":bool,"index":true}. Neither the
+ * index nor the walk follows symlinked directories, so both find the same entries.
+ * -1 with nothing sent when the index cannot answer for reqpath. */
+static int api_search_index(int conn, const char *reqpath, const struct list_opts *lo, long long limit) {
+    char fs[PATH_MAX], rel[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    const char *r = ix_rel(fs);
+    if (!r) return -1;
+    snprintf(rel, sizeof(rel), "%s", r);
+    struct strbuf hits = {0};
+    long long found, candidates, sent = 0;
+    int truncated;
+    if (index_search(lo->match, rel, limit, &hits, &found, &candidates, &truncated) != 0 || hits.oom) {
+        free(hits.p);
+        return -1;
+    }
+    struct ostream os;
+    send_headers_chunked(conn, 200, "OK", "application/x-ndjson", NULL);
+    os_init(&os, conn, 1);
+    for (size_t at = 0, next; at < hits.len; at = next) {
+        char *path = hits.p + at, *slash = strrchr(path, '/');
+        next = at + strlen(path) + 1;
+        struct list_item li;
+        join_path(fs, sizeof(fs), g_root, path);
+        if (list_item_at(&li, fs, lo) != 0) continue;
+        if (li.broken) { free(li.target); continue; }
+        li.name = slash + 1;
+        *slash = '\0';
+        list_emit(&os, slash == path ? "/" : path, &li, lo, 1);
+        os_write(&os, "\n", 1);
+        free(li.target);
+        sent++;
+    }
+    os_write(&os, "{\"done\":true,\"entries\":", 23);
+    os_int(&os, sent);
+    os_write(&os, ",\"candidates\":", 14);
+    os_int(&os, candidates);
+    os_write(&os, truncated ? ",\"truncated\":true,\"index\":true}\n" : ",\"truncated\":false,\"index\":true}\n",
+             truncated ? 32 : 33);
+    os_end(&os);
+    free(hits.p);
+    return 0;
+}
+
+/* /api/hash?path=...[&alg=sha256,xxh3,crc32c,md5][&fresh=1][&depth=N][&limit=N]
+ * For a file: its hash_json object. For a directory: the hash walk of api_tree, files
+ * hashed in parallel and streamed as NDJSON. fresh=1 recomputes rather than trusting
+ * the hash cache (the results still replace what it holds). */
+static void api_hash(int conn, const char *reqpath, int algs, int fresh, int max_depth, long long limit) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) == 0 && S_ISDIR(st.st_mode)) {
+        struct list_opts lo;
+        memset(&lo, 0, sizeof(lo));
+        lo.need = LF_TYPE;
+        api_tree(conn, reqpath, &lo, NULL, algs, fresh, max_depth, limit);
+        return;
+    }
+    int fd = open(fs, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    uint8_t *buf = malloc(HASH_READ);
+    struct ostream *os = malloc(sizeof(*os));
+    struct hc_sums sums;
+    long long n = 0;
+    int rc = buf && os ? hash_fd(fd, &st, algs, fresh, buf, &sums, &n) : -1;
+    if (rc < 0) {
+        const char *err = buf && os ? strerror(errno) : "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+    } else {
+        send_headers_chunked(conn, 200, "OK", "application/json", NULL);
+        os_init(os, conn, 1);
+        hash_json(os, reqpath, (long long)st.st_size, algs, &sums, rc);
+        os_end(os);
+    }
+    close(fd);
+    free(buf);
+    free(os);
+}
+
+/* One change for /api/events. A create or modify is sent with the entry as a listing
+ * would show it now; one whose entry has vanished since goes out as a delete. */
+static void ev_send(struct ostream *os, const char *reqpath, const char *dirfs, const struct ev_pending *p,
+                    const struct list_opts *lo) {
+    char fs[PATH_MAX];
+    struct list_item li;
+    int fit = snprintf(fs, sizeof(fs), "%s/%s", strcmp(dirfs, "/") ? dirfs : "", p->name) < (int)sizeof(fs);
+    if (fit && p->kind != EV_DELETE && list_item_at(&li, fs, lo) == 0) {
+        os_write(os, p->kind == EV_CREATE ? "event: create\ndata: " : "event: modify\ndata: ", 20);
+        li.name = p->name;
+        list_emit(os, reqpath, &li, lo, 1);
+        os_write(os, "\n\n", 2);
+        free(li.target);
+        return;
+    }
+    snprintf(fs, sizeof(fs), "%s/%s", strcmp(reqpath, "/") ? reqpath : "", p->name);
+    os_write(os, "event: delete\ndata: {\"name\":", 28);
+    os_json_str(os, p->name);
+    os_write(os, ",\"path\":", 8);
+    os_json_str(os, fs);
+    os_write(os, "}\n\n", 3);
+}
+
+/* /api/events?path=DIR[&fields=...] -> text/event-stream of changes directly inside DIR:
+ *   event: ready    data: {"path":DIR}      first, and again after every reconnect
+ *   event: create   data: the /api/list entry (fields= as for /api/list), path included
+ *   event: modify   data: the same
+ *   event: delete   data: {"name":..,"path":..}
+ *   event: reset    data: {}    changes were dropped (too many at once): list DIR again
+ *   event: gone     data: {}    DIR itself was deleted or moved away; the stream ends
+ * Changes are coalesced per name over EV_COALESCE_MS. A comment line every
+ * EV_KEEPALIVE_SEC keeps an idle stream open through proxies. */
+static void api_events(int conn, const char *reqpath, const struct list_opts *lo) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    struct ostream *os = malloc(sizeof(*os));
+    struct ev_pending *batch = malloc(EV_PENDING_MAX * sizeof(*batch));
+    struct ev_sub *s = os && batch ? ev_subscribe(fs) : NULL;
+    if (!s) {
+        int busy = os && batch && (errno == EMFILE || errno == ENOSPC);
+        const char *err = !os || !batch ? "Out of memory" : busy ? "Too many watchers" : strerror(errno);
+        send_headers(conn, busy ? 503 : 500, busy ? "Service Unavailable" : "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        free(os);
+        free(batch);
+        return;
+    }
+    send_headers_chunked(conn, 200, "OK", "text/event-stream", "Cache-Control: no-cache\r\n");
+    os_init(os, conn, 1);
+    os_write(os, "retry: 3000\n\nevent: ready\ndata: {\"path\":", 40);
+    os_json_str(os, reqpath);
+    os_write(os, "}\n\n", 3);
+    os_flush(os);
+    time_t sent = time(NULL);
+    int gone = 0;
+    pthread_mutex_lock(&g_ev_mu);
+    while (!os->failed && !gone) {
+        if (!s->n && !s->reset && !s->gone) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            if (pthread_cond_timedwait(&s->cv, &g_ev_mu, &ts) == 0) continue;
+            pthread_mutex_unlock(&g_ev_mu);
+            if (peer_gone(conn)) os->failed = 1;
+            else if (time(NULL) - sent >= EV_KEEPALIVE_SEC) {
+                os_write(os, ":\n\n", 3);
+                os_flush(os);
+                sent = time(NULL);
+            }
+            pthread_mutex_lock(&g_ev_mu);
+            continue;
+        }
+        /* let the rest of a burst arrive and merge, then take it all */
+        pthread_mutex_unlock(&g_ev_mu);
+        struct timespec pause = { 0, EV_COALESCE_MS * 1000000L };
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&g_ev_mu);
+        int n = s->n, reset = s->reset;
+        gone = s->gone;
+        memcpy(batch, s->q, (size_t)n * sizeof(*batch));
+        s->n = 0;
+        s->reset = 0;
+        pthread_mutex_unlock(&g_ev_mu);
+        if (reset) os_write(os, "event: reset\ndata: {}\n\n", 23);
+        for (int i = 0; i < n; i++) {
+            ev_send(os, reqpath, fs, &batch[i], lo);
+            free(batch[i].name);
+        }
+        if (gone) os_write(os, "event: gone\ndata: {}\n\n", 22);
+        os_flush(os);
+        sent = time(NULL);
+        pthread_mutex_lock(&g_ev_mu);
+    }
+    pthread_mutex_unlock(&g_ev_mu);
+    if (gone) os_end(os);
+    ev_unsubscribe(s);
+    free(batch);
+    free(os);
+}
+
+/* ---------- Disk usage ----------
+ * /api/du totals a subtree the way du(1) does: symlinks are not followed, a hard-linked
+ * file counts once per (dev, ino), wherever it is met first, and both apparent size and
+ * allocated space are summed. A directory is finished once all its subdirectories are;
+ * its total then goes into the size cache and on to its parent. A subdirectory whose
+ * cached total is still valid is not entered at all.
+ * /api/top is the same walk entering everything, with a bounded heap of the top k files
+ * per worker (merged into the walk's as each helper finishes) and one of the top k
+ * directories, offered each directory as it is finished. Memory stays O(k) beyond
+ * what du needs itself. */
+
+#define TOP_K_MAX 10000
+
+enum { TOP_NONE, TOP_SIZE, TOP_MTIME };
+
+struct top_item {
+    long long key;              /* what the heap orders by */
+    long long size, mtime_ns;   /* directories: total bytes, newest mtime below */
+    long long files;            /* directories: files below */
+    char *path;                 /* filesystem path */
+};
+
+struct top_heap {               /* min-heap of the k largest keys so far */
+    struct top_item *v;
+    int n, k;
+};
+
+struct du_dir {
+    struct du_dir *parent;
+    struct du_dir *next;                    /* on the stack */
+    struct du_dir *live_prev, *live_next;   /* every node not yet freed */
+    int pending;                /* unfinished subdirectories, +1 while it is being read */
+    int errors;                 /* unreadable directories at or below it */
+    int overflow;               /* more distinct hard links below than DU_LINKS_MAX */
+    dev_t dev;
+    ino_t ino;
+    long long mtime_ns, ctime_ns;
+    struct du_total t;          /* what this walk counted under it */
+    long long newest;           /* latest mtime at or below it (top) */
+    int nlinks;
+    struct du_link *links;      /* DU_LINKS_MAX slots once needed */
+    char path[];                /* filesystem path */
+};
+
+struct du_walk {
+    struct walk_crew crew;      /* first: helpers get the walk from their crew */
+    struct list_opts lo;
+    int fresh;                  /* fresh=1: ignore cached totals */
+    struct du_dir *dirs;        /* waiting to be read */
+    struct du_dir *live;
+    struct du_dir *root;
+    int done;                   /* the root is finished */
+    struct devino_set seen;     /* directories entered and hard links counted */
+    struct strbuf children;     /* JSON objects for the root's subdirectories */
+    int by;                     /* TOP_*: what /api/top ranks by */
+    struct top_heap top_files, top_dirs;
+};
+
+/* Would key make it into h? */
+static int top_wants(const struct top_heap *h, long long key) {
+    return h->k > 0 && (h->n < h->k || key > h->v[0].key);
+}
+
+static void top_sift_down(struct top_heap *h, int i) {
+    for (;;) {
+        int m = i, l = 2 * i + 1, r = l + 1;
+        if (l < h->n && h->v[l].key < h->v[m].key) m = l;
+        if (r < h->n && h->v[r].key < h->v[m].key) m = r;
+        if (m == i) return;
+        struct top_item t = h->v[i];
+        h->v[i] = h->v[m];
+        h->v[m] = t;
+        i = m;
+    }
+}
+
+/* Offer it to h, which takes over it->path (freed if it does not make it). -1 when out
+ * of memory. */
+static int top_offer(struct top_heap *h, struct top_item *it) {
+    if (!top_wants(h, it->key)) { free(it->path); return 0; }
+    if (!it->path) return -1;
+    if (!h->v && !(h->v = malloc((size_t)h->k * sizeof(*h->v)))) { free(it->path); return -1; }
+    if (h->n == h->k) {
+        free(h->v[0].path);
+        h->v[0] = *it;
+        top_sift_down(h, 0);
+        return 0;
+    }
+    int i = h->n++;
+    while (i > 0 && h->v[(i - 1) / 2].key > it->key) {
+        h->v[i] = h->v[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->v[i] = *it;
+    return 0;
+}
+
+/* Move everything in src over to dst. -1 when out of memory. */
+static int top_merge(struct top_heap *dst, struct top_heap *src) {
+    int rc = 0;
+    for (int i = 0; i < src->n; i++)
+        if (top_offer(dst, &src->v[i]) != 0) rc = -1;
+    free(src->v);
+    src->v = NULL;
+    src->n = 0;
+    return rc;
+}
+
+static void top_free(struct top_heap *h) {
+    for (int i = 0; i < h->n; i++) free(h->v[i].path);
+    free(h->v);
+}
+
+static int top_cmp_desc(const void *a, const void *b) {
+    const struct top_item *x = a, *y = b;
+    return x->key != y->key ? (x->key > y->key ? -1 : 1) : strcmp(x->path, y->path);
+}
+
+static void du_add(struct du_total *a, const struct du_total *b) {
+    a->bytes += b->bytes;
+    a->alloc += b->alloc;
+    a->files += b->files;
+    a->dirs += b->dirs;
+}
+
+/* Record hard link l as met under d (caller holds the lock) */
+static void du_add_link(struct du_dir *d, const struct du_link *l) {
+    if (d->overflow) return;
+    for (int i = 0; i < d->nlinks; i++) {
+        if (d->links[i].dev == l->dev && d->links[i].ino == l->ino) {
+            d->links[i].counted |= l->counted;
+            return;
+        }
+    }
+    if (d->nlinks == DU_LINKS_MAX || (!d->links && !(d->links = malloc(DU_LINKS_MAX * sizeof(*d->links))))) {
+        d->overflow = 1;
+        return;
+    }
+    d->links[d->nlinks++] = *l;
+}
+
+static void du_note_child(struct du_walk *dw, const char *path, const struct du_total *t) {
+    struct strbuf *sb = &dw->children;
+    sb_append(sb, sb->len ? ",{\"name\":" : "{\"name\":", sb->len ? 9 : 8);
+    sb_json_str(sb, strrchr(path, '/') + 1);
+    sb_printf(sb, ",\"bytes\":%lld,\"alloc\":%lld,\"files\":%lld,\"dirs\":%lld}", t->bytes, t->alloc, t->files, t->dirs);
+}
+
+static struct du_dir *du_dir_new(struct du_walk *dw, struct du_dir *parent, const char *path, const struct list_item *li) {
+    size_t pl = strlen(path);
+    struct du_dir *d = calloc(1, sizeof(*d) + pl + 1);
+    if (!d) return NULL;
+    memcpy(d->path, path, pl + 1);
+    d->parent = parent;
+    d->pending = 1;
+    d->dev = li->dev;
+    d->ino = li->ino;
+    d->mtime_ns = li->mtime_ns;
+    d->ctime_ns = li->ctime_ns;
+    d->newest = li->mtime_ns;
+    d->t.alloc = li->alloc;
+    d->t.dirs = 1;
+    d->live_next = dw->live;
+    if (dw->live) dw->live->live_prev = d;
+    dw->live = d;
+    return d;
+}
+
+static void du_dir_free(struct du_walk *dw, struct du_dir *d) {
+    if (d->live_prev) d->live_prev->live_next = d->live_next; else dw->live = d->live_next;
+    if (d->live_next) d->live_next->live_prev = d->live_prev;
+    free(d->links);
+    free(d);
+}
+
+/* Count subdirectory path of d from the size cache if possible (caller holds the lock).
+ * Its hard links go through this walk's set, so one counted elsewhere already is
+ * taken back out of the cached total. */
+static int du_reuse(struct du_walk *dw, struct du_dir *d, const char *path, const struct list_item *li) {
+    struct du_total t;
+    struct du_link links[DU_LINKS_MAX];
+    int n;
+    if (dw->fresh || !du_cache_get(path, li->dev, li->ino, li->mtime_ns, li->ctime_ns, &t, links, &n)) return 0;
+    for (int k = 0; k < n; k++) {
+        int r = devino_add(&dw->seen, links[k].dev, links[k].ino);
+        if (r < 0) dw->crew.stop = 1;
+        links[k].counted = r == 0;
+        if (r == 1) { t.bytes -= links[k].bytes; t.alloc -= links[k].alloc; t.files--; }
+        du_add_link(d, &links[k]);
+    }
+    du_add(&d->t, &t);
+    if (d == dw->root) du_note_child(dw, path, &t);
+    return 1;
+}
+
+/* d has one thing less outstanding; finish it, and then its parents, as they complete */
+static void du_finish(struct du_walk *dw, struct du_dir *d) {
+    pthread_mutex_lock(&dw->crew.mu);
+    while (--d->pending == 0) {
+        /* the cached total stands on its own: links first counted outside d go back in */
+        struct du_total own = d->t;
+        for (int i = 0; i < d->nlinks; i++) {
+            if (d->links[i].counted) continue;
+            own.bytes += d->links[i].bytes;
+            own.alloc += d->links[i].alloc;
+            own.files++;
+        }
+        if (!d->errors && !d->overflow && !dw->crew.stop)
+            du_cache_put(d->path, d->dev, d->ino, d->mtime_ns, d->ctime_ns, &own, d->links, d->nlinks);
+        struct du_dir *p = d->parent;
+        if (!p) { dw->done = 1; break; }
+        if (dw->by) {
+            struct top_item it = { dw->by == TOP_SIZE ? d->t.bytes : d->newest, d->t.bytes, d->newest, d->t.files, NULL };
+            if (top_wants(&dw->top_dirs, it.key)) it.path = strdup(d->path);
+            if (top_offer(&dw->top_dirs, &it) != 0) dw->crew.stop = 1;
+        }
+        if (d->newest > p->newest) p->newest = d->newest;
+        du_add(&p->t, &d->t);
+        p->errors += d->errors;
+        if (d->overflow) p->overflow = 1;
+        for (int i = 0; i < d->nlinks; i++) du_add_link(p, &d->links[i]);
+        if (p == dw->root) du_note_child(dw, d->path, &d->t);
+        du_dir_free(dw, d);
+        d = p;
+    }
+    pthread_cond_broadcast(&dw->crew.cv);
+    pthread_mutex_unlock(&dw->crew.mu);
+}
+
+/* Offer file li of d to this worker's heap (caller holds the lock) */
+static void du_top_file(struct du_walk *dw, struct du_dir *d, const struct list_item *li, struct top_heap *top) {
+    if (li->mtime_ns > d->newest) d->newest = li->mtime_ns;
+    struct top_item it = { dw->by == TOP_SIZE ? li->size : li->mtime_ns, li->size, li->mtime_ns, 1, NULL };
+    if (li->special || !top_wants(top, it.key)) return;
+    size_t pl = strcmp(d->path, "/") == 0 ? 0 : strlen(d->path), nl = strlen(li->name);
+    if ((it.path = malloc(pl + nl + 2))) {
+        memcpy(it.path, d->path, pl);
+        it.path[pl] = '/';
+        memcpy(it.path + pl + 1, li->name, nl + 1);
+    }
+    if (top_offer(top, &it) != 0) dw->crew.stop = 1;
+}
+
+/* Read directory d: count its files, queue its subdirectories. When ranking, top gets
+ * its files (a hard-linked one where it is counted). */
+static void du_walk_dir(struct du_walk *dw, struct du_dir *d, struct list_batch *b, struct top_heap *top) {
+    struct dir_iter it;
+    long long t0 = mono_ns();
+    int opened = dir_iter_open(&it, d->path, dw->lo.need) == 0;
+    iopool_observe(mono_ns() - t0, 1);
+    size_t plen = strcmp(d->path, "/") == 0 ? 0 : strlen(d->path);
+    while (opened && list_fill(&it, &dw->lo, b)) {
+        struct du_total t = { 0, 0, 0, 0 };
+        struct du_dir *kids = NULL;
+        int nkids = 0;
+        int gone = peer_gone(dw->crew.conn);     /* a big directory can take a while */
+        pthread_mutex_lock(&dw->crew.mu);
+        if (gone) dw->crew.stop = 1;
+        for (int i = 0; i < b->n && !dw->crew.stop; i++) {
+            const struct list_item *li = &b->item[i];
+            if (li->isdir) {
+                char path[PATH_MAX];
+                size_t nl = strlen(li->name);
+                if (plen + 1 + nl >= sizeof(path)) { d->errors++; continue; }
+                memcpy(path, d->path, plen);
+                path[plen] = '/';
+                memcpy(path + plen + 1, li->name, nl + 1);
+                int r = devino_add(&dw->seen, li->dev, li->ino);   /* a bind mount met twice */
+                if (r < 0) dw->crew.stop = 1;
+                if (r || du_reuse(dw, d, path, li)) continue;
+                struct du_dir *k = du_dir_new(dw, d, path, li);
+                if (!k) { dw->crew.stop = 1; continue; }
+                k->next = kids;
+                kids = k;
+                nkids++;
+            } else if (li->nlink > 1) {
+                struct du_link l = { li->dev, (ino_t)li->ino, li->size, li->alloc, 0 };
+                int r = devino_add(&dw->seen, l.dev, l.ino);
+                if (r < 0) dw->crew.stop = 1;
+                l.counted = r == 0;
+                if (l.counted) { t.bytes += l.bytes; t.alloc += l.alloc; t.files++; }
+                du_add_link(d, &l);
+                if (l.counted && dw->by) du_top_file(dw, d, li, top);
+            } else {
+                t.bytes += li->size;
+                t.alloc += li->alloc;
+                t.files++;
+                if (dw->by) du_top_file(dw, d, li, top);
+            }
+        }
+        du_add(&d->t, &t);
+        d->pending += nkids;
+        while (kids) {
+            struct du_dir *next = kids->next;
+            kids->next = dw->dirs;
+            dw->dirs = kids;
+            dw->crew.queued++;
+            kids = next;
+        }
+        crew_grow(&dw->crew);
+        pthread_cond_broadcast(&dw->crew.cv);
+        int stop = dw->crew.stop;
+        pthread_mutex_unlock(&dw->crew.mu);
+        if (stop) break;
+    }
+    if (opened) dir_iter_close(&it);
+    else { pthread_mutex_lock(&dw->crew.mu); d->errors++; pthread_mutex_unlock(&dw->crew.mu); }
+    du_finish(dw, d);
+}
+
+static int du_next(struct du_walk *dw, struct du_dir **d) {
+    pthread_mutex_lock(&dw->crew.mu);
+    *d = dw->crew.stop ? NULL : dw->dirs;
+    if (*d) { dw->dirs = (*d)->next; dw->crew.queued--; }
+    pthread_mutex_unlock(&dw->crew.mu);
+    return *d != NULL;
+}
+
+static void du_help(struct walk_crew *crew) {
+    struct du_walk *dw = (struct du_walk *)crew;
+    struct list_batch *b = calloc(1, sizeof(*b));
+    struct top_heap top = { NULL, 0, dw->top_files.k };
+    struct du_dir *d;
+    while (b && du_next(dw, &d)) du_walk_dir(dw, d, b, &top);
+    list_batch_free(b);
+    pthread_mutex_lock(&dw->crew.mu);
+    if (top_merge(&dw->top_files, &top) != 0) dw->crew.stop = 1;
+    pthread_mutex_unlock(&dw->crew.mu);
+}
+
+static void du_walk_free(struct du_walk *dw) {
+    while (dw->live) du_dir_free(dw, dw->live);
+    crew_destroy(&dw->crew);
+    top_free(&dw->top_files);
+    top_free(&dw->top_dirs);
+    free(dw->children.p);
+    free(dw->seen.t);
+    free(dw);
+}
+
+/* Walk the directory fs (st its stat) for /api/du, or for /api/top when by is set,
+ * keeping the top k. NULL when out of memory; otherwise dw->done says whether the walk
+ * got to the end. */
+static struct du_walk *du_run(int conn, const char *fs, const struct stat *st, int fresh, int by, int k) {
+    struct du_walk *dw = calloc(1, sizeof(*dw));
+    struct list_batch *b = calloc(1, sizeof(*b));
+    struct list_item rootli;
+    memset(&rootli, 0, sizeof(rootli));
+    rootli.dev = st->st_dev;
+    rootli.ino = st->st_ino;
+    rootli.mtime_ns = (long long)ST_MTIM(st).tv_sec * 1000000000LL + ST_MTIM(st).tv_nsec;
+    rootli.ctime_ns = (long long)ST_CTIM(st).tv_sec * 1000000000LL + ST_CTIM(st).tv_nsec;
+    rootli.alloc = (long long)st->st_blocks * 512;
+    if (dw) dw->root = du_dir_new(dw, NULL, fs, &rootli);
+    if (!dw || !b || !dw->root || devino_add(&dw->seen, st->st_dev, st->st_ino) < 0) {
+        if (dw && dw->root) du_dir_free(dw, dw->root);
+        if (dw) free(dw->seen.t);
+        free(dw);
+        free(b);
+        return NULL;
+    }
+    crew_init(&dw->crew, conn, du_help);
+    dw->lo.need = LF_TYPE | LF_SIZE | LF_ALLOC | LF_NLINK | LF_MTIME;
+    dw->lo.nofollow = 1;
+    dw->fresh = fresh || by;    /* ranking has to see every file */
+    dw->by = by;
+    dw->top_files.k = dw->top_dirs.k = by ? k : 0;
+    dw->dirs = dw->root;
+    dw->crew.queued = 1;
+    struct top_heap top = { NULL, 0, dw->top_files.k };
+
+    pthread_mutex_lock(&dw->crew.mu);
+    for (;;) {
+        crew_grow(&dw->crew);
+        struct du_dir *d = dw->crew.stop ? NULL : dw->dirs;
+        if (d) {
+            dw->dirs = d->next;
+            dw->crew.queued--;
+            pthread_mutex_unlock(&dw->crew.mu);
+            du_walk_dir(dw, d, b, &top);
+            pthread_mutex_lock(&dw->crew.mu);
+            continue;
+        }
+        if ((dw->done || dw->crew.stop) && dw->crew.helpers == 0) break;
+        crew_wait(&dw->crew);
+    }
+    if (top_merge(&dw->top_files, &top) != 0) dw->done = 0;
+    pthread_mutex_unlock(&dw->crew.mu);
+    list_batch_free(b);
+
+    /* listings that carry du sizes for this subtree are out of date now */
+    if (dw->done) lcache_touch(fs);
+    return dw;
+}
+
+/* /api/du?path=...[&fresh=1] -> {"path":..,"bytes":..,"alloc":..,"files":..,"dirs":..,
+ * "errors":..,"children":[{"name":..,"bytes":..,"alloc":..,"files":..,"dirs":..},..]}.
+ * bytes is the apparent size of everything but directories, alloc the space allocated
+ * on disk (directories included); children are the immediate subdirectories. errors
+ * counts directories that could not be read. Totals are kept in the size cache, where
+ * listings pick them up (fields=du). */
+static void api_du(int conn, const char *reqpath, int fresh) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    struct du_walk *dw = du_run(conn, fs, &st, fresh, TOP_NONE, 0);
+    if (!dw) {
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    struct strbuf sb = { 0 };
+    if (dw->done) {
+        const struct du_dir *r = dw->root;
+        sb_append(&sb, "{\"path\":", 8);
+        sb_json_str(&sb, reqpath);
+        sb_printf(&sb, ",\"bytes\":%lld,\"alloc\":%lld,\"files\":%lld,\"dirs\":%lld,\"errors\":%d,\"children\":[",
+                  r->t.bytes, r->t.alloc, r->t.files, r->t.dirs, r->errors);
+        if (dw->children.len) sb_append(&sb, dw->children.p, dw->children.len);
+        sb_append(&sb, "]}", 2);
+        if (dw->children.oom || sb.oom) {
+            const char *err = "Out of memory";
+            send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+            send_all(conn, err, strlen(err));
+        } else {
+            send_headers(conn, 200, "OK", "application/json; charset=utf-8", sb.len, NULL);
+            send_all(conn, sb.p, sb.len);
+        }
+    }
+    free(sb.p);
+    du_walk_free(dw);
+}
+
+/* The entries of h, largest key first, as a JSON array; dirs says which kind they are */
+static void top_json(struct strbuf *sb, struct top_heap *h, int dirs, const char *reqpath, size_t rootlen) {
+    const char *prefix = strcmp(reqpath, "/") ? reqpath : "";
+    qsort(h->v, (size_t)h->n, sizeof(*h->v), top_cmp_desc);
+    sb_append(sb, "[", 1);
+    for (int i = 0; i < h->n; i++) {
+        const struct top_item *it = &h->v[i];
+        char path[2 * PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", prefix, it->path + rootlen);
+        sb_append(sb, i ? ",{\"path\":" : "{\"path\":", i ? 9 : 8);
+        sb_json_str(sb, path);
+        if (dirs)
+            sb_printf(sb, ",\"bytes\":%lld,\"files\":%lld,\"newest\":%lld}", it->size, it->files, it->mtime_ns / 1000000000LL);
+        else
+            sb_printf(sb, ",\"size\":%lld,\"mtime\":%lld}", it->size, it->mtime_ns / 1000000000LL);
+    }
+    sb_append(sb, "]", 1);
+}
+
+/* /api/top?path=...[&by=size|mtime][&k=N] -> the k largest (or most recently modified)
+ * files under path and the k directories below it with the largest totals (or the
+ * newest file anywhere below):
+ *   {"path":..,"by":"size","k":N,"bytes":..,"files":..,"dirs":..,"errors":..,
+ *    "files_top":[{"path":..,"size":..,"mtime":..},..],
+ *    "dirs_top":[{"path":..,"bytes":..,"files":..,"newest":..},..]}
+ * largest first; bytes, files and dirs are the totals for path as /api/du gives them.
+ * Symlinks are not followed and a hard-linked file counts once. */
+static void api_top(int conn, const char *reqpath, int by, int k) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    struct du_walk *dw = du_run(conn, fs, &st, 0, by, k);
+    if (!dw) {
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    struct strbuf sb = { 0 };
+    if (dw->done) {
+        const struct du_dir *r = dw->root;
+        size_t rootlen = strcmp(fs, "/") == 0 ? 0 : strlen(fs);
+        sb_append(&sb, "{\"path\":", 8);
+        sb_json_str(&sb, reqpath);
+        sb_printf(&sb, ",\"by\":\"%s\",\"k\":%d,\"bytes\":%lld,\"files\":%lld,\"dirs\":%lld,\"errors\":%d,\"files_top\":",
+                  by == TOP_MTIME ? "mtime" : "size", k, r->t.bytes, r->t.files, r->t.dirs, r->errors);
+        top_json(&sb, &dw->top_files, 0, reqpath, rootlen);
+        sb_append(&sb, ",\"dirs_top\":", 12);
+        top_json(&sb, &dw->top_dirs, 1, reqpath, rootlen);
+        sb_append(&sb, "}", 1);
+        if (sb.oom) {
+            const char *err = "Out of memory";
+            send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+            send_all(conn, err, strlen(err));
+        } else {
+            send_headers(conn, 200, "OK", "application/json; charset=utf-8", sb.len, NULL);
+            send_all(conn, sb.p, sb.len);
+        }
+    }
+    free(sb.p);
+    du_walk_free(dw);
+}
+
+/* ---------- Duplicate files ----------
+ * /api/duplicates finds files with the same content in three rounds, each over what
+ * the one before left standing. A walk (symlinks not followed, a hard-linked file only
+ * once) collects every regular file, and files of a size no other file has drop out.
+ * A quick hash of the first and last DUP_BLOCK bytes splits the rest, and only files
+ * still sharing size and quick hash are read whole for a SHA-256. Both hashing rounds
+ * spread over the CPUs and go through the file hash cache, so a repeated scan reads
+ * next to nothing. The last round works from the largest files down and sends each
+ * set of candidates as soon as all of it is hashed. */
+
+#define DUP_BLOCK 4096              /* quick hash: this much from each end */
+#define DUP_FILES_MAX 1000000       /* files collected per request */
+#define DUP_READ (256 * 1024)
+
+enum { DUP_NEW, DUP_QUICK, DUP_FULL, DUP_SKIP };
+
+struct dup_file {
+    size_t name;                /* offset of its filesystem path in the walk's names */
+    struct hc_id id;            /* as last seen; a file that changes meanwhile is skipped */
+    int state;                  /* DUP_*: which hashes are known, or skipped */
+    uint64_t quick;
+    uint8_t sha256[32];
+    size_t set;                 /* last round: the set it is hashed for */
+};
+
+struct dup_set {                /* candidates sharing size and quick hash */
+    size_t first, n;            /* in the walk's members[] */
+    size_t pending;             /* still to be hashed in full */
+};
+
+struct dup_walk {
+    struct walk_crew crew;      /* first: helpers get the walk from their crew */
+    struct list_opts lo;
+    long long min_size;
+    int fresh;                  /* fresh=1: ignore cached hashes */
+    int round;                  /* 0 walk, 1 quick hash, 2 full hash */
+    struct tree_dir *dirs;      /* round 0: directories waiting (filesystem paths) */
+    struct dup_file *files;
+    size_t nfiles, cap;
+    struct strbuf names;
+    size_t *work;               /* rounds 1 and 2: files to hash, in order */
+    size_t nwork, next;
+    size_t *members;            /* round 2: the files of every set, set by set */
+    struct dup_set *sets;
+    size_t nsets;
+    size_t *ready;              /* sets fully hashed, in the order they finished */
+    size_t nready, sent;
+    struct devino_set seen;     /* directories entered, hard-linked files met */
+    long long dirs_read, candidates, bytes_read, cached, unreadable;
+    int truncated;              /* stopped collecting at DUP_FILES_MAX */
+};
+
+struct dup_worker {
+    struct list_batch *b;
+    char *buf;                  /* DUP_READ bytes */
+};
+
+/* Read directory d: collect its files, queue its subdirectories */
+static void dup_walk_dir(struct dup_walk *dw, const struct tree_dir *d, struct list_batch *b) {
+    struct dir_iter it;
+    long long t0 = mono_ns();
+    if (dir_iter_open(&it, d->path, dw->lo.need) != 0) {
+        iopool_observe(mono_ns() - t0, 1);
+        pthread_mutex_lock(&dw->crew.mu);
+        dw->unreadable++;
+        pthread_mutex_unlock(&dw->crew.mu);
+        return;
+    }
+    iopool_observe(mono_ns() - t0, 1);
+    /* symlinks are not followed, but a bind mount can still bring a directory back */
+    struct stat st;
+    int again = 0;
+    pthread_mutex_lock(&dw->crew.mu);
+    if (dw->truncated) again = 1;
+    else if (fstat(it.fd, &st) == 0) again = devino_add(&dw->seen, st.st_dev, st.st_ino);
+    if (again < 0) dw->crew.stop = 1;
+    if (!again) dw->dirs_read++;
+    pthread_mutex_unlock(&dw->crew.mu);
+    if (again) {
+        dir_iter_close(&it);
+        return;
+    }
+    size_t plen = strcmp(d->path, "/") == 0 ? 0 : strlen(d->path);
+    while (list_fill(&it, &dw->lo, b)) {
+        struct tree_dir *kids = NULL;
+        int gone = peer_gone(dw->crew.conn);     /* a big directory can take a while */
+        pthread_mutex_lock(&dw->crew.mu);
+        if (gone) dw->crew.stop = 1;
+        for (int i = 0; i < b->n && !dw->crew.stop && !dw->truncated; i++) {
+            const struct list_item *li = &b->item[i];
+            if (li->isdir) {
+                struct tree_dir *k = tree_item(d->path, plen, li->name, 0, 0);
+                if (!k) { dw->unreadable++; continue; }
+                k->next = kids;
+                kids = k;
+                continue;
+            }
+            if (li->special || li->size < dw->min_size) continue;
+            if (li->nlink > 1) {
+                int r = devino_add(&dw->seen, li->dev, li->ino);
+                if (r < 0) dw->crew.stop = 1;
+                if (r) continue;
+            }
+            if (dw->nfiles == DUP_FILES_MAX) { dw->truncated = 1; break; }
+            if (dw->nfiles == dw->cap) {
+                size_t cap = dw->cap ? dw->cap * 2 : 4096;
+                struct dup_file *nf = realloc(dw->files, cap * sizeof(*nf));
+                if (!nf) { dw->crew.stop = 1; break; }
+                dw->files = nf;
+                dw->cap = cap;
+            }
+            struct dup_file *f = &dw->files[dw->nfiles++];
+            memset(f, 0, sizeof(*f));
+            f->name = dw->names.len;
+            sb_append(&dw->names, d->path, plen);
+            sb_append(&dw->names, "/", 1);
+            sb_append(&dw->names, li->name, strlen(li->name) + 1);
+            if (dw->names.oom) dw->crew.stop = 1;
+            f->id.dev = li->dev;
+            f->id.ino = li->ino;
+            f->id.size = li->size;
+            f->id.mtime_ns = li->mtime_ns;
+            f->id.ctime_ns = li->ctime_ns;
+        }
+        while (kids) {
+            struct tree_dir *next = kids->next;
+            if (dw->crew.stop || dw->truncated) free(kids);
+            else { kids->next = dw->dirs; dw->dirs = kids; dw->crew.queued++; }
+            kids = next;
+        }
+        crew_grow(&dw->crew);
+        pthread_cond_broadcast(&dw->crew.cv);
+        int stop = dw->crew.stop || dw->truncated;
+        pthread_mutex_unlock(&dw->crew.mu);
+        if (stop) break;
+    }
+    dir_iter_close(&it);
+}
+
+static int dup_read_at(int fd, char *buf, size_t n, off_t off) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = pread(fd, buf + got, n - got, off + (off_t)got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
+/* Open f if it is still the file the walk saw (by inode, size and mtime; the walk may
+ * not have had a full stat), and take its current identity. -1 otherwise. */
+static int dup_open(struct dup_walk *dw, struct dup_file *f) {
+    struct stat st;
+    int fd = open(dw->names.p + f->name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0) return -1;
+    struct hc_id id;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        hc_id_stat(&id, &st);
+        if (id.ino == f->id.ino && id.size == f->id.size && id.mtime_ns == f->id.mtime_ns) {
+            f->id = id;
+            return fd;
+        }
+    }
+    close(fd);
+    return -1;
+}
+
+/* Quick round for f: the cache, else the first and last DUP_BLOCK bytes. A file of no
+ * more than two blocks is read whole and hashed in full at once, its quick hash taken
+ * from that. */
+static void dup_quick(struct dup_walk *dw, struct dup_file *f, char *buf) {
+    int fd = dup_open(dw, f);
+    long long bytes = 0;
+    struct hc_sums hs;
+    int have = fd >= 0 && !dw->fresh ? hcache_get(&f->id, &hs) : 0;
+    if (have & HC_QUICK) f->quick = hs.quick;
+    if (have & HC_SHA256) memcpy(f->sha256, hs.sha256, 32);
+    if (fd < 0) {
+        f->state = DUP_SKIP;
+    } else if (have & HC_QUICK) {
+        f->state = have & HC_SHA256 ? DUP_FULL : DUP_QUICK;
+    } else if (f->id.size <= 2 * DUP_BLOCK) {
+        bytes = f->id.size;
+        f->state = dup_read_at(fd, buf, (size_t)bytes, 0) == 0 ? DUP_FULL : DUP_SKIP;
+        if (f->state == DUP_FULL) {
+            struct sha256_ctx c;
+            sha256_init(&c);
+            sha256_update(&c, buf, (size_t)bytes);
+            sha256_final(&c, f->sha256);
+            memcpy(&f->quick, f->sha256, sizeof(f->quick));
+            hs.quick = f->quick;
+            memcpy(hs.sha256, f->sha256, 32);
+            hcache_put(&f->id, HC_QUICK | HC_SHA256, &hs);
+        }
+    } else {
+        bytes = 2 * DUP_BLOCK;
+        if (dup_read_at(fd, buf, DUP_BLOCK, 0) == 0 &&
+            dup_read_at(fd, buf + DUP_BLOCK, DUP_BLOCK, (off_t)(f->id.size - DUP_BLOCK)) == 0) {
+            f->quick = (uint64_t)crc32c_update(0, buf, DUP_BLOCK) << 32 | crc32c_update(0, buf + DUP_BLOCK, DUP_BLOCK);
+            f->state = have & HC_SHA256 ? DUP_FULL : DUP_QUICK;
+            hs.quick = f->quick;
+            hcache_put(&f->id, HC_QUICK, &hs);
+        } else {
+            f->state = DUP_SKIP;
+        }
+    }
+    if (fd >= 0) close(fd);
+    pthread_mutex_lock(&dw->crew.mu);
+    dw->bytes_read += bytes;
+    if (have & HC_QUICK) dw->cached++;
+    if (f->state == DUP_SKIP) dw->unreadable++;
+    pthread_mutex_unlock(&dw->crew.mu);
+}
+
+/* Full round for f: SHA-256 of all of it, then its set may be ready to send */
+static void dup_full(struct dup_walk *dw, struct dup_file *f, char *buf) {
+    int fd = dup_open(dw, f);
+    long long bytes = 0;
+    f->state = DUP_SKIP;
+    if (fd >= 0) {
+        struct sha256_ctx c;
+        sha256_init(&c);
+        ssize_t r;
+        while ((r = read(fd, buf, DUP_READ)) != 0) {
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) break;
+            sha256_update(&c, buf, (size_t)r);
+            bytes += r;
+        }
+        close(fd);
+        if (r == 0 && bytes == f->id.size) {
+            sha256_final(&c, f->sha256);
+            f->state = DUP_FULL;
+            struct hc_sums hs;
+            memcpy(hs.sha256, f->sha256, 32);
+            hcache_put(&f->id, HC_SHA256, &hs);
+        }
+    }
+    pthread_mutex_lock(&dw->crew.mu);
+    dw->bytes_read += bytes;
+    if (f->state == DUP_SKIP) dw->unreadable++;
+    if (--dw->sets[f->set].pending == 0) {
+        dw->ready[dw->nready++] = f->set;
+        pthread_cond_broadcast(&dw->crew.cv);
+    }
+    pthread_mutex_unlock(&dw->crew.mu);
+}
+
+/* Take the next piece of work (caller holds the lock): a directory in *d, or a file
+ * index in *fi with *d NULL. 0 when there is none or the walk stopped. */
+static int dup_take(struct dup_walk *dw, struct tree_dir **d, size_t *fi, int *round) {
+    if (dw->crew.stop || !dw->crew.queued) return 0;
+    dw->crew.queued--;
+    *round = dw->round;
+    *d = NULL;
+    if (dw->round == 0) { *d = dw->dirs; dw->dirs = (*d)->next; }
+    else *fi = dw->work[dw->next++];
+    return 1;
+}
+
+static void dup_work(struct dup_walk *dw, struct tree_dir *d, size_t fi, int round, struct dup_worker *w) {
+    if (!d && fi % 256 == 0 && peer_gone(dw->crew.conn)) {    /* hashing can take a while too */
+        pthread_mutex_lock(&dw->crew.mu);
+        dw->crew.stop = 1;
+        pthread_mutex_unlock(&dw->crew.mu);
+    }
+    if (d) dup_walk_dir(dw, d, w->b);
+    else if (round == 1) dup_quick(dw, &dw->files[fi], w->buf);
+    else dup_full(dw, &dw->files[fi], w->buf);
+    free(d);
+}
+
+static int dup_worker_init(struct dup_worker *w) {
+    w->b = calloc(1, sizeof(*w->b));
+    w->buf = malloc(DUP_READ);
+    return w->b && w->buf ? 0 : -1;
+}
+
+static void dup_worker_free(struct dup_worker *w) {
+    list_batch_free(w->b);
+    free(w->buf);
+}
+
+static void dup_help(struct walk_crew *crew) {
+    struct dup_walk *dw = (struct dup_walk *)crew;
+    struct dup_worker w;
+    struct tree_dir *d;
+    size_t fi = 0;
+    int round = 0;
+    if (dup_worker_init(&w) == 0) {
+        for (;;) {
+            pthread_mutex_lock(&dw->crew.mu);
+            int got = dup_take(dw, &d, &fi, &round);
+            pthread_mutex_unlock(&dw->crew.mu);
+            if (!got) break;
+            dup_work(dw, d, fi, round, &w);
+        }
+    }
+    dup_worker_free(&w);
+}
+
+/* Largest first; within a size, files still in the running first, by quick hash */
+static int dup_cmp_file(const void *a, const void *b) {
+    const struct dup_file *x = a, *y = b;
+    if (x->id.size != y->id.size) return x->id.size > y->id.size ? -1 : 1;
+    int xin = x->state == DUP_QUICK || x->state == DUP_FULL, yin = y->state == DUP_QUICK || y->state == DUP_FULL;
+    if (xin != yin) return yin - xin;
+    if (x->quick != y->quick) return x->quick < y->quick ? -1 : 1;
+    return 0;
+}
+
+static int dup_cmp_sha(const void *a, const void *b) {
+    const struct dup_file *x = *(struct dup_file *const *)a, *y = *(struct dup_file *const *)b;
+    if ((x->state == DUP_FULL) != (y->state == DUP_FULL)) return x->state == DUP_FULL ? -1 : 1;
+    return memcmp(x->sha256, y->sha256, 32);
+}
+
+/* Set up round dw->round from what the last one left (no helpers running). -1 when
+ * out of memory. */
+static int dup_plan(struct dup_walk *dw) {
+    dw->next = dw->nwork = 0;
+    if (dw->round == 1) {
+        /* files sharing their size with another go on to the quick hash */
+        qsort(dw->files, dw->nfiles, sizeof(*dw->files), dup_cmp_file);
+        dw->work = malloc((dw->nfiles ? dw->nfiles : 1) * sizeof(*dw->work));
+        if (!dw->work) return -1;
+        for (size_t i = 0, j; i < dw->nfiles; i = j) {
+            for (j = i + 1; j < dw->nfiles && dw->files[j].id.size == dw->files[i].id.size; j++) {}
+            for (size_t k = i; j - i > 1 && k < j; k++) dw->work[dw->nwork++] = k;
+        }
+        dw->candidates = (long long)dw->nwork;
+    } else {
+        /* files sharing size and quick hash form a set; those not yet fully hashed are
+         * the work, a set at a time, largest files first */
+        qsort(dw->files, dw->nfiles, sizeof(*dw->files), dup_cmp_file);
+        size_t n = dw->nfiles ? dw->nfiles : 1;
+        dw->members = malloc(n * sizeof(*dw->members));
+        dw->sets = malloc(n * sizeof(*dw->sets));
+        dw->ready = malloc(n * sizeof(*dw->ready));
+        if (!dw->members || !dw->sets || !dw->ready) return -1;
+        size_t nm = 0;
+        for (size_t i = 0, j; i < dw->nfiles; i = j) {
+            const struct dup_file *f = &dw->files[i];
+            for (j = i + 1; j < dw->nfiles && dup_cmp_file(f, &dw->files[j]) == 0; j++) {}
+            if (j - i < 2 || (f->state != DUP_QUICK && f->state != DUP_FULL)) continue;
+            struct dup_set *s = &dw->sets[dw->nsets];
+            s->first = nm;
+            s->n = j - i;
+            s->pending = 0;
+            for (size_t k = i; k < j; k++) {
+                dw->members[nm++] = k;
+                dw->files[k].set = dw->nsets;
+                if (dw->files[k].state == DUP_QUICK) { dw->work[dw->nwork++] = k; s->pending++; }
+            }
+            if (!s->pending) dw->ready[dw->nready++] = dw->nsets;
+            dw->nsets++;
+        }
+    }
+    dw->crew.queued = (int)dw->nwork;
+    dw->crew.cpu = 1;
+    return 0;
+}
+
+/* Send the groups of identical files in set si: {"size":..,"sha256":..,"paths":[..]}.
+ * -1 when out of memory. */
+static int dup_send_set(struct dup_walk *dw, size_t si, struct ostream *os, const char *reqpath, size_t rootlen,
+                        long long *groups, long long *dups, long long *wasted) {
+    static const char hex[] = "0123456789abcdef";
+    const struct dup_set *s = &dw->sets[si];
+    struct dup_file **v = malloc(s->n * sizeof(*v));
+    if (!v) return -1;
+    for (size_t k = 0; k < s->n; k++) v[k] = &dw->files[dw->members[s->first + k]];
+    qsort(v, s->n, sizeof(*v), dup_cmp_sha);
+    const char *prefix = strcmp(reqpath, "/") ? reqpath : "";
+    for (size_t i = 0, j; i < s->n && v[i]->state == DUP_FULL; i = j) {
+        for (j = i + 1; j < s->n && v[j]->state == DUP_FULL && !memcmp(v[j]->sha256, v[i]->sha256, 32); j++) {}
+        if (j - i < 2) continue;
+        char sha[65];
+        for (int k = 0; k < 32; k++) { sha[2 * k] = hex[v[i]->sha256[k] >> 4]; sha[2 * k + 1] = hex[v[i]->sha256[k] & 15]; }
+        sha[64] = '\0';
+        os_write(os, "{\"size\":", 8);
+        os_int(os, v[i]->id.size);
+        os_write(os, ",\"sha256\":\"", 11);
+        os_write(os, sha, 64);
+        os_write(os, "\",\"paths\":[", 11);
+        for (size_t k = i; k < j; k++) {
+            os_write(os, k > i ? ",\"" : "\"", k > i ? 2 : 1);
+            os_json_raw(os, prefix);
+            os_json_raw(os, dw->names.p + v[k]->name + rootlen);
+            os_write(os, "\"", 1);
+        }
+        os_write(os, "]}\n", 3);
+        (*groups)++;
+        *dups += (long long)(j - i - 1);
+        *wasted += (long long)(j - i - 1) * v[i]->id.size;
+    }
+    free(v);
+    return 0;
+}
+
+/* /api/duplicates?path=...[&min_size=N][&fresh=1] -> NDJSON, one line per group of
+ * files with identical content:
+ *   {"size":N,"sha256":"..","paths":["/a","/b",..]}
+ * each sent once all its candidates are hashed (the largest are hashed first), then
+ *   {"done":true,"groups":N,"duplicates":N,"wasted":N,"files":N,"dirs":N,"candidates":N,
+ *    "bytes_read":N,"cached":N,"unreadable":N,"truncated":bool}
+ * duplicates counts the files beyond the first of each group and wasted their bytes;
+ * candidates the files that shared a size and were hashed, cached those whose hashes
+ * came from the cache. Files smaller than min_size (default 1, so empty files are
+ * left out) are not looked at; truncated means the walk stopped at DUP_FILES_MAX.
+ * fresh=1 hashes everything again. Stops early when the client disconnects. */
+static void api_duplicates(int conn, const char *reqpath, long long min_size, int fresh) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    size_t rootlen = strcmp(fs, "/") == 0 ? 0 : strlen(fs);
+    struct dup_walk *dw = calloc(1, sizeof(*dw));
+    struct ostream *os = malloc(sizeof(*os));
+    struct dup_worker w = { 0 };
+    struct tree_dir *root = malloc(sizeof(*root) + rootlen + 2);
+    if (!dw || !os || !root || dup_worker_init(&w) != 0) {
+        dup_worker_free(&w);
+        free(dw); free(os); free(root);
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    crew_init(&dw->crew, conn, dup_help);
+    dw->lo.need = LF_TYPE | LF_SIZE | LF_MTIME | LF_NLINK;
+    dw->lo.nofollow = 1;
+    dw->min_size = min_size;
+    dw->fresh = fresh;
+    memcpy(root->path, rootlen ? fs : "/", rootlen ? rootlen + 1 : 2);
+    root->next = NULL;
+    root->depth = 1;
+    root->file = 0;
+    dw->dirs = root;
+    dw->crew.queued = 1;
+
+    send_headers_chunked(conn, 200, "OK", "application/x-ndjson", NULL);
+    os_init(os, conn, 1);
+    long long groups = 0, dups = 0, wasted = 0;
+    pthread_mutex_lock(&dw->crew.mu);
+    for (;;) {
+        crew_grow(&dw->crew);
+        struct tree_dir *d;
+        size_t fi = 0;
+        int round = 0;
+        if (dw->sent < dw->nready && !dw->crew.stop) {
+            size_t si = dw->ready[dw->sent++];
+            pthread_mutex_unlock(&dw->crew.mu);
+            int oom = dup_send_set(dw, si, os, reqpath, rootlen, &groups, &dups, &wasted) != 0;
+            os_flush(os);
+            pthread_mutex_lock(&dw->crew.mu);
+            if (oom || os->failed) dw->crew.stop = 1;
+            continue;
+        }
+        if (dup_take(dw, &d, &fi, &round)) {
+            pthread_mutex_unlock(&dw->crew.mu);
+            dup_work(dw, d, fi, round, &w);
+            pthread_mutex_lock(&dw->crew.mu);
+            continue;
+        }
+        if (dw->crew.helpers) { crew_wait(&dw->crew); continue; }
+        if (dw->crew.stop || dw->round == 2) break;
+        dw->round++;
+        if (dup_plan(dw) != 0) dw->crew.stop = 1;
+    }
+    pthread_mutex_unlock(&dw->crew.mu);
+
+    while (dw->dirs) {
+        struct tree_dir *d = dw->dirs;
+        dw->dirs = d->next;
+        free(d);
+    }
+    if (!dw->crew.stop) {
+        os_write(os, "{\"done\":true,\"groups\":", 22);
+        os_int(os, groups);
+        os_write(os, ",\"duplicates\":", 14);
+        os_int(os, dups);
+        os_write(os, ",\"wasted\":", 10);
+        os_int(os, wasted);
+        os_write(os, ",\"files\":", 9);
+        os_int(os, (long long)dw->nfiles);
+        os_write(os, ",\"dirs\":", 8);
+        os_int(os, dw->dirs_read);
+        os_write(os, ",\"candidates\":", 14);
+        os_int(os, dw->candidates);
+        os_write(os, ",\"bytes_read\":", 14);
+        os_int(os, dw->bytes_read);
+        os_write(os, ",\"cached\":", 10);
+        os_int(os, dw->cached);
+        os_write(os, ",\"unreadable\":", 14);
+        os_int(os, dw->unreadable);
+        os_write(os, dw->truncated ? ",\"truncated\":true}\n" : ",\"truncated\":false}\n", dw->truncated ? 19 : 20);
+        os_end(os);
+    }
+    crew_destroy(&dw->crew);
+    dup_worker_free(&w);
+    free(dw->files);
+    free(dw->names.p);
+    free(dw->work);
+    free(dw->members);
+    free(dw->sets);
+    free(dw->ready);
+    free(dw->seen.t);
+    free(dw);
+    free(os);
+}
+
+/* ---------- Merkle manifest ----------
+ * /api/manifest hashes a subtree as a Merkle tree, so two copies (a device and its
+ * backup) can be compared from the top down, going only into subtrees whose hashes
+ * differ. A file's hash is the SHA-256 of its content, a symlink's that of its target
+ * text (links are not followed), and a directory's the SHA-256 over its entries in
+ * byte order of name, each as a type byte ('f', 'l' or 'd'), the name, a NUL and the
+ * entry's 32-byte hash. Other file types are left out, and so is anything that cannot
+ * be read (counted as an error, which keeps the directories above it out of the cache).
+ * Directories and files wait on one stack, so the crew spreads the hashing of a large
+ * directory as well as the reading of many small ones. A directory is finished, hashed
+ * and cached once all its entries are, by whichever worker finishes the last of them.
+ * File hashes come from the hash cache and directory hashes from the subtree hash
+ * cache, so after a change only the changed files are read again, and only the
+ * directories above them (and those the response lists) are re-read. */
+
+#define MK_DEPTH_DEFAULT 1
+#define MK_OUTPUT_MAX (64 * 1024 * 1024)   /* JSON for one response */
+
+struct mk_node {
+    struct mk_node *parent;
+    struct mk_node *next;       /* on the stack */
+    int type;                   /* 'f', 'l' or 'd' */
+    int depth;                  /* 0 for the requested directory */
+    int pending;                /* unfinished: +1 while being read or hashed, +1 per entry for directories */
+    int error;                  /* errno: left out of its parent */
+    int cached;                 /* directories: from the subtree hash cache */
+    long long size;             /* files */
+    struct mk_total t;          /* the hash, and for directories the totals below */
+    long long errors;           /* directories: entries left out at or below it */
+    dev_t dev;                  /* directories: the stat they were read with */
+    ino_t ino;
+    long long mtime_ns, ctime_ns;
+    struct mk_node **kids;      /* directories: entries, until finished */
+    int nkids, capkids;
+    struct strbuf json;         /* directories: their entries' objects, when listed */
+    const char *name;           /* last component of path */
+    char path[];                /* filesystem path */
+};
+
+struct mk_walk {
+    struct walk_crew crew;      /* first: helpers get the walk from their crew */
+    struct list_opts lo;
+    int max_depth;              /* list entries down to this depth, 0 = all */
+    int verify;                 /* ignore cached directory hashes */
+    int fresh;                  /* ignore cached file hashes as well */
+    struct mk_node *stack;
+    struct mk_node *root;
+    int done;                   /* the root is finished */
+    int too_big;                /* the JSON would pass MK_OUTPUT_MAX */
+    struct devino_set seen;     /* directories entered (a bind mount can loop) */
+    long long hashed, cached, bytes_read, dirs_read, dirs_cached;
+};
+
+static struct mk_node *mk_node_new(struct mk_node *parent, const char *path, size_t plen, const char *name, int type) {
+    size_t nl = strlen(name);
+    if (plen + 1 + nl >= PATH_MAX) return NULL;
+    struct mk_node *n = calloc(1, sizeof(*n) + plen + 1 + nl + 1);
+    if (!n) return NULL;
+    memcpy(n->path, path, plen);
+    n->path[plen] = '/';
+    memcpy(n->path + plen + 1, name, nl + 1);
+    n->name = n->path + plen + 1;
+    n->parent = parent;
+    n->type = type;
+    n->depth = parent ? parent->depth + 1 : 0;
+    n->pending = 1;
+    return n;
+}
+
+static void mk_node_free(struct mk_node *n) {
+    for (int i = 0; i < n->nkids; i++) mk_node_free(n->kids[i]);
+    free(n->kids);
+    free(n->json.p);
+    free(n);
+}
+
+static int mk_cmp_name(const void *a, const void *b) {
+    return strcmp((*(struct mk_node *const *)a)->name, (*(struct mk_node *const *)b)->name);
+}
+
+static void mk_hex(struct strbuf *sb, const uint8_t *sum) {
+    static const char hex[] = "0123456789abcdef";
+    char h[64];
+    for (int k = 0; k < 32; k++) { h[2 * k] = hex[sum[k] >> 4]; h[2 * k + 1] = hex[sum[k] & 15]; }
+    sb_append(sb, h, 64);
+}
+
+/* The object for entry k of a listed directory */
+static void mk_entry_json(struct strbuf *sb, const struct mk_node *k) {
+    sb_append(sb, "{\"name\":", 8);
+    sb_json_str(sb, k->name);
+    if (k->error) {
+        sb_append(sb, ",\"error\":", 9);
+        sb_json_str(sb, strerror(k->error));
+        sb_append(sb, "}", 1);
+        return;
+    }
+    sb_printf(sb, ",\"type\":\"%s\",\"hash\":\"", k->type == 'd' ? "dir" : k->type == 'l' ? "link" : "file");
+    mk_hex(sb, k->t.sum);
+    if (k->type == 'f') sb_printf(sb, "\",\"size\":%lld", k->size);
+    else if (k->type == 'l') sb_append(sb, "\"", 1);
+    else sb_printf(sb, "\",\"files\":%lld,\"dirs\":%lld,\"bytes\":%lld", k->t.files, k->t.dirs, k->t.bytes);
+    if (k->type == 'd' && k->errors) sb_printf(sb, ",\"errors\":%lld", k->errors);
+    if (k->type == 'd' && k->json.p) {
+        sb_append(sb, ",\"children\":[", 13);
+        sb_append(sb, k->json.p, k->json.len);
+        sb_append(sb, "]", 1);
+    }
+    sb_append(sb, "}", 1);
+}
+
+/* All of d's entries are in: hash d, list its entries if the response goes that deep,
+ * cache it and free the entries. Only the worker that finished d's last entry gets
+ * here, so nothing else touches d or them meanwhile. */
+static void mk_dir_done(struct mk_walk *mw, struct mk_node *d) {
+    int list = mw->max_depth == 0 || d->depth < mw->max_depth;
+    qsort(d->kids, (size_t)d->nkids, sizeof(*d->kids), mk_cmp_name);
+    struct sha256_ctx sha;
+    sha256_init(&sha);
+    d->t.dirs = 1;
+    for (int i = 0; i < d->nkids; i++) {
+        struct mk_node *k = d->kids[i];
+        if (list) {
+            if (i) sb_append(&d->json, ",", 1);
+            mk_entry_json(&d->json, k);
+        }
+        if (k->error) { d->errors++; continue; }
+        uint8_t type = (uint8_t)k->type;
+        sha256_update(&sha, &type, 1);
+        sha256_update(&sha, k->name, strlen(k->name) + 1);
+        sha256_update(&sha, k->t.sum, 32);
+        if (k->type == 'd') {
+            d->t.files += k->t.files;
+            d->t.dirs += k->t.dirs;
+            d->t.bytes += k->t.bytes;
+            d->errors += k->errors;
+        } else {
+            d->t.files++;
+            d->t.bytes += k->size;
+        }
+    }
+    sha256_final(&sha, d->t.sum);
+    if (list && !d->json.p) sb_append(&d->json, "", 0);    /* an empty directory still lists [] */
+    for (int i = 0; i < d->nkids; i++) mk_node_free(d->kids[i]);
+    free(d->kids);
+    d->kids = NULL;
+    d->nkids = 0;
+    if (!d->errors && !d->error) mk_cache_put(d->path, d->dev, d->ino, d->mtime_ns, d->ctime_ns, &d->t);
+    if (d->json.oom || d->json.len > MK_OUTPUT_MAX) {
+        pthread_mutex_lock(&mw->crew.mu);
+        mw->too_big = mw->crew.stop = 1;
+        pthread_mutex_unlock(&mw->crew.mu);
+    }
+}
+
+/* n is read or hashed: finish it and every directory it was the last entry of */
+static void mk_finish(struct mk_walk *mw, struct mk_node *n) {
+    pthread_mutex_lock(&mw->crew.mu);
+    int last = --n->pending == 0 && !mw->crew.stop;
+    pthread_mutex_unlock(&mw->crew.mu);
+    while (last) {
+        if (n->type == 'd' && !n->cached && !n->error) mk_dir_done(mw, n);
+        pthread_mutex_lock(&mw->crew.mu);
+        if (!n->parent) mw->done = 1;
+        else last = --n->parent->pending == 0 && !mw->crew.stop;
+        pthread_cond_broadcast(&mw->crew.cv);
+        pthread_mutex_unlock(&mw->crew.mu);
+        if (!n->parent) break;
+        n = n->parent;
+    }
+}
+
+static void mk_hash_file(struct mk_walk *mw, struct mk_node *f, uint8_t *buf) {
+    struct stat st;
+    struct hc_sums sums;
+    long long n = 0;
+    int rc = -1;
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        if (!S_ISREG(st.st_mode)) errno = EINVAL;  /* replaced since it was listed */
+        else rc = hash_fd(fd, &st, DIGEST_SHA256, mw->fresh, buf, &sums, &n);
+    }
+    if (rc < 0) f->error = errno ? errno : EIO;
+    else {
+        memcpy(f->t.sum, sums.sha256, 32);
+        f->size = (long long)st.st_size;
+    }
+    if (fd >= 0) close(fd);
+    pthread_mutex_lock(&mw->crew.mu);
+    if (rc >= 0) mw->hashed++;
+    if (rc == 1) mw->cached++;
+    mw->bytes_read += n;
+    pthread_mutex_unlock(&mw->crew.mu);
+    mk_finish(mw, f);
+}
+
+/* Add entry k to directory d (d is being read by this worker only) */
+static int mk_add_kid(struct mk_node *d, struct mk_node *k) {
+    if (d->nkids == d->capkids) {
+        int cap = d->capkids ? 2 * d->capkids : 16;
+        struct mk_node **v = realloc(d->kids, (size_t)cap * sizeof(*v));
+        if (!v) return -1;
+        d->kids = v;
+        d->capkids = cap;
+    }
+    d->kids[d->nkids++] = k;
+    return 0;
+}
+
+/* Read directory d: subdirectories and files go on the stack, symlinks are hashed here.
+ * A directory below the listed depth whose cached hash is valid is not read at all. */
+static void mk_walk_dir(struct mk_walk *mw, struct mk_node *d, struct list_batch *b) {
+    struct dir_iter it;
+    struct stat st;
+    long long t0 = mono_ns();
+    int opened = dir_iter_open(&it, d->path, mw->lo.need) == 0;
+    iopool_observe(mono_ns() - t0, 1);
+    if (!opened || fstat(it.fd, &st) != 0) {
+        d->error = errno ? errno : EIO;
+        if (opened) dir_iter_close(&it);
+        mk_finish(mw, d);
+        return;
+    }
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime_ns = (long long)ST_MTIM(&st).tv_sec * 1000000000LL + ST_MTIM(&st).tv_nsec;
+    d->ctime_ns = (long long)ST_CTIM(&st).tv_sec * 1000000000LL + ST_CTIM(&st).tv_nsec;
+    int unlisted = mw->max_depth && d->depth >= mw->max_depth;
+    if (unlisted && !mw->verify && mk_cache_get(d->path, &st, &d->t)) {
+        d->cached = 1;
+        dir_iter_close(&it);
+        pthread_mutex_lock(&mw->crew.mu);
+        mw->dirs_cached++;
+        pthread_mutex_unlock(&mw->crew.mu);
+        mk_finish(mw, d);
+        return;
+    }
+    pthread_mutex_lock(&mw->crew.mu);
+    int again = devino_add(&mw->seen, st.st_dev, st.st_ino);
+    if (again < 0) mw->crew.stop = 1;
+    if (!again) mw->dirs_read++;
+    pthread_mutex_unlock(&mw->crew.mu);
+    if (again) {
+        d->error = ELOOP;
+        dir_iter_close(&it);
+        mk_finish(mw, d);
+        return;
+    }
+    size_t plen = strcmp(d->path, "/") == 0 ? 0 : strlen(d->path);
+    int oom = 0;
+    while (!oom && list_fill(&it, &mw->lo, b)) {
+        struct mk_node *push = NULL;
+        int npush = 0;
+        for (int i = 0; i < b->n && !oom; i++) {
+            const struct list_item *li = &b->item[i];
+            int type = li->isdir ? 'd' : li->target ? 'l' : li->special ? 0 : 'f';
+            if (!type) continue;    /* devices, FIFOs, sockets */
+            struct mk_node *k = mk_node_new(d, d->path, plen, li->name, type);
+            if (!k || mk_add_kid(d, k) != 0) {
+                free(k);
+                oom = 1;
+                break;
+            }
+            if (type == 'l') {
+                struct sha256_ctx sha;
+                sha256_init(&sha);
+                sha256_update(&sha, li->target, strlen(li->target));
+                sha256_final(&sha, k->t.sum);
+                k->pending = 0;
+                continue;
+            }
+            k->next = push;
+            push = k;
+            npush++;
+        }
+        int gone = peer_gone(mw->crew.conn);     /* a big directory can take a while */
+        pthread_mutex_lock(&mw->crew.mu);
+        if (gone || oom) mw->crew.stop = 1;
+        d->pending += npush;
+        while (push) {
+            struct mk_node *next = push->next;
+            push->next = mw->stack;
+            mw->stack = push;
+            mw->crew.queued++;
+            push = next;
+        }
+        crew_grow(&mw->crew);
+        pthread_cond_broadcast(&mw->crew.cv);
+        int stop = mw->crew.stop;
+        pthread_mutex_unlock(&mw->crew.mu);
+        if (stop) break;
+    }
+    dir_iter_close(&it);
+    mk_finish(mw, d);
+}
+
+static void mk_work(struct mk_walk *mw, struct mk_node *n, struct list_batch *b, uint8_t *buf) {
+    if (n->type == 'd') mk_walk_dir(mw, n, b);
+    else mk_hash_file(mw, n, buf);
+}
+
+static int mk_next(struct mk_walk *mw, struct mk_node **n) {
+    pthread_mutex_lock(&mw->crew.mu);
+    *n = mw->crew.stop ? NULL : mw->stack;
+    if (*n) { mw->stack = (*n)->next; mw->crew.queued--; }
+    pthread_mutex_unlock(&mw->crew.mu);
+    return *n != NULL;
+}
+
+static void mk_help(struct walk_crew *crew) {
+    struct mk_walk *mw = (struct mk_walk *)crew;
+    struct list_batch *b = calloc(1, sizeof(*b));
+    uint8_t *buf = malloc(HASH_READ);
+    struct mk_node *n;
+    while (b && buf && mk_next(mw, &n)) mk_work(mw, n, b, buf);
+    if (!b || !buf) {
+        pthread_mutex_lock(&mw->crew.mu);
+        mw->crew.stop = 1;
+        pthread_mutex_unlock(&mw->crew.mu);
+    }
+    list_batch_free(b);
+    free(buf);
+}
+
+/* /api/manifest?path=...[&depth=N][&verify=1][&fresh=1] -> the Merkle tree of a directory:
+ *   {"path":..,"hash":"..","files":N,"dirs":N,"bytes":N,"errors":N,"children":[..],
+ *    "hashed":N,"cached":N,"bytes_read":N,"dirs_read":N,"dirs_cached":N}
+ * children lists the entries in name order, each
+ *   {"name":..,"type":"file","hash":"..","size":N}
+ *   {"name":..,"type":"link","hash":".."}
+ *   {"name":..,"type":"dir","hash":"..","files":N,"dirs":N,"bytes":N[,"errors":N][,"children":[..]]}
+ *   {"name":..,"error":".."}     left out of the hash
+ * Hashes are lowercase hex. depth=1 (the default) lists the directory's own entries,
+ * depth=N that many levels, depth=0 the whole subtree. files counts non-directories and
+ * dirs the directories, the top one included. verify=1 re-reads every directory rather
+ * than trusting cached subtree hashes (files are still only read when their stat has
+ * changed); fresh=1 reads every file as well. The rest of the top level says what it
+ * took: files hashed (of which cached needed no reading), bytes read, directories read
+ * and subtrees taken from the cache. */
+static void api_manifest(int conn, const char *reqpath, int max_depth, int verify, int fresh) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    size_t fl = strlen(fs);
+    while (fl > 1 && fs[fl - 1] == '/') fs[--fl] = '\0';
+    struct mk_walk *mw = calloc(1, sizeof(*mw));
+    struct mk_node *root = calloc(1, sizeof(*root) + fl + 1);
+    struct list_batch *b = calloc(1, sizeof(*b));
+    uint8_t *buf = malloc(HASH_READ);
+    if (!mw || !root || !b || !buf) {
+        free(mw); free(root); free(b); free(buf);
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    memcpy(root->path, fs, fl + 1);
+    root->name = root->path;
+    root->type = 'd';
+    root->pending = 1;
+    crew_init(&mw->crew, conn, mk_help);
+    mw->crew.cpu = 1;
+    mw->lo.need = LF_TYPE | LF_TARGET;
+    mw->lo.nofollow = 1;
+    mw->max_depth = max_depth;
+    mw->verify = verify || fresh;
+    mw->fresh = fresh;
+    mw->root = root;
+    mw->stack = root;
+    mw->crew.queued = 1;
+
+    pthread_mutex_lock(&mw->crew.mu);
+    for (;;) {
+        crew_grow(&mw->crew);
+        struct mk_node *n = mw->crew.stop ? NULL : mw->stack;
+        if (n) {
+            mw->stack = n->next;
+            mw->crew.queued--;
+            pthread_mutex_unlock(&mw->crew.mu);
+            mk_work(mw, n, b, buf);
+            pthread_mutex_lock(&mw->crew.mu);
+            continue;
+        }
+        if ((mw->done || mw->crew.stop) && mw->crew.helpers == 0) break;
+        crew_wait(&mw->crew);
+    }
+    pthread_mutex_unlock(&mw->crew.mu);
+    list_batch_free(b);
+    free(buf);
+
+    struct strbuf sb = { 0 };
+    if (mw->done && !root->error) {
+        sb_append(&sb, "{\"path\":", 8);
+        sb_json_str(&sb, reqpath);
+        sb_append(&sb, ",\"hash\":\"", 9);
+        mk_hex(&sb, root->t.sum);
+        sb_printf(&sb, "\",\"files\":%lld,\"dirs\":%lld,\"bytes\":%lld,\"errors\":%lld,\"children\":[",
+                  root->t.files, root->t.dirs, root->t.bytes, root->errors);
+        if (root->json.p) sb_append(&sb, root->json.p, root->json.len);
+        sb_printf(&sb, "],\"hashed\":%lld,\"cached\":%lld,\"bytes_read\":%lld,\"dirs_read\":%lld,\"dirs_cached\":%lld}",
+                  mw->hashed, mw->cached, mw->bytes_read, mw->dirs_read, mw->dirs_cached);
+    }
+    if (mw->done && root->error) {
+        const char *err = strerror(root->error);
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+    } else if (mw->too_big) {
+        const char *err = "Manifest too large: ask for a smaller depth";
+        send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+    } else if (mw->done && !sb.oom) {
+        send_headers(conn, 200, "OK", "application/json; charset=utf-8", sb.len, NULL);
+        send_all(conn, sb.p, sb.len);
+    } else if (!peer_gone(conn)) {
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+    }
+    free(sb.p);
+    mk_node_free(root);
+    crew_destroy(&mw->crew);
+    free(mw->seen.t);
+    free(mw);
+}
+
+/* /api/download?path=... */
+static void api_download(int conn, const char *reqpath, const char *headers) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    if (stat(fs, &st) != 0 || S_ISDIR(st.st_mode)) {
+        const char *nf = "Not found";
+        send_headers(conn, 404, "Not Found", "text/plain; charset=utf-8", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    int fd = open(fs, O_RDONLY);
+    if (fd < 0) {
+        const char *err = "Error";
+        send_headers(conn, 500, "Error", "text/plain; charset=utf-8", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    off_t fsz = st.st_size;
+    const char *ctype = "application/octet-stream";
+    const char *ext = strrchr(fs, '.');
+    if (ext) {
+        if (!strcasecmp(ext, ".html") || !strcasecmp(ext, ".htm")) ctype = "text/html";
+        else if (!strcasecmp(ext, ".txt")) ctype = "text/plain";
+        else if (!strcasecmp(ext, ".json")) ctype = "application/json";
+        else if (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg")) ctype = "image/jpeg";
+        else if (!strcasecmp(ext, ".png")) ctype = "image/png";
+    }
+    char buf[BUFSIZE];
+    ssize_t n;
+    /* Want-Repr-Digest: hash while streaming and deliver the result as a trailer */
+    int algs = digest_algs_from_header(header_get(headers, "Want-Repr-Digest"));
+    if (!algs) {
+        send_headers(conn, 200, "OK", ctype, (size_t)fsz, NULL);
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            if (send_all(conn, buf, n) <= 0) break;
+        }
+        close(fd);
+        return;
+    }
+    struct digest_ctx dc;
+    digest_init(&dc, algs);
+    send_headers_chunked(conn, 200, "OK", ctype, "Trailer: Repr-Digest\r\n");
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        digest_update(&dc, buf, n);
+        if (send_chunk(conn, buf, n) <= 0) break;
+    }
+    close(fd);
+    if (n != 0) return;    /* truncated response; the missing terminator signals failure */
+    char digest[160], trailer[224];
+    digest_final(&dc, digest, sizeof(digest));
+    if (algs & DIGEST_SHA256) cindex_add(dc.sha256, fs, &st);
+    int m = snprintf(trailer, sizeof(trailer), "0\r\nRepr-Digest: %s\r\n\r\n", digest);
+    send_all(conn, trailer, m);
+}
+
+/* Create the missing parent directories of fs */
+static void ensure_parent_dirs(const char *fs) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", fs);
+    char *slash = strrchr(tmp, '/');
+    if (!slash) return;
+    *slash = '\0';
+    char accum[PATH_MAX] = {0};
+    char *tok, *save;
+    tok = strtok_r((tmp[0]=='/'? tmp+1: tmp), "/", &save);
+    if (tmp[0]=='/') strcpy(accum, "/");
+    while (tok) {
+        strcat(accum, tok);
+        strcat(accum, "/");
+        if (mkdir(accum, 0755) == 0) fs_changed(accum);
+        tok = strtok_r(NULL, "/", &save);
+    }
+}
+
+/* Open a fresh hidden temp file in the same directory as fs (so it can be renamed over fs) */
+static int open_temp_beside(const char *fs, char *tmpfs, size_t tmpsz) {
+    const char *base = strrchr(fs, '/');
+    int dirlen = base ? (int)(base - fs) : 0;
+    snprintf(tmpfs, tmpsz, "%.*s/.%s" TEMP_TAG "XXXXXX", dirlen, fs, base ? base + 1 : fs);
+    int fd = mkstemp(tmpfs);
+    if (fd < 0 && errno == ENAMETOOLONG) {
+        snprintf(tmpfs, tmpsz, "%.*s/" TEMP_TAG "XXXXXX", dirlen, fs);
+        fd = mkstemp(tmpfs);
+    }
+    if (fd >= 0) fchmod(fd, 0644);
+    return fd;
+}
+
+/* How a replacement for an upload target gets written. Normally into a temp file that is
+ * renamed over the target, which then keeps its mode and owner. A symlink is followed and
+ * its target replaced, so the link survives. A file with other hard links, or a link that
+ * dangles, is rewritten in place instead, as a rename would split it off or replace the
+ * link itself; a failed upload then leaves it truncated, as plain O_TRUNC writes did. */
+struct replace_plan {
+    char path[PATH_MAX];        /* the file to replace: the upload path, symlinks resolved */
+    int exists;                 /* st holds its metadata */
+    int in_place;               /* truncate and write path itself, no temp file */
+    struct stat st;
+};
+
+static void replace_plan(const char *fs, struct replace_plan *rp) {
+    memset(rp, 0, sizeof(*rp));
+    snprintf(rp->path, sizeof(rp->path), "%s", fs);
+    struct stat lst;
+    if (lstat(fs, &lst) != 0) return;
+    if (S_ISLNK(lst.st_mode)) {
+        char real[PATH_MAX];
+        if (!realpath(fs, real) || stat(real, &rp->st) != 0) { rp->in_place = 1; return; }
+        snprintf(rp->path, sizeof(rp->path), "%s", real);
+    } else {
+        rp->st = lst;
+    }
+    rp->exists = 1;
+    if (rp->st.st_nlink > 1) rp->in_place = 1;
+}
+
+/* Open the file the body is written to: the temp file beside rp->path (named in tmpfs),
+ * carrying over the old file's owner and mode, or the target itself when in place */
+static int replace_open(const struct replace_plan *rp, char *tmpfs, size_t tmpsz) {
+    if (rp->in_place) {
+        tmpfs[0] = '\0';
+        return open(rp->path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    }
+    int fd = open_temp_beside(rp->path, tmpfs, tmpsz);
+    if (fd >= 0 && rp->exists) {
+        if (fchown(fd, rp->st.st_uid, rp->st.st_gid) != 0) { /* only root gives files away */ }
+        fchmod(fd, rp->st.st_mode & 07777);    /* after chown, which may clear set-id bits */
+    }
+    return fd;
+}
+
+/* Drop an unfinished replacement (nothing to undo once written in place) */
+static void replace_abort(const char *tmpfs) {
+    if (tmpfs[0]) unlink(tmpfs);
+}
+
+/* Put the finished replacement in place */
+static int replace_commit(const struct replace_plan *rp, const char *tmpfs) {
+    return tmpfs[0] ? rename(tmpfs, rp->path) : 0;
+}
+
+/* Reserve len bytes for fd up front so a large upload lands in few extents instead of
+ * growing the file one write at a time. The file size itself is left unchanged. */
+static int prealloc_fd(int fd, long long len) {
+    if (len <= 0) return 0;
+#if defined(__APPLE__)
+    fstore_t fst = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, len, 0 };
+    if (fcntl(fd, F_PREALLOCATE, &fst) == 0) return 0;
+    fst.fst_flags = F_ALLOCATEALL;
+    if (fcntl(fd, F_PREALLOCATE, &fst) == 0) return 0;
+    return errno == ENOSPC ? -1 : 0;
+#elif defined(__linux__)
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)len) == 0) return 0;
+    return errno == ENOSPC ? -1 : 0;
+#else
+    (void)fd;
+    return 0;
+#endif
+}
+
+struct upload_sink {
+    int fd;
+    long long written;
+    long long synced;       /* start of the writeback window not yet submitted */
+    struct digest_ctx dig;  /* hashed on the writer thread, off the receive path */
+};
+
+/* Writer-thread side of api_upload: append the chunk and keep writeback moving */
+static int upload_sink_write(void *ctx, const char *data, size_t len) {
+    struct upload_sink *us = ctx;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = write(us->fd, data + off, len - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        off += w;
+    }
+    digest_update(&us->dig, data, len);
+    us->written += len;
+#if defined(__linux__)
+    /* Start writeback of each full window as soon as it is written, and wait for the one
+     * before it, so dirty pages never pile up into one long stall at close time. */
+    while (us->written - us->synced >= WRITEBACK_WINDOW) {
+        sync_file_range(us->fd, us->synced, WRITEBACK_WINDOW, SYNC_FILE_RANGE_WRITE);
+        if (us->synced >= WRITEBACK_WINDOW)
+            sync_file_range(us->fd, us->synced - WRITEBACK_WINDOW, WRITEBACK_WINDOW,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        us->synced += WRITEBACK_WINDOW;
+    }
+#endif
+    return 0;
+}
+
+/* Decide whether a body of len bytes may be written to fs (a file, or a directory to
+ * unpack into when want_dir is set) before any of it is read.
+ * Sends the final error response and returns -1 when it may not. */
+static int upload_precheck(int conn, const char *fs, long long len, int want_dir) {
+    struct stat st;
+    const char *err = NULL;
+    int code = 0;
+    const char *status = NULL;
+    if (stat(fs, &st) == 0 && !S_ISDIR(st.st_mode) != !want_dir) {
+        code = 409; status = "Conflict"; err = want_dir ? "Not a directory" : "Is a directory";
+    } else {
+        /* nearest existing ancestor: must be a directory with room for the whole body */
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", fs);
+        for (;;) {
+            char *slash = strrchr(dir, '/');
+            if (!slash) { strcpy(dir, "."); break; }
+            if (slash == dir) slash[1] = '\0'; else *slash = '\0';
+            if (stat(dir, &st) == 0 || strcmp(dir, "/") == 0) break;
+        }
+        struct statvfs vfs;
+        if (stat(dir, &st) == 0 && !S_ISDIR(st.st_mode)) {
+            code = 409; status = "Conflict"; err = "Parent is not a directory";
+        } else if (statvfs(dir, &vfs) == 0 && (long long)vfs.f_bavail * (long long)vfs.f_frsize < len) {
+            code = 507; status = "Insufficient Storage"; err = "Insufficient storage";
+        }
+    }
+    if (!err) return 0;
+    send_headers(conn, code, status, "text/plain", strlen(err), NULL);
+    send_all(conn, err, strlen(err));
+    return -1;
+}
+
+/* PUT /api/upload?path=... -> request body streamed to disk */
+static void api_upload(int conn, const char *reqpath, struct http_req *req) {
+    if (!req || req->content_len <= 0) {
+        const char *nb = "No body";
         send_headers(conn, 400, "Bad Request", "text/plain", strlen(nb), NULL);
         send_all(conn, nb, strlen(nb));
         return;
     }
     char fs[PATH_MAX];
     join_path(fs, sizeof(fs), g_root, reqpath);
-    /* ensure parent dirs */
-    char tmp[PATH_MAX]; strncpy(tmp, fs, sizeof(tmp)-1);
-    char *slash = strrchr(tmp, '/');
-    if (slash) {
-        *slash = '\0';
-        char accum[PATH_MAX] = {0};
-        char *tok, *save;
-        tok = strtok_r((tmp[0]=='/'? tmp+1: tmp), "/", &save);
-        if (tmp[0]=='/') strcpy(accum, "/");
-        while (tok) {
-            strcat(accum, tok);
-            strcat(accum, "/");
-            mkdir(accum, 0755);
-            tok = strtok_r(NULL, "/", &save);
-        }
-    }
-    int fd = open(fs, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (upload_precheck(conn, fs, req->content_len, 0) != 0) return;
+    ensure_parent_dirs(fs);
+    /* write next to the target and rename into place only once the body is complete
+     * and verified, so a failed or mismatched upload never replaces the old file */
+    struct replace_plan rp;
+    replace_plan(fs, &rp);
+    char tmpfs[PATH_MAX];
+    int fd = replace_open(&rp, tmpfs, sizeof(tmpfs));
     if (fd < 0) {
         const char *err = "Failed";
         send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
         send_all(conn, err, strlen(err));
         return;
     }
-    ssize_t w = write(fd, req->body, req->body_len);
+    if (prealloc_fd(fd, req->content_len) != 0) {
+        close(fd);
+        replace_abort(tmpfs);
+        const char *err = "Insufficient storage";
+        send_headers(conn, 507, "Insufficient Storage", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    /* always hash with SHA-256; add whatever the client supplied or asked for */
+    char expected[256] = {0}, want[128] = {0};
+    if (!header_copy(req->headers, "Repr-Digest", expected, sizeof(expected)))
+        header_copy(req->headers, "Content-Digest", expected, sizeof(expected));
+    header_copy(req->headers, "Want-Repr-Digest", want, sizeof(want));
+    struct upload_sink us;
+    memset(&us, 0, sizeof(us));
+    us.fd = fd;
+    digest_init(&us.dig, DIGEST_SHA256 | digest_algs_from_header(expected) | digest_algs_from_header(want));
+    int rc = pipe_body(req, upload_sink_write, &us);
     close(fd);
-    if ((size_t)w != req->body_len) {
-        const char *err = "Write failed";
+    if (rc != PIPE_OK) {
+        replace_abort(tmpfs);
+        const char *err = rc == PIPE_SHORT ? "Incomplete body" : "Write failed";
+        if (rc == PIPE_SHORT) send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), NULL);
+        else send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    char digest[160], extra[192];
+    digest_final(&us.dig, digest, sizeof(digest));
+    snprintf(extra, sizeof(extra), "Repr-Digest: %s\r\n", digest);
+    if (expected[0] && !digest_matches(expected, digest)) {
+        replace_abort(tmpfs);
+        const char *err = "Digest mismatch";
+        send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), extra);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    if (replace_commit(&rp, tmpfs) != 0) {
+        replace_abort(tmpfs);
+        const char *err = "Failed";
         send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
         send_all(conn, err, strlen(err));
         return;
     }
+    fs_changed(fs);
+    struct stat st;
+    if (stat(fs, &st) == 0) cindex_add(us.dig.sha256, fs, &st);
     const char *ok = "Created";
-    send_headers(conn, 201, "Created", "text/plain", strlen(ok), NULL);
+    send_headers(conn, 201, "Created", "text/plain", strlen(ok), extra);
     send_all(conn, ok, strlen(ok));
 }
 
+/* ---------- Delta transfer ----------
+ * rsync-style updates of large files. /api/signature describes the server's copy block
+ * by block; the client finds the blocks it still has and sends /api/patch, a stream of
+ * "copy these blocks" and "insert these bytes" records, which is rebuilt into a temp
+ * file beside the target and renamed over it only once the result's SHA-256 matches the
+ * Repr-Digest the client sent. All integers are little-endian.
+ *   signature  "WFSSIG1\0", u32 block, u32 0, u64 file size, u64 blocks, then per block
+ *              u32 weak, u64 strong (the last block may be short)
+ *   patch      "WFSDLT1\0", u32 block, then records:
+ *              0x01 u64 first, u32 count   copy count blocks of the current file
+ *              0x02 u32 len, len bytes     literal data
+ * weak is rsync's rolling checksum (s1 = sum of the bytes, s2 = sum of the running s1,
+ * both mod 2^16, weak = s1 | s2 << 16), strong the block's XXH3-64. Signatures are
+ * computed in ranges spread over the CPUs, with SSE2 / NEON for the weak sums. */
+
+#define SIG_RANGE (4 * 1024 * 1024)     /* bytes per work item */
+#define SIG_BLOCK_MIN 512
+#define SIG_BLOCK_MAX (1024 * 1024)
+#define SIG_BLOCKS_MAX (4 * 1024 * 1024)
+#define SIG_ENTRY 12
+#define SIG_HEADER 32
+
+/* rsync's weak checksum of one block */
+static uint32_t rs_weak(const uint8_t *p, size_t n) {
+    uint32_t s1 = 0, s2 = 0;
+    size_t i = 0;
+#if defined(__x86_64__)
+    /* per 16 bytes: s2 += 16 * s1 + sum (16 - j) * p[j], s1 += sum p[j] */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i v1 = zero, v2 = zero;
+    for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i));
+        v2 = _mm_add_epi32(v2, _mm_slli_epi32(v1, 4));
+        v1 = _mm_add_epi32(v1, _mm_sad_epu8(d, zero));
+        v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_unpacklo_epi8(d, zero), w_lo));
+        v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_unpackhi_epi8(d, zero), w_hi));
+    }
+    uint32_t a[4], b[4];    /* the byte sums land in lanes 0 and 2 */
+    _mm_storeu_si128((__m128i *)a, v1);
+    _mm_storeu_si128((__m128i *)b, v2);
+    s1 = a[0] + a[2];
+    s2 = b[0] + b[1] + b[2] + b[3];
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    static const uint8_t w[16] = { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+    const uint8x16_t wv = vld1q_u8(w);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t d = vld1q_u8(p + i);
+        s2 += 16 * s1;
+        s1 += vaddlvq_u8(d);
+        uint16x8_t m = vmull_u8(vget_low_u8(d), vget_low_u8(wv));
+        m = vmlal_u8(m, vget_high_u8(d), vget_high_u8(wv));
+        s2 += vaddlvq_u16(m);
+    }
+#endif
+    for (; i < n; i++) {
+        s1 += p[i];
+        s2 += s1;
+    }
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+struct sig_job {
+    struct walk_crew crew;      /* first: helpers get the job from their crew */
+    int fd;
+    long long size;
+    int block;
+    long long nblocks;
+    long long per;              /* blocks per range */
+    long long next;             /* first block not yet claimed */
+    int failed;                 /* errno of a failed read */
+    uint8_t *out;               /* SIG_ENTRY bytes per block */
+};
+
+static void sig_put64(uint8_t *p, uint64_t v) {
+    for (int k = 0; k < 8; k++) p[k] = (uint8_t)(v >> (8 * k));
+}
+
+/* Claim a range of blocks and compute their entries; 0 when none is left */
+static int sig_range(struct sig_job *sj, uint8_t *buf) {
+    pthread_mutex_lock(&sj->crew.mu);
+    long long first = sj->crew.stop ? sj->nblocks : sj->next;
+    long long last = first + sj->per < sj->nblocks ? first + sj->per : sj->nblocks;
+    sj->next = last;
+    if (first < last) sj->crew.queued--;
+    pthread_mutex_unlock(&sj->crew.mu);
+    if (first >= last) return 0;
+    long long off = first * sj->block;
+    size_t want = (size_t)((last * sj->block < sj->size ? last * sj->block : sj->size) - off);
+    size_t got = 0;
+    while (got < want) {
+        ssize_t r = pread(sj->fd, buf + got, want - got, (off_t)(off + (long long)got));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            pthread_mutex_lock(&sj->crew.mu);
+            sj->failed = r < 0 ? errno : EIO;   /* short: the file shrank meanwhile */
+            sj->crew.stop = 1;
+            pthread_mutex_unlock(&sj->crew.mu);
+            return 0;
+        }
+        got += (size_t)r;
+    }
+    for (long long b = first; b < last; b++) {
+        const uint8_t *p = buf + (b - first) * sj->block;
+        size_t n = b == last - 1 ? want - (size_t)(b - first) * sj->block : (size_t)sj->block;
+        struct xxh3_ctx x;
+        xxh3_init(&x);
+        xxh3_update(&x, p, n);
+        uint8_t *e = sj->out + b * SIG_ENTRY;
+        uint32_t weak = rs_weak(p, n);
+        for (int k = 0; k < 4; k++) e[k] = (uint8_t)(weak >> (8 * k));
+        sig_put64(e + 4, xxh3_final(&x));
+    }
+    return 1;
+}
+
+static void sig_help(struct walk_crew *crew) {
+    struct sig_job *sj = (struct sig_job *)crew;
+    uint8_t *buf = malloc((size_t)(sj->per * sj->block));
+    while (buf && sig_range(sj, buf)) {}
+    if (!buf) {
+        pthread_mutex_lock(&sj->crew.mu);
+        sj->failed = ENOMEM;
+        sj->crew.stop = 1;
+        pthread_mutex_unlock(&sj->crew.mu);
+    }
+    free(buf);
+}
+
+/* GET /api/signature?path=...[&block=N] -> the signature of the file (see above), as
+ * application/octet-stream. block defaults to about the square root of the file size,
+ * as rsync picks it, and is raised where needed to keep to SIG_BLOCKS_MAX blocks. */
+static void api_signature(int conn, const char *reqpath, long long block) {
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    int fd = open(fs, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    long long size = (long long)st.st_size;
+    if (block <= 0) {
+        block = 1024;
+        while (block * block < size) block *= 2;
+    }
+    while (block < SIG_BLOCK_MAX && (size + block - 1) / block > SIG_BLOCKS_MAX) block *= 2;
+    if (block < SIG_BLOCK_MIN) block = SIG_BLOCK_MIN;
+    if (block > SIG_BLOCK_MAX) block = SIG_BLOCK_MAX;
+    struct sig_job *sj = calloc(1, sizeof(*sj));
+    long long nblocks = (size + block - 1) / block;
+    uint8_t *out = sj ? malloc(SIG_HEADER + (size_t)nblocks * SIG_ENTRY) : NULL;
+    long long per = SIG_RANGE / block > 0 ? SIG_RANGE / block : 1;
+    uint8_t *buf = out ? malloc((size_t)(per * block)) : NULL;
+    if (!buf) {
+        close(fd);
+        free(sj); free(out);
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    crew_init(&sj->crew, conn, sig_help);
+    sj->crew.cpu = 1;
+    sj->fd = fd;
+    sj->size = size;
+    sj->block = (int)block;
+    sj->nblocks = nblocks;
+    sj->per = per;
+    sj->out = out + SIG_HEADER;
+    sj->crew.queued = (int)((nblocks + per - 1) / per);
+
+    pthread_mutex_lock(&sj->crew.mu);
+    for (;;) {
+        crew_grow(&sj->crew);
+        if (!sj->crew.stop && sj->next < sj->nblocks) {
+            pthread_mutex_unlock(&sj->crew.mu);
+            sig_range(sj, buf);
+            pthread_mutex_lock(&sj->crew.mu);
+            continue;
+        }
+        if (sj->crew.helpers == 0) break;
+        crew_wait(&sj->crew);
+    }
+    pthread_mutex_unlock(&sj->crew.mu);
+    close(fd);
+    free(buf);
+
+    if (sj->failed) {
+        const char *err = strerror(sj->failed);
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+    } else if (!sj->crew.stop) {
+        memcpy(out, "WFSSIG1", 8);
+        for (int k = 0; k < 4; k++) { out[8 + k] = (uint8_t)(block >> (8 * k)); out[12 + k] = 0; }
+        sig_put64(out + 16, (uint64_t)size);
+        sig_put64(out + 24, (uint64_t)nblocks);
+        size_t len = SIG_HEADER + (size_t)nblocks * SIG_ENTRY;
+        send_headers(conn, 200, "OK", "application/octet-stream", len, NULL);
+        send_all(conn, out, len);
+    }
+    crew_destroy(&sj->crew);
+    free(out);
+    free(sj);
+}
+
+#define PATCH_COPY 0x01
+#define PATCH_LITERAL 0x02
+
+struct patch_sink {
+    struct upload_sink us;      /* the temp file, written and hashed as by api_upload */
+    int base;                   /* the current file */
+    long long base_size;
+    int block;                  /* from the header, 0 until it is in */
+    uint8_t rec[16];            /* header or record header being gathered */
+    size_t nrec;
+    long long literal;          /* literal bytes still to come */
+    long long copied, inserted;
+    char *buf;                  /* for copies */
+    const char *err;            /* a malformed patch: 400 */
+};
+
+static uint64_t patch_get(const uint8_t *p, int n) {
+    uint64_t v = 0;
+    for (int k = n - 1; k >= 0; k--) v = v << 8 | p[k];
+    return v;
+}
+
+/* Copy count blocks from first on of the current file to the temp file */
+static int patch_copy(struct patch_sink *ps, uint64_t first, uint64_t count) {
+    if (!count || first >= (uint64_t)(ps->base_size + ps->block - 1) / (uint64_t)ps->block) {
+        ps->err = "Copy outside the current file";
+        return -1;
+    }
+    long long off = (long long)first * ps->block;
+    long long end = off + (long long)count * ps->block;     /* count < 2^32, block <= 1M */
+    if (end > ps->base_size) end = ps->base_size;
+    while (off < end) {
+        size_t want = end - off < UPLOAD_CHUNK ? (size_t)(end - off) : UPLOAD_CHUNK;
+        ssize_t r = pread(ps->base, ps->buf, want, (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0 || upload_sink_write(&ps->us, ps->buf, (size_t)r) != 0) return -1;
+        off += r;
+        ps->copied += r;
+    }
+    return 0;
+}
+
+/* Writer-thread side of api_patch: decode records from the body as it arrives. A
+ * record can be split anywhere between chunks. */
+static int patch_sink_write(void *ctx, const char *data, size_t len) {
+    struct patch_sink *ps = ctx;
+    const uint8_t *p = (const uint8_t *)data;
+    while (len) {
+        if (ps->literal) {
+            size_t n = (unsigned long long)ps->literal < len ? (size_t)ps->literal : len;
+            if (upload_sink_write(&ps->us, (const char *)p, n) != 0) return -1;
+            ps->literal -= (long long)n;
+            ps->inserted += (long long)n;
+            p += n;
+            len -= n;
+            continue;
+        }
+        size_t need = !ps->block ? 12 : !ps->nrec ? 1 : ps->rec[0] == PATCH_COPY ? 13 : 5;
+        size_t n = need - ps->nrec < len ? need - ps->nrec : len;
+        memcpy(ps->rec + ps->nrec, p, n);
+        ps->nrec += n;
+        p += n;
+        len -= n;
+        if (need == 1 && ps->rec[0] != PATCH_COPY && ps->rec[0] != PATCH_LITERAL) {
+            ps->err = "Unknown record";
+            return -1;
+        }
+        if (ps->nrec < need || need == 1) continue;
+        ps->nrec = 0;
+        if (!ps->block) {
+            uint64_t block = patch_get(ps->rec + 8, 4);
+            if (memcmp(ps->rec, "WFSDLT1", 8) != 0 || block < SIG_BLOCK_MIN || block > SIG_BLOCK_MAX) {
+                ps->err = "Not a patch";
+                return -1;
+            }
+            ps->block = (int)block;
+        } else if (ps->rec[0] == PATCH_COPY) {
+            if (patch_copy(ps, patch_get(ps->rec + 1, 8), patch_get(ps->rec + 9, 4)) != 0) return -1;
+        } else {
+            ps->literal = (long long)patch_get(ps->rec + 1, 4);
+        }
+    }
+    return 0;
+}
+
+/* PUT /api/patch?path=... with a patch (see above) as the body and the SHA-256 of the
+ * resulting file in Repr-Digest (or Content-Digest): rebuild the file from its current
+ * content and the patch, and replace it if the result matches. 200 with
+ * {"size":N,"copied":N,"literal":N}; 400 for a malformed patch or a digest mismatch,
+ * which also catches a file changed since its signature was taken. The file keeps its
+ * permissions. */
+static void api_patch(int conn, const char *reqpath, struct http_req *req) {
+    char expected[256] = {0};
+    if (!header_copy(req->headers, "Repr-Digest", expected, sizeof(expected)))
+        header_copy(req->headers, "Content-Digest", expected, sizeof(expected));
+    if (req->content_len <= 0 || !(digest_algs_from_header(expected) & DIGEST_SHA256)) {
+        const char *err = req->content_len <= 0 ? "No body" : "Repr-Digest with the sha-256 of the result is required";
+        send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    struct stat st;
+    int base = open(fs, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (base < 0 || fstat(base, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (base >= 0) close(base);
+        const char *nf = "Not Found";
+        send_headers(conn, 404, "Not Found", "text/plain", strlen(nf), NULL);
+        send_all(conn, nf, strlen(nf));
+        return;
+    }
+    /* the result is mostly copied from the base: room for all of it plus every literal */
+    if (upload_precheck(conn, fs, (long long)st.st_size + req->content_len, 0) != 0) { close(base); return; }
+    struct replace_plan rp;
+    replace_plan(fs, &rp);
+    if (rp.in_place) {      /* the blocks to copy would be gone once the file is truncated */
+        close(base);
+        const char *err = "File has other hard links; upload it whole";
+        send_headers(conn, 409, "Conflict", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    char tmpfs[PATH_MAX];
+    struct patch_sink ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.us.fd = replace_open(&rp, tmpfs, sizeof(tmpfs));
+    ps.buf = malloc(UPLOAD_CHUNK);
+    if (ps.us.fd < 0 || !ps.buf) {
+        if (ps.us.fd >= 0) { close(ps.us.fd); unlink(tmpfs); }
+        close(base);
+        free(ps.buf);
+        const char *err = "Failed";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    ps.base = base;
+    ps.base_size = (long long)st.st_size;
+    digest_init(&ps.us.dig, DIGEST_SHA256 | digest_algs_from_header(expected));
+    int rc = pipe_body(req, patch_sink_write, &ps);
+    if (rc == PIPE_OK && (!ps.block || ps.nrec || ps.literal)) ps.err = "Truncated patch";
+    close(ps.us.fd);
+    close(base);
+    free(ps.buf);
+    char digest[160], extra[192];
+    digest_final(&ps.us.dig, digest, sizeof(digest));
+    snprintf(extra, sizeof(extra), "Repr-Digest: %s\r\n", digest);
+    const char *err = NULL;
+    int code = 400;
+    if (ps.err) err = ps.err;
+    else if (rc == PIPE_SHORT) err = "Incomplete body";
+    else if (rc != PIPE_OK) { err = "Write failed"; code = 500; }
+    else if (!digest_matches(expected, digest)) err = "Digest mismatch";
+    else if (replace_commit(&rp, tmpfs) != 0) { err = "Failed"; code = 500; }
+    if (err) {
+        unlink(tmpfs);
+        send_headers(conn, code, code == 400 ? "Bad Request" : "Internal", "text/plain", strlen(err), code == 400 ? extra : NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    fs_changed(fs);
+    if (stat(fs, &st) == 0) cindex_add(ps.us.dig.sha256, fs, &st);
+    char body[160];
+    int n = snprintf(body, sizeof(body), "{\"size\":%lld,\"copied\":%lld,\"literal\":%lld}",
+                     ps.us.written, ps.copied, ps.inserted);
+    send_headers(conn, 200, "OK", "application/json; charset=utf-8", (size_t)n, extra);
+    send_all(conn, body, (size_t)n);
+}
+
+/* Materialize src at tmp (a fresh, empty temp file from open_temp_beside, fd open on it).
+ * Tries the cheapest method allowed: hard link (if allowed), clone, then a kernel copy. */
+static const char *dedup_materialize(const char *src, const char *tmp, int fd, int allow_link) {
+    if (allow_link) {
+        unlink(tmp);
+        if (link(src, tmp) == 0) return "linked";
+        int nfd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (nfd < 0) return NULL;
+        dup2(nfd, fd); close(nfd);
+    }
+#if defined(__APPLE__)
+    unlink(tmp);
+    if (clonefile(src, tmp, 0) == 0) return "cloned";
+    int nfd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (nfd < 0) return NULL;
+    dup2(nfd, fd); close(nfd);
+#endif
+    int sfd = open(src, O_RDONLY);
+    if (sfd < 0) return NULL;
+    const char *how = NULL;
+#if defined(__linux__) && defined(FICLONE)
+    if (ioctl(fd, FICLONE, sfd) == 0) { close(sfd); return "cloned"; }
+#endif
+#if defined(__APPLE__)
+    if (fcopyfile(sfd, fd, NULL, COPYFILE_DATA) == 0) how = "copied";
+#else
+    struct stat st;
+    if (fstat(sfd, &st) == 0) {
+        prealloc_fd(fd, (long long)st.st_size);
+        off_t left = st.st_size;
+        char *buf = NULL;
+        while (left > 0) {
+            ssize_t n = -1;
+#if defined(__linux__)
+            if (!buf) n = copy_file_range(sfd, NULL, fd, NULL, (size_t)left, 0);
+#endif
+            if (n <= 0) {
+                if (!buf && !(buf = malloc(UPLOAD_CHUNK))) break;
+                n = read(sfd, buf, UPLOAD_CHUNK);
+                if (n <= 0 || write(fd, buf, n) != n) break;
+            }
+            left -= n;
+        }
+        free(buf);
+        if (left == 0) how = "copied";
+    }
+#endif
+    close(sfd);
+    return how;
+}
+
+/* POST /api/dedup?path=...&size=...&sha256=<hex>[&link=1]
+ * Upload preflight: when the server already holds a file with this content, create the
+ * target from it locally and answer 201; 404 means the client has to send the bytes. */
+static void api_dedup(int conn, const char *uri) {
+    char reqpath[PATH_MAX], sizebuf[32], hex[80], linkbuf[8] = {0};
+    uint8_t sha[32];
+    int ok = query_param(uri, "path", reqpath, sizeof(reqpath)) &&
+             query_param(uri, "size", sizebuf, sizeof(sizebuf)) &&
+             query_param(uri, "sha256", hex, sizeof(hex)) && strlen(hex) == 64;
+    for (int i = 0; ok && i < 32; i++) {
+        unsigned v;
+        if (!isxdigit((unsigned char)hex[2*i]) || !isxdigit((unsigned char)hex[2*i+1]) ||
+            sscanf(hex + 2 * i, "%2x", &v) != 1) ok = 0;
+        else sha[i] = (uint8_t)v;
+    }
+    if (!ok) {
+        send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL);
+        send_all(conn, "Bad Request", 11);
+        return;
+    }
+    query_param(uri, "link", linkbuf, sizeof(linkbuf));
+    long long size = strtoll(sizebuf, NULL, 10);
+    char fs[PATH_MAX], src[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    if (!cindex_lookup(sha, size, src, sizeof(src))) {
+        const char *miss = "{\"status\":\"miss\"}";
+        send_headers(conn, 404, "Not Found", "application/json; charset=utf-8", strlen(miss), NULL);
+        send_all(conn, miss, strlen(miss));
+        return;
+    }
+    struct replace_plan rp;
+    replace_plan(fs, &rp);
+    if (strcmp(src, fs) == 0 || strcmp(src, rp.path) == 0) {
+        const char *same = "{\"status\":\"present\"}";
+        send_headers(conn, 201, "Created", "application/json; charset=utf-8", strlen(same), NULL);
+        send_all(conn, same, strlen(same));
+        return;
+    }
+    ensure_parent_dirs(fs);
+    /* a target that must be rewritten in place is left to a real upload */
+    char tmpfs[PATH_MAX];
+    int fd = rp.in_place ? -1 : open_temp_beside(rp.path, tmpfs, sizeof(tmpfs));
+    const char *how = fd < 0 ? NULL : dedup_materialize(src, tmpfs, fd, linkbuf[0] == '1');
+    if (fd >= 0) close(fd);
+    if (how && rp.exists && strcmp(how, "linked") != 0) {  /* a link shares src's inode */
+        if (chown(tmpfs, rp.st.st_uid, rp.st.st_gid) != 0) { /* only root gives files away */ }
+        chmod(tmpfs, rp.st.st_mode & 07777);
+    }
+    if (!how || replace_commit(&rp, tmpfs) != 0) {
+        if (fd >= 0) unlink(tmpfs);
+        const char *miss = "{\"status\":\"miss\"}";
+        send_headers(conn, 404, "Not Found", "application/json; charset=utf-8", strlen(miss), NULL);
+        send_all(conn, miss, strlen(miss));
+        return;
+    }
+    fs_changed(fs);
+    struct stat st;
+    if (stat(fs, &st) == 0) cindex_add(sha, fs, &st);
+    char out[64];
+    int n = snprintf(out, sizeof(out), "{\"status\":\"%s\"}", how);
+    send_headers(conn, 201, "Created", "application/json; charset=utf-8", (size_t)n, NULL);
+    send_all(conn, out, n);
+}
+
+/* ---------- Archive extraction ----------
+ * Streaming tar (ustar, pax and GNU long names) unpacker used by PUT /api/extract.
+ * It runs as a body_pipe sink, so files are created on the writer thread while the
+ * next part of the archive is still on the wire. Directories are resolved through a
+ * small cache of open dirfds, and every entry is created with *at() calls relative
+ * to them, so a directory is made once per archive rather than once per file and a
+ * path is never walked from the root. Symlinked directories are never followed. */
+
+#define XDIR_CACHE 32
+#define TAR_META_MAX (64 * 1024)
+#define TAR_DEPTH_MAX 128           /* path components an entry may have */
+
+enum { TX_HEADER, TX_DATA, TX_META, TX_PAD, TX_END };
+
+struct xdir {
+    char rel[PATH_MAX];     /* directory relative to the extraction root */
+    int fd;
+    unsigned long used;
+};
+
+struct tar_x {
+    int rootfd;
+    struct xdir dirs[XDIR_CACHE];
+    unsigned long tick;
+    int state;
+    unsigned char hdr[512];
+    size_t hdr_have;
+    long long left;         /* bytes of the current entry's data still to come */
+    long long pad;          /* padding up to the next 512-byte boundary */
+    int out_fd;             /* file being written; -1 while skipping data */
+    char path[PATH_MAX];    /* current entry, relative to the root */
+    char meta_type;         /* 'x' / 'L' while collecting a pax or long-name record */
+    struct strbuf meta;
+    char next_path[PATH_MAX];   /* name override for the next entry (pax path / GNU L) */
+    long long next_size;        /* pax size override, -1 if none */
+    int bad_meta;               /* the pax record for the next entry was malformed */
+    int zero_blocks;
+    struct strbuf *report;
+    int reported;
+    int files, ndirs, links, skipped, errors;
+};
+
+static void tx_report(struct tar_x *tx, const char *path, const char *status) {
+    if (tx->reported++) sb_append(tx->report, ",", 1);
+    sb_append(tx->report, "{\"path\":", 8);
+    sb_json_str(tx->report, path);
+    sb_append(tx->report, ",\"status\":\"", 11);
+    sb_append(tx->report, status, strlen(status));
+    sb_append(tx->report, "\"}", 2);
+}
+
+/* Normalize an archive member name; rejects absolute escapes, ".." components and
+ * paths more than TAR_DEPTH_MAX deep */
+static int tx_sanitize(const char *raw, char *out, size_t outsz) {
+    size_t o = 0;
+    int depth = 0;
+    const char *p = raw;
+    while (*p) {
+        while (*p == '/') p++;
+        size_t n = strcspn(p, "/");
+        if (n == 0) break;
+        if (n == 2 && p[0] == '.' && p[1] == '.') return -1;
+        if (!(n == 1 && p[0] == '.')) {
+            if (o + n + 2 > outsz || n > NAME_MAX || ++depth > TAR_DEPTH_MAX) return -1;
+            if (o) out[o++] = '/';
+            memcpy(out + o, p, n);
+            o += n;
+        }
+        p += n;
+    }
+    out[o] = '\0';
+    return o ? 0 : -1;
+}
+
+/* The cached fd of the first len bytes of rel, or -1 */
+static int xdir_find(struct tar_x *tx, const char *rel, size_t len) {
+    for (int i = 0; i < XDIR_CACHE; i++) {
+        struct xdir *x = &tx->dirs[i];
+        if (x->fd >= 0 && strncmp(x->rel, rel, len) == 0 && x->rel[len] == '\0') {
+            x->used = ++tx->tick;
+            return x->fd;
+        }
+    }
+    return -1;
+}
+
+/* Cache fd as the first len bytes of rel, in place of the least recently used entry */
+static void xdir_put(struct tar_x *tx, const char *rel, size_t len, int fd) {
+    int lru = 0;
+    for (int i = 1; i < XDIR_CACHE; i++) if (tx->dirs[i].used < tx->dirs[lru].used) lru = i;
+    if (tx->dirs[lru].fd >= 0) close(tx->dirs[lru].fd);
+    snprintf(tx->dirs[lru].rel, sizeof(tx->dirs[lru].rel), "%.*s", (int)len, rel);
+    tx->dirs[lru].fd = fd;
+    tx->dirs[lru].used = ++tx->tick;
+}
+
+/* Open (creating as needed) directory rel under the root; the fd stays owned by the cache.
+ * Starts from the deepest ancestor already open and goes down one component at a time. */
+static int xdir_open(struct tar_x *tx, const char *rel) {
+    if (!rel[0]) return tx->rootfd;
+    size_t done = strlen(rel);
+    int fd = xdir_find(tx, rel, done);
+    while (fd < 0) {
+        while (done > 0 && rel[done - 1] != '/') done--;
+        if (done == 0) { fd = tx->rootfd; break; }
+        fd = xdir_find(tx, rel, --done);
+    }
+    while (rel[done]) {
+        size_t start = done + (rel[done] == '/'), n = strcspn(rel + start, "/");
+        char name[NAME_MAX + 1];
+        if (n > NAME_MAX) return -1;
+        memcpy(name, rel + start, n);
+        name[n] = '\0';
+        if (mkdirat(fd, name, 0755) != 0 && errno != EEXIST) return -1;
+        /* the parent was just used, so it is never the entry this one replaces */
+        int nfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (nfd < 0) return -1;
+        done = start + n;
+        xdir_put(tx, rel, done, nfd);
+        fd = nfd;
+    }
+    return fd;
+}
+
+/* Split path into its parent dirfd and final component */
+static int tx_parent(struct tar_x *tx, const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) { *name = path; return tx->rootfd; }
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+    *name = slash + 1;
+    return xdir_open(tx, parent);
+}
+
+static long long tar_num(const unsigned char *f, size_t n) {
+    if (f[0] & 0x80) {      /* GNU base-256 */
+        long long v = f[0] & 0x3f;
+        for (size_t i = 1; i < n; i++) v = (v << 8) | f[i];
+        return v;
+    }
+    long long v = 0;
+    size_t i = 0;
+    while (i < n && (f[i] == ' ' || f[i] == '\0')) i++;
+    for (; i < n && f[i] >= '0' && f[i] <= '7'; i++) v = v * 8 + (f[i] - '0');
+    return v;
+}
+
+/* Pull "path" and "size" out of a pax extended header. Each record is
+ * "LEN KEY=VALUE\n" with LEN counting the whole record; -1 if one is not. */
+static int tx_parse_pax(struct tar_x *tx) {
+    char *p = tx->meta.p, *end = tx->meta.p + tx->meta.len;
+    while (p < end) {
+        long long reclen = 0;
+        char *sp = p;
+        while (sp < end && *sp >= '0' && *sp <= '9' && reclen <= end - p) reclen = reclen * 10 + (*sp++ - '0');
+        if (sp == p || reclen > end - p || sp + 1 >= p + reclen || *sp != ' ' || p[reclen - 1] != '\n') return -1;
+        char *kv = sp + 1, *rec_end = p + reclen - 1;   /* drop the trailing newline */
+        char *eq = memchr(kv, '=', rec_end - kv);
+        if (eq) {
+            if (eq - kv == 4 && memcmp(kv, "path", 4) == 0)
+                snprintf(tx->next_path, sizeof(tx->next_path), "%.*s", (int)(rec_end - eq - 1), eq + 1);
+            else if (eq - kv == 4 && memcmp(kv, "size", 4) == 0)
+                tx->next_size = strtoll(eq + 1, NULL, 10);
+        }
+        p += reclen;
+    }
+    return 0;
+}
+
+/* The current regular file has all its data: stamp its mtime and close it */
+static void tx_finish_file(struct tar_x *tx) {
+    if (tx->out_fd < 0) return;
+    struct timespec ts[2];
+    ts[0].tv_sec = 0; ts[0].tv_nsec = UTIME_OMIT;
+    ts[1].tv_sec = (time_t)tar_num(tx->hdr + 136, 12); ts[1].tv_nsec = 0;
+    futimens(tx->out_fd, ts);
+    int rc = close(tx->out_fd);
+    tx->out_fd = -1;
+    tx_report(tx, tx->path, rc == 0 ? "file" : "error");
+    if (rc == 0) tx->files++; else tx->errors++;
+}
+
+/* A complete 512-byte header is in tx->hdr: set up the entry it describes */
+static void tx_begin_entry(struct tar_x *tx) {
+    const unsigned char *h = tx->hdr;
+    unsigned sum = 0;
+    int zero = 1;
+    for (int i = 0; i < 512; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+        if (h[i]) zero = 0;
+    }
+    if (zero) {
+        if (++tx->zero_blocks >= 2) tx->state = TX_END;
+        return;
+    }
+    tx->zero_blocks = 0;
+    if (sum != (unsigned)tar_num(h + 148, 8)) {
+        tx_report(tx, "", "error");
+        tx->errors++;
+        tx->state = TX_END;
+        return;
+    }
+    char type = h[156] ? (char)h[156] : '0';
+    int meta = type == 'x' || type == 'L' || type == 'g' || type == 'K';
+    /* a pax size is for the header right after it; records always carry their own */
+    long long size = tx->next_size >= 0 && !meta ? tx->next_size : tar_num(h + 124, 12);
+    tx->next_size = -1;
+    tx->left = size;
+    tx->pad = (512 - (size % 512)) % 512;
+    tx->out_fd = -1;
+    tx->state = TX_DATA;
+    if (type == 'x' || type == 'L') {
+        tx->meta_type = type;
+        tx->meta.len = 0;
+        tx->state = size > TAR_META_MAX ? TX_DATA : TX_META;
+        return;
+    }
+    if (meta) return;       /* global pax / GNU long link: not needed */
+
+    char raw[PATH_MAX];
+    if (tx->next_path[0]) snprintf(raw, sizeof(raw), "%s", tx->next_path);
+    else if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+        snprintf(raw, sizeof(raw), "%.155s/%.100s", (const char *)h + 345, (const char *)h + 0);
+    else snprintf(raw, sizeof(raw), "%.100s", (const char *)h);
+    tx->next_path[0] = '\0';
+    if (tx->bad_meta) {     /* its name or size may be wrong: skip the data as the header says */
+        tx->bad_meta = 0;
+        tx_report(tx, raw, "error");
+        tx->errors++;
+        return;
+    }
+    if (tx_sanitize(raw, tx->path, sizeof(tx->path)) != 0) {
+        if (type == '5') return;    /* "./" itself: the root already exists */
+        tx_report(tx, raw, "skipped");
+        tx->skipped++;
+        return;
+    }
+    const char *name;
+    int pfd = tx_parent(tx, tx->path, &name);
+    if (type == '5') {
+        if (xdir_open(tx, tx->path) < 0) { tx_report(tx, tx->path, "error"); tx->errors++; }
+        else { tx_report(tx, tx->path, "dir"); tx->ndirs++; }
+    } else if (type == '2') {
+        char target[101];
+        snprintf(target, sizeof(target), "%.100s", (const char *)h + 157);
+        if (pfd >= 0) unlinkat(pfd, name, 0);
+        if (pfd < 0 || symlinkat(target, pfd, name) != 0) { tx_report(tx, tx->path, "error"); tx->errors++; }
+        else { tx_report(tx, tx->path, "symlink"); tx->links++; }
+    } else if (type == '0' || type == '7') {
+        int mode = (int)(tar_num(h + 100, 8) & 0777);
+        int fd = pfd < 0 ? -1 : openat(pfd, name, O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW, mode ? mode : 0644);
+        if (fd < 0) { tx_report(tx, tx->path, "error"); tx->errors++; return; }
+        if (size >= UPLOAD_CHUNK) prealloc_fd(fd, size);
+        tx->out_fd = fd;
+        if (size == 0) tx_finish_file(tx);
+    } else {
+        tx_report(tx, tx->path, "skipped");     /* hard links, devices, fifos */
+        tx->skipped++;
+    }
+}
+
+/* body_sink_fn: feed the next piece of the archive */
+static int tar_sink(void *ctx, const char *data, size_t len) {
+    struct tar_x *tx = ctx;
+    while (len > 0 && tx->state != TX_END) {
+        if (tx->state == TX_HEADER) {
+            size_t take = 512 - tx->hdr_have < len ? 512 - tx->hdr_have : len;
+            memcpy(tx->hdr + tx->hdr_have, data, take);
+            tx->hdr_have += take; data += take; len -= take;
+            if (tx->hdr_have == 512) { tx->hdr_have = 0; tx_begin_entry(tx); }
+            continue;
+        }
+        if (tx->state == TX_DATA || tx->state == TX_META) {
+            size_t take = (long long)len < tx->left ? len : (size_t)tx->left;
+            if (tx->state == TX_META) sb_append(&tx->meta, data, take);
+            else if (tx->out_fd >= 0) {
+                size_t off = 0;
+                while (off < take) {
+                    ssize_t w = write(tx->out_fd, data + off, take - off);
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w <= 0) {
+                        close(tx->out_fd);
+                        tx->out_fd = -1;
+                        tx_report(tx, tx->path, "error");
+                        tx->errors++;
+                        break;
+                    }
+                    off += w;
+                }
+            }
+            tx->left -= take; data += take; len -= take;
+            if (tx->left > 0) continue;
+            if (tx->state == TX_META) {
+                if (tx->meta_type == 'x') tx->bad_meta = tx_parse_pax(tx) != 0;
+                else snprintf(tx->next_path, sizeof(tx->next_path), "%.*s", (int)tx->meta.len, tx->meta.p ? tx->meta.p : "");
+            } else {
+                tx_finish_file(tx);
+            }
+            tx->state = TX_PAD;
+        }
+        if (tx->state == TX_PAD) {
+            size_t take = (long long)len < tx->pad ? len : (size_t)tx->pad;
+            tx->pad -= take; data += take; len -= take;
+            if (tx->pad == 0) tx->state = TX_HEADER;
+        }
+    }
+    return 0;
+}
+
+#if defined(WEBFS_HAVE_ZLIB)
+/* gzip layer in front of tar_sink */
+struct gunzip_sink {
+    z_stream zs;
+    struct tar_x *tx;
+    int done, failed;
+};
+
+static int gunzip_sink(void *ctx, const char *data, size_t len) {
+    struct gunzip_sink *gz = ctx;
+    unsigned char out[64 * 1024];
+    gz->zs.next_in = (unsigned char *)data;
+    gz->zs.avail_in = (unsigned)len;
+    while (gz->zs.avail_in > 0 && !gz->done) {
+        gz->zs.next_out = out;
+        gz->zs.avail_out = sizeof(out);
+        int rc = inflate(&gz->zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) { gz->failed = 1; return -1; }
+        tar_sink(gz->tx, (const char *)out, sizeof(out) - gz->zs.avail_out);
+        if (rc == Z_STREAM_END) gz->done = 1;
+        if (rc == Z_BUF_ERROR) break;
+    }
+    return 0;
+}
+#endif
+
+/* PUT /api/extract?path=<dir> -> unpack a streamed tar (or tar.gz) body into dir */
+static void api_extract(int conn, const char *reqpath, struct http_req *req) {
+    if (!req || req->content_len <= 0) {
+        const char *nb = "No body";
+        send_headers(conn, 400, "Bad Request", "text/plain", strlen(nb), NULL);
+        send_all(conn, nb, strlen(nb));
+        return;
+    }
+    char fs[PATH_MAX];
+    join_path(fs, sizeof(fs), g_root, reqpath);
+    if (upload_precheck(conn, fs, req->content_len, 1) != 0) return;
+    ensure_parent_dirs(fs);
+    if (mkdir(fs, 0755) == 0) fs_changed(fs);
+    int rootfd = open(fs, O_RDONLY | O_DIRECTORY);
+    if (rootfd < 0) {
+        const char *err = "Failed";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    struct strbuf report = {0};
+    struct tar_x tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.rootfd = rootfd;
+    for (int i = 0; i < XDIR_CACHE; i++) tx.dirs[i].fd = -1;
+    tx.out_fd = -1;
+    tx.next_size = -1;
+    tx.report = &report;
+    tx.state = TX_HEADER;
+    char enc[64] = {0}, ctype[64] = {0};
+    header_copy(req->headers, "Content-Encoding", enc, sizeof(enc));
+    header_copy(req->headers, "Content-Type", ctype, sizeof(ctype));
+    int gzipped = my_strcasestr(enc, "gzip") || my_strcasestr(ctype, "gzip");
+    int rc, bad = 0;
+    if (gzipped) {
+#if defined(WEBFS_HAVE_ZLIB)
+        struct gunzip_sink gz;
+        memset(&gz, 0, sizeof(gz));
+        gz.tx = &tx;
+        if (inflateInit2(&gz.zs, 15 + 16) != Z_OK) rc = PIPE_NOMEM;
+        else {
+            rc = pipe_body(req, gunzip_sink, &gz);
+            bad = gz.failed || !gz.done;
+            inflateEnd(&gz.zs);
+        }
+#else
+        const char *err = "Compressed archives are not supported by this build";
+        send_headers(conn, 415, "Unsupported Media Type", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        close(rootfd);
+        return;
+#endif
+    } else {
+        rc = pipe_body(req, tar_sink, &tx);
+    }
+    if (tx.out_fd >= 0) {
+        close(tx.out_fd);
+        tx_report(&tx, tx.path, "error");
+        tx.errors++;
+    }
+    /* a clean archive ends on a header boundary, normally after its two zero blocks */
+    if (tx.state != TX_END && !(tx.state == TX_HEADER && tx.hdr_have == 0)) bad = 1;
+    for (int i = 0; i < XDIR_CACHE; i++) if (tx.dirs[i].fd >= 0) close(tx.dirs[i].fd);
+    close(rootfd);
+    free(tx.meta.p);
+    fs_changed(fs);
+
+    struct strbuf out = {0};
+    sb_printf(&out, "{\"files\":%d,\"dirs\":%d,\"symlinks\":%d,\"skipped\":%d,\"errors\":%d,\"complete\":%s,\"entries\":[",
+              tx.files, tx.ndirs, tx.links, tx.skipped, tx.errors, (rc == PIPE_OK && !bad) ? "true" : "false");
+    if (report.len) sb_append(&out, report.p, report.len);
+    sb_append(&out, "]}", 2);
+    free(report.p);
+    if (out.oom) {
+        free(out.p);
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    if (rc == PIPE_OK && !bad) send_headers(conn, 200, "OK", "application/json; charset=utf-8", out.len, NULL);
+    else send_headers(conn, 400, "Bad Request", "application/json; charset=utf-8", out.len, NULL);
+    send_all(conn, out.p, out.len);
+    free(out.p);
+}
+
 /* POST /api/mkdir?path=... */
 static void api_mkdir(int conn, const char *reqpath) {
     char fs[PATH_MAX];
@@ -1832,7 +10694,7 @@ static void api_mkdir(int conn, const char *reqpath) {
     while (tok) {
         strcat(accum, tok);
         strcat(accum, "/");
-        mkdir(accum, 0755);
+        if (mkdir(accum, 0755) == 0) fs_changed(accum);
         tok = strtok_r(NULL, "/", &save);
     }
     const char *ok = "Created";
@@ -1853,10 +10715,39 @@ static void api_delete(int conn, const char *reqpath) {
     }
     int rc = 0;
     if (S_ISDIR(st.st_mode)) rc = rmdir(fs); else rc = unlink(fs);
+    if (rc == 0) fs_changed(fs);
     if (rc == 0) send_headers(conn, 204, "No Content", NULL, 0, NULL);
     else { const char *err = "Error"; send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL); send_all(conn, err, strlen(err)); }
 }
 
+/* GET /api/metrics -> cache counters as JSON */
+static void api_metrics(int conn) {
+    struct strbuf sb = {0};
+    sb_append(&sb, "{", 1);
+    lcache_metrics(&sb);
+    sb_append(&sb, ",", 1);
+    du_metrics(&sb);
+    sb_append(&sb, ",", 1);
+    index_metrics(&sb);
+    sb_append(&sb, ",", 1);
+    events_metrics(&sb);
+    sb_append(&sb, ",", 1);
+    hcache_metrics(&sb);
+    sb_append(&sb, ",", 1);
+    mk_metrics(&sb);
+    sb_append(&sb, "}", 1);
+    if (sb.oom) {
+        free(sb.p);
+        const char *err = "Out of memory";
+        send_headers(conn, 500, "Internal", "text/plain", strlen(err), NULL);
+        send_all(conn, err, strlen(err));
+        return;
+    }
+    send_headers(conn, 200, "OK", "application/json; charset=utf-8", sb.len, NULL);
+    send_all(conn, sb.p, sb.len);
+    free(sb.p);
+}
+
 /* Serve UI */
 static void serve_index(int conn) {
     size_t len = strlen(INDEX_HTML);
@@ -1866,22 +10757,47 @@ static void serve_index(int conn) {
 
 /* ---------- Connection worker ---------- */
 
+/* Close a connection whose request body may not have been read. Closing with unread
+ * data makes the kernel send a RST that can destroy the response in flight, so for a
+ * client that did not wait for 100 Continue, half-close and drain briefly first. */
+static void close_conn(int conn, struct http_req *req) {
+    if (req->content_len > req->body_read && !req->expect_continue) {
+        shutdown(conn, SHUT_WR);
+        struct timeval tv = { 1, 0 };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char sink[BUFSIZE];
+        long long drained = 0;
+        ssize_t n;
+        while (drained < 4 * UPLOAD_CHUNK && (n = recv(conn, sink, sizeof(sink), 0)) > 0) drained += n;
+    }
+    close(conn);
+}
+
 static void *conn_thread(void *arg) {
     int conn = (intptr_t)arg;
     char buf[BUFSIZE + 1];
-    ssize_t r = recv(conn, buf, BUFSIZE, 0);
+    ssize_t r = 0;
+    /* read until the end of the headers; the body stays on the socket for the handler */
+    while (r < BUFSIZE) {
+        ssize_t n = recv(conn, buf + r, BUFSIZE - r, 0);
+        if (n <= 0) break;
+        r += n;
+        buf[r] = '\0';
+        if (strstr(buf, "\r\n\r\n")) break;
+    }
     if (r <= 0) { close(conn); return NULL; }
     struct http_req req;
     memset(&req, 0, sizeof(req));
     if (parse_request(conn, &req, buf, r) != 0) { close(conn); return NULL; }
 
-    char *authhdr = header_get(req.headers, "Authorization");
-    if (!check_basic_auth_header(authhdr)) {
+    /* everything up to routing is decided from the headers alone, so a rejected
+     * request costs the client no body transfer (see Expect: 100-continue in req_read) */
+    char authhdr[512];
+    if (!check_basic_auth_header(header_copy(req.headers, "Authorization", authhdr, sizeof(authhdr)) ? authhdr : NULL)) {
         const char *hdr = "WWW-Authenticate: Basic realm=\"WebFS\"\r\n";
         send_headers(conn, 401, "Unauthorized", "text/plain", 13, hdr);
         send_all(conn, "Unauthorized\n", 13);
-        if (req.body) free(req.body);
-        close(conn);
+        close_conn(conn, &req);
         return NULL;
     }
 
@@ -1889,24 +10805,182 @@ static void *conn_thread(void *arg) {
     if (strcasecmp(req.method, "GET") == 0 && (strcmp(req.uri, "/") == 0 || strncmp(req.uri, "/?path=", 6) == 0)) {
         serve_index(conn);
     } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/list", 9) == 0) {
-        char *q = strchr(req.uri, '?');
-        if (!q) { api_list(conn, "/"); }
-        else {
-            char tmp[PATH_MAX]; strncpy(tmp, q+1, sizeof(tmp)-1);
-            char *p = strstr(tmp, "path=");
-            if (!p) api_list(conn, "/");
-            else {
-                p += 5; char *amp = strchr(p, '&'); if (amp) *amp = '\0';
-                char dec[PATH_MAX]; url_decode(dec, p);
-                api_list(conn, dec);
+        char dec[PATH_MAX], fields[256], val[512];
+        struct list_opts lo;
+        memset(&lo, 0, sizeof(lo));
+        lo.fields = LF_TYPE | LF_SIZE;
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        if (query_param(req.uri, "fields", fields, sizeof(fields))) lo.fields = list_fields_parse(fields);
+        /* any of sort/limit/cursor selects the sorted, paged response object */
+        if (query_param(req.uri, "sort", val, sizeof(val)))
+            lo.sort = !strcmp(val, "size") ? SORT_SIZE : !strcmp(val, "mtime") ? SORT_MTIME : SORT_NAME;
+        if (query_param(req.uri, "order", val, sizeof(val))) lo.desc = !strcmp(val, "desc");
+        if (query_param(req.uri, "limit", val, sizeof(val))) { lo.limit = atol(val); if (!lo.sort) lo.sort = SORT_NAME; }
+        int bad_cursor = 0;
+        if (query_param(req.uri, "cursor", val, sizeof(val)) && val[0]) {
+            if (!lo.sort) lo.sort = SORT_NAME;
+            bad_cursor = list_cursor_decode(val, &lo) != 0;
+        }
+        if (lo.limit < 0) lo.limit = 0;
+        if (lo.sort == SORT_MTIME) lo.fields |= LF_MTIME;
+        char accept[256];
+        lo.cbor = header_copy(req.headers, "Accept", accept, sizeof(accept)) && strstr(accept, "application/cbor") != NULL;
+        /* sorted pages put directories first and count them, so they always need types */
+        lo.need = lo.fields | (lo.sort != SORT_NONE ? LF_TYPE : 0) | (lo.sort == SORT_SIZE ? LF_SIZE : 0);
+        char since[64];
+        int has_since = query_param(req.uri, "since", since, sizeof(since)) && since[0];
+        int sync = query_param(req.uri, "sync", val, sizeof(val)) && strcmp(val, "0") != 0;
+        if (bad_cursor) {   /* starting over at page one would repeat what the client has */
+            const char *err = "Invalid cursor";
+            send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), NULL);
+            send_all(conn, err, strlen(err));
+        } else {
+            api_list(conn, dec, &lo, has_since ? since : NULL, sync);
+        }
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/tree", 9) == 0) {
+        char dec[PATH_MAX], fields[256], val[64];
+        struct list_opts lo;
+        memset(&lo, 0, sizeof(lo));
+        lo.fields = LF_TYPE | LF_SIZE;
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        if (query_param(req.uri, "fields", fields, sizeof(fields))) lo.fields = list_fields_parse(fields);
+        lo.need = lo.fields | LF_TYPE;      /* directories have to be recognized to be walked */
+        int depth = query_param(req.uri, "depth", val, sizeof(val)) ? atoi(val) : 0;
+        long long limit = query_param(req.uri, "limit", val, sizeof(val)) ? atoll(val) : TREE_MAX_ENTRIES;
+        if (limit <= 0 || limit > TREE_MAX_ENTRIES) limit = TREE_MAX_ENTRIES;
+        api_tree(conn, dec, &lo, NULL, 0, 0, depth < 0 ? 0 : depth, limit);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/search", 11) == 0) {
+        char dec[PATH_MAX], fields[256], val[64], pat[NAME_MAX + 1], err[256];
+        struct list_opts lo;
+        struct name_matcher *m = malloc(sizeof(*m));
+        memset(&lo, 0, sizeof(lo));
+        lo.fields = LF_TYPE | LF_SIZE;
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        if (query_param(req.uri, "fields", fields, sizeof(fields))) lo.fields = list_fields_parse(fields);
+        lo.need = lo.fields | LF_TYPE;
+        int depth = query_param(req.uri, "depth", val, sizeof(val)) ? atoi(val) : 0;
+        long long limit = query_param(req.uri, "limit", val, sizeof(val)) ? atoll(val) : SEARCH_DEFAULT_LIMIT;
+        if (limit <= 0 || limit > TREE_MAX_ENTRIES) limit = TREE_MAX_ENTRIES;
+        /* case-insensitive unless case=1 */
+        int icase = !(query_param(req.uri, "case", val, sizeof(val)) && strcmp(val, "0") != 0);
+        int kind = query_param(req.uri, "regex", pat, sizeof(pat)) ? MATCH_REGEX
+                 : query_param(req.uri, "glob", pat, sizeof(pat)) ? MATCH_GLOB
+                 : query_param(req.uri, "q", pat, sizeof(pat)) ? MATCH_SUBSTR : 0;
+        if (!m) {
+            const char *oom = "Out of memory";
+            send_headers(conn, 500, "Internal", "text/plain", strlen(oom), NULL);
+            send_all(conn, oom, strlen(oom));
+        } else if (!kind || matcher_init(m, kind, pat, icase, err, sizeof(err)) != 0) {
+            if (!kind) snprintf(err, sizeof(err), "One of q, glob or regex is required");
+            send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), NULL);
+            send_all(conn, err, strlen(err));
+        } else {
+            lo.match = m;
+            /* plain substrings over the whole subtree come from the index when it is up */
+            int walk = kind != MATCH_SUBSTR || depth > 0 || (query_param(req.uri, "index", val, sizeof(val)) && !strcmp(val, "0"));
+            if (walk || api_search_index(conn, dec, &lo, limit) != 0) api_tree(conn, dec, &lo, NULL, 0, 0, depth < 0 ? 0 : depth, limit);
+            matcher_free(m);
+        }
+        free(m);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/grep", 9) == 0) {
+        char dec[PATH_MAX], val[64], pat[NAME_MAX + 1], err[256] = "";
+        struct list_opts lo;
+        struct grep_opts *g = calloc(1, sizeof(*g));
+        memset(&lo, 0, sizeof(lo));
+        lo.need = LF_TYPE;
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        int depth = query_param(req.uri, "depth", val, sizeof(val)) ? atoi(val) : 0;
+        long long limit = query_param(req.uri, "limit", val, sizeof(val)) ? atoll(val) : SEARCH_DEFAULT_LIMIT;
+        if (limit <= 0 || limit > TREE_MAX_ENTRIES) limit = TREE_MAX_ENTRIES;
+        int icase = !(query_param(req.uri, "case", val, sizeof(val)) && strcmp(val, "0") != 0);
+        if (!g) {
+            const char *oom = "Out of memory";
+            send_headers(conn, 500, "Internal", "text/plain", strlen(oom), NULL);
+            send_all(conn, oom, strlen(oom));
+        } else {
+            /* q= may be repeated: a line matches if it contains any of them */
+            for (int i = 0; !err[0] && g->npat < GREP_PATTERNS && query_param_nth(req.uri, "q", i, pat, sizeof(pat)); i++) {
+                if (!pat[0]) snprintf(err, sizeof(err), "Empty pattern");
+                else if (matcher_init(&g->pat[g->npat], MATCH_SUBSTR, pat, icase, err, sizeof(err)) == 0) g->npat++;
+            }
+            /* include= and exclude= are name globs, always case-insensitive */
+            for (int i = 0; !err[0] && g->ninclude < GREP_PATTERNS && query_param_nth(req.uri, "include", i, pat, sizeof(pat)); i++)
+                if (matcher_init(&g->include[g->ninclude], MATCH_GLOB, pat, 1, err, sizeof(err)) == 0) g->ninclude++;
+            for (int i = 0; !err[0] && g->nexclude < GREP_PATTERNS && query_param_nth(req.uri, "exclude", i, pat, sizeof(pat)); i++)
+                if (matcher_init(&g->exclude[g->nexclude], MATCH_GLOB, pat, 1, err, sizeof(err)) == 0) g->nexclude++;
+            if (!err[0] && !g->npat) snprintf(err, sizeof(err), "q is required");
+            g->max_size = query_param(req.uri, "max_size", val, sizeof(val)) ? atoll(val) : GREP_DEFAULT_MAX_SIZE;
+            if (g->max_size <= 0 || g->max_size > GREP_MAX_SIZE) g->max_size = GREP_MAX_SIZE;
+            g->context = query_param(req.uri, "context", val, sizeof(val)) ? atoi(val) : 0;
+            if (g->context < 0) g->context = 0;
+            if (g->context > GREP_CONTEXT_MAX) g->context = GREP_CONTEXT_MAX;
+            g->binary = query_param(req.uri, "binary", val, sizeof(val)) && strcmp(val, "0") != 0;
+            if (err[0]) {
+                send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), NULL);
+                send_all(conn, err, strlen(err));
+            } else {
+                api_tree(conn, dec, &lo, g, 0, 0, depth < 0 ? 0 : depth, limit);
             }
+            for (int i = 0; i < g->npat; i++) matcher_free(&g->pat[i]);
+            for (int i = 0; i < g->ninclude; i++) matcher_free(&g->include[i]);
+            for (int i = 0; i < g->nexclude; i++) matcher_free(&g->exclude[i]);
+        }
+        free(g);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/manifest", 13) == 0) {
+        char dec[PATH_MAX], val[16];
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        int depth = query_param(req.uri, "depth", val, sizeof(val)) ? atoi(val) : MK_DEPTH_DEFAULT;
+        int verify = query_param(req.uri, "verify", val, sizeof(val)) && strcmp(val, "0") != 0;
+        int fresh = query_param(req.uri, "fresh", val, sizeof(val)) && strcmp(val, "0") != 0;
+        api_manifest(conn, dec, depth < 0 ? 0 : depth, verify, fresh);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/hash", 9) == 0) {
+        char dec[PATH_MAX], val[64];
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        int algs = query_param(req.uri, "alg", val, sizeof(val)) ? hash_algs_parse(val) : DIGEST_SHA256;
+        int fresh = query_param(req.uri, "fresh", val, sizeof(val)) && strcmp(val, "0") != 0;
+        int depth = query_param(req.uri, "depth", val, sizeof(val)) ? atoi(val) : 0;
+        long long limit = query_param(req.uri, "limit", val, sizeof(val)) ? atoll(val) : TREE_MAX_ENTRIES;
+        if (limit <= 0 || limit > TREE_MAX_ENTRIES) limit = TREE_MAX_ENTRIES;
+        if (algs <= 0) {
+            const char *err = "alg must list sha256, xxh3, crc32c or md5";
+            send_headers(conn, 400, "Bad Request", "text/plain", strlen(err), NULL);
+            send_all(conn, err, strlen(err));
+        } else {
+            api_hash(conn, dec, algs, fresh, depth < 0 ? 0 : depth, limit);
         }
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/events", 11) == 0) {
+        char dec[PATH_MAX], fields[256];
+        struct list_opts lo;
+        memset(&lo, 0, sizeof(lo));
+        lo.fields = LF_TYPE | LF_SIZE;
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        if (query_param(req.uri, "fields", fields, sizeof(fields))) lo.fields = list_fields_parse(fields);
+        lo.need = lo.fields;
+        api_events(conn, dec, &lo);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/top", 8) == 0) {
+        char dec[PATH_MAX], val[16];
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        int by = query_param(req.uri, "by", val, sizeof(val)) && strcmp(val, "mtime") == 0 ? TOP_MTIME : TOP_SIZE;
+        int k = query_param(req.uri, "k", val, sizeof(val)) ? atoi(val) : 20;
+        if (k < 1) k = 1;
+        if (k > TOP_K_MAX) k = TOP_K_MAX;
+        api_top(conn, dec, by, k);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/duplicates", 15) == 0) {
+        char dec[PATH_MAX], val[32];
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        long long min_size = query_param(req.uri, "min_size", val, sizeof(val)) ? atoll(val) : 1;
+        if (min_size < 0) min_size = 0;
+        api_duplicates(conn, dec, min_size, query_param(req.uri, "fresh", val, sizeof(val)) && strcmp(val, "0") != 0);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/du", 7) == 0) {
+        char dec[PATH_MAX], val[16];
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) strcpy(dec, "/");
+        api_du(conn, dec, query_param(req.uri, "fresh", val, sizeof(val)) && strcmp(val, "0") != 0);
     } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/download", 13) == 0) {
         char *q = strchr(req.uri, '?'); if (!q) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
         else {
             char tmp[PATH_MAX]; strncpy(tmp, q+1, sizeof(tmp)-1);
             char *p = strstr(tmp, "path="); if (!p) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
-            else { p += 5; char *amp = strchr(p, '&'); if (amp) *amp = '\0'; char dec[PATH_MAX]; url_decode(dec, p); api_download(conn, dec); }
+            else { p += 5; char *amp = strchr(p, '&'); if (amp) *amp = '\0'; char dec[PATH_MAX]; url_decode(dec, p); api_download(conn, dec, req.headers); }
         }
     } else if (strcasecmp(req.method, "PUT") == 0 && strncmp(req.uri, "/api/upload", 11) == 0) {
         char *q = strchr(req.uri, '?'); if (!q) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
@@ -1915,6 +10989,23 @@ static void *conn_thread(void *arg) {
             char *p = strstr(tmp, "path="); if (!p) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
             else { p += 5; char *amp = strchr(p, '&'); if (amp) *amp = '\0'; char dec[PATH_MAX]; url_decode(dec, p); api_upload(conn, dec, &req); }
         }
+    } else if (strcasecmp(req.method, "PUT") == 0 && strncmp(req.uri, "/api/patch", 10) == 0) {
+        char dec[PATH_MAX];
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
+        else api_patch(conn, dec, &req);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/signature", 14) == 0) {
+        char dec[PATH_MAX], val[32];
+        long long block = query_param(req.uri, "block", val, sizeof(val)) ? atoll(val) : 0;
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
+        else api_signature(conn, dec, block);
+    } else if ((strcasecmp(req.method, "PUT") == 0 || strcasecmp(req.method, "POST") == 0) && strncmp(req.uri, "/api/extract", 12) == 0) {
+        char dec[PATH_MAX];
+        if (!query_param(req.uri, "path", dec, sizeof(dec))) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
+        else api_extract(conn, dec, &req);
+    } else if (strcasecmp(req.method, "GET") == 0 && strncmp(req.uri, "/api/metrics", 12) == 0) {
+        api_metrics(conn);
+    } else if (strcasecmp(req.method, "POST") == 0 && strncmp(req.uri, "/api/dedup", 10) == 0) {
+        api_dedup(conn, req.uri);
     } else if (strcasecmp(req.method, "POST") == 0 && strncmp(req.uri, "/api/mkdir", 10) == 0) {
         char *q = strchr(req.uri, '?'); if (!q) { send_headers(conn, 400, "Bad Request", "text/plain", 11, NULL); send_all(conn, "Bad Request", 11); }
         else {
@@ -1935,8 +11026,7 @@ static void *conn_thread(void *arg) {
         send_all(conn, nf, strlen(nf));
     }
 
-    if (req.body) free(req.body);
-    close(conn);
+    close_conn(conn, &req);
     return NULL;
 }
 
@@ -1968,17 +11058,19 @@ static void run_server(void) {
 
 static void usage(const char *prog) {
     fprintf(stderr, "WebFS - minimal HTTP file manager for jailbroken iOS\n");
-    fprintf(stderr, "Usage: %s [-p port] [-r root] [-u user -P pass]\n", prog);
+    fprintf(stderr, "Usage: %s [-p port] [-r root] [-u user -P pass] [-i index-file] [-c hash-cache-file]\n", prog);
 }
 
 int main(int argc, char **argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "p:r:u:P:h")) != -1) {
+    while ((opt = getopt(argc, argv, "p:r:u:P:i:c:h")) != -1) {
         switch (opt) {
             case 'p': g_port = atoi(optarg); break;
             case 'r': strncpy(g_root, optarg, sizeof(g_root)-1); break;
             case 'u': strncpy(g_user, optarg, sizeof(g_user)-1); break;
             case 'P': strncpy(g_pass, optarg, sizeof(g_pass)-1); break;
+            case 'i': strncpy(g_ix_file, optarg, sizeof(g_ix_file)-1); break;
+            case 'c': strncpy(g_hc_file, optarg, sizeof(g_hc_file)-1); break;
             case 'h':
             default: usage(argv[0]); return 0;
         }
@@ -1986,6 +11078,11 @@ int main(int argc, char **argv) {
     if (g_user[0] && g_pass[0]) g_auth_enabled = 1;
     if (!is_jailbroken()) fprintf(stderr, "Warning: device does not appear jailbroken. Server may lack privileges.\n");
     if (g_root[0] == 0) strcpy(g_root, "/");
+    signal(SIGPIPE, SIG_IGN);     /* a client that hangs up shows as a failed send */
+    checksum_init();
+    cindex_init();
+    if (g_ix_file[0]) index_start();
+    if (g_hc_file[0]) hcache_start();
     run_server();
     return 0;
 